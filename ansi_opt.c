@@ -0,0 +1,1011 @@
+/*****************************************************************************
+ * ANSI Optimizer Module
+ * Virtual screen in front of the line: sends the cheapest ANSI that
+ * leaves the caller's terminal showing what the output asked for
+ * Based on MBSE BBS mbsebbs/term.c (colour(), locate()) and the
+ * cursor-motion costing of curses (mvcur)
+ *
+ * At 4800 bps every byte of a screen costs about 2 ms.  BBS screens and
+ * menus are drawn with absolute cursor positions, a full SGR before every
+ * colour change and long runs of the same character, and a redraw sends
+ * the whole screen again although most of it is already on the terminal.
+ *
+ * Output is interpreted into 'want', the screen it would produce.  'have'
+ * is the screen the terminal shows; ansi_opt_output() compares the two
+ * row by row and sends only the cells that differ: the shortest of an
+ * absolute or relative cursor move, the shortest SGR from the terminal's
+ * current attributes (none at all when the difference cannot be seen, as
+ * for the foreground of a blank), REP (CSI n b) for runs of one character
+ * and EL or ED for blank areas.  Scrolling, bells and sequences that change
+ * nothing on the screen are passed on in order.  After a sequence that is
+ * not modelled the output is passed through unchanged until the next
+ * ED 2 (clear screen) makes the contents known again.
+ *
+ * The model follows ANSI.SYS as BBS screens expect it: ED 2 homes the
+ * cursor, erased cells take the current background.  Attributes are only
+ * ever turned off with SGR 0, which every ANSI terminal understands, and
+ * the bottom right cell is never written (it scrolls some terminals).
+ *****************************************************************************/
+
+#include "modem_sample.h"
+
+/* ansi_cell_t.attr */
+#define ANSI_FG         0x0007
+#define ANSI_BOLD       0x0008
+#define ANSI_BG         0x0070
+#define ANSI_BLINK      0x0080
+#define ANSI_UNDERLINE  0x0100
+#define ANSI_REVERSE    0x0200
+#define ANSI_ALL        0x03FF
+#define ANSI_DEFAULT    0x0007  /* White on black */
+
+#define ANSI_OUT_INITIAL    4096
+#define ANSI_GAP_REWRITE    3   /* Rewrite up to this many cells instead of moving */
+
+/*
+ * Attribute bits that can be seen on a cell
+ * A blank shows only its background unless it is underlined or reversed.
+ */
+static unsigned short ansi_visible(const ansi_cell_t *cell)
+{
+    if (cell->ch == ' ' && !(cell->attr & (ANSI_UNDERLINE | ANSI_REVERSE)))
+        return ANSI_BG | ANSI_BLINK | ANSI_UNDERLINE | ANSI_REVERSE;
+    return ANSI_ALL;
+}
+
+static int ansi_cell_same(const ansi_cell_t *a, const ansi_cell_t *b)
+{
+    unsigned short mask;
+
+    if (a->ch != b->ch)
+        return 0;
+    mask = ansi_visible(a) & ansi_visible(b);
+    return (a->attr & mask) == (b->attr & mask);
+}
+
+static void ansi_blank(ansi_cell_t *cells, int count, unsigned short pen)
+{
+    int i;
+
+    for (i = 0; i < count; i++) {
+        cells[i].ch = ' ';
+        cells[i].attr = ANSI_FG & ANSI_DEFAULT;
+        cells[i].attr |= pen & ANSI_BG;
+    }
+}
+
+/*
+ * Append to the output buffer (grown on demand, kept for the session)
+ */
+static void ansi_out(ansi_opt_t *ao, const char *data, int len)
+{
+    char *grown;
+    int size;
+
+    if (ao->used + len > ao->size) {
+        size = ao->size ? ao->size : ANSI_OUT_INITIAL;
+        while (size < ao->used + len)
+            size *= 2;
+        grown = realloc(ao->out, size);
+        if (!grown) {
+            ao->error = 1;
+            return;
+        }
+        ao->out = grown;
+        ao->size = size;
+    }
+
+    memcpy(ao->out + ao->used, data, len);
+    ao->used += len;
+}
+
+static void ansi_outc(ansi_opt_t *ao, char c)
+{
+    ansi_out(ao, &c, 1);
+}
+
+/*
+ * CSI with one numeric parameter (omitted when it is the default 1)
+ */
+static int ansi_csi(char *buf, int n, char final)
+{
+    if (n == 1)
+        return sprintf(buf, "\033[%c", final);
+    return sprintf(buf, "\033[%d%c", n, final);
+}
+
+/*
+ * Vertical part of a relative move: LFs for a few rows down, else CUD/CUU
+ */
+static int ansi_move_rows(char *buf, int from, int to)
+{
+    int i, n = to - from;
+
+    if (n > 0 && n <= 3) {
+        for (i = 0; i < n; i++)
+            buf[i] = '\n';
+        return n;
+    }
+    if (n > 0)
+        return ansi_csi(buf, n, 'B');
+    if (n < 0)
+        return ansi_csi(buf, -n, 'A');
+    return 0;
+}
+
+/*
+ * Horizontal part: BSs for a few columns back, else CUB/CUF
+ */
+static int ansi_move_cols(char *buf, int from, int to)
+{
+    int i, n = to - from;
+
+    if (n < 0 && n >= -3) {
+        for (i = 0; i < -n; i++)
+            buf[i] = '\b';
+        return -n;
+    }
+    if (n < 0)
+        return ansi_csi(buf, -n, 'D');
+    if (n > 0)
+        return ansi_csi(buf, n, 'C');
+    return 0;
+}
+
+/*
+ * Can the terminal's cursor move right to col by writing over what the
+ * terminal already shows, with the attributes it has now?
+ */
+static int ansi_move_over(const ansi_opt_t *ao, int row, int col)
+{
+    const ansi_cell_t *cell;
+    unsigned short mask;
+    int i;
+
+    if (ao->term_row != row || ao->term_col < 0 || col <= ao->term_col ||
+        col - ao->term_col > ANSI_GAP_REWRITE || ao->term_pen < 0)
+        return 0;
+
+    for (i = ao->term_col; i < col; i++) {
+        cell = &ao->have[row][i];
+        mask = ansi_visible(cell);
+        if ((ao->term_pen & mask) != (cell->attr & mask))
+            return 0;
+    }
+
+    return 1;
+}
+
+/*
+ * Move the terminal's cursor with the shortest of CUP, a relative move,
+ * CR followed by a relative move, or rewriting a few cells
+ */
+static void ansi_move(ansi_opt_t *ao, int row, int col)
+{
+    char best[32], alt[32];
+    int len, n, i;
+
+    if (ao->term_row == row && ao->term_col == col)
+        return;
+
+    if (col == 0)
+        len = row == 0 ? sprintf(best, "\033[H") : sprintf(best, "\033[%dH", row + 1);
+    else
+        len = sprintf(best, "\033[%d;%dH", row + 1, col + 1);
+
+    if (ao->term_row >= 0 && ao->term_col >= 0) {
+        n = ansi_move_rows(alt, ao->term_row, row);
+        n += ansi_move_cols(alt + n, ao->term_col, col);
+        if (n < len) {
+            memcpy(best, alt, n);
+            len = n;
+        }
+
+        alt[0] = '\r';
+        n = 1 + ansi_move_rows(alt + 1, ao->term_row, row);
+        n += ansi_move_cols(alt + n, 0, col);
+        if (n < len) {
+            memcpy(best, alt, n);
+            len = n;
+        }
+
+        if (ansi_move_over(ao, row, col) && col - ao->term_col < len) {
+            for (n = 0, i = ao->term_col; i < col; i++)
+                best[n++] = (char)ao->have[row][i].ch;
+            len = n;
+        }
+    }
+
+    ansi_out(ao, best, len);
+    ao->term_row = row;
+    ao->term_col = col;
+}
+
+/*
+ * SGR parameters taking the attributes from 'from' to 'to', where nothing
+ * has to be turned off (each with a leading ';')
+ */
+static int ansi_sgr_params(char *buf, unsigned short from, unsigned short to)
+{
+    unsigned short on = to & ~from;
+    int len = 0;
+
+    if (on & ANSI_BOLD)
+        len += sprintf(buf + len, ";1");
+    if (on & ANSI_UNDERLINE)
+        len += sprintf(buf + len, ";4");
+    if (on & ANSI_BLINK)
+        len += sprintf(buf + len, ";5");
+    if (on & ANSI_REVERSE)
+        len += sprintf(buf + len, ";7");
+    if ((from ^ to) & ANSI_FG)
+        len += sprintf(buf + len, ";%d", 30 + (to & ANSI_FG));
+    if ((from ^ to) & ANSI_BG)
+        len += sprintf(buf + len, ";%d", 40 + ((to & ANSI_BG) >> 4));
+
+    return len;
+}
+
+/*
+ * Bring the terminal's attributes to attr in the bits of mask
+ * Either only what changes is sent, or SGR 0 and what differs from the
+ * default; the bits outside mask keep whatever costs least.
+ */
+static void ansi_pen(ansi_opt_t *ao, unsigned short attr, unsigned short mask)
+{
+    const unsigned short flags = ANSI_BOLD | ANSI_UNDERLINE | ANSI_BLINK | ANSI_REVERSE;
+    char best[48], alt[48];
+    unsigned short from = (unsigned short)ao->term_pen, target;
+    int known = ao->term_pen >= 0, len, n;
+
+    if (known && (from & mask) == (attr & mask))
+        return;
+
+    /* SGR 0, then what is not the default */
+    target = (ANSI_DEFAULT & ~mask) | (attr & mask);
+    len = sprintf(best, "\033[0");
+    len += ansi_sgr_params(best + len, ANSI_DEFAULT, target);
+    if (len == 3)
+        len = 2;  /* ESC [ m */
+    best[len++] = 'm';
+    ao->term_pen = target;
+
+    /* Just the changes, if nothing has to be turned off */
+    if (known) {
+        target = (from & ~mask) | (attr & mask);
+        if (!(from & ~target & flags)) {
+            n = ansi_sgr_params(alt + 1, from, target);
+            alt[0] = '\033';
+            alt[1] = '[';  /* Over the first ';' */
+            n += 1;
+            alt[n++] = 'm';
+            if (n < len) {
+                memcpy(best, alt, n);
+                len = n;
+                ao->term_pen = target;
+            }
+        }
+    }
+
+    ansi_out(ao, best, len);
+}
+
+/*
+ * Paint want[row][col] and, with REP, the rest of its run
+ * Returns the column after what was painted.
+ */
+static int ansi_paint(ansi_opt_t *ao, int row, int col, int end)
+{
+    const ansi_cell_t *cell = &ao->want[row][col];
+    char rep[16];
+    int run, n, i;
+
+    ansi_pen(ao, cell->attr, ansi_visible(cell));
+    ansi_outc(ao, (char)cell->ch);
+
+    run = 1;
+    if (ao->use_rep) {
+        while (col + run < end && ao->want[row][col + run].ch == cell->ch &&
+               ansi_cell_same(&ao->want[row][col + run], cell) &&
+               ansi_visible(&ao->want[row][col + run]) == ansi_visible(cell))
+            run++;
+        n = run > 1 ? sprintf(rep, "\033[%db", run - 1) : 0;
+        if (run > 1 && n < run - 1)
+            ansi_out(ao, rep, n);
+        else
+            run = 1;
+    }
+
+    for (i = 0; i < run; i++) {
+        ao->have[row][col + i].ch = cell->ch;
+        ao->have[row][col + i].attr = (unsigned short)ao->term_pen;
+    }
+
+    col += run;
+    ao->term_col = col < ANSI_COLS ? col : -1;
+    if (ao->term_col < 0)
+        ao->term_row = -1;  /* Wrapped or wrap pending: depends on the terminal */
+
+    return col;
+}
+
+/*
+ * If want[row][col..] are all blanks that EL can produce, the number of
+ * them the terminal does not show yet; else 0
+ */
+static int ansi_blank_tail(const ansi_opt_t *ao, int row, int col)
+{
+    const ansi_cell_t *cell;
+    unsigned short bg = ao->want[row][col].attr & ANSI_BG;
+    int differ = 0;
+
+    for (; col < ANSI_COLS; col++) {
+        cell = &ao->want[row][col];
+        if (cell->ch != ' ' || (cell->attr & (ANSI_BG | ANSI_BLINK | ANSI_UNDERLINE | ANSI_REVERSE)) != bg)
+            return 0;
+        if (!ansi_cell_same(&ao->have[row][col], cell))
+            differ++;
+    }
+
+    return differ;
+}
+
+/*
+ * Send the differences of one row
+ */
+static void ansi_render_row(ansi_opt_t *ao, int row)
+{
+    const ansi_cell_t *last = &ao->want[row][ANSI_COLS - 1];
+    int col = 0, end = ANSI_COLS, tail = ANSI_COLS;
+
+    if (row == ao->rows - 1)
+        end = ANSI_COLS - 1;  /* Left as it is; sent once scrolled up */
+
+    /* Start of the blanks at the end of the line */
+    if (last->ch == ' ') {
+        while (tail > 0 && ao->want[row][tail - 1].ch == ' ' &&
+               ao->want[row][tail - 1].attr == last->attr)
+            tail--;
+    }
+
+    while (col < end) {
+        if (ansi_cell_same(&ao->have[row][col], &ao->want[row][col])) {
+            col++;
+            continue;
+        }
+
+        ansi_move(ao, row, col);
+
+        /* Blanks to the end of the line: EL */
+        if (col >= tail && ansi_blank_tail(ao, row, col) >= 4) {
+            ansi_pen(ao, ao->want[row][col].attr, ANSI_BG | ANSI_BLINK | ANSI_UNDERLINE | ANSI_REVERSE);
+            ansi_out(ao, "\033[K", 3);
+            ansi_blank(&ao->have[row][col], ANSI_COLS - col, (unsigned short)ao->term_pen);
+            return;
+        }
+
+        col = ansi_paint(ao, row, col, end);
+    }
+}
+
+/*
+ * Cells of want a clear would leave to paint, clearing with the
+ * background most of its blanks have (*bg)
+ */
+static int ansi_clear_cost(const ansi_opt_t *ao, unsigned short *bg)
+{
+    const ansi_cell_t *cell;
+    int count[8], row, col, best = 0;
+
+    memset(count, 0, sizeof(count));
+
+    for (row = 0; row < ao->rows; row++) {
+        for (col = 0; col < ANSI_COLS; col++) {
+            cell = &ao->want[row][col];
+            if (cell->ch == ' ' && !(cell->attr & (ANSI_BLINK | ANSI_UNDERLINE | ANSI_REVERSE)))
+                count[(cell->attr & ANSI_BG) >> 4]++;
+        }
+    }
+
+    for (col = 1; col < 8; col++) {
+        if (count[col] > count[best])
+            best = col;
+    }
+
+    *bg = (unsigned short)(best << 4);
+    return ao->rows * ANSI_COLS - count[best];
+}
+
+/*
+ * Send what differs between want and have
+ */
+static void ansi_render(ansi_opt_t *ao)
+{
+    const unsigned short fill = ANSI_BG | ANSI_BLINK | ANSI_UNDERLINE | ANSI_REVERSE;
+    unsigned short bg = 0;
+    int row, col, differ = 0;
+
+    if (ao->raw)
+        return;
+
+    if (ao->have_valid) {
+        /* A clear is cheaper when most of the screen changes to blank */
+        for (row = 0; row < ao->rows; row++) {
+            if (!ao->dirty[row])
+                continue;
+            for (col = 0; col < ANSI_COLS; col++) {
+                if (!ansi_cell_same(&ao->have[row][col], &ao->want[row][col]))
+                    differ++;
+            }
+        }
+        if (differ > ANSI_COLS && ansi_clear_cost(ao, &bg) + 8 < differ)
+            ao->have_valid = 0;
+    } else {
+        ansi_clear_cost(ao, &bg);
+    }
+
+    if (!ao->have_valid) {
+        ansi_pen(ao, bg, fill);
+        ansi_out(ao, "\033[2J", 4);
+        for (row = 0; row < ao->rows; row++) {
+            ansi_blank(ao->have[row], ANSI_COLS, bg);
+            ao->dirty[row] = 1;
+        }
+        ao->term_row = ao->term_col = -1;  /* ANSI.SYS homes, VT100 does not */
+        ao->have_valid = 1;
+    }
+
+    for (row = 0; row < ao->rows; row++) {
+        if (ao->dirty[row]) {
+            ansi_render_row(ao, row);
+            /* The bottom right cell waits until it is scrolled up */
+            ao->dirty[row] = row == ao->rows - 1 &&
+                !ansi_cell_same(&ao->have[row][ANSI_COLS - 1], &ao->want[row][ANSI_COLS - 1]);
+        }
+    }
+}
+
+/*
+ * Bring the terminal fully up to date: screen, cursor and attributes
+ * (before something is passed through as it is)
+ */
+static void ansi_sync(ansi_opt_t *ao)
+{
+    if (ao->raw)
+        return;
+
+    ansi_render(ao);
+    ansi_move(ao, ao->row, ao->col);
+    ansi_pen(ao, ao->pen, ANSI_ALL);
+}
+
+/*
+ * Pass a sequence the model does not know through, after which the
+ * screen is unknown until the next clear
+ */
+static void ansi_unknown(ansi_opt_t *ao, const char *seq, int len)
+{
+    ansi_sync(ao);
+    ansi_out(ao, seq, len);
+    ansi_opt_bypass(ao);
+}
+
+/*
+ * Scroll both screens up one line; the terminal does it with LF on the
+ * bottom row, everything before it on the screen first
+ */
+static void ansi_scroll(ansi_opt_t *ao)
+{
+    int row;
+
+    if (!ao->raw) {
+        ansi_render(ao);
+        ansi_pen(ao, ao->pen, ANSI_BG);  /* New line takes the background */
+        ansi_move(ao, ao->rows - 1, ao->term_col >= 0 && ao->term_row >= 0 ? ao->term_col : 0);
+        ansi_outc(ao, '\n');
+    }
+
+    for (row = 1; row < ao->rows; row++) {
+        memcpy(ao->want[row - 1], ao->want[row], sizeof(ao->want[row]));
+        memcpy(ao->have[row - 1], ao->have[row], sizeof(ao->have[row]));
+        ao->dirty[row - 1] = ao->dirty[row];
+    }
+    ansi_blank(ao->want[ao->rows - 1], ANSI_COLS, ao->pen);
+    ansi_blank(ao->have[ao->rows - 1], ANSI_COLS, ao->raw ? ao->pen : (unsigned short)ao->term_pen);
+    ao->dirty[ao->rows - 1] = 0;
+}
+
+static void ansi_newline(ansi_opt_t *ao)
+{
+    if (ao->row < ao->rows - 1)
+        ao->row++;
+    else
+        ansi_scroll(ao);
+}
+
+/*
+ * A printable character at the cursor (CP437: everything but the
+ * controls handled below is a glyph)
+ */
+static void ansi_print(ansi_opt_t *ao, unsigned char ch)
+{
+    if (ao->wrap) {
+        ao->wrap = 0;
+        ao->col = 0;
+        ansi_newline(ao);
+    }
+
+    ao->want[ao->row][ao->col].ch = ch;
+    ao->want[ao->row][ao->col].attr = ao->pen;
+    ao->dirty[ao->row] = 1;
+    ao->last_ch = ch;
+
+    if (ao->col == ANSI_COLS - 1)
+        ao->wrap = 1;
+    else
+        ao->col++;
+}
+
+static void ansi_erase(ansi_opt_t *ao, int row, int from, int to)
+{
+    ansi_blank(&ao->want[row][from], to - from, ao->pen);
+    ao->dirty[row] = 1;
+}
+
+/*
+ * SGR; returns 0 for a parameter the model does not have
+ */
+static int ansi_sgr(ansi_opt_t *ao, const int *param, int count)
+{
+    unsigned short pen = ao->pen;
+    int i, p;
+
+    if (count == 0)
+        count = 1;  /* param[0] is 0 */
+
+    for (i = 0; i < count; i++) {
+        p = param[i];
+        if (p == 0)
+            pen = ANSI_DEFAULT;
+        else if (p == 1)
+            pen |= ANSI_BOLD;
+        else if (p == 4)
+            pen |= ANSI_UNDERLINE;
+        else if (p == 5 || p == 6)
+            pen |= ANSI_BLINK;
+        else if (p == 7)
+            pen |= ANSI_REVERSE;
+        else if (p == 22)
+            pen &= ~ANSI_BOLD;
+        else if (p == 24)
+            pen &= ~ANSI_UNDERLINE;
+        else if (p == 25)
+            pen &= ~ANSI_BLINK;
+        else if (p == 27)
+            pen &= ~ANSI_REVERSE;
+        else if (p >= 30 && p <= 37)
+            pen = (pen & ~ANSI_FG) | (p - 30);
+        else if (p == 39)
+            pen = (pen & ~ANSI_FG) | (ANSI_DEFAULT & ANSI_FG);
+        else if (p >= 40 && p <= 47)
+            pen = (pen & ~ANSI_BG) | ((p - 40) << 4);
+        else if (p == 49)
+            pen = (pen & ~ANSI_BG) | (ANSI_DEFAULT & ANSI_BG);
+        else
+            return 0;
+    }
+
+    ao->pen = pen;
+    return 1;
+}
+
+/*
+ * Apply a complete CSI sequence (ao->esc[0..esc_len))
+ */
+static void ansi_csi_apply(ansi_opt_t *ao)
+{
+    int param[16], count = 0, n, i, cleared;
+    const char *p = ao->esc + 2, *end = ao->esc + ao->esc_len - 1;
+    char final = *end;
+
+    memset(param, 0, sizeof(param));
+
+    if (*p == '?' || *p == '=' || *p == '>') {
+        /* Private modes (cursor visibility, iCE colour, ...): content unchanged */
+        if (final == 'h' || final == 'l') {
+            ansi_sync(ao);
+            ansi_out(ao, ao->esc, ao->esc_len);
+        } else {
+            ansi_unknown(ao, ao->esc, ao->esc_len);
+        }
+        return;
+    }
+
+    for (; p < end; p++) {
+        if (*p >= '0' && *p <= '9') {
+            if (count == 0)
+                count = 1;
+            param[count - 1] = param[count - 1] * 10 + (*p - '0');
+            if (param[count - 1] > 9999)
+                param[count - 1] = 9999;
+        } else if (*p == ';' && count < (int)(sizeof(param) / sizeof(param[0]))) {
+            if (count == 0)
+                count = 1;
+            count++;
+        } else {
+            ansi_unknown(ao, ao->esc, ao->esc_len);
+            return;
+        }
+    }
+
+    n = param[0] > 0 ? param[0] : 1;
+
+    if (ao->raw)
+        ansi_out(ao, ao->esc, ao->esc_len);
+
+    switch (final) {
+        case 'A':
+            ao->row = ao->row - n < 0 ? 0 : ao->row - n;
+            break;
+        case 'B':
+            ao->row = ao->row + n >= ao->rows ? ao->rows - 1 : ao->row + n;
+            break;
+        case 'C':
+            ao->col = ao->col + n >= ANSI_COLS ? ANSI_COLS - 1 : ao->col + n;
+            break;
+        case 'D':
+            ao->col = ao->col - n < 0 ? 0 : ao->col - n;
+            break;
+        case 'E':
+        case 'F':
+            ao->row += final == 'E' ? n : -n;
+            ao->row = ao->row < 0 ? 0 : ao->row >= ao->rows ? ao->rows - 1 : ao->row;
+            ao->col = 0;
+            break;
+        case 'G':
+            ao->col = n > ANSI_COLS ? ANSI_COLS - 1 : n - 1;
+            break;
+        case 'd':
+            ao->row = n > ao->rows ? ao->rows - 1 : n - 1;
+            break;
+        case 'H':
+        case 'f':
+            ao->row = n > ao->rows ? ao->rows - 1 : n - 1;
+            n = count > 1 && param[1] > 0 ? param[1] : 1;
+            ao->col = n > ANSI_COLS ? ANSI_COLS - 1 : n - 1;
+            break;
+        case 'J':
+            cleared = param[0] == 2;
+            for (i = 0; i < ao->rows; i++) {
+                if (cleared || (param[0] == 0 && i > ao->row) || (param[0] == 1 && i < ao->row))
+                    ansi_erase(ao, i, 0, ANSI_COLS);
+            }
+            if (param[0] == 0)
+                ansi_erase(ao, ao->row, ao->col, ANSI_COLS);
+            else if (param[0] == 1)
+                ansi_erase(ao, ao->row, 0, ao->col + 1);
+            if (cleared) {
+                ao->row = ao->col = 0;
+                if (ao->raw) {
+                    /* Contents known again: back to optimizing */
+                    memcpy(ao->have, ao->want, sizeof(ao->have));
+                    memset(ao->dirty, 0, sizeof(ao->dirty));
+                    ao->raw = 0;
+                    ao->have_valid = 1;
+                    ao->term_row = ao->term_col = -1;
+                }
+            }
+            break;
+        case 'K':
+            if (param[0] == 0)
+                ansi_erase(ao, ao->row, ao->col, ANSI_COLS);
+            else if (param[0] == 1)
+                ansi_erase(ao, ao->row, 0, ao->col + 1);
+            else
+                ansi_erase(ao, ao->row, 0, ANSI_COLS);
+            break;
+        case 'm':
+            if (!ansi_sgr(ao, param, count) && !ao->raw)
+                ansi_unknown(ao, ao->esc, ao->esc_len);
+            return;
+        case 's':
+            ao->saved_row = ao->row;
+            ao->saved_col = ao->col;
+            break;
+        case 'u':
+            ao->row = ao->saved_row;
+            ao->col = ao->saved_col;
+            break;
+        case 'b':
+            ao->wrap = 0;
+            for (i = 0; i < n && ao->last_ch; i++)
+                ansi_print(ao, ao->last_ch);
+            return;
+        case 'n':
+        case 'c':
+            /* Status and attribute reports: the answer depends on the cursor */
+            if (!ao->raw) {
+                ansi_sync(ao);
+                ansi_out(ao, ao->esc, ao->esc_len);
+            }
+            return;
+        default:
+            if (!ao->raw)
+                ansi_unknown(ao, ao->esc, ao->esc_len);
+            return;
+    }
+
+    ao->wrap = 0;
+}
+
+/*
+ * A two-byte escape sequence (ESC x)
+ */
+static void ansi_esc_apply(ansi_opt_t *ao)
+{
+    switch (ao->esc[1]) {
+        case '7':
+            ao->saved_row = ao->row;
+            ao->saved_col = ao->col;
+            if (ao->raw)
+                ansi_out(ao, ao->esc, 2);
+            break;
+        case '8':
+            ao->row = ao->saved_row;
+            ao->col = ao->saved_col;
+            ao->wrap = 0;
+            if (ao->raw)
+                ansi_out(ao, ao->esc, 2);
+            break;
+        case 'c':
+            /* Terminal reset: everything known again */
+            ansi_out(ao, ao->esc, 2);
+            ansi_opt_reset(ao);
+            ao->pen = ANSI_DEFAULT;
+            ao->term_pen = ANSI_DEFAULT;
+            ao->have_valid = 1;
+            ao->term_row = ao->term_col = 0;
+            break;
+        default:
+            if (ao->raw)
+                ansi_out(ao, ao->esc, 2);
+            else
+                ansi_unknown(ao, ao->esc, 2);
+            break;
+    }
+}
+
+/*
+ * Optimizer for a terminal of rows lines (80 columns); use_rep if it
+ * understands REP.  The terminal's contents are unknown until the first
+ * output clears it.
+ */
+ansi_opt_t *ansi_opt_new(int rows, int use_rep)
+{
+    ansi_opt_t *ao;
+
+    ao = calloc(1, sizeof(*ao));
+    if (!ao)
+        return NULL;
+
+    ao->rows = rows < 2 ? 2 : rows > ANSI_ROWS_MAX ? ANSI_ROWS_MAX : rows;
+    ao->use_rep = use_rep;
+    ansi_opt_reset(ao);
+
+    return ao;
+}
+
+void ansi_opt_free(ansi_opt_t *ao)
+{
+    if (!ao)
+        return;
+
+    free(ao->out);
+    free(ao);
+}
+
+/*
+ * Forget what the terminal shows (new call): the next output starts
+ * with a clear
+ */
+void ansi_opt_reset(ansi_opt_t *ao)
+{
+    int row;
+
+    for (row = 0; row < ao->rows; row++) {
+        ansi_blank(ao->want[row], ANSI_COLS, ANSI_DEFAULT);
+        ansi_blank(ao->have[row], ANSI_COLS, ANSI_DEFAULT);
+        ao->dirty[row] = 0;
+    }
+
+    ao->row = ao->col = ao->wrap = 0;
+    ao->saved_row = ao->saved_col = 0;
+    ao->pen = ANSI_DEFAULT;
+    ao->last_ch = 0;
+    ao->have_valid = 0;
+    ao->raw = 0;
+    ao->term_row = ao->term_col = -1;
+    ao->term_pen = -1;
+    ao->esc_len = 0;
+}
+
+/*
+ * Output is about to reach the terminal around the optimizer (a file sent
+ * as it is): pass everything through until the next clear
+ */
+void ansi_opt_bypass(ansi_opt_t *ao)
+{
+    if (!ao)
+        return;
+
+    ao->raw = 1;
+    ao->have_valid = 0;
+    ao->term_row = ao->term_col = -1;
+    ao->term_pen = -1;
+}
+
+/*
+ * Interpret output; what has to go out in order (scrolling, bells,
+ * sequences passed through) is collected for ansi_opt_output()
+ */
+int ansi_opt_feed(ansi_opt_t *ao, const char *data, int len)
+{
+    unsigned char c;
+    int i;
+
+    if (!ao || !data || len < 0)
+        return ERROR_GENERAL;
+
+    if (ao->taken) {
+        ao->used = 0;
+        ao->taken = 0;
+    }
+
+    ao->bytes_in += len;
+
+    for (i = 0; i < len; i++) {
+        c = (unsigned char)data[i];
+
+        if (ao->esc_len > 0) {
+            if (ao->esc_len == sizeof(ao->esc)) {
+                /* Runaway sequence: give up modelling it */
+                if (ao->raw)
+                    ansi_out(ao, ao->esc, ao->esc_len);
+                else
+                    ansi_unknown(ao, ao->esc, ao->esc_len);
+                ao->esc_len = 0;
+            } else {
+                ao->esc[ao->esc_len++] = (char)c;
+                if (ao->esc_len == 2 && c != '[') {
+                    ansi_esc_apply(ao);
+                    ao->esc_len = 0;
+                } else if (ao->esc_len > 2 && c >= 0x40 && c <= 0x7E) {
+                    ansi_csi_apply(ao);
+                    ao->esc_len = 0;
+                }
+                continue;
+            }
+        }
+
+        if (c == 0x1B) {
+            ao->esc[0] = (char)c;
+            ao->esc_len = 1;
+            continue;
+        }
+
+        if (ao->raw && c != 0)
+            ansi_outc(ao, (char)c);
+
+        switch (c) {
+            case '\r':
+                ao->col = 0;
+                ao->wrap = 0;
+                break;
+            case '\n':
+                ao->wrap = 0;
+                ansi_newline(ao);
+                break;
+            case '\b':
+                if (ao->col > 0)
+                    ao->col--;
+                ao->wrap = 0;
+                break;
+            case '\t':
+                ao->col = (ao->col / 8 + 1) * 8;
+                if (ao->col >= ANSI_COLS)
+                    ao->col = ANSI_COLS - 1;
+                ao->wrap = 0;
+                break;
+            case '\a':
+                if (!ao->raw) {
+                    ansi_sync(ao);
+                    ansi_outc(ao, '\a');
+                }
+                break;
+            case 0:
+                break;  /* Padding */
+            case '\v':
+            case '\f':
+                if (!ao->raw)
+                    ansi_unknown(ao, (const char *)&data[i], 1);
+                break;
+            default:
+                ansi_print(ao, c);
+                break;
+        }
+    }
+
+    return ao->error ? ERROR_GENERAL : SUCCESS;
+}
+
+/*
+ * Everything the terminal needs for the output fed so far: the cells that
+ * differ, then the cursor
+ * Returns the length with *data pointing to it (valid until the next call
+ * on ao), or ERROR_GENERAL.
+ */
+int ansi_opt_output(ansi_opt_t *ao, const char **data)
+{
+    if (!ao || !data)
+        return ERROR_GENERAL;
+
+    if (ao->taken) {
+        ao->used = 0;
+        ao->taken = 0;
+    }
+
+    if (!ao->raw) {
+        ansi_render(ao);
+        ansi_move(ao, ao->row, ao->wrap ? ANSI_COLS - 1 : ao->col);
+    }
+
+    if (ao->error) {
+        ao->error = 0;
+        ao->used = 0;
+        return ERROR_GENERAL;
+    }
+
+    ao->bytes_out += ao->used;
+    ao->taken = 1;
+    *data = ao->out;
+    return ao->used;
+}
+
+/*
+ * Optimize data and queue the result on fd (output_queue.c)
+ * Returns len or an error code.
+ */
+int ansi_opt_send(int fd, ansi_opt_t *ao, const char *data, int len)
+{
+    const char *out;
+    int n, rc;
+
+    if (ansi_opt_feed(ao, data, len) != SUCCESS)
+        return ERROR_GENERAL;
+
+    n = ansi_opt_output(ao, &out);
+    if (n <= 0)
+        return n < 0 ? n : len;
+
+    rc = outq_write(fd, out, n);
+    return rc < 0 ? rc : len;
+}
+
+/*
+ * A cached screen as this terminal needs it: a private screen holding
+ * only what changes (freed by screen_cache_release), or NULL
+ */
+screen_t *ansi_opt_screen(ansi_opt_t *ao, const screen_t *screen)
+{
+    const char *out;
+    int n;
+
+    if (!ao || !screen || ansi_opt_feed(ao, screen->data, screen->len) != SUCCESS)
+        return NULL;
+
+    n = ansi_opt_output(ao, &out);
+    if (n < 0)
+        return NULL;
+
+    return screen_cache_build(screen->name, out, n);
+}
@@ -0,0 +1,655 @@
+/*****************************************************************************
+ * Asynchronous Log Module
+ * Binary log records on a lock-free ring, formatted by a background thread
+ * Based on MBSE BBS lib/clcomm.c Syslog() and the transmission log of
+ * TRANSMISSION_IMPROVEMENTS.md (log_transmission)
+ *
+ * "Sending: ...", "Received: ..." and transmission hex dumps are logged on
+ * the serial path, so formatting them and writing to the terminal there
+ * adds latency to every command and response.  With the logger running,
+ * the serial path only fills in a fixed-size binary record: a timestamp,
+ * the port, the level, the format pointer (the format id; it must be a
+ * string literal) and the raw arguments, with %s strings copied.  The
+ * ring is a bounded multi-producer queue using sequence numbers per slot,
+ * so claiming a slot is one compare-and-swap.  A full ring drops the
+ * record and counts it; a writer never waits.  The log thread formats
+ * records in batches and writes each batch with a single write().
+ *
+ * Informational records follow verbose_mode, like print_message();
+ * errors are always logged.  Synchronous output must not overtake
+ * records logged before it, so a program's print_message() and
+ * print_error() call async_log_flush() first.
+ *****************************************************************************/
+
+#include "modem_sample.h"
+#include <stdarg.h>
+#include <stdint.h>
+
+#define LOG_MAX_ARGS        8
+#define LOG_DATA_SIZE       160     /* Copied %s strings / hex dump bytes */
+#define LOG_BATCH_SIZE      65536   /* Formatted bytes per write() */
+#define LOG_IDLE_US         5000    /* Log thread sleep when the ring is empty */
+#define LOG_LINE_SIZE       1024
+
+typedef enum {
+    ARG_NONE = 0,
+    ARG_INT,            /* int, and everything promoted to it */
+    ARG_LONG,
+    ARG_LLONG,
+    ARG_SIZE,
+    ARG_DOUBLE,
+    ARG_PTR,
+    ARG_STR             /* Copied into data[]: offset in .str.off */
+} log_arg_type_t;
+
+typedef union {
+    long long ll;
+    long l;
+    int i;
+    size_t z;
+    double d;
+    const void *p;
+    struct {
+        unsigned short off;
+        unsigned short len;
+    } str;
+} log_arg_t;
+
+typedef struct {
+    unsigned long seq;              /* Ring slot sequence (producer/consumer handoff) */
+    long long time_ns;              /* CLOCK_REALTIME */
+    const char *format;             /* Format id: a string literal; label for LOG_LEVEL_DATA */
+    int port;
+    short level;
+    unsigned short data_len;
+    int total_len;                  /* LOG_LEVEL_DATA: bytes before truncation */
+    unsigned char type[LOG_MAX_ARGS];
+    log_arg_t arg[LOG_MAX_ARGS];
+    char data[LOG_DATA_SIZE];
+} log_record_t;
+
+static log_record_t *ring = NULL;
+static unsigned long ring_mask;
+static unsigned long enqueue_pos;       /* Shared by producers (atomic) */
+static unsigned long dequeue_pos;       /* Log thread only */
+static unsigned long dropped;           /* Atomic */
+static volatile int log_running = 0;
+static volatile int log_stop = 0;
+static pthread_t log_thread;
+static int out_fd = STDOUT_FILENO;
+static int err_fd = STDERR_FILENO;
+
+/* async_log_flush(): the log thread is woken and reports its progress */
+static pthread_mutex_t flush_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t flush_wake = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t flush_done = PTHREAD_COND_INITIALIZER;
+static unsigned long written_pos;       /* Records written out so far */
+static int flush_wanted;
+
+static char batch_out[LOG_BATCH_SIZE];
+static char batch_err[LOG_BATCH_SIZE];
+static int batch_out_len, batch_err_len;
+
+/*
+ * Claim a free slot, or NULL when the ring is full (never waits)
+ */
+static log_record_t *log_claim(unsigned long *pos_out)
+{
+    unsigned long pos, seq;
+    log_record_t *rec;
+    long diff;
+
+    pos = __atomic_load_n(&enqueue_pos, __ATOMIC_RELAXED);
+    for (;;) {
+        rec = &ring[pos & ring_mask];
+        seq = __atomic_load_n(&rec->seq, __ATOMIC_ACQUIRE);
+        diff = (long)seq - (long)pos;
+
+        if (diff == 0) {
+            if (__atomic_compare_exchange_n(&enqueue_pos, &pos, pos + 1, 1,
+                                            __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                *pos_out = pos;
+                return rec;
+            }
+        } else if (diff < 0) {
+            __atomic_add_fetch(&dropped, 1, __ATOMIC_RELAXED);
+            return NULL;
+        } else {
+            pos = __atomic_load_n(&enqueue_pos, __ATOMIC_RELAXED);
+        }
+    }
+}
+
+/*
+ * Hand a filled slot to the log thread
+ */
+static void log_publish(log_record_t *rec, unsigned long pos)
+{
+    __atomic_store_n(&rec->seq, pos + 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * Length modifier of a conversion: the argument type to fetch
+ */
+static log_arg_type_t log_int_type(const char *mod, int mod_len)
+{
+    if (mod_len == 2 && mod[0] == 'l')
+        return ARG_LLONG;
+    if (mod_len == 1 && mod[0] == 'l')
+        return ARG_LONG;
+    if (mod_len == 1 && (mod[0] == 'z' || mod[0] == 't' || mod[0] == 'j'))
+        return mod[0] == 'j' ? ARG_LLONG : ARG_SIZE;
+    return ARG_INT;
+}
+
+/*
+ * Walk one conversion specification starting after '%'
+ * Returns its length; *conv is the conversion character, *stars the
+ * number of '*' width/precision arguments, *mod the length modifier.
+ */
+static int log_parse_spec(const char *p, char *conv, int *stars, const char **mod, int *mod_len)
+{
+    const char *s = p;
+
+    *stars = 0;
+    while (*s && strchr("-+ #0'", *s))
+        s++;
+    if (*s == '*') {
+        (*stars)++;
+        s++;
+    } else {
+        while (*s >= '0' && *s <= '9')
+            s++;
+    }
+    if (*s == '.') {
+        s++;
+        if (*s == '*') {
+            (*stars)++;
+            s++;
+        } else {
+            while (*s >= '0' && *s <= '9')
+                s++;
+        }
+    }
+    *mod = s;
+    while (*s && strchr("hlLqjzt", *s))
+        s++;
+    *mod_len = (int)(s - *mod);
+    *conv = *s;
+
+    return (int)(s - p) + (*s ? 1 : 0);
+}
+
+/*
+ * Capture the arguments of format into rec (hot path: no formatting)
+ */
+static void log_capture(log_record_t *rec, const char *format, va_list args)
+{
+    const char *p = format, *mod, *str;
+    int n = 0, stars, mod_len, len, i;
+    char conv;
+
+    rec->data_len = 0;
+
+    while ((p = strchr(p, '%')) != NULL && n < LOG_MAX_ARGS) {
+        p++;
+        p += log_parse_spec(p, &conv, &stars, &mod, &mod_len);
+
+        for (i = 0; i < stars && n < LOG_MAX_ARGS; i++) {
+            rec->type[n] = ARG_INT;
+            rec->arg[n++].i = va_arg(args, int);
+        }
+        if (n >= LOG_MAX_ARGS)
+            break;
+
+        switch (conv) {
+        case 'd': case 'i': case 'u': case 'x': case 'X': case 'o': case 'c':
+            rec->type[n] = log_int_type(mod, mod_len);
+            if (rec->type[n] == ARG_LLONG)
+                rec->arg[n].ll = va_arg(args, long long);
+            else if (rec->type[n] == ARG_LONG)
+                rec->arg[n].l = va_arg(args, long);
+            else if (rec->type[n] == ARG_SIZE)
+                rec->arg[n].z = va_arg(args, size_t);
+            else
+                rec->arg[n].i = va_arg(args, int);
+            n++;
+            break;
+        case 'f': case 'F': case 'e': case 'E': case 'g': case 'G': case 'a': case 'A':
+            rec->type[n] = ARG_DOUBLE;
+            rec->arg[n++].d = va_arg(args, double);
+            break;
+        case 'p':
+            rec->type[n] = ARG_PTR;
+            rec->arg[n++].p = va_arg(args, const void *);
+            break;
+        case 's':
+            str = va_arg(args, const char *);
+            if (!str)
+                str = "(null)";
+            len = strlen(str);
+            if (len > LOG_DATA_SIZE - 1 - rec->data_len)
+                len = LOG_DATA_SIZE - 1 - rec->data_len;
+            memcpy(rec->data + rec->data_len, str, len);
+            rec->type[n] = ARG_STR;
+            rec->arg[n].str.off = rec->data_len;
+            rec->arg[n++].str.len = len;
+            rec->data_len += len;
+            break;
+        default:
+            break;  /* "%%", or a conversion we do not capture */
+        }
+    }
+
+    for (i = n; i < LOG_MAX_ARGS; i++)
+        rec->type[i] = ARG_NONE;
+}
+
+static long long log_now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/*
+ * Format one conversion with its captured argument(s)
+ */
+static int log_format_arg(char *out, size_t size, const char *spec, const log_record_t *rec,
+                          int *n, int stars)
+{
+    int star[2] = { 0, 0 }, i;
+    const log_arg_t *a;
+    char str[LOG_DATA_SIZE];
+
+    for (i = 0; i < stars && *n < LOG_MAX_ARGS; i++)
+        star[i] = rec->arg[(*n)++].i;
+
+    if (*n >= LOG_MAX_ARGS || rec->type[*n] == ARG_NONE)
+        return snprintf(out, size, "%s", spec);
+
+    a = &rec->arg[*n];
+
+#define LOG_SNPRINTF(value) \
+    (stars == 2 ? snprintf(out, size, spec, star[0], star[1], value) : \
+     stars == 1 ? snprintf(out, size, spec, star[0], value) : \
+     snprintf(out, size, spec, value))
+
+    switch (rec->type[(*n)++]) {
+    case ARG_INT:
+        return LOG_SNPRINTF(a->i);
+    case ARG_LONG:
+        return LOG_SNPRINTF(a->l);
+    case ARG_LLONG:
+        return LOG_SNPRINTF(a->ll);
+    case ARG_SIZE:
+        return LOG_SNPRINTF(a->z);
+    case ARG_DOUBLE:
+        return LOG_SNPRINTF(a->d);
+    case ARG_PTR:
+        return LOG_SNPRINTF(a->p);
+    case ARG_STR:
+        memcpy(str, rec->data + a->str.off, a->str.len);
+        str[a->str.len] = '\0';
+        return LOG_SNPRINTF(str);
+    default:
+        return 0;
+    }
+
+#undef LOG_SNPRINTF
+}
+
+/*
+ * Rebuild the message text of a record
+ */
+static int log_format_message(const log_record_t *rec, char *out, int size)
+{
+    const char *p = rec->format, *start, *mod;
+    char spec[32], conv;
+    int len = 0, n = 0, stars, mod_len, spec_len, w;
+
+    while (*p && len < size - 1) {
+        if (*p != '%') {
+            out[len++] = *p++;
+            continue;
+        }
+        if (p[1] == '%') {
+            out[len++] = '%';
+            p += 2;
+            continue;
+        }
+
+        start = p++;
+        p += log_parse_spec(p, &conv, &stars, &mod, &mod_len);
+        spec_len = (int)(p - start);
+        if (spec_len >= (int)sizeof(spec))
+            spec_len = sizeof(spec) - 1;
+        memcpy(spec, start, spec_len);
+        spec[spec_len] = '\0';
+
+        w = log_format_arg(out + len, size - len, spec, rec, &n, stars);
+        if (w > 0)
+            len += w < size - len ? w : size - len - 1;
+    }
+
+    out[len] = '\0';
+    return len;
+}
+
+/*
+ * Hex dump of a transmission record (log_transmission format)
+ */
+static int log_format_data(const log_record_t *rec, char *out, int size)
+{
+    const unsigned char *d = (const unsigned char *)rec->data;
+    int len, i;
+
+    len = snprintf(out, size, "[%s] %d bytes:", rec->format, rec->total_len);
+    for (i = 0; i < rec->data_len && len < size - 4; i++)
+        len += snprintf(out + len, size - len, " %02X", d[i]);
+    if (rec->data_len < rec->total_len && len < size - 4)
+        len += snprintf(out + len, size - len, " ...");
+
+    return len < size ? len : size - 1;
+}
+
+static void log_write_all(int fd, const char *buf, int len)
+{
+    ssize_t n;
+
+    while (len > 0) {
+        n = write(fd, buf, len);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return;  /* Nowhere to report a failed log write */
+        }
+        buf += n;
+        len -= n;
+    }
+}
+
+static void log_flush_batches(void)
+{
+    if (batch_out_len > 0)
+        log_write_all(out_fd, batch_out, batch_out_len);
+    if (batch_err_len > 0)
+        log_write_all(err_fd, batch_err, batch_err_len);
+    batch_out_len = batch_err_len = 0;
+}
+
+/*
+ * Append one formatted record to its batch
+ */
+static void log_emit(const log_record_t *rec)
+{
+    char line[LOG_LINE_SIZE];
+    char *batch;
+    int *batch_len;
+    int len = 0;
+    struct tm tm;
+    time_t sec;
+
+    if (config.enable_timing_log) {
+        sec = rec->time_ns / 1000000000LL;
+        localtime_r(&sec, &tm);
+        len = snprintf(line, sizeof(line), "[%02d:%02d:%02d.%03d] ", tm.tm_hour, tm.tm_min,
+                       tm.tm_sec, (int)(rec->time_ns / 1000000 % 1000));
+    }
+    if (rec->level == LOG_LEVEL_ERROR)
+        len += snprintf(line + len, sizeof(line) - len, "ERROR: ");
+
+    if (rec->level == LOG_LEVEL_DATA)
+        len += log_format_data(rec, line + len, sizeof(line) - len - 1);
+    else
+        len += log_format_message(rec, line + len, sizeof(line) - len - 1);
+    line[len++] = '\n';
+
+    batch = rec->level == LOG_LEVEL_ERROR ? batch_err : batch_out;
+    batch_len = rec->level == LOG_LEVEL_ERROR ? &batch_err_len : &batch_out_len;
+
+    if (*batch_len + len > LOG_BATCH_SIZE)
+        log_flush_batches();
+    memcpy(batch + *batch_len, line, len);
+    *batch_len += len;
+}
+
+/*
+ * Tell async_log_flush() callers how far the output got, then sleep
+ * until there is more (or LOG_IDLE_US when idle)
+ */
+static void log_thread_report(int idle)
+{
+    struct timespec ts;
+
+    pthread_mutex_lock(&flush_lock);
+    written_pos = dequeue_pos;
+    pthread_cond_broadcast(&flush_done);
+
+    if (idle && !flush_wanted && !log_stop) {
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_nsec += LOG_IDLE_US * 1000L;
+        if (ts.tv_nsec >= 1000000000L) {
+            ts.tv_sec++;
+            ts.tv_nsec -= 1000000000L;
+        }
+        pthread_cond_timedwait(&flush_wake, &flush_lock, &ts);
+    }
+    flush_wanted = 0;
+    pthread_mutex_unlock(&flush_lock);
+}
+
+/*
+ * Log thread: format everything published, one write() per batch
+ */
+static void *log_thread_main(void *arg)
+{
+    unsigned long reported = 0, now_dropped;
+    log_record_t *rec;
+    char line[96];
+    int len, idle;
+
+    (void)arg;
+
+    for (;;) {
+        idle = 1;
+
+        for (;;) {
+            rec = &ring[dequeue_pos & ring_mask];
+            if (__atomic_load_n(&rec->seq, __ATOMIC_ACQUIRE) != dequeue_pos + 1)
+                break;
+
+            log_emit(rec);
+            __atomic_store_n(&rec->seq, dequeue_pos + ring_mask + 1, __ATOMIC_RELEASE);
+            dequeue_pos++;
+            idle = 0;
+        }
+
+        now_dropped = __atomic_load_n(&dropped, __ATOMIC_RELAXED);
+        if (now_dropped != reported) {
+            len = snprintf(line, sizeof(line), "ERROR: log ring full, %lu record(s) dropped\n",
+                           now_dropped - reported);
+            reported = now_dropped;
+            if (batch_err_len + len > LOG_BATCH_SIZE)
+                log_flush_batches();
+            memcpy(batch_err + batch_err_len, line, len);
+            batch_err_len += len;
+        }
+
+        log_flush_batches();
+
+        if (idle && log_stop)
+            break;
+        log_thread_report(idle);
+    }
+
+    log_thread_report(0);
+    return NULL;
+}
+
+/*
+ * Start the log thread with a ring of at least 'records' slots
+ * Messages go to out, errors to err.  The ring is allocated once and
+ * kept (a writer racing async_log_stop may still hold a slot), so a
+ * restart keeps the first size.  Returns SUCCESS (also if already
+ * running) or ERROR_GENERAL; until it succeeds, logging is synchronous.
+ */
+int async_log_start(int records, int out, int err)
+{
+    unsigned long size = 64, i;
+
+    if (log_running)
+        return SUCCESS;
+
+    if (!ring) {
+        while ((long)size < records)
+            size <<= 1;
+
+        ring = calloc(size, sizeof(log_record_t));
+        if (!ring)
+            return ERROR_GENERAL;
+
+        for (i = 0; i < size; i++)
+            ring[i].seq = i;
+        ring_mask = size - 1;
+        atexit(async_log_stop);
+    }
+
+    out_fd = out;
+    err_fd = err;
+    log_stop = 0;
+    written_pos = dequeue_pos;
+
+    if (pthread_create(&log_thread, NULL, log_thread_main, NULL) != 0)
+        return ERROR_GENERAL;
+
+    __atomic_store_n(&log_running, 1, __ATOMIC_RELEASE);
+    return SUCCESS;
+}
+
+/*
+ * Write out everything queued and stop the log thread (also run at exit)
+ */
+void async_log_stop(void)
+{
+    if (!log_running)
+        return;
+
+    __atomic_store_n(&log_running, 0, __ATOMIC_RELEASE);
+    pthread_mutex_lock(&flush_lock);
+    log_stop = 1;
+    pthread_cond_signal(&flush_wake);
+    pthread_mutex_unlock(&flush_lock);
+    pthread_join(log_thread, NULL);
+}
+
+/*
+ * Wait until every record logged so far is written out
+ * For synchronous output that must come after them (print_message,
+ * print_error).  Returns at once without the log thread.
+ */
+void async_log_flush(void)
+{
+    unsigned long target;
+
+    if (!__atomic_load_n(&log_running, __ATOMIC_ACQUIRE) ||
+        pthread_equal(pthread_self(), log_thread))
+        return;
+
+    target = __atomic_load_n(&enqueue_pos, __ATOMIC_ACQUIRE);
+
+    pthread_mutex_lock(&flush_lock);
+    while ((long)(target - written_pos) > 0 && !log_stop) {
+        flush_wanted = 1;
+        pthread_cond_signal(&flush_wake);
+        pthread_cond_wait(&flush_done, &flush_lock);
+    }
+    pthread_mutex_unlock(&flush_lock);
+}
+
+/*
+ * Records dropped because the ring was full
+ */
+unsigned long async_log_dropped(void)
+{
+    return __atomic_load_n(&dropped, __ATOMIC_RELAXED);
+}
+
+/*
+ * Log a message from the serial path
+ * format must be a string literal (its address is the record's format
+ * id); at most LOG_MAX_ARGS arguments and LOG_DATA_SIZE bytes of %s
+ * strings are kept.  Below LOG_LEVEL_ERROR nothing is logged unless
+ * verbose_mode is set.  Without the log thread the message is printed
+ * synchronously through print_message / print_error.
+ */
+void log_message(int port, int level, const char *format, ...)
+{
+    log_record_t *rec;
+    unsigned long pos;
+    char text[LOG_LINE_SIZE];
+    va_list args;
+
+    if (level != LOG_LEVEL_ERROR && !config.verbose_mode)
+        return;
+
+    if (!__atomic_load_n(&log_running, __ATOMIC_ACQUIRE)) {
+        va_start(args, format);
+        vsnprintf(text, sizeof(text), format, args);
+        va_end(args);
+        if (level == LOG_LEVEL_ERROR)
+            print_error("%s", text);
+        else
+            print_message("%s", text);
+        return;
+    }
+
+    rec = log_claim(&pos);
+    if (!rec)
+        return;
+
+    rec->time_ns = log_now_ns();
+    rec->format = format;
+    rec->port = port;
+    rec->level = level;
+    va_start(args, format);
+    log_capture(rec, format, args);
+    va_end(args);
+
+    log_publish(rec, pos);
+}
+
+/*
+ * Log a hex dump of transmitted or received bytes (label: a literal)
+ * Only with verbose_mode set (see log_message).
+ */
+void log_data(int port, const char *label, const void *data, int len)
+{
+    log_record_t *rec, tmp;
+    unsigned long pos;
+    char text[LOG_LINE_SIZE];
+
+    if (!data || len < 0 || !config.verbose_mode)
+        return;
+
+    rec = __atomic_load_n(&log_running, __ATOMIC_ACQUIRE) ? log_claim(&pos) : &tmp;
+    if (!rec)
+        return;
+
+    rec->time_ns = log_now_ns();
+    rec->format = label;
+    rec->port = port;
+    rec->level = LOG_LEVEL_DATA;
+    rec->total_len = len;
+    rec->data_len = len > LOG_DATA_SIZE ? LOG_DATA_SIZE : len;
+    memcpy(rec->data, data, rec->data_len);
+
+    if (rec == &tmp) {
+        log_format_data(rec, text, sizeof(text));
+        print_message("%s", text);
+        return;
+    }
+
+    log_publish(rec, pos);
+}
@@ -0,0 +1,424 @@
+/*****************************************************************************
+ * Traffic Capture Module
+ * Append-only binary capture of serial traffic and modem line changes
+ * Based on MBSE BBS mbcico session logging and the log_transmission()
+ * hex dumps of TRANSMISSION_IMPROVEMENTS.md
+ *
+ * The 32-byte hex dumps of log_transmission() cannot show why a session
+ * stalled or went to garbage.  With capture_file set, every read from and
+ * write to a port and every status line change is appended to one file:
+ *
+ *   file    = "MDMCAP1\n" record*
+ *   record  = type:u8 port:varint delta_ns:varint len:varint payload[len]
+ *
+ * delta_ns is the CLOCK_MONOTONIC time since the previous record, so a
+ * record header is usually 5-7 bytes.  A CAPTURE_SESSION record (payload:
+ * realtime and monotonic ns, u64 little endian) starts every capture_open()
+ * and resets the time base, so a file may be appended to by several runs.
+ * CAPTURE_LINES carries TIOCM lines and changed bits (u32 little endian),
+ * CAPTURE_PORT the device name of a port.  Records are buffered and written
+ * once the buffer fills or a second has passed; a record cut off by a
+ * crash is ignored by the reader.  modem_replay feeds a capture back
+ * through the receive ring and the result code parser.
+ *****************************************************************************/
+
+#include "modem_sample.h"
+#include <stdint.h>
+#include <sys/stat.h>
+
+#define CAPTURE_MAGIC       "MDMCAP1\n"
+#define CAPTURE_MAGIC_LEN   8
+#define CAPTURE_BUF_SIZE    65536
+#define CAPTURE_FLUSH_MS    1000
+#define CAPTURE_HDR_MAX     31      /* type + three 10-byte varints */
+
+static pthread_mutex_t capture_lock = PTHREAD_MUTEX_INITIALIZER;
+static volatile int capture_fd = -1;
+static unsigned char capture_buf[CAPTURE_BUF_SIZE];
+static int capture_used = 0;
+static long long capture_last_ns;
+static long long capture_flush_ms;
+static int capture_atexit = 0;
+
+static long long capture_clock_ns(clockid_t clock)
+{
+    struct timespec ts;
+
+    clock_gettime(clock, &ts);
+    return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static int put_varint(unsigned char *p, unsigned long long v)
+{
+    int n = 0;
+
+    while (v >= 0x80) {
+        p[n++] = (unsigned char)(v | 0x80);
+        v >>= 7;
+    }
+    p[n++] = (unsigned char)v;
+    return n;
+}
+
+static void put_u64(unsigned char *p, unsigned long long v)
+{
+    int i;
+
+    for (i = 0; i < 8; i++)
+        p[i] = (unsigned char)(v >> (8 * i));
+}
+
+static void put_u32(unsigned char *p, unsigned int v)
+{
+    int i;
+
+    for (i = 0; i < 4; i++)
+        p[i] = (unsigned char)(v >> (8 * i));
+}
+
+/*
+ * Write len bytes to the capture file; on failure capturing stops
+ * (call with capture_lock held)
+ */
+static void capture_write(const void *data, int len)
+{
+    const char *p = data;
+    ssize_t n;
+
+    while (len > 0 && capture_fd >= 0) {
+        n = write(capture_fd, p, len);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            print_error("Capture write failed, capture stopped: %s", strerror(errno));
+            close(capture_fd);
+            capture_fd = -1;
+            return;
+        }
+        p += n;
+        len -= n;
+    }
+}
+
+/*
+ * Write out the buffer (call with capture_lock held)
+ */
+static void capture_flush_locked(void)
+{
+    if (capture_used > 0)
+        capture_write(capture_buf, capture_used);
+    capture_used = 0;
+    capture_flush_ms = monotonic_ms();
+}
+
+/*
+ * Append one record (call with capture_lock held)
+ */
+static void capture_append(int type, int port, long long now_ns, const void *data, int len)
+{
+    unsigned char hdr[CAPTURE_HDR_MAX];
+    int hlen;
+
+    hdr[0] = (unsigned char)type;
+    hlen = 1;
+    hlen += put_varint(hdr + hlen, (unsigned int)port);
+    hlen += put_varint(hdr + hlen, now_ns > capture_last_ns ? now_ns - capture_last_ns : 0);
+    hlen += put_varint(hdr + hlen, (unsigned int)len);
+    capture_last_ns = now_ns;
+
+    if (capture_used + hlen + len > CAPTURE_BUF_SIZE)
+        capture_flush_locked();
+
+    memcpy(capture_buf + capture_used, hdr, hlen);
+    capture_used += hlen;
+
+    if (len > CAPTURE_BUF_SIZE - capture_used) {
+        /* Bigger than the buffer: straight to the file */
+        capture_flush_locked();
+        capture_write(data, len);
+    } else if (len > 0) {
+        memcpy(capture_buf + capture_used, data, len);
+        capture_used += len;
+    }
+
+    if (monotonic_ms() - capture_flush_ms >= CAPTURE_FLUSH_MS)
+        capture_flush_locked();
+}
+
+/*
+ * Start capturing to path (appended to; created with the magic if new)
+ * A capture already running is closed first.  Returns SUCCESS or
+ * ERROR_GENERAL.
+ */
+int capture_open(const char *path)
+{
+    unsigned char session[16];
+    struct stat st;
+    int fd;
+
+    if (!path || !path[0])
+        return ERROR_GENERAL;
+
+    capture_close();
+
+    fd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0640);
+    if (fd < 0) {
+        print_error("Cannot open capture file %s: %s", path, strerror(errno));
+        return ERROR_GENERAL;
+    }
+
+    pthread_mutex_lock(&capture_lock);
+
+    capture_fd = fd;
+    capture_used = 0;
+    if (!capture_atexit) {
+        atexit(capture_close);
+        capture_atexit = 1;
+    }
+    capture_flush_ms = monotonic_ms();
+
+    if (fstat(fd, &st) == 0 && st.st_size == 0) {
+        memcpy(capture_buf, CAPTURE_MAGIC, CAPTURE_MAGIC_LEN);
+        capture_used = CAPTURE_MAGIC_LEN;
+    }
+
+    capture_last_ns = capture_clock_ns(CLOCK_MONOTONIC);
+    put_u64(session, capture_clock_ns(CLOCK_REALTIME));
+    put_u64(session + 8, capture_last_ns);
+    capture_append(CAPTURE_SESSION, 0, capture_last_ns, session, sizeof(session));
+
+    pthread_mutex_unlock(&capture_lock);
+
+    return SUCCESS;
+}
+
+/*
+ * Write out buffered records and stop capturing
+ */
+void capture_close(void)
+{
+    pthread_mutex_lock(&capture_lock);
+
+    if (capture_fd >= 0) {
+        capture_flush_locked();
+        if (capture_fd >= 0)
+            close(capture_fd);
+        capture_fd = -1;
+    }
+
+    pthread_mutex_unlock(&capture_lock);
+}
+
+/*
+ * Write out buffered records now
+ */
+void capture_flush(void)
+{
+    pthread_mutex_lock(&capture_lock);
+    if (capture_fd >= 0)
+        capture_flush_locked();
+    pthread_mutex_unlock(&capture_lock);
+}
+
+/*
+ * Non-zero while capturing (cheap check for callers that must prepare data)
+ */
+int capture_active(void)
+{
+    return capture_fd >= 0;
+}
+
+/*
+ * Record bytes read from (CAPTURE_RX) or written to (CAPTURE_TX) a port
+ */
+void capture_data(int port, int type, const void *data, int len)
+{
+    if (capture_fd < 0 || !data || len <= 0)
+        return;
+
+    pthread_mutex_lock(&capture_lock);
+    if (capture_fd >= 0)
+        capture_append(type, port, capture_clock_ns(CLOCK_MONOTONIC), data, len);
+    pthread_mutex_unlock(&capture_lock);
+}
+
+/*
+ * Record a status line change (TIOCM_* bits)
+ */
+void capture_lines(int port, int lines, int changed)
+{
+    unsigned char payload[8];
+
+    if (capture_fd < 0)
+        return;
+
+    put_u32(payload, (unsigned int)lines);
+    put_u32(payload + 4, (unsigned int)changed);
+
+    pthread_mutex_lock(&capture_lock);
+    if (capture_fd >= 0)
+        capture_append(CAPTURE_LINES, port, capture_clock_ns(CLOCK_MONOTONIC),
+                       payload, sizeof(payload));
+    pthread_mutex_unlock(&capture_lock);
+}
+
+/*
+ * Record the device name of a port
+ */
+void capture_port(int port, const char *device)
+{
+    if (capture_fd < 0 || !device)
+        return;
+
+    pthread_mutex_lock(&capture_lock);
+    if (capture_fd >= 0)
+        capture_append(CAPTURE_PORT, port, capture_clock_ns(CLOCK_MONOTONIC),
+                       device, strlen(device));
+    pthread_mutex_unlock(&capture_lock);
+}
+
+static int get_varint(FILE *fp, unsigned long long *v)
+{
+    int c, shift = 0;
+
+    *v = 0;
+    while ((c = getc(fp)) != EOF) {
+        *v |= (unsigned long long)(c & 0x7F) << shift;
+        if (!(c & 0x80))
+            return 1;
+        shift += 7;
+        if (shift > 63)
+            return -1;
+    }
+    return 0;
+}
+
+static unsigned long long get_u64(const unsigned char *p)
+{
+    unsigned long long v = 0;
+    int i;
+
+    for (i = 7; i >= 0; i--)
+        v = (v << 8) | p[i];
+    return v;
+}
+
+static unsigned int get_u32(const unsigned char *p)
+{
+    return (unsigned int)p[0] | (unsigned int)p[1] << 8 |
+           (unsigned int)p[2] << 16 | (unsigned int)p[3] << 24;
+}
+
+/*
+ * Open a capture file for reading
+ */
+int capture_reader_open(capture_reader_t *r, const char *path)
+{
+    char magic[CAPTURE_MAGIC_LEN];
+
+    if (!r || !path)
+        return ERROR_GENERAL;
+
+    memset(r, 0, sizeof(*r));
+
+    r->fp = fopen(path, "rb");
+    if (!r->fp) {
+        print_error("Cannot open %s: %s", path, strerror(errno));
+        return ERROR_GENERAL;
+    }
+
+    if (fread(magic, 1, sizeof(magic), r->fp) != sizeof(magic) ||
+        memcmp(magic, CAPTURE_MAGIC, CAPTURE_MAGIC_LEN) != 0) {
+        print_error("%s is not a capture file", path);
+        fclose(r->fp);
+        r->fp = NULL;
+        return ERROR_GENERAL;
+    }
+
+    return SUCCESS;
+}
+
+/*
+ * Read the next record; rec->data stays valid until the next call
+ * Returns 1, 0 at the end of the file (r->truncated set if the last
+ * record was cut off), or ERROR_GENERAL on a malformed record.
+ */
+int capture_reader_next(capture_reader_t *r, capture_record_t *rec)
+{
+    unsigned long long port, delta, len;
+    unsigned char *buf;
+    int type, rc;
+
+    if (!r || !r->fp || !rec)
+        return ERROR_GENERAL;
+
+    type = getc(r->fp);
+    if (type == EOF)
+        return 0;
+
+    if ((rc = get_varint(r->fp, &port)) <= 0 ||
+        (rc = get_varint(r->fp, &delta)) <= 0 ||
+        (rc = get_varint(r->fp, &len)) <= 0) {
+        if (rc == 0) {
+            r->truncated = 1;
+            return 0;
+        }
+        return ERROR_GENERAL;
+    }
+
+    if (type < CAPTURE_SESSION || type > CAPTURE_PORT || len > 0x7FFFFFFF)
+        return ERROR_GENERAL;
+
+    if ((long long)len + 1 > r->buf_size) {
+        buf = realloc(r->buf, len + 1);
+        if (!buf)
+            return ERROR_GENERAL;
+        r->buf = buf;
+        r->buf_size = len + 1;
+    }
+
+    if (fread(r->buf, 1, len, r->fp) != len) {
+        r->truncated = 1;
+        return 0;
+    }
+    r->buf[len] = '\0';
+
+    r->time_ns += delta;
+    if (type == CAPTURE_SESSION) {
+        if (len < 16)
+            return ERROR_GENERAL;
+        r->realtime_ns = get_u64(r->buf);
+        r->time_ns = get_u64(r->buf + 8);
+        r->sessions++;
+    }
+
+    rec->type = type;
+    rec->port = (int)port;
+    rec->time_ns = r->time_ns;
+    rec->data = r->buf;
+    rec->len = (int)len;
+    rec->lines = rec->changed = 0;
+    if (type == CAPTURE_LINES && len >= 8) {
+        rec->lines = (int)get_u32(r->buf);
+        rec->changed = (int)get_u32(r->buf + 4);
+    }
+
+    r->records++;
+    return 1;
+}
+
+/*
+ * Close a capture file opened for reading
+ */
+void capture_reader_close(capture_reader_t *r)
+{
+    if (!r)
+        return;
+
+    if (r->fp)
+        fclose(r->fp);
+    free(r->buf);
+    r->fp = NULL;
+    r->buf = NULL;
+    r->buf_size = 0;
+}
@@ -0,0 +1,406 @@
+/*****************************************************************************
+ * Carrier Watch Module
+ * Event-driven monitoring of the modem status lines (DCD, DSR, CTS, RI)
+ * Based on MBSE BBS mbcico/ttyio.c tty_status() and the carrier checks of
+ * mbsebbs/input.c
+ *
+ * Polling TIOCMGET once a second notices a dropped carrier up to a second
+ * late and makes validation sit out its whole period.  A watch thread per
+ * port blocks in TIOCMIWAIT instead and reports each status line
+ * transition as a carrier_event_t on a pipe.  The pipe can sit in an
+ * epoll/poll set next to the port, so DCD loss wakes its reader
+ * immediately.  Drivers without TIOCMIWAIT get TIOCMGET polling every
+ * CARRIER_POLL_MS from the same thread.
+ *
+ * The UART's TIOCGICOUNT counters are snapshotted when the watch starts,
+ * so carrier_watch_counters() gives the characters, framing, parity and
+ * overrun errors of the call so far.  A DCD pulse too short to be seen as
+ * a level change still moves the dcd counter and is reported.
+ *****************************************************************************/
+
+#include "modem_sample.h"
+#include <poll.h>
+#include <linux/serial.h>
+
+#define MAX_CARRIER_WATCHES     64
+#define CARRIER_POLL_MS         50      /* Fallback when TIOCMIWAIT is refused */
+#define CARRIER_WATCH_SIGNAL    SIGUSR2 /* Interrupts TIOCMIWAIT on stop */
+
+typedef struct {
+    int fd;                 /* -1 = free slot */
+    int pipe_fd[2];         /* Events: thread writes [1], reader reads [0] */
+    pthread_t thread;
+    volatile sig_atomic_t stop;
+    volatile sig_atomic_t running;
+    volatile int lines;     /* Last TIOCMGET result */
+    int have_icount;        /* Driver supports TIOCGICOUNT */
+    struct serial_icounter_struct base;     /* Counters at start of the call */
+    int dcd_count;          /* Last seen DCD interrupt count (watch thread) */
+    long long start_ms;
+} carrier_watch_t;
+
+static carrier_watch_t watches[MAX_CARRIER_WATCHES];
+static int watch_count = 0;
+static pthread_mutex_t watch_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t watch_once = PTHREAD_ONCE_INIT;
+
+/*
+ * Empty handler: the signal only has to interrupt TIOCMIWAIT
+ */
+static void carrier_watch_wakeup(int sig)
+{
+    (void)sig;
+}
+
+static void carrier_watch_install(void)
+{
+    struct sigaction sa;
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = carrier_watch_wakeup;
+    sigemptyset(&sa.sa_mask);
+    sa.sa_flags = 0;  /* No SA_RESTART: the ioctl must return EINTR */
+    sigaction(CARRIER_WATCH_SIGNAL, &sa, NULL);
+}
+
+/*
+ * Watch of a port (call with watch_lock held)
+ */
+static carrier_watch_t *watch_find(int fd)
+{
+    int i;
+
+    for (i = 0; i < watch_count; i++) {
+        if (watches[i].fd == fd)
+            return &watches[i];
+    }
+
+    return NULL;
+}
+
+/*
+ * Report one transition; dropped if the reader is that far behind
+ */
+static void watch_post(carrier_watch_t *w, int lines, int changed)
+{
+    carrier_event_t ev;
+    ssize_t n;
+
+    ev.lines = lines;
+    ev.changed = changed;
+    ev.time_ms = monotonic_ms();
+    capture_lines(w->fd, lines, changed);
+
+    do {
+        n = write(w->pipe_fd[1], &ev, sizeof(ev));
+    } while (n < 0 && errno == EINTR);
+}
+
+/*
+ * Watch thread: wait for a status line change, then report it
+ */
+static void *watch_thread(void *arg)
+{
+    carrier_watch_t *w = arg;
+    int mask = TIOCM_CD | TIOCM_DSR | TIOCM_CTS | TIOCM_RI;
+    struct serial_icounter_struct icount;
+    int miwait = 1, lines, changed;
+
+    while (!w->stop) {
+        if (miwait) {
+            if (ioctl(w->fd, TIOCMIWAIT, mask) != 0) {
+                if (errno == EINTR)
+                    continue;
+                if (errno == EINVAL || errno == ENOTTY || errno == ENOSYS) {
+                    miwait = 0;
+                } else {
+                    /* Port gone (EIO after close or unplug): report all lines down */
+                    watch_post(w, 0, w->lines & mask);
+                    w->lines = 0;
+                    break;
+                }
+            }
+        } else {
+            usleep(CARRIER_POLL_MS * 1000);
+        }
+
+        if (ioctl(w->fd, TIOCMGET, &lines) != 0)
+            continue;
+
+        changed = (lines ^ w->lines) & mask;
+        w->lines = lines;
+
+        /* DCD dropped and came back before we looked: still a transition */
+        if (w->have_icount && ioctl(w->fd, TIOCGICOUNT, &icount) == 0) {
+            if (icount.dcd != w->dcd_count)
+                changed |= TIOCM_CD;
+            w->dcd_count = icount.dcd;
+        }
+        if (changed)
+            watch_post(w, lines, changed);
+    }
+
+    w->running = 0;
+    return NULL;
+}
+
+/*
+ * Start watching the status lines of a port
+ * Returns SUCCESS (also if already watched), ERROR_PORT if the port has
+ * no modem status lines (a pty, CLOCAL-only adapters) or ERROR_GENERAL.
+ */
+int carrier_watch_start(int fd)
+{
+    carrier_watch_t *w;
+    int lines, i;
+
+    if (fd < 0)
+        return ERROR_GENERAL;
+
+    if (ioctl(fd, TIOCMGET, &lines) != 0)
+        return ERROR_PORT;
+
+    pthread_once(&watch_once, carrier_watch_install);
+    pthread_mutex_lock(&watch_lock);
+
+    if (watch_find(fd)) {
+        pthread_mutex_unlock(&watch_lock);
+        return SUCCESS;
+    }
+
+    for (i = 0; i < watch_count; i++) {
+        if (watches[i].fd < 0 && !watches[i].running)
+            break;
+    }
+    if (i == watch_count) {
+        if (watch_count >= MAX_CARRIER_WATCHES) {
+            pthread_mutex_unlock(&watch_lock);
+            print_error("carrier_watch_start: too many open ports");
+            return ERROR_GENERAL;
+        }
+        watch_count++;
+    }
+
+    w = &watches[i];
+    memset(w, 0, sizeof(*w));
+    w->fd = fd;
+    w->lines = lines;
+    w->start_ms = monotonic_ms();
+    w->have_icount = ioctl(fd, TIOCGICOUNT, &w->base) == 0;
+    w->dcd_count = w->base.dcd;
+
+    if (pipe(w->pipe_fd) != 0) {
+        w->fd = -1;
+        pthread_mutex_unlock(&watch_lock);
+        print_error("carrier_watch_start: pipe failed: %s", strerror(errno));
+        return ERROR_GENERAL;
+    }
+    fcntl(w->pipe_fd[0], F_SETFL, O_NONBLOCK);
+    fcntl(w->pipe_fd[1], F_SETFL, O_NONBLOCK);
+    fcntl(w->pipe_fd[0], F_SETFD, FD_CLOEXEC);
+    fcntl(w->pipe_fd[1], F_SETFD, FD_CLOEXEC);
+
+    w->running = 1;
+    if (pthread_create(&w->thread, NULL, watch_thread, w) != 0) {
+        close(w->pipe_fd[0]);
+        close(w->pipe_fd[1]);
+        w->running = 0;
+        w->fd = -1;
+        pthread_mutex_unlock(&watch_lock);
+        print_error("carrier_watch_start: cannot start watch thread");
+        return ERROR_GENERAL;
+    }
+
+    pthread_mutex_unlock(&watch_lock);
+
+    if (config.verbose_mode)
+        print_message("Carrier watch started (DCD %s)", (lines & TIOCM_CD) ? "ON" : "OFF");
+
+    return SUCCESS;
+}
+
+/*
+ * Stop watching a port (hangup or close)
+ */
+void carrier_watch_stop(int fd)
+{
+    carrier_watch_t *w;
+
+    pthread_mutex_lock(&watch_lock);
+
+    w = watch_find(fd);
+    if (!w) {
+        pthread_mutex_unlock(&watch_lock);
+        return;
+    }
+
+    /* Signal until the thread is out of TIOCMIWAIT */
+    w->stop = 1;
+    while (w->running) {
+        pthread_kill(w->thread, CARRIER_WATCH_SIGNAL);
+        usleep(1000);
+    }
+    pthread_join(w->thread, NULL);
+
+    close(w->pipe_fd[0]);
+    close(w->pipe_fd[1]);
+    w->fd = -1;
+
+    pthread_mutex_unlock(&watch_lock);
+}
+
+/*
+ * Descriptor that becomes readable when a transition is pending
+ * (for poll/epoll sets), or -1 if the port is not watched
+ */
+int carrier_watch_fd(int fd)
+{
+    carrier_watch_t *w;
+    int event_fd;
+
+    pthread_mutex_lock(&watch_lock);
+    w = watch_find(fd);
+    event_fd = w ? w->pipe_fd[0] : -1;
+    pthread_mutex_unlock(&watch_lock);
+
+    return event_fd;
+}
+
+/*
+ * Take the next pending transition without blocking
+ * Returns 1 with *ev filled, 0 if none is pending, ERROR_GENERAL if the
+ * port is not watched.
+ */
+int carrier_watch_read(int fd, carrier_event_t *ev)
+{
+    int event_fd = carrier_watch_fd(fd);
+    ssize_t n;
+
+    if (event_fd < 0 || !ev)
+        return ERROR_GENERAL;
+
+    do {
+        n = read(event_fd, ev, sizeof(*ev));
+    } while (n < 0 && errno == EINTR);
+
+    return n == (ssize_t)sizeof(*ev) ? 1 : 0;
+}
+
+/*
+ * Wait up to timeout_ms for a transition (timeout_ms < 0: no limit)
+ * Returns 1 with *ev filled, 0 on timeout, or an error code.
+ */
+int carrier_watch_wait(int fd, carrier_event_t *ev, int timeout_ms)
+{
+    struct pollfd pfd;
+    int rc;
+
+    pfd.fd = carrier_watch_fd(fd);
+    if (pfd.fd < 0 || !ev)
+        return ERROR_GENERAL;
+    pfd.events = POLLIN;
+
+    for (;;) {
+        rc = carrier_watch_read(fd, ev);
+        if (rc != 0)
+            return rc;
+
+        pfd.revents = 0;
+        rc = poll(&pfd, 1, timeout_ms);
+        if (rc == 0)
+            return 0;
+        if (rc < 0) {
+            if (errno == EINTR && !interrupted)
+                continue;
+            return interrupted ? ERROR_GENERAL : ERROR_PORT;
+        }
+    }
+}
+
+/*
+ * Last known TIOCM_* status lines of a watched port, or -1
+ */
+int carrier_watch_lines(int fd)
+{
+    carrier_watch_t *w;
+    int lines;
+
+    pthread_mutex_lock(&watch_lock);
+    w = watch_find(fd);
+    lines = w ? w->lines : -1;
+    pthread_mutex_unlock(&watch_lock);
+
+    return lines;
+}
+
+/*
+ * Line counters of a watched port since the watch started (the call)
+ * Returns SUCCESS, ERROR_PORT if the driver keeps no counters
+ * (TIOCGICOUNT), or ERROR_GENERAL if the port is not watched.
+ */
+int carrier_watch_counters(int fd, line_counters_t *counters)
+{
+    struct serial_icounter_struct now;
+    carrier_watch_t *w;
+    int rc = SUCCESS;
+
+    if (!counters)
+        return ERROR_GENERAL;
+
+    pthread_mutex_lock(&watch_lock);
+
+    w = watch_find(fd);
+    if (!w) {
+        rc = ERROR_GENERAL;
+    } else if (!w->have_icount || ioctl(fd, TIOCGICOUNT, &now) != 0) {
+        rc = ERROR_PORT;
+    } else {
+        /* The kernel counters are free running ints: unsigned subtraction wraps */
+        counters->rx = (unsigned)now.rx - (unsigned)w->base.rx;
+        counters->tx = (unsigned)now.tx - (unsigned)w->base.tx;
+        counters->frame = (unsigned)now.frame - (unsigned)w->base.frame;
+        counters->overrun = (unsigned)now.overrun - (unsigned)w->base.overrun;
+        counters->parity = (unsigned)now.parity - (unsigned)w->base.parity;
+        counters->brk = (unsigned)now.brk - (unsigned)w->base.brk;
+        counters->buf_overrun = (unsigned)now.buf_overrun - (unsigned)w->base.buf_overrun;
+        counters->dcd = (unsigned)now.dcd - (unsigned)w->base.dcd;
+        counters->dsr = (unsigned)now.dsr - (unsigned)w->base.dsr;
+        counters->cts = (unsigned)now.cts - (unsigned)w->base.cts;
+        counters->elapsed_ms = monotonic_ms() - w->start_ms;
+    }
+
+    pthread_mutex_unlock(&watch_lock);
+    return rc;
+}
+
+/*
+ * Receive errors per million characters (at least LINE_ERROR_MIN_CHARS
+ * are assumed, so one error on a quiet line is not a 100% error rate)
+ * Breaks are signalling, not errors, and are not counted.
+ */
+long line_error_rate_ppm(const line_counters_t *counters)
+{
+    long long errors, chars;
+
+    errors = (long long)counters->frame + counters->parity +
+             counters->overrun + counters->buf_overrun;
+    chars = counters->rx > LINE_ERROR_MIN_CHARS ? counters->rx : LINE_ERROR_MIN_CHARS;
+
+    return (long)(errors * 1000000 / chars);
+}
+
+/*
+ * Log the line counters of the call (hangup)
+ */
+void carrier_watch_report(int fd, const char *device)
+{
+    line_counters_t c;
+
+    if (carrier_watch_counters(fd, &c) != SUCCESS)
+        return;
+
+    print_message("[%s] Line: rx %lld tx %lld, errors frame %d parity %d overrun %d "
+                  "buffer %d (%ld ppm), breaks %d, DCD changes %d",
+                  device, c.rx, c.tx, c.frame, c.parity, c.overrun, c.buf_overrun,
+                  line_error_rate_ppm(&c), c.brk, c.dcd);
+}
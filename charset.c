@@ -0,0 +1,352 @@
+/*****************************************************************************
+ * Charset Module
+ * Streaming UTF-8 <-> CP437 / EUC-KR transcoding for callers' terminals
+ * Based on MBSE BBS lib/charset.c (per-user character set translation)
+ *
+ * Screens and session output are UTF-8, while many callers still run DOS
+ * terminals (CP437) or Korean ones (EUC-KR, KS X 1001).  Every line keeps a
+ * charset_t for its session: output passes through charset_encode() on its
+ * way to the output queue, input through charset_decode() before the
+ * session sees it.  Nearly all BBS output is ASCII, which the terminal
+ * charsets share with UTF-8, so runs of it are found eight bytes at a time
+ * and copied as they are.  Only the other characters are looked up: CP437
+ * in a 128 entry table, KS X 1001 in its 94x94 table (charset_ksx1001.c)
+ * and, for output, in a BMP wide reverse table built once.  A character
+ * split across calls is kept in the charset_t; nothing is allocated per
+ * call.  Characters the caller's charset lacks are sent as '?'.
+ *****************************************************************************/
+
+#include "modem_sample.h"
+#include <ctype.h>
+
+#define CHARSET_HIGH_BITS   0x8080808080808080ULL
+#define CHARSET_REPLACEMENT '?'
+
+/* CP437 0x80..0xFF */
+static const unsigned short cp437_ucs[128] = {
+    0x00C7, 0x00FC, 0x00E9, 0x00E2, 0x00E4, 0x00E0, 0x00E5, 0x00E7,
+    0x00EA, 0x00EB, 0x00E8, 0x00EF, 0x00EE, 0x00EC, 0x00C4, 0x00C5,
+    0x00C9, 0x00E6, 0x00C6, 0x00F4, 0x00F6, 0x00F2, 0x00FB, 0x00F9,
+    0x00FF, 0x00D6, 0x00DC, 0x00A2, 0x00A3, 0x00A5, 0x20A7, 0x0192,
+    0x00E1, 0x00ED, 0x00F3, 0x00FA, 0x00F1, 0x00D1, 0x00AA, 0x00BA,
+    0x00BF, 0x2310, 0x00AC, 0x00BD, 0x00BC, 0x00A1, 0x00AB, 0x00BB,
+    0x2591, 0x2592, 0x2593, 0x2502, 0x2524, 0x2561, 0x2562, 0x2556,
+    0x2555, 0x2563, 0x2551, 0x2557, 0x255D, 0x255C, 0x255B, 0x2510,
+    0x2514, 0x2534, 0x252C, 0x251C, 0x2500, 0x253C, 0x255E, 0x255F,
+    0x255A, 0x2554, 0x2569, 0x2566, 0x2560, 0x2550, 0x256C, 0x2567,
+    0x2568, 0x2564, 0x2565, 0x2559, 0x2558, 0x2552, 0x2553, 0x256B,
+    0x256A, 0x2518, 0x250C, 0x2588, 0x2584, 0x258C, 0x2590, 0x2580,
+    0x03B1, 0x00DF, 0x0393, 0x03C0, 0x03A3, 0x03C3, 0x00B5, 0x03C4,
+    0x03A6, 0x0398, 0x03A9, 0x03B4, 0x221E, 0x03C6, 0x03B5, 0x2229,
+    0x2261, 0x00B1, 0x2265, 0x2264, 0x2320, 0x2321, 0x00F7, 0x2248,
+    0x00B0, 0x2219, 0x00B7, 0x221A, 0x207F, 0x00B2, 0x25A0, 0x00A0,
+};
+
+/* Reverse tables: code point -> terminal bytes, 0 = none */
+static unsigned char cp437_from_ucs[0x2600];
+static unsigned short ksx1001_from_ucs[0x10000];
+static pthread_once_t charset_once = PTHREAD_ONCE_INIT;
+
+static void charset_build(void)
+{
+    int i;
+
+    for (i = 0; i < 128; i++)
+        cp437_from_ucs[cp437_ucs[i]] = (unsigned char)(0x80 + i);
+
+    for (i = 0; i < KSX1001_CELLS; i++) {
+        if (charset_ksx1001[i] >= 0x80 && ksx1001_from_ucs[charset_ksx1001[i]] == 0)
+            ksx1001_from_ucs[charset_ksx1001[i]] =
+                (unsigned short)(((0xA1 + i / 94) << 8) | (0xA1 + i % 94));
+    }
+}
+
+/*
+ * Length of the ASCII run at the start of p (up to len)
+ */
+static int charset_ascii_run(const unsigned char *p, int len)
+{
+    unsigned long long word;
+    int i = 0;
+
+    while (i + 8 <= len) {
+        memcpy(&word, p + i, 8);
+        if (word & CHARSET_HIGH_BITS)
+            break;
+        i += 8;
+    }
+
+    while (i < len && p[i] < 0x80)
+        i++;
+
+    return i;
+}
+
+/*
+ * Put a non-ASCII code point in the caller's charset (room for 2 bytes)
+ */
+static int charset_put(charset_t *cs, unsigned int ucs, unsigned char *out)
+{
+    unsigned short ks;
+
+    if (cs->id == CHARSET_CP437) {
+        if (ucs < sizeof(cp437_from_ucs) && cp437_from_ucs[ucs]) {
+            out[0] = cp437_from_ucs[ucs];
+            return 1;
+        }
+    } else if (ucs < 0x10000 && (ks = ksx1001_from_ucs[ucs]) != 0) {
+        out[0] = (unsigned char)(ks >> 8);
+        out[1] = (unsigned char)ks;
+        return 2;
+    }
+
+    cs->replaced++;
+    out[0] = CHARSET_REPLACEMENT;
+    return 1;
+}
+
+/*
+ * Put a code point as UTF-8 (room for 3 bytes; only BMP ones come here)
+ */
+static int charset_put_utf8(unsigned int ucs, unsigned char *out)
+{
+    if (ucs < 0x80) {
+        out[0] = (unsigned char)ucs;
+        return 1;
+    }
+    if (ucs < 0x800) {
+        out[0] = (unsigned char)(0xC0 | (ucs >> 6));
+        out[1] = (unsigned char)(0x80 | (ucs & 0x3F));
+        return 2;
+    }
+    out[0] = (unsigned char)(0xE0 | (ucs >> 12));
+    out[1] = (unsigned char)(0x80 | ((ucs >> 6) & 0x3F));
+    out[2] = (unsigned char)(0x80 | (ucs & 0x3F));
+    return 3;
+}
+
+/*
+ * Charset by name (utf-8, cp437, euc-kr; case and '-' ignored)
+ * Returns a CHARSET_* id or ERROR_GENERAL.
+ */
+int charset_lookup(const char *name)
+{
+    char key[16];
+    int n = 0;
+
+    if (!name)
+        return ERROR_GENERAL;
+
+    for (; *name && n < (int)sizeof(key) - 1; name++) {
+        if (*name == '-' || *name == '_')
+            continue;
+        key[n++] = (char)tolower((unsigned char)*name);
+    }
+    key[n] = '\0';
+
+    if (strcmp(key, "utf8") == 0)
+        return CHARSET_UTF8;
+    if (strcmp(key, "cp437") == 0 || strcmp(key, "ibm437") == 0)
+        return CHARSET_CP437;
+    if (strcmp(key, "euckr") == 0 || strcmp(key, "ksc5601") == 0)
+        return CHARSET_EUCKR;
+
+    return ERROR_GENERAL;
+}
+
+const char *charset_name(int id)
+{
+    switch (id) {
+        case CHARSET_CP437: return "CP437";
+        case CHARSET_EUCKR: return "EUC-KR";
+        default:            return "UTF-8";
+    }
+}
+
+/*
+ * Start a session's transcoding to and from charset id
+ */
+void charset_init(charset_t *cs, int id)
+{
+    pthread_once(&charset_once, charset_build);
+
+    memset(cs, 0, sizeof(*cs));
+    cs->id = (id == CHARSET_CP437 || id == CHARSET_EUCKR) ? id : CHARSET_UTF8;
+}
+
+/*
+ * Convert UTF-8 output to the caller's charset
+ * Writes up to size bytes to out and returns how many; *used is set to
+ * the input taken, which is all of it unless out filled up.  A character
+ * cut off at the end of data is completed by the next call.
+ */
+int charset_encode(charset_t *cs, const char *data, int len, char *out, int size, int *used)
+{
+    const unsigned char *in = (const unsigned char *)data;
+    unsigned char *dst = (unsigned char *)out;
+    unsigned char c;
+    int i = 0, o = 0, n;
+
+    if (cs->id == CHARSET_UTF8) {
+        n = len < size ? len : size;
+        memcpy(out, data, n);
+        *used = n;
+        return n;
+    }
+
+    while (i < len && o < size) {
+        if (cs->utf_need == 0) {
+            n = charset_ascii_run(in + i, (len - i < size - o) ? len - i : size - o);
+            memcpy(dst + o, in + i, n);
+            i += n;
+            o += n;
+            if (i == len || o == size)
+                break;
+
+            c = in[i++];
+            if (c >= 0xC2 && c <= 0xDF) {
+                cs->utf_need = 1;
+                cs->utf_ucs = c & 0x1F;
+                cs->utf_min = 0x80;
+            } else if (c >= 0xE0 && c <= 0xEF) {
+                cs->utf_need = 2;
+                cs->utf_ucs = c & 0x0F;
+                cs->utf_min = 0x800;
+            } else if (c >= 0xF0 && c <= 0xF4) {
+                cs->utf_need = 3;
+                cs->utf_ucs = c & 0x07;
+                cs->utf_min = 0x10000;
+            } else {
+                /* Stray continuation byte or invalid lead */
+                cs->replaced++;
+                dst[o++] = CHARSET_REPLACEMENT;
+            }
+            continue;
+        }
+
+        c = in[i];
+        if ((c & 0xC0) != 0x80) {
+            /* Sequence cut short; c starts over */
+            cs->utf_need = 0;
+            cs->replaced++;
+            dst[o++] = CHARSET_REPLACEMENT;
+            continue;
+        }
+
+        if (cs->utf_need == 1 && size - o < 2)
+            break;  /* The character may take two bytes */
+
+        i++;
+        cs->utf_ucs = (cs->utf_ucs << 6) | (c & 0x3F);
+        if (--cs->utf_need > 0)
+            continue;
+
+        if (cs->utf_ucs < cs->utf_min || (cs->utf_ucs >= 0xD800 && cs->utf_ucs <= 0xDFFF)) {
+            cs->replaced++;
+            dst[o++] = CHARSET_REPLACEMENT;
+        } else {
+            o += charset_put(cs, cs->utf_ucs, dst + o);
+        }
+    }
+
+    *used = i;
+    return o;
+}
+
+/*
+ * Convert the caller's input to UTF-8 (see charset_encode for out and
+ * *used); an EUC-KR lead byte at the end of data waits for its pair
+ */
+int charset_decode(charset_t *cs, const char *data, int len, char *out, int size, int *used)
+{
+    const unsigned char *in = (const unsigned char *)data;
+    unsigned char *dst = (unsigned char *)out;
+    unsigned short ucs;
+    unsigned char c;
+    int i = 0, o = 0, n;
+
+    if (cs->id == CHARSET_UTF8) {
+        n = len < size ? len : size;
+        memcpy(out, data, n);
+        *used = n;
+        return n;
+    }
+
+    while (i < len) {
+        if (cs->lead == 0) {
+            n = charset_ascii_run(in + i, (len - i < size - o) ? len - i : size - o);
+            memcpy(dst + o, in + i, n);
+            i += n;
+            o += n;
+            if (i == len)
+                break;
+        }
+
+        if (size - o < 3)
+            break;
+
+        c = in[i];
+        if (cs->id == CHARSET_CP437) {
+            o += charset_put_utf8(cp437_ucs[c - 0x80], dst + o);
+            i++;
+            continue;
+        }
+
+        if (cs->lead == 0) {
+            if (c >= 0xA1 && c <= 0xFE) {
+                cs->lead = c;
+            } else {
+                cs->replaced++;
+                dst[o++] = CHARSET_REPLACEMENT;
+            }
+            i++;
+            continue;
+        }
+
+        if (c < 0xA1 || c > 0xFE) {
+            /* Lead byte without its pair; c starts over */
+            cs->lead = 0;
+            cs->replaced++;
+            dst[o++] = CHARSET_REPLACEMENT;
+            continue;
+        }
+
+        ucs = charset_ksx1001[(cs->lead - 0xA1) * 94 + c - 0xA1];
+        cs->lead = 0;
+        i++;
+        if (ucs == 0) {
+            cs->replaced++;
+            dst[o++] = CHARSET_REPLACEMENT;
+        } else {
+            o += charset_put_utf8(ucs, dst + o);
+        }
+    }
+
+    *used = i;
+    return o;
+}
+
+/*
+ * A screen in the caller's charset: a private copy (freed by
+ * screen_cache_release), or NULL
+ */
+screen_t *charset_screen(charset_t *cs, const screen_t *screen)
+{
+    screen_t *converted;
+    char *data;
+    int len, used;
+
+    if (!cs || !screen)
+        return NULL;
+
+    /* Output never grows, apart from a character left from an earlier call */
+    data = malloc(screen->len + 4);
+    if (!data)
+        return NULL;
+
+    len = charset_encode(cs, screen->data, screen->len, data, screen->len + 4, &used);
+    converted = screen_cache_build(screen->name, data, len);
+    free(data);
+
+    return converted;
+}
@@ -5,74 +5,308 @@
 
 #include "modem_sample.h"
 #include <ctype.h>
+#include <sys/inotify.h>
 
 /* Global configuration structure */
 modem_config_t config;
 
-/* Configuration key-value storage for flexible parsing */
-#define MAX_CONFIG_ENTRIES 100
+/*
+ * Configuration key-value storage for flexible parsing
+ * Open addressing with linear probing; the table doubles when 3/4 full,
+ * so there is no limit on the number of entries.  A reload parses into a
+ * new store and swaps it in only once the file was read; the replaced
+ * store is kept on the retired chain, so strings handed out by
+ * get_config_string() stay valid.
+ */
+#define CONFIG_STORE_MIN    64
+
 typedef struct {
-    char key[128];
-    char value[512];
+    char *key;          /* NULL = empty slot */
+    char *value;
 } config_entry_t;
 
-static config_entry_t config_entries[MAX_CONFIG_ENTRIES];
-static int config_count = 0;
+typedef struct config_store {
+    config_entry_t *slots;
+    int capacity;       /* Power of two */
+    int count;
+    struct config_store *retired;   /* Stores replaced by reloads */
+} config_store_t;
+
+static config_store_t config_store;
+static pthread_mutex_t store_lock = PTHREAD_MUTEX_INITIALIZER;  /* Reloads run in any serial wait */
+
+/* Published snapshots (config_acquire / config_release) */
+static pthread_mutex_t snapshot_lock = PTHREAD_MUTEX_INITIALIZER;
+static config_snapshot_t *current_snapshot = NULL;
+static unsigned long snapshot_generation = 0;
+static unsigned long synced_generation = 0;
+static char config_path[512];
+
+/* Reload triggers */
+static volatile sig_atomic_t reload_requested = 0;
+static int watch_fd = -1;
+static char watch_name[sizeof(config_path)];
 
 /*
- * Initialize default configuration values
+ * FNV-1a hash of a key
  */
-void init_default_config(void)
+static unsigned int store_hash(const char *key)
+{
+    unsigned int hash = 2166136261u;
+
+    while (*key) {
+        hash ^= (unsigned char)*key++;
+        hash *= 16777619u;
+    }
+
+    return hash;
+}
+
+/*
+ * Slot holding key, or the empty slot where it would go
+ */
+static config_entry_t *store_slot(config_entry_t *slots, int capacity, const char *key)
+{
+    unsigned int i = store_hash(key) & (capacity - 1);
+
+    while (slots[i].key && strcmp(slots[i].key, key) != 0)
+        i = (i + 1) & (capacity - 1);
+
+    return &slots[i];
+}
+
+static void store_clear(config_store_t *store)
+{
+    int i;
+
+    if (store->retired) {
+        store_clear(store->retired);
+        free(store->retired);
+        store->retired = NULL;
+    }
+
+    for (i = 0; i < store->capacity; i++) {
+        free(store->slots[i].key);
+        free(store->slots[i].value);
+    }
+    free(store->slots);
+
+    store->slots = NULL;
+    store->capacity = 0;
+    store->count = 0;
+}
+
+static int store_grow(config_store_t *store)
+{
+    int capacity = store->capacity ? store->capacity * 2 : CONFIG_STORE_MIN;
+    config_entry_t *slots = calloc(capacity, sizeof(config_entry_t));
+    int i;
+
+    if (!slots)
+        return ERROR_GENERAL;
+
+    for (i = 0; i < store->capacity; i++) {
+        if (store->slots[i].key)
+            *store_slot(slots, capacity, store->slots[i].key) = store->slots[i];
+    }
+
+    free(store->slots);
+    store->slots = slots;
+    store->capacity = capacity;
+    return SUCCESS;
+}
+
+/*
+ * Add a key; the first occurrence in the file wins (as with the former
+ * linear search).  Returns 1 if added, 0 for a duplicate, or an error.
+ */
+static int store_put(config_store_t *store, const char *key, const char *value)
+{
+    config_entry_t *slot;
+
+    if ((store->count + 1) * 4 > store->capacity * 3 && store_grow(store) != SUCCESS)
+        return ERROR_GENERAL;
+
+    slot = store_slot(store->slots, store->capacity, key);
+    if (slot->key)
+        return 0;
+
+    slot->key = strdup(key);
+    slot->value = strdup(value);
+    if (!slot->key || !slot->value) {
+        free(slot->key);
+        free(slot->value);
+        slot->key = slot->value = NULL;
+        return ERROR_GENERAL;
+    }
+
+    store->count++;
+    return 1;
+}
+
+static const char *store_get(const config_store_t *store, const char *key)
+{
+    config_entry_t *slot;
+
+    if (store->count == 0)
+        return NULL;
+
+    slot = store_slot(store->slots, store->capacity, key);
+    return slot->key ? slot->value : NULL;
+}
+
+/*
+ * Make fresh the current store; the old one joins the retired chain
+ */
+static void store_replace(config_store_t *store, config_store_t *fresh)
+{
+    config_store_t *old = NULL;
+
+    if (store->count > 0) {
+        old = malloc(sizeof(*old));
+        if (old)
+            *old = *store;  /* Without memory the old strings are leaked, not freed */
+    } else {
+        free(store->slots);
+        old = store->retired;
+    }
+
+    *store = *fresh;
+    store->retired = old;
+}
+
+static int store_get_int(const config_store_t *store, const char *key, int default_value)
+{
+    const char *value;
+    char *endptr;
+    long number;
+
+    if (!key) {
+        return default_value;
+    }
+
+    value = store_get(store, key);
+    if (!value) {
+        return default_value;
+    }
+
+    number = strtol(value, &endptr, 10);
+    if (endptr != value && *endptr == '\0') {
+        return (int)number;
+    }
+
+    print_error("Invalid integer value for %s: %s", key, value);
+    return default_value;
+}
+
+/*
+ * Copy a string setting into a fixed size field if the key is present
+ */
+static void store_copy_string(const config_store_t *store, char *dst, size_t size, const char *key)
+{
+    const char *value = store_get(store, key);
+
+    if (value)
+        snprintf(dst, size, "%s", value);
+}
+
+/*
+ * Fill a configuration structure with default values
+ */
+static void config_defaults(modem_config_t *cfg)
 {
     /* Serial Port Configuration */
-    strcpy(config.serial_port, "/dev/ttyUSB0");
-    config.baudrate = 4800;
-    config.data_bits = 8;
-    strcpy(config.parity, "NONE");
-    config.stop_bits = 1;
-    strcpy(config.flow_control, "NONE");
+    strcpy(cfg->serial_port, "/dev/ttyUSB0");
+    cfg->baudrate = 4800;
+    cfg->data_bits = 8;
+    strcpy(cfg->parity, "NONE");
+    cfg->stop_bits = 1;
+    strcpy(cfg->flow_control, "NONE");
 
     /* Modem Configuration */
-    strcpy(config.modem_init_command, "ATZ; AT&F Q0 V1 X4 &C1 &D2 S7=60 S10=120 S30=5");
-    strcpy(config.modem_autoanswer_software_command, "ATE0 S0=0");
-    strcpy(config.modem_autoanswer_hardware_command, "ATE0 S0=2");
-    strcpy(config.modem_hangup_command, "ATH");
+    strcpy(cfg->modem_init_command, "ATZ; AT&F Q0 V1 X4 &C1 &D2 S7=60 S10=120 S30=5");
+    strcpy(cfg->modem_autoanswer_software_command, "ATE0 S0=0");
+    strcpy(cfg->modem_autoanswer_hardware_command, "ATE0 S0=2");
+    strcpy(cfg->modem_hangup_command, "ATH");
 
     /* Autoanswer Mode Configuration */
-    config.autoanswer_mode = 1;  /* HARDWARE */
+    cfg->autoanswer_mode = 1;  /* HARDWARE */
+
+    /* Result Code Mode */
+    cfg->numeric_results = 0;  /* Verbose */
 
     /* Timeout Configuration (seconds) */
-    config.at_command_timeout = 5;
-    config.at_answer_timeout = 60;
-    config.ring_wait_timeout = 60;
-    config.ring_idle_timeout = 10;
-    config.connect_timeout = 30;
+    cfg->at_command_timeout = 5;
+    cfg->at_answer_timeout = 60;
+    cfg->ring_wait_timeout = 60;
+    cfg->ring_idle_timeout = 10;
+    cfg->connect_timeout = 30;
 
     /* Buffer Sizes */
-    config.buffer_size = 1024;
-    config.line_buffer_size = 256;
+    cfg->buffer_size = 1024;
+    cfg->line_buffer_size = 256;
 
     /* Retry Configuration */
-    config.max_write_retry = 3;
-    config.retry_delay_us = 100000;  /* 100ms */
-    config.tx_chunk_size = 256;
-    config.tx_chunk_delay_us = 10000;  /* 10ms */
+    cfg->max_write_retry = 3;
+    cfg->retry_delay_us = 100000;  /* 100ms */
+    cfg->tx_chunk_size = 256;
+    cfg->tx_chunk_delay_us = 10000;  /* 10ms */
+    cfg->tx_pacing = 1;              /* Adaptive once CONNECT gives the line rate */
+    cfg->tx_queue_ms = 100;
+    cfg->tx_coalesce_bytes = 256;
+    cfg->tx_coalesce_ms = 10;
+    cfg->tx_write_timeout_ms = 10000;
+
+    /* AT Command Pacing */
+    cfg->at_settle_delay_ms = 0;
+    cfg->at_command_guard_ms = 0;
+
+    /* Screen Cache */
+    cfg->screen_dir[0] = '\0';
+    cfg->connect_screen[0] = '\0';
+    cfg->ansi_optimize = 0;
+    cfg->ansi_rep = 1;
+    cfg->ansi_rows = 24;
+    strcpy(cfg->terminal_charset, "utf-8");
+
+    /* File Transfer */
+    cfg->zmodem_resume = 1;
+    cfg->zmodem_window = 0;
 
     /* Logging Configuration */
-    config.verbose_mode = 1;
-    config.enable_transmission_log = 1;
-    config.enable_timing_log = 1;
+    cfg->verbose_mode = 1;
+    cfg->enable_transmission_log = 1;
+    cfg->enable_timing_log = 1;
+    cfg->async_log = 1;
+    cfg->async_log_records = 4096;
+    cfg->capture_file[0] = '\0';
+    cfg->metrics_socket[0] = '\0';
+    cfg->metrics_file[0] = '\0';
+    cfg->metrics_interval_ms = 15000;
 
     /* Advanced Options */
-    config.enable_carrier_detect = 1;
-    config.enable_connection_validation = 1;
-    config.validation_duration = 2;
-    config.enable_error_recovery = 1;
-    config.max_recovery_attempts = 3;
+    cfg->enable_carrier_detect = 1;
+    cfg->enable_connection_validation = 1;
+    cfg->validation_duration = 2;
+    cfg->carrier_settle_ms = 250;
+    cfg->quality_window_ms = 300;
+    cfg->quality_sample_ms = 10;
+    cfg->max_line_error_ppm = 1000;   /* 0.1% */
+    cfg->enable_error_recovery = 1;
+    cfg->max_recovery_attempts = 3;
+}
+
+/*
+ * Initialize default configuration values
+ */
+void init_default_config(void)
+{
+    config_defaults(&config);
 
     /* Clear configuration entries */
-    config_count = 0;
-    memset(config_entries, 0, sizeof(config_entries));
+    pthread_mutex_lock(&store_lock);
+    store_clear(&config_store);
+    pthread_mutex_unlock(&store_lock);
 }
 
 /*
@@ -143,16 +377,21 @@ static int parse_config_line(const char *line, char *key, char *value)
     if (value_len >= 512) {
         value_len = 511;
     }
-    strcpy(value, equals + 1);
+    memcpy(value, equals + 1, value_len);
+    value[value_len] = '\0';
     trim_string(value);
 
     return 1;  /* Successfully parsed */
 }
 
 /*
- * Load configuration from file
+ * Read a configuration file into a fresh structure
+ * cfg starts from the defaults; once the file was read its keys replace
+ * those available to get_config_*.  Returns the number of settings
+ * parsed, or ERROR_GENERAL if the file could not be opened (cfg then
+ * holds the defaults and the keys are left alone).
  */
-int load_config(const char *config_file)
+static int config_parse_file(const char *config_file, modem_config_t *cfg)
 {
     FILE *fp;
     char line[1024];
@@ -160,20 +399,14 @@ int load_config(const char *config_file)
     char value[512];
     int line_num = 0;
     int parsed_count = 0;
+    config_store_t store = { NULL, 0, 0, NULL };
 
-    if (!config_file) {
-        print_error("load_config: config_file is NULL");
-        return ERROR_GENERAL;
-    }
-
-    /* Initialize default values first */
-    init_default_config();
+    config_defaults(cfg);
 
     fp = fopen(config_file, "r");
     if (!fp) {
         print_error("Failed to open config file '%s': %s", config_file, strerror(errno));
-        print_message("Using default configuration values");
-        return SUCCESS;  /* Not fatal - use defaults */
+        return ERROR_GENERAL;
     }
 
     print_message("Loading configuration from: %s", config_file);
@@ -186,12 +419,14 @@ int load_config(const char *config_file)
 
         int result = parse_config_line(line, key, value);
         if (result == 1) {
-            /* Store in configuration entries array */
-            if (config_count < MAX_CONFIG_ENTRIES) {
-                strcpy(config_entries[config_count].key, key);
-                strcpy(config_entries[config_count].value, value);
-                config_count++;
+            /* Store in the configuration hash */
+            result = store_put(&store, key, value);
+            if (result == 1) {
                 parsed_count++;
+            } else if (result == 0) {
+                print_error("Duplicate config key on line %d ignored: %s", line_num, key);
+            } else {
+                print_error("Out of memory storing config key: %s", key);
             }
         } else if (result == -1) {
             print_error("Invalid config line %d: %s", line_num, line);
@@ -204,103 +439,177 @@ int load_config(const char *config_file)
     /* Now apply the loaded values to the config structure */
 
     /* Serial Port Configuration */
-    strcpy(config.serial_port, get_config_string("serial_port", config.serial_port));
-    config.baudrate = get_config_int("baudrate", config.baudrate);
-    config.data_bits = get_config_int("data_bits", config.data_bits);
-    strcpy(config.parity, get_config_string("parity", config.parity));
-    config.stop_bits = get_config_int("stop_bits", config.stop_bits);
-    strcpy(config.flow_control, get_config_string("flow_control", config.flow_control));
+    store_copy_string(&store, cfg->serial_port, sizeof(cfg->serial_port), "serial_port");
+    cfg->baudrate = store_get_int(&store, "baudrate", cfg->baudrate);
+    cfg->data_bits = store_get_int(&store, "data_bits", cfg->data_bits);
+    store_copy_string(&store, cfg->parity, sizeof(cfg->parity), "parity");
+    cfg->stop_bits = store_get_int(&store, "stop_bits", cfg->stop_bits);
+    store_copy_string(&store, cfg->flow_control, sizeof(cfg->flow_control), "flow_control");
 
     /* Modem Configuration */
-    strcpy(config.modem_init_command, get_config_string("modem_init_command", config.modem_init_command));
-    strcpy(config.modem_autoanswer_software_command,
-           get_config_string("modem_autoanswer_software_command", config.modem_autoanswer_software_command));
-    strcpy(config.modem_autoanswer_hardware_command,
-           get_config_string("modem_autoanswer_hardware_command", config.modem_autoanswer_hardware_command));
-    strcpy(config.modem_hangup_command, get_config_string("modem_hangup_command", config.modem_hangup_command));
+    store_copy_string(&store, cfg->modem_init_command, sizeof(cfg->modem_init_command), "modem_init_command");
+    store_copy_string(&store, cfg->modem_autoanswer_software_command, sizeof(cfg->modem_autoanswer_software_command), "modem_autoanswer_software_command");
+    store_copy_string(&store, cfg->modem_autoanswer_hardware_command, sizeof(cfg->modem_autoanswer_hardware_command), "modem_autoanswer_hardware_command");
+    store_copy_string(&store, cfg->modem_hangup_command, sizeof(cfg->modem_hangup_command), "modem_hangup_command");
 
     /* Autoanswer Mode Configuration */
-    config.autoanswer_mode = get_config_int("autoanswer_mode", config.autoanswer_mode);
+    cfg->autoanswer_mode = store_get_int(&store, "autoanswer_mode", cfg->autoanswer_mode);
+
+    /* Result Code Mode */
+    cfg->numeric_results = store_get_int(&store, "numeric_results", cfg->numeric_results);
 
     /* Timeout Configuration */
-    config.at_command_timeout = get_config_int("at_command_timeout", config.at_command_timeout);
-    config.at_answer_timeout = get_config_int("at_answer_timeout", config.at_answer_timeout);
-    config.ring_wait_timeout = get_config_int("ring_wait_timeout", config.ring_wait_timeout);
-    config.ring_idle_timeout = get_config_int("ring_idle_timeout", config.ring_idle_timeout);
-    config.connect_timeout = get_config_int("connect_timeout", config.connect_timeout);
+    cfg->at_command_timeout = store_get_int(&store, "at_command_timeout", cfg->at_command_timeout);
+    cfg->at_answer_timeout = store_get_int(&store, "at_answer_timeout", cfg->at_answer_timeout);
+    cfg->ring_wait_timeout = store_get_int(&store, "ring_wait_timeout", cfg->ring_wait_timeout);
+    cfg->ring_idle_timeout = store_get_int(&store, "ring_idle_timeout", cfg->ring_idle_timeout);
+    cfg->connect_timeout = store_get_int(&store, "connect_timeout", cfg->connect_timeout);
 
     /* Buffer Sizes */
-    config.buffer_size = get_config_int("buffer_size", config.buffer_size);
-    config.line_buffer_size = get_config_int("line_buffer_size", config.line_buffer_size);
+    cfg->buffer_size = store_get_int(&store, "buffer_size", cfg->buffer_size);
+    cfg->line_buffer_size = store_get_int(&store, "line_buffer_size", cfg->line_buffer_size);
 
     /* Retry Configuration */
-    config.max_write_retry = get_config_int("max_write_retry", config.max_write_retry);
-    config.retry_delay_us = get_config_int("retry_delay_us", config.retry_delay_us);
-    config.tx_chunk_size = get_config_int("tx_chunk_size", config.tx_chunk_size);
-    config.tx_chunk_delay_us = get_config_int("tx_chunk_delay_us", config.tx_chunk_delay_us);
+    cfg->max_write_retry = store_get_int(&store, "max_write_retry", cfg->max_write_retry);
+    cfg->retry_delay_us = store_get_int(&store, "retry_delay_us", cfg->retry_delay_us);
+    cfg->tx_chunk_size = store_get_int(&store, "tx_chunk_size", cfg->tx_chunk_size);
+    cfg->tx_chunk_delay_us = store_get_int(&store, "tx_chunk_delay_us", cfg->tx_chunk_delay_us);
+    cfg->tx_pacing = store_get_int(&store, "tx_pacing", cfg->tx_pacing);
+    cfg->tx_queue_ms = store_get_int(&store, "tx_queue_ms", cfg->tx_queue_ms);
+    cfg->tx_coalesce_bytes = store_get_int(&store, "tx_coalesce_bytes", cfg->tx_coalesce_bytes);
+    cfg->tx_coalesce_ms = store_get_int(&store, "tx_coalesce_ms", cfg->tx_coalesce_ms);
+    cfg->tx_write_timeout_ms = store_get_int(&store, "tx_write_timeout_ms", cfg->tx_write_timeout_ms);
+
+    /* AT Command Pacing */
+    cfg->at_settle_delay_ms = store_get_int(&store, "at_settle_delay_ms", cfg->at_settle_delay_ms);
+    cfg->at_command_guard_ms = store_get_int(&store, "at_command_guard_ms", cfg->at_command_guard_ms);
+
+    /* Screen Cache */
+    store_copy_string(&store, cfg->screen_dir, sizeof(cfg->screen_dir), "screen_dir");
+    store_copy_string(&store, cfg->connect_screen, sizeof(cfg->connect_screen), "connect_screen");
+    cfg->ansi_optimize = store_get_int(&store, "ansi_optimize", cfg->ansi_optimize);
+    cfg->ansi_rep = store_get_int(&store, "ansi_rep", cfg->ansi_rep);
+    cfg->ansi_rows = store_get_int(&store, "ansi_rows", cfg->ansi_rows);
+    store_copy_string(&store, cfg->terminal_charset, sizeof(cfg->terminal_charset), "terminal_charset");
+
+    /* File Transfer */
+    cfg->zmodem_resume = store_get_int(&store, "zmodem_resume", cfg->zmodem_resume);
+    cfg->zmodem_window = store_get_int(&store, "zmodem_window", cfg->zmodem_window);
 
     /* Logging Configuration */
-    config.verbose_mode = get_config_int("verbose_mode", config.verbose_mode);
-    config.enable_transmission_log = get_config_int("enable_transmission_log", config.enable_transmission_log);
-    config.enable_timing_log = get_config_int("enable_timing_log", config.enable_timing_log);
+    cfg->verbose_mode = store_get_int(&store, "verbose_mode", cfg->verbose_mode);
+    cfg->enable_transmission_log = store_get_int(&store, "enable_transmission_log", cfg->enable_transmission_log);
+    cfg->enable_timing_log = store_get_int(&store, "enable_timing_log", cfg->enable_timing_log);
+    cfg->async_log = store_get_int(&store, "async_log", cfg->async_log);
+    cfg->async_log_records = store_get_int(&store, "async_log_records", cfg->async_log_records);
+    store_copy_string(&store, cfg->capture_file, sizeof(cfg->capture_file), "capture_file");
+    store_copy_string(&store, cfg->metrics_socket, sizeof(cfg->metrics_socket), "metrics_socket");
+    store_copy_string(&store, cfg->metrics_file, sizeof(cfg->metrics_file), "metrics_file");
+    cfg->metrics_interval_ms = store_get_int(&store, "metrics_interval_ms", cfg->metrics_interval_ms);
 
     /* Advanced Options */
-    config.enable_carrier_detect = get_config_int("enable_carrier_detect", config.enable_carrier_detect);
-    config.enable_connection_validation = get_config_int("enable_connection_validation", config.enable_connection_validation);
-    config.validation_duration = get_config_int("validation_duration", config.validation_duration);
-    config.enable_error_recovery = get_config_int("enable_error_recovery", config.enable_error_recovery);
-    config.max_recovery_attempts = get_config_int("max_recovery_attempts", config.max_recovery_attempts);
+    cfg->enable_carrier_detect = store_get_int(&store, "enable_carrier_detect", cfg->enable_carrier_detect);
+    cfg->enable_connection_validation = store_get_int(&store, "enable_connection_validation", cfg->enable_connection_validation);
+    cfg->validation_duration = store_get_int(&store, "validation_duration", cfg->validation_duration);
+    cfg->carrier_settle_ms = store_get_int(&store, "carrier_settle_ms", cfg->carrier_settle_ms);
+    cfg->quality_window_ms = store_get_int(&store, "quality_window_ms", cfg->quality_window_ms);
+    cfg->quality_sample_ms = store_get_int(&store, "quality_sample_ms", cfg->quality_sample_ms);
+    cfg->max_line_error_ppm = store_get_int(&store, "max_line_error_ppm", cfg->max_line_error_ppm);
+    cfg->enable_error_recovery = store_get_int(&store, "enable_error_recovery", cfg->enable_error_recovery);
+    cfg->max_recovery_attempts = store_get_int(&store, "max_recovery_attempts", cfg->max_recovery_attempts);
+
+    pthread_mutex_lock(&store_lock);
+    store_replace(&config_store, &store);
+    pthread_mutex_unlock(&store_lock);
+    return parsed_count;
+}
+
+/*
+ * Make cfg the current snapshot (the previous one is freed once the last
+ * line holding it lets go)
+ */
+static int config_publish(const modem_config_t *cfg)
+{
+    config_snapshot_t *snap = malloc(sizeof(*snap));
+    config_snapshot_t *old;
+
+    if (!snap)
+        return ERROR_GENERAL;
+
+    snap->cfg = *cfg;
+    snap->refs = 1;  /* Reference held as current_snapshot */
+
+    pthread_mutex_lock(&snapshot_lock);
+    old = current_snapshot;
+    snap->generation = ++snapshot_generation;
+    current_snapshot = snap;
+    pthread_mutex_unlock(&snapshot_lock);
+
+    if (old)
+        config_release(old);
 
-    print_message("Configuration loaded successfully: %d settings parsed", parsed_count);
     return SUCCESS;
 }
 
 /*
- * Get integer value from configuration
+ * Load configuration from file
  */
-int get_config_int(const char *key, int default_value)
+int load_config(const char *config_file)
 {
-    int i;
+    modem_config_t cfg;
+    int parsed_count;
 
-    if (!key) {
-        return default_value;
+    if (!config_file) {
+        print_error("load_config: config_file is NULL");
+        return ERROR_GENERAL;
     }
 
-    for (i = 0; i < config_count; i++) {
-        if (strcmp(config_entries[i].key, key) == 0) {
-            char *endptr;
-            long value = strtol(config_entries[i].value, &endptr, 10);
+    snprintf(config_path, sizeof(config_path), "%s", config_file);
 
-            if (endptr != config_entries[i].value && *endptr == '\0') {
-                return (int)value;
-            } else {
-                print_error("Invalid integer value for %s: %s", key, config_entries[i].value);
-                return default_value;
-            }
-        }
-    }
+    parsed_count = config_parse_file(config_file, &cfg);
+    if (parsed_count < 0)
+        print_message("Using default configuration values");  /* Not fatal */
 
-    return default_value;
+    config = cfg;
+    config_publish(&cfg);
+    synced_generation = snapshot_generation;
+
+    if (parsed_count >= 0)
+        print_message("Configuration loaded successfully: %d settings parsed", parsed_count);
+    return SUCCESS;
+}
+
+/*
+ * Get integer value from configuration
+ */
+int get_config_int(const char *key, int default_value)
+{
+    int value;
+
+    pthread_mutex_lock(&store_lock);
+    value = store_get_int(&config_store, key, default_value);
+    pthread_mutex_unlock(&store_lock);
+
+    return value;
 }
 
 /*
  * Get string value from configuration
+ * The string outlives reloads; it is freed only by init_default_config().
  */
 const char *get_config_string(const char *key, const char *default_value)
 {
-    int i;
+    const char *value;
 
     if (!key) {
         return default_value;
     }
 
-    for (i = 0; i < config_count; i++) {
-        if (strcmp(config_entries[i].key, key) == 0) {
-            return config_entries[i].value;
-        }
-    }
+    pthread_mutex_lock(&store_lock);
+    value = store_get(&config_store, key);
+    pthread_mutex_unlock(&store_lock);
 
-    return default_value;
+    return value ? value : default_value;
 }
 
 /*
@@ -318,6 +627,9 @@ void print_config(void)
                   config.autoanswer_mode ? "HARDWARE" : "SOFTWARE",
                   config.autoanswer_mode ? "2" : "0");
 
+    print_message("Result Codes: %s",
+                  config.numeric_results ? "NUMERIC (V0)" : "VERBOSE (V1)");
+
     print_message("Timeouts: AT=%ds, Answer=%ds, Ring=%ds, Connect=%ds",
                   config.at_command_timeout, config.at_answer_timeout,
                   config.ring_wait_timeout, config.connect_timeout);
@@ -327,17 +639,280 @@ void print_config(void)
 
     print_message("Retry: Max %d attempts, Delay %d us",
                   config.max_write_retry, config.retry_delay_us);
+    print_message("Write Timeout: %d ms without progress", config.tx_write_timeout_ms);
+
+    if (config.tx_pacing)
+        print_message("TX Pacing: ADAPTIVE (queue %d ms of line time)", config.tx_queue_ms);
+    else
+        print_message("TX Pacing: FIXED (%d bytes, %d us)",
+                      config.tx_chunk_size, config.tx_chunk_delay_us);
+
+    if (config.tx_coalesce_ms > 0)
+        print_message("TX Coalesce: %d bytes or %d ms", config.tx_coalesce_bytes,
+                      config.tx_coalesce_ms);
+    else
+        print_message("TX Coalesce: OFF (write through)");
+
+    print_message("AT Pacing: Settle %d ms, Guard %d ms",
+                  config.at_settle_delay_ms, config.at_command_guard_ms);
+
+    print_message("Screens: %s, On CONNECT: %s",
+                  config.screen_dir[0] ? config.screen_dir : "(none)",
+                  config.connect_screen[0] ? config.connect_screen : "(none)");
+
+    if (config.ansi_optimize)
+        print_message("ANSI Optimizer: ON (%d rows, REP %s)", config.ansi_rows,
+                      config.ansi_rep ? "ON" : "OFF");
+    else
+        print_message("ANSI Optimizer: OFF");
+
+    print_message("Terminal Charset: %s", config.terminal_charset);
+
+    if (config.zmodem_window > 0)
+        print_message("ZMODEM: Resume=%s, Window %d bytes",
+                      config.zmodem_resume ? "ON" : "OFF", config.zmodem_window);
+    else
+        print_message("ZMODEM: Resume=%s, Streaming",
+                      config.zmodem_resume ? "ON" : "OFF");
 
     print_message("Logging: Verbose=%s, TX Log=%s, Timing=%s",
                   config.verbose_mode ? "ON" : "OFF",
                   config.enable_transmission_log ? "ON" : "OFF",
                   config.enable_timing_log ? "ON" : "OFF");
 
-    print_message("Advanced: Carrier Detect=%s, Validation=%s (%ds), Recovery=%s",
+    if (config.async_log)
+        print_message("Async Log: ON (%d records)", config.async_log_records);
+    else
+        print_message("Async Log: OFF");
+
+    print_message("Capture: %s", config.capture_file[0] ? config.capture_file : "OFF");
+
+    print_message("Metrics: Socket %s, File %s (every %d ms)",
+                  config.metrics_socket[0] ? config.metrics_socket : "(none)",
+                  config.metrics_file[0] ? config.metrics_file : "(none)",
+                  config.metrics_interval_ms);
+
+    print_message("Advanced: Carrier Detect=%s, Validation=%s (%ds, settle %d ms), Recovery=%s",
                   config.enable_carrier_detect ? "ON" : "OFF",
                   config.enable_connection_validation ? "ON" : "OFF",
-                  config.validation_duration,
+                  config.validation_duration, config.carrier_settle_ms,
                   config.enable_error_recovery ? "ON" : "OFF");
 
+    print_message("Line Quality: %d ms window, sampled every %d ms, max %d ppm errors",
+                  config.quality_window_ms, config.quality_sample_ms, config.max_line_error_ppm);
+
     print_message("==============================");
-}
\ No newline at end of file
+}
+/*
+ * Take a reference to the current configuration snapshot
+ * Returns NULL if no configuration has been loaded yet.
+ */
+config_snapshot_t *config_acquire(void)
+{
+    config_snapshot_t *snap;
+
+    pthread_mutex_lock(&snapshot_lock);
+    snap = current_snapshot;
+    if (snap)
+        snap->refs++;
+    pthread_mutex_unlock(&snapshot_lock);
+
+    return snap;
+}
+
+/*
+ * Drop a snapshot reference; the last one frees it
+ */
+void config_release(config_snapshot_t *snap)
+{
+    int refs;
+
+    if (!snap)
+        return;
+
+    pthread_mutex_lock(&snapshot_lock);
+    refs = --snap->refs;
+    pthread_mutex_unlock(&snapshot_lock);
+
+    if (refs == 0)
+        free(snap);
+}
+
+/*
+ * Generation of the current snapshot (0 = none loaded)
+ */
+unsigned long config_generation(void)
+{
+    unsigned long generation;
+
+    pthread_mutex_lock(&snapshot_lock);
+    generation = snapshot_generation;
+    pthread_mutex_unlock(&snapshot_lock);
+
+    return generation;
+}
+
+/*
+ * Re-read the configuration file and publish it as a new snapshot
+ * The running snapshot is kept if the file cannot be read.
+ */
+int config_reload(void)
+{
+    modem_config_t cfg;
+    int parsed_count;
+
+    if (config_path[0] == '\0')
+        return ERROR_GENERAL;
+
+    parsed_count = config_parse_file(config_path, &cfg);
+    if (parsed_count < 0) {
+        print_error("Configuration reload failed, keeping current settings");
+        return ERROR_GENERAL;
+    }
+
+    if (config_publish(&cfg) != SUCCESS)
+        return ERROR_GENERAL;
+
+    print_message("Configuration reloaded: %d settings parsed (generation %lu)",
+                  parsed_count, config_generation());
+    return SUCCESS;
+}
+
+/*
+ * Copy a newer snapshot into the global config
+ * For the single-line path; call only between calls.
+ * Returns 1 if the global config changed.
+ */
+int config_sync(void)
+{
+    config_snapshot_t *snap;
+
+    if (config_generation() == synced_generation)
+        return 0;
+
+    snap = config_acquire();
+    if (!snap)
+        return 0;
+
+    config = snap->cfg;
+    synced_generation = snap->generation;
+    config_release(snap);
+
+    print_message("Applied configuration generation %lu", synced_generation);
+    return 1;
+}
+
+/*
+ * Ask for a reload at the next config_check_reload() (async-signal-safe)
+ */
+void config_request_reload(void)
+{
+    reload_requested = 1;
+}
+
+static void config_sighup_handler(int sig)
+{
+    (void)sig;
+    reload_requested = 1;
+}
+
+/*
+ * Watch the configuration file for changes
+ * Installs a SIGHUP handler and an inotify watch on the file's directory
+ * (editors usually replace the file rather than write it in place).
+ * Returns the inotify descriptor to poll for input, or ERROR_GENERAL.
+ */
+int config_watch_start(void)
+{
+    struct sigaction sa;
+    char dir[sizeof(config_path)];
+    char *slash;
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = config_sighup_handler;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGHUP, &sa, NULL);
+
+    if (config_path[0] == '\0' || watch_fd >= 0)
+        return watch_fd >= 0 ? watch_fd : ERROR_GENERAL;
+
+    snprintf(dir, sizeof(dir), "%s", config_path);
+    slash = strrchr(dir, '/');
+    if (slash) {
+        snprintf(watch_name, sizeof(watch_name), "%s", slash + 1);
+        if (slash == dir)
+            slash[1] = '\0';
+        else
+            *slash = '\0';
+    } else {
+        snprintf(watch_name, sizeof(watch_name), "%s", dir);
+        strcpy(dir, ".");
+    }
+
+    watch_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (watch_fd < 0) {
+        print_error("inotify_init1 failed: %s (reload on SIGHUP only)", strerror(errno));
+        return ERROR_GENERAL;
+    }
+
+    if (inotify_add_watch(watch_fd, dir, IN_CLOSE_WRITE | IN_MOVED_TO) < 0) {
+        print_error("Cannot watch %s: %s (reload on SIGHUP only)", dir, strerror(errno));
+        close(watch_fd);
+        watch_fd = -1;
+        return ERROR_GENERAL;
+    }
+
+    print_message("Watching %s for configuration changes", config_path);
+    return watch_fd;
+}
+
+/*
+ * Drain inotify events; a change to the configuration file requests a reload
+ */
+void config_watch_handle(void)
+{
+    char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    const struct inotify_event *event;
+    ssize_t n;
+    char *p;
+
+    if (watch_fd < 0)
+        return;
+
+    while ((n = read(watch_fd, buf, sizeof(buf))) > 0) {
+        for (p = buf; p < buf + n; p += sizeof(struct inotify_event) + event->len) {
+            event = (const struct inotify_event *)p;
+            if (event->len > 0 && strcmp(event->name, watch_name) == 0)
+                reload_requested = 1;
+        }
+    }
+}
+
+void config_watch_stop(void)
+{
+    if (watch_fd >= 0) {
+        close(watch_fd);
+        watch_fd = -1;
+    }
+}
+
+/*
+ * The inotify descriptor of config_watch_start(), or -1
+ */
+int config_watch_fd(void)
+{
+    return watch_fd;
+}
+
+/*
+ * Reload if SIGHUP or the inotify watch asked for it
+ * Returns 1 if a new snapshot was published.
+ */
+int config_check_reload(void)
+{
+    if (!reload_requested)
+        return 0;
+
+    reload_requested = 0;
+    return config_reload() == SUCCESS;
+}
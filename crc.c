@@ -0,0 +1,147 @@
+/*****************************************************************************
+ * CRC Module
+ * Table-driven CRC-16/XMODEM and CRC-32 for the file transfer protocols
+ * Based on MBSE BBS lib/crc.c (updcrc16/updcrc32 tables) and the
+ * XMODEM/YMODEM and ZMODEM Protocol References (Forsberg)
+ *
+ * The classic byte-at-a-time table loop has a dependency on the previous
+ * CRC for every byte.  Slice-by-8 takes eight input bytes per step: the
+ * eight table lookups are independent of each other and only the first
+ * two depend on the running CRC, so a 1K block needs 128 steps instead of
+ * 1024.  crc16_tables[k][b] is the CRC of byte b followed by k zero
+ * bytes.  CRC-32 (ZMODEM, reflected polynomial 0xEDB88320) is sliced the
+ * same way; being reflected, the running CRC folds into the first four
+ * lookups instead of two.  The tables are built once, on first use.
+ *****************************************************************************/
+
+#include "modem_sample.h"
+
+static unsigned short crc16_tables[8][256];
+static pthread_once_t crc16_once = PTHREAD_ONCE_INIT;
+static unsigned int crc32_tables[8][256];
+static pthread_once_t crc32_once = PTHREAD_ONCE_INIT;
+
+static void crc16_build(void)
+{
+    unsigned short crc;
+    int b, k, bit;
+
+    /* Polynomial 0x1021, MSB first, no reflection */
+    for (b = 0; b < 256; b++) {
+        crc = (unsigned short)(b << 8);
+        for (bit = 0; bit < 8; bit++)
+            crc = (crc & 0x8000) ? (unsigned short)((crc << 1) ^ 0x1021) : (unsigned short)(crc << 1);
+        crc16_tables[0][b] = crc;
+    }
+
+    for (k = 1; k < 8; k++) {
+        for (b = 0; b < 256; b++) {
+            crc = crc16_tables[k - 1][b];
+            crc16_tables[k][b] = (unsigned short)((crc << 8) ^ crc16_tables[0][crc >> 8]);
+        }
+    }
+}
+
+/*
+ * Byte-at-a-time CRC-16/XMODEM (reference for crc16_update)
+ */
+unsigned short crc16_update_bytewise(unsigned short crc, const void *data, size_t len)
+{
+    const unsigned char *p = data;
+
+    pthread_once(&crc16_once, crc16_build);
+
+    while (len--)
+        crc = (unsigned short)((crc << 8) ^ crc16_tables[0][(crc >> 8) ^ *p++]);
+
+    return crc;
+}
+
+/*
+ * CRC-16/XMODEM (poly 0x1021, init 0) of data, continuing from crc
+ */
+unsigned short crc16_update(unsigned short crc, const void *data, size_t len)
+{
+    const unsigned short (*t)[256] = (const unsigned short (*)[256])crc16_tables;
+    const unsigned char *p = data;
+
+    pthread_once(&crc16_once, crc16_build);
+
+    while (len >= 8) {
+        crc = t[7][p[0] ^ (crc >> 8)] ^ t[6][p[1] ^ (crc & 0xFF)] ^
+              t[5][p[2]] ^ t[4][p[3]] ^ t[3][p[4]] ^ t[2][p[5]] ^
+              t[1][p[6]] ^ t[0][p[7]];
+        p += 8;
+        len -= 8;
+    }
+
+    while (len--)
+        crc = (unsigned short)((crc << 8) ^ t[0][(crc >> 8) ^ *p++]);
+
+    return crc;
+}
+
+static void crc32_build(void)
+{
+    unsigned int crc;
+    int b, k, bit;
+
+    /* Polynomial 0x04C11DB7, reflected */
+    for (b = 0; b < 256; b++) {
+        crc = (unsigned int)b;
+        for (bit = 0; bit < 8; bit++)
+            crc = (crc & 1) ? (crc >> 1) ^ 0xEDB88320U : crc >> 1;
+        crc32_tables[0][b] = crc;
+    }
+
+    for (k = 1; k < 8; k++) {
+        for (b = 0; b < 256; b++) {
+            crc = crc32_tables[k - 1][b];
+            crc32_tables[k][b] = (crc >> 8) ^ crc32_tables[0][crc & 0xFF];
+        }
+    }
+}
+
+/*
+ * Byte-at-a-time CRC-32 (reference for crc32_update)
+ */
+unsigned int crc32_update_bytewise(unsigned int crc, const void *data, size_t len)
+{
+    const unsigned char *p = data;
+
+    pthread_once(&crc32_once, crc32_build);
+
+    crc = ~crc;
+    while (len--)
+        crc = (crc >> 8) ^ crc32_tables[0][(crc ^ *p++) & 0xFF];
+
+    return ~crc;
+}
+
+/*
+ * CRC-32 (as ZMODEM and zlib: init and final inversion) of data,
+ * continuing from crc; start with 0
+ */
+unsigned int crc32_update(unsigned int crc, const void *data, size_t len)
+{
+    const unsigned int (*t)[256] = (const unsigned int (*)[256])crc32_tables;
+    const unsigned char *p = data;
+
+    pthread_once(&crc32_once, crc32_build);
+
+    crc = ~crc;
+    while (len >= 8) {
+        crc ^= (unsigned int)p[0] | (unsigned int)p[1] << 8 |
+               (unsigned int)p[2] << 16 | (unsigned int)p[3] << 24;
+        crc = t[7][crc & 0xFF] ^ t[6][(crc >> 8) & 0xFF] ^
+              t[5][(crc >> 16) & 0xFF] ^ t[4][crc >> 24] ^
+              t[3][p[4]] ^ t[2][p[5]] ^ t[1][p[6]] ^ t[0][p[7]];
+        p += 8;
+        len -= 8;
+    }
+
+    while (len--)
+        crc = (crc >> 8) ^ t[0][(crc ^ *p++) & 0xFF];
+
+    return ~crc;
+}
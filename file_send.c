@@ -0,0 +1,295 @@
+/*****************************************************************************
+ * File Send Module
+ * Zero-copy transmission of screen files (logos, banners, ANSI art)
+ * Based on MBSE BBS mbsebbs/misc.c DisplayLogo() and mbsebbs/ttyio.c tty_write()
+ *
+ * File contents go from the page cache to the tty with sendfile(), so no
+ * read+copy+write round trip per chunk.  If the kernel refuses sendfile()
+ * for the descriptor pair the file is read with pread() and written from
+ * a buffer instead.  Nothing is mmap()ed: a file truncated while it is
+ * sent would raise SIGBUS, while a short read just ends the send at the
+ * new size.  The send offset lives in file_send_t, so a transfer cut
+ * short by a full driver buffer or a partial write resumes at the first
+ * unsent byte.
+ *****************************************************************************/
+
+#include "modem_sample.h"
+#include <limits.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+
+#define FILE_SEND_BURST     65536   /* Max bytes per call when unpaced */
+#define FILE_SEND_COPY      8192    /* Bytes per write() without sendfile() */
+
+/*
+ * Open a file for sending, starting at offset (0, or a resume point)
+ */
+int file_send_open(file_send_t *fs, const char *path, off_t offset)
+{
+    struct stat st;
+
+    if (!fs || !path)
+        return ERROR_GENERAL;
+
+    memset(fs, 0, sizeof(*fs));
+
+    fs->file_fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fs->file_fd < 0) {
+        print_error("Cannot open %s: %s", path, strerror(errno));
+        return ERROR_GENERAL;
+    }
+
+    if (fstat(fs->file_fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+        print_error("Not a regular file: %s", path);
+        close(fs->file_fd);
+        fs->file_fd = -1;
+        return ERROR_GENERAL;
+    }
+
+    fs->size = st.st_size;
+    fs->offset = offset < 0 ? 0 : (offset > fs->size ? fs->size : offset);
+
+    posix_fadvise(fs->file_fd, fs->offset, 0, POSIX_FADV_SEQUENTIAL);
+
+    return SUCCESS;
+}
+
+/*
+ * Release the file
+ */
+void file_send_close(file_send_t *fs)
+{
+    if (!fs)
+        return;
+
+    if (fs->file_fd >= 0) {
+        close(fs->file_fd);
+        fs->file_fd = -1;
+    }
+}
+
+/*
+ * The file ended before fs->size (someone truncated it while we send)
+ * A mapping would take SIGBUS here and a caller seeing 0 bytes would wait
+ * for the driver forever, so the new size becomes the end of the send.
+ * at is the byte that could not be read.
+ * Returns 0, or ERROR_GENERAL if the file is not shorter after all.
+ */
+static int file_send_shrunk(file_send_t *fs, off_t at)
+{
+    struct stat st;
+
+    if (fstat(fs->file_fd, &st) != 0 || st.st_size >= fs->size) {
+        print_error("File send: no data at byte %lld of %lld",
+                    (long long)at, (long long)fs->size);
+        return ERROR_GENERAL;
+    }
+
+    print_error("File shrank from %lld to %lld bytes while being sent",
+                (long long)fs->size, (long long)st.st_size);
+    fs->size = st.st_size > fs->offset ? st.st_size : fs->offset;
+    return 0;
+}
+
+/*
+ * Read len bytes at offset, for senders that transform the data (ZMODEM
+ * escaping)
+ * Returns len, or ERROR_GENERAL on a read error or if the file ended
+ * early (fs->size is then the new end, see file_send_shrunk).
+ */
+int file_send_read(file_send_t *fs, off_t offset, void *buf, int len)
+{
+    ssize_t n;
+    int got = 0;
+
+    if (!fs || fs->file_fd < 0 || !buf || len < 0)
+        return ERROR_GENERAL;
+
+    while (got < len) {
+        n = pread(fs->file_fd, (char *)buf + got, len - got, offset + got);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0) {
+            print_error("File read failed: %s", strerror(errno));
+            return ERROR_GENERAL;
+        }
+        if (n == 0) {
+            file_send_shrunk(fs, offset + got);
+            return ERROR_GENERAL;
+        }
+        got += n;
+    }
+
+    return len;
+}
+
+/*
+ * Capture bytes sendfile() moved without passing through our memory
+ */
+static void file_send_capture(int fd, file_send_t *fs, off_t start, ssize_t n)
+{
+    char buf[4096];
+    ssize_t got;
+
+    while (n > 0) {
+        got = pread(fs->file_fd, buf, n < (ssize_t)sizeof(buf) ? n : (ssize_t)sizeof(buf), start);
+        if (got <= 0)
+            return;
+        capture_data(fd, CAPTURE_TX, buf, got);
+        start += got;
+        n -= got;
+    }
+}
+
+/*
+ * Move up to max bytes from the file to the port in one system call
+ * Safe on O_NONBLOCK ports: returns 0 when the driver buffer is full.
+ * A file that shrank ends the send at its new size (fs->size).
+ * Returns bytes sent, ERROR_HANGUP or ERROR_PORT; fs->offset advances by
+ * exactly the bytes the driver accepted.
+ */
+int file_send_step(int fd, file_send_t *fs, size_t max)
+{
+    char buf[FILE_SEND_COPY];
+    size_t count;
+    off_t start;
+    ssize_t n, got;
+
+    if (!fs || fs->file_fd < 0)
+        return ERROR_GENERAL;
+
+    if (fs->offset >= fs->size)
+        return 0;
+
+    count = fs->size - fs->offset;
+    if (max > 0 && count > max)
+        count = max;
+
+    for (;;) {
+        if (!fs->no_sendfile) {
+            start = fs->offset;
+            n = sendfile(fd, fs->file_fd, &fs->offset, count);
+            if (n < 0 && (errno == EINVAL || errno == ENOSYS)) {
+                fs->no_sendfile = 1;
+                continue;
+            }
+            if (n == 0)
+                return file_send_shrunk(fs, fs->offset) < 0 ? ERROR_PORT : 0;  /* EOF before fs->size */
+            if (n > 0 && capture_active())
+                file_send_capture(fd, fs, start, n);
+        } else {
+            got = pread(fs->file_fd, buf, count < sizeof(buf) ? count : sizeof(buf), fs->offset);
+            if (got < 0 && errno == EINTR)
+                continue;
+            if (got < 0)
+                return ERROR_PORT;
+            if (got == 0)
+                return file_send_shrunk(fs, fs->offset) < 0 ? ERROR_PORT : 0;
+
+            n = write(fd, buf, got);
+            if (n > 0) {
+                capture_data(fd, CAPTURE_TX, buf, n);
+                fs->offset += n;
+            }
+        }
+
+        if (n >= 0) {
+            metrics_tx(fd, n);
+            return (int)n;
+        }
+
+        if (errno == EINTR)
+            continue;
+        if (errno == EAGAIN || errno == EWOULDBLOCK)
+            return 0;
+        if (errno == EPIPE || errno == ECONNRESET || errno == EIO)
+            return ERROR_HANGUP;
+        return ERROR_PORT;
+    }
+}
+
+/*
+ * Send the rest of an open file at the pace of the line (serial_tx.c)
+ * Carrier is verified before every chunk.  On ERROR_HANGUP or
+ * ERROR_TIMEOUT fs->offset is the resume point.
+ */
+int file_send_run(int fd, file_send_t *fs)
+{
+    size_t chunk;
+    int n, rc, allowed, delay_us;
+
+    if (!fs || fs->file_fd < 0)
+        return ERROR_GENERAL;
+
+    /* Unpaced port: fixed chunks, or as much as the driver takes per call */
+    delay_us = serial_tx_delay_us(fd);
+    chunk = delay_us > 0 && config.tx_chunk_size > 0 ?
+            (size_t)config.tx_chunk_size : FILE_SEND_BURST;
+
+    while (fs->offset < fs->size) {
+        rc = signal_event_handle();
+        if (rc != SUCCESS)
+            return rc;
+
+        if (verify_carrier_before_send(fd) != SUCCESS) {
+            print_error("Carrier lost at byte %lld of %lld",
+                        (long long)fs->offset, (long long)fs->size);
+            return ERROR_HANGUP;
+        }
+
+        allowed = serial_tx_wait(fd, fs->size - fs->offset > INT_MAX ?
+                                     INT_MAX : (int)(fs->size - fs->offset));
+        if (allowed < 0)
+            return allowed;
+
+        n = file_send_step(fd, fs, allowed == INT_MAX ? chunk : (size_t)allowed);
+        if (n < 0)
+            return n;
+        serial_tx_account(fd, n);
+
+        if (n == 0 && fs->offset < fs->size) {
+            /* Driver buffer full: wait for room */
+            metrics_write_retry(fd);
+            rc = serial_wait_writable(fd, -1);
+            if (rc != SUCCESS)
+                return rc;
+            continue;
+        }
+
+        if (allowed == INT_MAX && delay_us > 0 && fs->offset < fs->size) {
+            rc = signal_event_sleep((delay_us + 999) / 1000);  /* Unpaced port: fixed pacing */
+            if (rc != SUCCESS)
+                return rc;
+        }
+    }
+
+    return SUCCESS;
+}
+
+/*
+ * Send a file to the port (blocking)
+ * If offset is not NULL the transfer starts at *offset and *offset is set
+ * to the first unsent byte, so a failed send can be resumed later.
+ * Returns SUCCESS, ERROR_HANGUP, ERROR_TIMEOUT or another error code.
+ */
+int serial_send_file(int fd, const char *path, off_t *offset)
+{
+    file_send_t fs;
+    int rc;
+
+    rc = file_send_open(&fs, path, offset ? *offset : 0);
+    if (rc != SUCCESS)
+        return rc;
+
+    if (config.verbose_mode)
+        print_message("Sending %s (%lld bytes from %lld)", path,
+                      (long long)fs.size, (long long)fs.offset);
+
+    rc = file_send_run(fd, &fs);
+
+    if (offset)
+        *offset = fs.offset;
+
+    file_send_close(&fs);
+    return rc;
+}
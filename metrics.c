@@ -0,0 +1,768 @@
+/*****************************************************************************
+ * Metrics Module
+ * Per-port counters and latency histograms, exported as Prometheus text
+ * Based on MBSE BBS mbtask/ports.c line status and the mbcico session
+ * statistics (bytes, cps) written at the end of each call
+ *
+ * Counters and histograms are kept per port and recorded with relaxed
+ * atomic adds, so the serial path never takes a lock to count.  Latencies
+ * go into HDR-style log-linear histograms in microseconds: exact below
+ * 32 us, then 16 sub-buckets per power of two (at most 1/16 = 6.25%
+ * relative error) up to 2^32 us.  A histogram is allocated when first
+ * recorded to.  The UART error counters of the call in progress
+ * (carrier_watch_counters) are read when the metrics are rendered.
+ *
+ * An exporter thread renders everything in the Prometheus text format.
+ * It answers each connection on metrics_socket (a Unix socket: raw text,
+ * or an HTTP response if the client sends "GET") and rewrites
+ * metrics_file every metrics_interval_ms (write + rename, never torn).
+ *****************************************************************************/
+
+#include "modem_sample.h"
+#include <stdarg.h>
+#include <stddef.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#define MAX_METRIC_PORTS        64
+#define METRICS_MAX_COMMANDS    32      /* Distinct AT commands per port */
+#define METRICS_MAX_SPEEDS      24      /* Distinct CONNECT speeds per port */
+#define METRICS_COMMAND_LEN     40
+#define METRICS_ANSWER_MAX_MS   120000  /* RING/ATA older than this is not this call */
+
+#define HIST_SUB_BITS           4
+#define HIST_SUB_COUNT          (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS            ((32 - HIST_SUB_BITS + 1) * HIST_SUB_COUNT)
+#define HIST_MAX_US             0xFFFFFFFFULL
+
+typedef struct {
+    unsigned long count;
+    unsigned long long sum_us;
+    unsigned long buckets[HIST_BUCKETS];
+} metrics_hist_t;
+
+typedef struct {
+    char name[METRICS_COMMAND_LEN];
+    metrics_hist_t *hist;
+} metrics_command_t;
+
+typedef struct {
+    int fd;
+    char device[64];
+    unsigned long rx_bytes;
+    unsigned long tx_bytes;
+    unsigned long tx_chunks;
+    unsigned long write_retries;
+    unsigned long recoveries;
+    unsigned long carrier_drops;
+    unsigned long connects;
+    long long ring_ms;                  /* Last RING, 0 = none */
+    long long ata_ms;                   /* Last ATA, 0 = none */
+    metrics_hist_t *ring_to_ata;
+    metrics_hist_t *ata_to_connect;
+    metrics_command_t commands[METRICS_MAX_COMMANDS];
+    int command_count;
+    int speeds[METRICS_MAX_SPEEDS];
+    unsigned long speed_count[METRICS_MAX_SPEEDS];
+    int speed_slots;
+} metrics_port_t;
+
+typedef struct {
+    char *buf;
+    size_t len;
+    size_t size;
+} metrics_text_t;
+
+static metrics_port_t ports[MAX_METRIC_PORTS];
+static int port_count = 0;
+static pthread_mutex_t metrics_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static pthread_t exporter_thread;
+static volatile int exporter_running = 0;
+static int listen_fd = -1;
+static char socket_path[108];
+static char file_path[256];
+static int export_interval_ms;
+static int exporter_atexit = 0;
+
+/* Bucket bounds exported for latencies, in seconds */
+static const double latency_le[] = {
+    0.001, 0.0025, 0.005, 0.01, 0.025, 0.05, 0.1, 0.25, 0.5, 1, 2.5, 5, 10, 30, 60
+};
+
+/*
+ * Histogram bucket of a value: exact below 2 * HIST_SUB_COUNT, then
+ * HIST_SUB_COUNT linear sub-buckets per power of two
+ */
+static int hist_index(unsigned long long v)
+{
+    int e;
+
+    if (v > HIST_MAX_US)
+        v = HIST_MAX_US;
+    if (v < 2 * HIST_SUB_COUNT)
+        return (int)v;
+
+    e = 63 - __builtin_clzll(v);
+    return (e - HIST_SUB_BITS + 1) * HIST_SUB_COUNT +
+           (int)((v >> (e - HIST_SUB_BITS)) - HIST_SUB_COUNT);
+}
+
+/*
+ * Lowest value that lands in a bucket
+ */
+static unsigned long long hist_lower(int index)
+{
+    int e;
+
+    if (index < 2 * HIST_SUB_COUNT)
+        return index;
+
+    e = index / HIST_SUB_COUNT + HIST_SUB_BITS - 1;
+    return (unsigned long long)(HIST_SUB_COUNT + index % HIST_SUB_COUNT) << (e - HIST_SUB_BITS);
+}
+
+static void hist_record(metrics_hist_t *h, unsigned long long us)
+{
+    __atomic_add_fetch(&h->buckets[hist_index(us)], 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&h->sum_us, us, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&h->count, 1, __ATOMIC_RELAXED);
+}
+
+/*
+ * Allocate a histogram on first use (call with metrics_lock held)
+ */
+static metrics_hist_t *hist_get(metrics_hist_t **slot)
+{
+    metrics_hist_t *h = __atomic_load_n(slot, __ATOMIC_ACQUIRE);
+
+    if (!h) {
+        h = calloc(1, sizeof(*h));
+        if (h)
+            __atomic_store_n(slot, h, __ATOMIC_RELEASE);
+    }
+
+    return h;
+}
+
+/*
+ * Metrics of a port, created on first use
+ */
+static metrics_port_t *metrics_port(int fd)
+{
+    int i, count = __atomic_load_n(&port_count, __ATOMIC_ACQUIRE);
+
+    if (fd < 0)
+        return NULL;
+
+    for (i = 0; i < count; i++) {
+        if (ports[i].fd == fd)
+            return &ports[i];
+    }
+
+    pthread_mutex_lock(&metrics_lock);
+
+    for (i = 0; i < port_count; i++) {
+        if (ports[i].fd == fd) {
+            pthread_mutex_unlock(&metrics_lock);
+            return &ports[i];
+        }
+    }
+
+    if (port_count >= MAX_METRIC_PORTS) {
+        pthread_mutex_unlock(&metrics_lock);
+        return NULL;
+    }
+
+    memset(&ports[port_count], 0, sizeof(ports[port_count]));
+    ports[port_count].fd = fd;
+    snprintf(ports[port_count].device, sizeof(ports[port_count].device), "fd%d", fd);
+    __atomic_store_n(&port_count, port_count + 1, __ATOMIC_RELEASE);
+
+    pthread_mutex_unlock(&metrics_lock);
+    return &ports[i];
+}
+
+/*
+ * Label a port with its device name
+ */
+void metrics_port_name(int fd, const char *device)
+{
+    metrics_port_t *m = metrics_port(fd);
+
+    if (m && device) {
+        pthread_mutex_lock(&metrics_lock);
+        snprintf(m->device, sizeof(m->device), "%s", device);
+        pthread_mutex_unlock(&metrics_lock);
+    }
+}
+
+/*
+ * AT command round trip: command written to final result code
+ */
+void metrics_at_command(int fd, const char *command, long long us)
+{
+    metrics_port_t *m = metrics_port(fd);
+    metrics_hist_t *h = NULL;
+    int i, count;
+
+    if (!m || !command)
+        return;
+
+    count = __atomic_load_n(&m->command_count, __ATOMIC_ACQUIRE);
+    for (i = 0; i < count; i++) {
+        if (strncmp(m->commands[i].name, command, METRICS_COMMAND_LEN - 1) == 0) {
+            h = m->commands[i].hist;
+            break;
+        }
+    }
+
+    if (!h) {
+        pthread_mutex_lock(&metrics_lock);
+        for (i = 0; i < m->command_count; i++) {
+            if (strncmp(m->commands[i].name, command, METRICS_COMMAND_LEN - 1) == 0)
+                break;
+        }
+        if (i < METRICS_MAX_COMMANDS) {
+            if (i == m->command_count) {
+                snprintf(m->commands[i].name, METRICS_COMMAND_LEN, "%s", command);
+                m->commands[i].hist = calloc(1, sizeof(metrics_hist_t));
+                if (m->commands[i].hist)
+                    __atomic_store_n(&m->command_count, i + 1, __ATOMIC_RELEASE);
+            }
+            h = m->commands[i].hist;
+        }
+        pthread_mutex_unlock(&metrics_lock);
+    }
+
+    if (h)
+        hist_record(h, us < 0 ? 0 : (unsigned long long)us);
+}
+
+/*
+ * RING seen on a port (start of RING -> ATA)
+ */
+void metrics_ring(int fd)
+{
+    metrics_port_t *m = metrics_port(fd);
+
+    if (m)
+        m->ring_ms = monotonic_ms();
+}
+
+/*
+ * ATA sent (end of RING -> ATA, start of ATA -> CONNECT)
+ */
+void metrics_answer(int fd)
+{
+    metrics_port_t *m = metrics_port(fd);
+    metrics_hist_t *h;
+    long long now = monotonic_ms();
+
+    if (!m)
+        return;
+
+    if (m->ring_ms > 0 && now - m->ring_ms < METRICS_ANSWER_MAX_MS) {
+        pthread_mutex_lock(&metrics_lock);
+        h = hist_get(&m->ring_to_ata);
+        pthread_mutex_unlock(&metrics_lock);
+        if (h)
+            hist_record(h, (now - m->ring_ms) * 1000);
+    }
+
+    m->ring_ms = 0;
+    m->ata_ms = now;
+}
+
+/*
+ * CONNECT received: ATA -> CONNECT time and the speed distribution
+ */
+void metrics_connect(int fd, int speed)
+{
+    metrics_port_t *m = metrics_port(fd);
+    metrics_hist_t *h;
+    long long now = monotonic_ms();
+    int i;
+
+    if (!m)
+        return;
+
+    __atomic_add_fetch(&m->connects, 1, __ATOMIC_RELAXED);
+
+    if (m->ata_ms > 0 && now - m->ata_ms < METRICS_ANSWER_MAX_MS) {
+        pthread_mutex_lock(&metrics_lock);
+        h = hist_get(&m->ata_to_connect);
+        pthread_mutex_unlock(&metrics_lock);
+        if (h)
+            hist_record(h, (now - m->ata_ms) * 1000);
+    }
+    m->ring_ms = m->ata_ms = 0;
+
+    pthread_mutex_lock(&metrics_lock);
+    for (i = 0; i < m->speed_slots; i++) {
+        if (m->speeds[i] == speed)
+            break;
+    }
+    if (i == m->speed_slots && i < METRICS_MAX_SPEEDS) {
+        m->speeds[i] = speed;
+        m->speed_slots++;
+    }
+    if (i < m->speed_slots)
+        m->speed_count[i]++;
+    pthread_mutex_unlock(&metrics_lock);
+}
+
+/*
+ * One successful write() of len bytes to a port
+ */
+void metrics_tx(int fd, int len)
+{
+    metrics_port_t *m = metrics_port(fd);
+
+    if (m && len > 0) {
+        __atomic_add_fetch(&m->tx_bytes, len, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&m->tx_chunks, 1, __ATOMIC_RELAXED);
+    }
+}
+
+/*
+ * Bytes read from a port
+ */
+void metrics_rx(int fd, int len)
+{
+    metrics_port_t *m = metrics_port(fd);
+
+    if (m && len > 0)
+        __atomic_add_fetch(&m->rx_bytes, len, __ATOMIC_RELAXED);
+}
+
+/*
+ * A write had to wait for the driver (EAGAIN, partial write)
+ */
+void metrics_write_retry(int fd)
+{
+    metrics_port_t *m = metrics_port(fd);
+
+    if (m)
+        __atomic_add_fetch(&m->write_retries, 1, __ATOMIC_RELAXED);
+}
+
+/*
+ * An error recovery attempt (re-init after a failed command)
+ */
+void metrics_recovery(int fd)
+{
+    metrics_port_t *m = metrics_port(fd);
+
+    if (m)
+        __atomic_add_fetch(&m->recoveries, 1, __ATOMIC_RELAXED);
+}
+
+/*
+ * Carrier lost during a call or its validation
+ */
+void metrics_carrier_drop(int fd)
+{
+    metrics_port_t *m = metrics_port(fd);
+
+    if (m)
+        __atomic_add_fetch(&m->carrier_drops, 1, __ATOMIC_RELAXED);
+}
+
+static void text_add(metrics_text_t *t, const char *format, ...)
+{
+    va_list args;
+    char *buf;
+    int n;
+
+    for (;;) {
+        if (t->buf) {
+            va_start(args, format);
+            n = vsnprintf(t->buf + t->len, t->size - t->len, format, args);
+            va_end(args);
+            if (n < 0)
+                return;
+            if ((size_t)n < t->size - t->len) {
+                t->len += n;
+                return;
+            }
+        }
+
+        buf = realloc(t->buf, t->size ? t->size * 2 : 16384);
+        if (!buf)
+            return;
+        t->buf = buf;
+        t->size = t->size ? t->size * 2 : 16384;
+    }
+}
+
+/*
+ * Label value with Prometheus escaping (\\, \", \n)
+ */
+static const char *label_escape(const char *in, char *out, size_t size)
+{
+    size_t n = 0;
+
+    for (; *in && n + 2 < size; in++) {
+        if (*in == '\\' || *in == '"') {
+            out[n++] = '\\';
+            out[n++] = *in;
+        } else if (*in == '\n') {
+            out[n++] = '\\';
+            out[n++] = 'n';
+        } else {
+            out[n++] = *in;
+        }
+    }
+    out[n] = '\0';
+
+    return out;
+}
+
+static void text_counter(metrics_text_t *t, const char *name, const char *help, size_t offset)
+{
+    char port[160];
+    int i;
+
+    text_add(t, "# HELP %s %s\n# TYPE %s counter\n", name, help, name);
+    for (i = 0; i < port_count; i++) {
+        text_add(t, "%s{port=\"%s\"} %lu\n", name,
+                 label_escape(ports[i].device, port, sizeof(port)),
+                 __atomic_load_n((unsigned long *)((char *)&ports[i] + offset), __ATOMIC_RELAXED));
+    }
+}
+
+/*
+ * Line errors of the call in progress, per watched port with TIOCGICOUNT
+ */
+static void text_line_errors(metrics_text_t *t)
+{
+    static const char *const types[] = { "frame", "overrun", "parity", "buf_overrun" };
+    line_counters_t c[MAX_METRIC_PORTS];
+    int have[MAX_METRIC_PORTS];
+    char port[160];
+    int count[4], i, j;
+
+    for (i = 0; i < port_count; i++)
+        have[i] = carrier_watch_counters(ports[i].fd, &c[i]) == SUCCESS;
+
+    text_add(t, "# HELP modem_line_errors UART receive errors in the current call\n"
+                "# TYPE modem_line_errors gauge\n");
+    for (i = 0; i < port_count; i++) {
+        if (!have[i])
+            continue;
+        label_escape(ports[i].device, port, sizeof(port));
+        count[0] = c[i].frame;
+        count[1] = c[i].overrun;
+        count[2] = c[i].parity;
+        count[3] = c[i].buf_overrun;
+        for (j = 0; j < 4; j++)
+            text_add(t, "modem_line_errors{port=\"%s\",type=\"%s\"} %d\n", port, types[j], count[j]);
+    }
+
+    text_add(t, "# HELP modem_line_breaks Breaks received in the current call\n"
+                "# TYPE modem_line_breaks gauge\n");
+    for (i = 0; i < port_count; i++) {
+        if (have[i])
+            text_add(t, "modem_line_breaks{port=\"%s\"} %d\n",
+                     label_escape(ports[i].device, port, sizeof(port)), c[i].brk);
+    }
+}
+
+/*
+ * One histogram series: cumulative buckets at latency_le, sum, count
+ */
+static void text_hist(metrics_text_t *t, const char *name, const char *labels, const metrics_hist_t *h)
+{
+    unsigned long cumulative = 0, count;
+    int b = 0, i;
+
+    for (i = 0; i < (int)(sizeof(latency_le) / sizeof(latency_le[0])); i++) {
+        unsigned long long le_us = (unsigned long long)(latency_le[i] * 1e6 + 0.5);
+
+        /* A bucket counts below the bound if it starts below it */
+        for (; b < HIST_BUCKETS && hist_lower(b) < le_us; b++)
+            cumulative += __atomic_load_n(&h->buckets[b], __ATOMIC_RELAXED);
+        text_add(t, "%s_bucket{%s,le=\"%g\"} %lu\n", name, labels, latency_le[i], cumulative);
+    }
+
+    count = __atomic_load_n(&h->count, __ATOMIC_RELAXED);
+    text_add(t, "%s_bucket{%s,le=\"+Inf\"} %lu\n", name, labels, count);
+    text_add(t, "%s_sum{%s} %.6f\n", name, labels,
+             __atomic_load_n(&h->sum_us, __ATOMIC_RELAXED) / 1e6);
+    text_add(t, "%s_count{%s} %lu\n", name, labels, count);
+}
+
+/*
+ * Render all metrics in the Prometheus text exposition format
+ */
+static void metrics_render(metrics_text_t *t)
+{
+    char port[160], command[2 * METRICS_COMMAND_LEN], labels[400];
+    metrics_hist_t *h;
+    int i, j;
+
+    t->len = 0;
+    text_add(t, "");
+
+    pthread_mutex_lock(&metrics_lock);
+
+    text_counter(t, "modem_rx_bytes_total", "Bytes read from the port",
+                 offsetof(metrics_port_t, rx_bytes));
+    text_counter(t, "modem_tx_bytes_total", "Bytes written to the port",
+                 offsetof(metrics_port_t, tx_bytes));
+    text_counter(t, "modem_tx_chunks_total", "Successful write() calls to the port",
+                 offsetof(metrics_port_t, tx_chunks));
+    text_counter(t, "modem_tx_write_retries_total", "Writes that waited for the driver (EAGAIN, partial)",
+                 offsetof(metrics_port_t, write_retries));
+    text_counter(t, "modem_recovery_attempts_total", "Modem error recovery attempts",
+                 offsetof(metrics_port_t, recoveries));
+    text_counter(t, "modem_carrier_drops_total", "Carrier lost during a call or its validation",
+                 offsetof(metrics_port_t, carrier_drops));
+    text_counter(t, "modem_connects_total", "CONNECT results",
+                 offsetof(metrics_port_t, connects));
+
+    text_add(t, "# HELP modem_connect_speed_total CONNECT results by line speed\n"
+                "# TYPE modem_connect_speed_total counter\n");
+    for (i = 0; i < port_count; i++) {
+        label_escape(ports[i].device, port, sizeof(port));
+        for (j = 0; j < ports[i].speed_slots; j++)
+            text_add(t, "modem_connect_speed_total{port=\"%s\",speed=\"%d\"} %lu\n",
+                     port, ports[i].speeds[j], ports[i].speed_count[j]);
+    }
+
+    text_line_errors(t);
+
+    text_add(t, "# HELP modem_at_command_duration_seconds AT command to final result code\n"
+                "# TYPE modem_at_command_duration_seconds histogram\n");
+    for (i = 0; i < port_count; i++) {
+        label_escape(ports[i].device, port, sizeof(port));
+        for (j = 0; j < ports[i].command_count; j++) {
+            snprintf(labels, sizeof(labels), "port=\"%s\",command=\"%s\"", port,
+                     label_escape(ports[i].commands[j].name, command, sizeof(command)));
+            text_hist(t, "modem_at_command_duration_seconds", labels, ports[i].commands[j].hist);
+        }
+    }
+
+    text_add(t, "# HELP modem_answer_duration_seconds Answer phases: RING to ATA, ATA to CONNECT\n"
+                "# TYPE modem_answer_duration_seconds histogram\n");
+    for (i = 0; i < port_count; i++) {
+        label_escape(ports[i].device, port, sizeof(port));
+        if ((h = ports[i].ring_to_ata) != NULL) {
+            snprintf(labels, sizeof(labels), "port=\"%s\",phase=\"ring_to_ata\"", port);
+            text_hist(t, "modem_answer_duration_seconds", labels, h);
+        }
+        if ((h = ports[i].ata_to_connect) != NULL) {
+            snprintf(labels, sizeof(labels), "port=\"%s\",phase=\"ata_to_connect\"", port);
+            text_hist(t, "modem_answer_duration_seconds", labels, h);
+        }
+    }
+
+    pthread_mutex_unlock(&metrics_lock);
+}
+
+/*
+ * Render the metrics into a caller buffer (tests, status displays)
+ * Returns the full length, like snprintf().
+ */
+int metrics_format(char *out, int size)
+{
+    metrics_text_t t = { NULL, 0, 0 };
+    int len;
+
+    metrics_render(&t);
+    len = (int)t.len;
+    if (out && size > 0)
+        snprintf(out, size, "%s", t.buf ? t.buf : "");
+    free(t.buf);
+
+    return len;
+}
+
+static void metrics_write_all(int fd, const char *buf, size_t len)
+{
+    ssize_t n;
+
+    while (len > 0) {
+        n = write(fd, buf, len);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return;
+        }
+        buf += n;
+        len -= n;
+    }
+}
+
+/*
+ * Answer one scraper on the Unix socket
+ */
+static void metrics_serve(int client, metrics_text_t *t)
+{
+    static const char http[] = "HTTP/1.0 200 OK\r\n"
+                               "Content-Type: text/plain; version=0.0.4\r\n"
+                               "Connection: close\r\n\r\n";
+    struct pollfd pfd;
+    char request[512];
+    ssize_t n = 0;
+
+    /* A plain client sends nothing; an HTTP client sends its request first */
+    pfd.fd = client;
+    pfd.events = POLLIN;
+    if (poll(&pfd, 1, 100) > 0)
+        n = read(client, request, sizeof(request));
+
+    metrics_render(t);
+    if (n >= 4 && memcmp(request, "GET ", 4) == 0)
+        metrics_write_all(client, http, sizeof(http) - 1);
+    metrics_write_all(client, t->buf, t->len);
+}
+
+/*
+ * Rewrite the metrics file (write to a temporary name, then rename)
+ */
+static void metrics_write_file(metrics_text_t *t)
+{
+    char tmp[sizeof(file_path) + 8];
+    int fd;
+
+    snprintf(tmp, sizeof(tmp), "%s.tmp", file_path);
+    fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0)
+        return;
+
+    metrics_render(t);
+    metrics_write_all(fd, t->buf, t->len);
+    close(fd);
+
+    if (rename(tmp, file_path) != 0)
+        unlink(tmp);
+}
+
+/*
+ * Exporter thread: serve the socket, rewrite the file on schedule
+ */
+static void *exporter_main(void *arg)
+{
+    metrics_text_t t = { NULL, 0, 0 };
+    struct pollfd pfd;
+    long long next_file = 0, now;
+    int timeout, client;
+
+    (void)arg;
+
+    while (exporter_running) {
+        now = monotonic_ms();
+        if (file_path[0] && now >= next_file) {
+            metrics_write_file(&t);
+            next_file = now + export_interval_ms;
+        }
+
+        /* Short timeout so metrics_stop() is noticed */
+        timeout = file_path[0] ? (int)(next_file - now) : 1000;
+        if (timeout > 1000)
+            timeout = 1000;
+
+        if (listen_fd < 0) {
+            usleep(timeout * 1000);
+            continue;
+        }
+
+        pfd.fd = listen_fd;
+        pfd.events = POLLIN;
+        if (poll(&pfd, 1, timeout) > 0 && (pfd.revents & POLLIN)) {
+            client = accept(listen_fd, NULL, NULL);
+            if (client >= 0) {
+                metrics_serve(client, &t);
+                close(client);
+            }
+        }
+    }
+
+    if (file_path[0])
+        metrics_write_file(&t);
+    free(t.buf);
+    return NULL;
+}
+
+/*
+ * Start exporting: socket and/or file path ("" or NULL = not used)
+ * Returns SUCCESS (also if already running) or ERROR_GENERAL.
+ */
+int metrics_start(const char *sock, const char *file, int interval_ms)
+{
+    struct sockaddr_un addr;
+
+    if (exporter_running)
+        return SUCCESS;
+    if ((!sock || !sock[0]) && (!file || !file[0]))
+        return ERROR_GENERAL;
+
+    snprintf(file_path, sizeof(file_path), "%s", file ? file : "");
+    export_interval_ms = interval_ms > 0 ? interval_ms : 15000;
+    socket_path[0] = '\0';
+
+    if (sock && sock[0]) {
+        if (strlen(sock) >= sizeof(addr.sun_path)) {
+            print_error("Metrics socket path too long: %s", sock);
+            return ERROR_GENERAL;
+        }
+
+        listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (listen_fd < 0) {
+            print_error("Metrics socket failed: %s", strerror(errno));
+            return ERROR_GENERAL;
+        }
+
+        memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", sock);
+        unlink(sock);  /* Left over from an earlier run */
+
+        if (bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+            listen(listen_fd, 8) != 0) {
+            print_error("Cannot listen on %s: %s", sock, strerror(errno));
+            close(listen_fd);
+            listen_fd = -1;
+            return ERROR_GENERAL;
+        }
+        snprintf(socket_path, sizeof(socket_path), "%s", sock);
+    }
+
+    exporter_running = 1;
+    if (pthread_create(&exporter_thread, NULL, exporter_main, NULL) != 0) {
+        exporter_running = 0;
+        if (listen_fd >= 0) {
+            close(listen_fd);
+            listen_fd = -1;
+            unlink(socket_path);
+        }
+        return ERROR_GENERAL;
+    }
+
+    if (!exporter_atexit) {
+        atexit(metrics_stop);
+        exporter_atexit = 1;
+    }
+    return SUCCESS;
+}
+
+/*
+ * Stop the exporter (the file gets a last update; the socket is removed)
+ */
+void metrics_stop(void)
+{
+    if (!exporter_running)
+        return;
+
+    exporter_running = 0;
+    pthread_join(exporter_thread, NULL);
+
+    if (listen_fd >= 0) {
+        close(listen_fd);
+        listen_fd = -1;
+        unlink(socket_path);
+    }
+}
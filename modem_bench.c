@@ -0,0 +1,1665 @@
+/*****************************************************************************
+ * Modem Benchmark
+ * AT round-trip latency and RING-to-first-byte timing against the
+ * PTY modem emulator (modem_emu.c)
+ *
+ * Usage: modem_bench [-n iterations] [-c calls] [-s connect_speed]
+ *                    [-d response_delay_us] [-S screen_dir] [-N] [-v]
+ *****************************************************************************/
+
+#include "modem_sample.h"
+#include <stdarg.h>
+#include <poll.h>
+#include <pty.h>
+#include <dirent.h>
+
+/* Globals normally provided by the main program */
+int serial_fd = -1;
+volatile sig_atomic_t interrupted = 0;
+
+static int bench_verbose = 0;
+
+#define BENCH_MAX_SAMPLES   1000
+#define BENCH_PACING_SECONDS    2
+#define BENCH_MODEM_BUFFER      1024    /* Typical V.34 modem transmit buffer */
+
+typedef struct {
+    const char *name;
+    double samples[BENCH_MAX_SAMPLES];
+    int count;
+} bench_series_t;
+
+void print_message(const char *format, ...)
+{
+    va_list args;
+
+    if (!bench_verbose)
+        return;
+
+    async_log_flush();  /* After the records logged before */
+    va_start(args, format);
+    vprintf(format, args);
+    va_end(args);
+    printf("\n");
+    fflush(stdout);
+}
+
+void print_error(const char *format, ...)
+{
+    va_list args;
+
+    if (!bench_verbose)
+        return;
+
+    async_log_flush();
+    va_start(args, format);
+    fprintf(stderr, "ERROR: ");
+    vfprintf(stderr, format, args);
+    va_end(args);
+    fprintf(stderr, "\n");
+}
+
+static long long bench_now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static void bench_add(bench_series_t *series, long long elapsed_ns)
+{
+    if (series->count < BENCH_MAX_SAMPLES)
+        series->samples[series->count++] = elapsed_ns / 1000000.0;
+}
+
+static int compare_double(const void *a, const void *b)
+{
+    double da = *(const double *)a, db = *(const double *)b;
+
+    return (da > db) - (da < db);
+}
+
+/*
+ * Nearest-rank percentile of a sorted series
+ */
+static double bench_percentile(const bench_series_t *series, int pct)
+{
+    int rank;
+
+    if (series->count == 0)
+        return 0.0;
+
+    rank = (pct * series->count + 99) / 100;
+    if (rank < 1)
+        rank = 1;
+
+    return series->samples[rank - 1];
+}
+
+static void bench_report(bench_series_t *series)
+{
+    if (series->count == 0) {
+        printf("  %-44s   (no samples)\n", series->name);
+        return;
+    }
+
+    qsort(series->samples, series->count, sizeof(double), compare_double);
+    printf("  %-44s %5d %9.2f %9.2f %9.2f %9.2f\n", series->name, series->count,
+           series->samples[0], bench_percentile(series, 50),
+           bench_percentile(series, 99), series->samples[series->count - 1]);
+}
+
+static void bench_header(const char *title)
+{
+    printf("\n%s\n", title);
+    printf("  %-44s %5s %9s %9s %9s %9s\n", "", "n", "min ms", "p50 ms", "p99 ms", "max ms");
+}
+
+/*
+ * Wait until the emulator has seen the first data byte of the call
+ */
+static long long wait_first_byte(modem_emu_t *emu, int timeout_ms)
+{
+    modem_emu_stats_t stats;
+    long long deadline = bench_now_ns() + (long long)timeout_ms * 1000000LL;
+
+    do {
+        modem_emu_get_stats(emu, &stats);
+        if (stats.first_data_ns != 0)
+            return stats.first_data_ns;
+        usleep(100);
+    } while (bench_now_ns() < deadline);
+
+    return 0;
+}
+
+/*
+ * Let the emulator ring twice and answer: RING x2 -> ATA -> CONNECT
+ */
+static int bench_answer(modem_emu_t *emu)
+{
+    char line_buf[LINE_BUFFER_SIZE];
+    int ring_count = 0;
+    int speed = 0;
+    int rc;
+
+    modem_emu_ring(emu, 2, 10);
+
+    while (ring_count < 2) {
+        rc = serial_read_line(serial_fd, line_buf, sizeof(line_buf), config.ring_wait_timeout);
+        if (rc < 0)
+            return rc;
+        if (rc > 0 && detect_ring(line_buf))
+            ring_count++;
+    }
+
+    rc = modem_answer_with_speed_adjust(serial_fd, &speed);
+    if (rc != SUCCESS)
+        return rc;
+
+    return SUCCESS;
+}
+
+/*
+ * One incoming call: RING x2 -> ATA -> CONNECT -> first data byte -> hangup
+ */
+static int bench_call(modem_emu_t *emu, bench_series_t *ring_connect,
+                      bench_series_t *ring_first_byte, bench_series_t *hangup)
+{
+    modem_emu_stats_t stats;
+    long long first_ns, start;
+    int rc;
+
+    rc = bench_answer(emu);
+    if (rc != SUCCESS)
+        return rc;
+
+    rc = serial_write(serial_fd, "first\n\r", 7);
+    if (rc >= 0)
+        rc = outq_flush(serial_fd);  /* A prompt waiting for input */
+    if (rc < 0)
+        return rc;
+
+    first_ns = wait_first_byte(emu, 1000);
+    modem_emu_get_stats(emu, &stats);
+
+    bench_add(ring_connect, stats.connect_ns - stats.ring_ns);
+    if (first_ns != 0)
+        bench_add(ring_first_byte, first_ns - stats.ring_ns);
+
+    start = bench_now_ns();
+    modem_hangup(serial_fd);
+    bench_add(hangup, bench_now_ns() - start);
+
+    return SUCCESS;
+}
+
+/*
+ * One call sending BENCH_PACING_SECONDS of line time through
+ * serial_paced_send(), with adaptive or the former fixed pacing
+ */
+static int bench_paced_call(modem_emu_t *emu, int adaptive, modem_emu_stats_t *stats,
+                            int *bytes, long long *elapsed_ns)
+{
+    static char data[115200 / 10 * BENCH_PACING_SECONDS];
+    long long start;
+    int len, i, rc;
+
+    len = emu->connect_speed / 10 * BENCH_PACING_SECONDS;
+    if (len > (int)sizeof(data))
+        len = sizeof(data);
+    for (i = 0; i < len; i++)
+        data[i] = (i % 64 == 63) ? '\n' : 'x';
+
+    config.tx_pacing = adaptive;
+    rc = bench_answer(emu);
+    if (rc != SUCCESS)
+        return rc;
+
+    if (!adaptive) {
+        /* modem_sample.conf values, whatever the line rate */
+        config.tx_chunk_size = TX_CHUNK_SIZE;
+        config.tx_chunk_delay_us = TX_CHUNK_DELAY_US;
+        serial_tx_chunk_delay(serial_fd, -1);  /* Not the delay derived from CONNECT */
+    }
+
+    start = bench_now_ns();
+    rc = serial_paced_send(serial_fd, data, len);
+    *elapsed_ns = bench_now_ns() - start;
+    *bytes = len;
+
+    usleep(50000);  /* Let the emulator take in the tail */
+    modem_emu_get_stats(emu, stats);
+    modem_hangup(serial_fd);
+
+    return rc < 0 ? rc : SUCCESS;
+}
+
+/*
+ * Fixed vs. adaptive TX pacing against a modem buffer draining at the
+ * line rate: overflowed bytes and line utilization
+ */
+static void bench_pacing(modem_emu_t *emu)
+{
+    static const int rates[] = { 2400, 14400, 33600 };
+    modem_emu_stats_t stats;
+    long long elapsed_ns, span_ns;
+    int saved_speed = emu->connect_speed;
+    int saved_pacing = config.tx_pacing;
+    int i, adaptive, bytes;
+
+    emu->tx_buffer_size = BENCH_MODEM_BUFFER;
+
+    printf("\nTX pacing (%d s of line time per run, %d byte modem buffer)\n",
+           BENCH_PACING_SECONDS, BENCH_MODEM_BUFFER);
+    printf("  %-28s %9s %9s %9s %10s %10s\n",
+           "", "line bps", "bytes", "send ms", "line busy", "overflow");
+
+    for (i = 0; i < (int)(sizeof(rates) / sizeof(rates[0])) && !interrupted; i++) {
+        for (adaptive = 0; adaptive <= 1; adaptive++) {
+            emu->connect_speed = rates[i];
+            if (bench_paced_call(emu, adaptive, &stats, &bytes, &elapsed_ns) != SUCCESS) {
+                fprintf(stderr, "Paced call at %d bps failed\n", rates[i]);
+                continue;
+            }
+
+            span_ns = stats.last_data_ns - stats.first_data_ns;
+            printf("  %-28s %9d %9d %9.1f %9.1f%% %10lld\n",
+                   adaptive ? "adaptive (rate + TIOCOUTQ)" : "fixed 256 B / 10 ms",
+                   rates[i], bytes, elapsed_ns / 1e6,
+                   span_ns > 0 ? 100.0 - stats.line_idle_ns * 100.0 / span_ns : 100.0,
+                   stats.overflow_bytes);
+        }
+    }
+
+    emu->tx_buffer_size = 0;
+    emu->connect_speed = saved_speed;
+    config.tx_pacing = saved_pacing;
+}
+
+/* A menu as a BBS writes it: one call per line, attribute or prompt */
+static const char *menu_output[] = {
+    "\x1b[2J", "\x1b[1;37m", "Main Menu\r\n", "\x1b[0m", "\r\n",
+    "\x1b[1;33m[M]\x1b[0m", " Message areas\r\n",
+    "\x1b[1;33m[F]\x1b[0m", " File areas\r\n",
+    "\x1b[1;33m[U]\x1b[0m", " User list\r\n",
+    "\x1b[1;33m[G]\x1b[0m", " Goodbye\r\n",
+    "\r\n", "Time left: ", "59", " min\r\n", "Select: ",
+};
+
+#define MENU_WRITES ((int)(sizeof(menu_output) / sizeof(menu_output[0])))
+
+/*
+ * write() calls made to all ports so far (modem_tx_chunks_total)
+ */
+static unsigned long bench_port_writes(void)
+{
+    static char text[1 << 16];
+    unsigned long total = 0, n;
+    char *p = text;
+
+    if (metrics_format(text, sizeof(text)) <= 0)
+        return 0;
+
+    while ((p = strstr(p, "\nmodem_tx_chunks_total{")) != NULL) {
+        p = strchr(p, '}');
+        if (!p)
+            break;
+        if (sscanf(p + 1, "%lu", &n) == 1)
+            total += n;
+    }
+
+    return total;
+}
+
+/*
+ * One call writing menu_output with serial_write(), coalescing off or on;
+ * counts the port writes and the reads at the modem
+ */
+static int bench_menu_call(modem_emu_t *emu, int coalesce_ms, modem_emu_stats_t *stats,
+                           long long *elapsed_ns, unsigned long *writes)
+{
+    long long start, deadline, received;
+    int total = 0, i, rc;
+
+    config.tx_coalesce_ms = coalesce_ms;
+    modem_emu_get_stats(emu, stats);
+    received = stats->data_bytes;  /* Counted over all calls */
+
+    rc = bench_answer(emu);
+    if (rc != SUCCESS)
+        return rc;
+
+    *writes = bench_port_writes();
+    start = bench_now_ns();
+    for (i = 0; i < MENU_WRITES && rc >= 0; i++) {
+        rc = serial_write(serial_fd, menu_output[i], strlen(menu_output[i]));
+        total += strlen(menu_output[i]);
+    }
+    if (rc >= 0)
+        rc = outq_flush(serial_fd);  /* End of the prompt */
+    *elapsed_ns = bench_now_ns() - start;
+    *writes = bench_port_writes() - *writes;
+
+    /* Wait until the emulator has it all */
+    deadline = bench_now_ns() + 1000000000LL;
+    do {
+        usleep(1000);
+        modem_emu_get_stats(emu, stats);
+    } while (stats->data_bytes - received < total && bench_now_ns() < deadline);
+
+    modem_hangup(serial_fd);
+    return rc < 0 ? rc : SUCCESS;
+}
+
+/*
+ * Small writes one by one vs. coalesced into writev() by the output queue
+ */
+static void bench_coalesce(modem_emu_t *emu)
+{
+    modem_emu_stats_t stats;
+    long long elapsed_ns;
+    unsigned long writes;
+    int saved_ms = config.tx_coalesce_ms;
+    int coalesce;
+
+    printf("\nOutput coalescing (%d small serial_write() calls per menu)\n", MENU_WRITES);
+    printf("  %-28s %12s %12s %10s\n", "", "port writes", "modem reads", "send ms");
+
+    for (coalesce = 0; coalesce <= 1 && !interrupted; coalesce++) {
+        if (bench_menu_call(emu, coalesce ? (saved_ms > 0 ? saved_ms : 10) : 0,
+                            &stats, &elapsed_ns, &writes) != SUCCESS) {
+            fprintf(stderr, "Menu call failed\n");
+            continue;
+        }
+        printf("  %-28s %12lu %12d %10.2f\n",
+               coalesce ? "coalesced (writev)" : "write per message",
+               writes, stats.data_reads, elapsed_ns / 1e6);
+    }
+
+    config.tx_coalesce_ms = saved_ms;
+}
+
+#define BENCH_TRANSFER_SECONDS  4
+#define BENCH_LINE_DELAY_MS     60      /* One way, V.42 buffering on both modems */
+
+/* Far end of a file transfer, on the emulator's remote socket */
+typedef struct {
+    int fd;
+    int zmodem;
+    unsigned char buf[4096];
+    int next, len;
+} bench_far_t;
+
+static int far_getc(bench_far_t *far, int timeout_ms)
+{
+    struct pollfd pfd;
+    ssize_t n;
+
+    if (far->next == far->len) {
+        pfd.fd = far->fd;
+        pfd.events = POLLIN;
+        if (poll(&pfd, 1, timeout_ms) <= 0)
+            return ERROR_TIMEOUT;
+        n = read(far->fd, far->buf, sizeof(far->buf));
+        if (n <= 0)
+            return ERROR_HANGUP;
+        far->next = 0;
+        far->len = n;
+    }
+
+    return far->buf[far->next++];
+}
+
+static void far_put(bench_far_t *far, const void *data, int len)
+{
+    if (write(far->fd, data, len) != len)
+        fprintf(stderr, "Far end write failed\n");
+}
+
+/*
+ * YMODEM receiver: 'C', ACK every block, 'C' after each header and EOT
+ */
+static void far_ymodem(bench_far_t *far)
+{
+    int c, i, size, header = 1, empty;
+
+    far_put(far, "C", 1);
+
+    while ((c = far_getc(far, 15000)) >= 0) {
+        if (c == 0x01 || c == 0x02) {
+            size = c == 0x02 ? 1024 : 128;
+            empty = 1;
+            for (i = 0; i < size + 4; i++) {
+                c = far_getc(far, 2000);
+                if (c < 0)
+                    return;
+                if (i == 2 && c != 0)
+                    empty = 0;  /* First byte of a header: the file name */
+            }
+            far_put(far, "\006", 1);
+            if (header) {
+                if (empty)
+                    return;  /* End of batch */
+                far_put(far, "C", 1);
+                header = 0;
+            }
+        } else if (c == 0x04) {
+            far_put(far, "\006C", 2);
+            header = 1;
+        }
+    }
+}
+
+static void far_zhex(bench_far_t *far, int type, int flags)
+{
+    unsigned char frame[5] = { (unsigned char)type, 0, 0, 0, (unsigned char)flags };
+    char text[32];
+    int len;
+
+    len = snprintf(text, sizeof(text), "**\030B%02x%02x%02x%02x%02x%04x\r\212",
+                   frame[0], frame[1], frame[2], frame[3], frame[4],
+                   crc16_update(0, frame, 5));
+    far_put(far, text, len);
+}
+
+/*
+ * ZMODEM receiver: ZRINIT, ZRPOS 0 for each file, ZRINIT after ZEOF,
+ * ZFIN; data is taken on trust (ZDLE A/B/C only occurs in headers)
+ */
+static void far_zmodem(bench_far_t *far)
+{
+    int c, type;
+
+    far_zhex(far, 1, 0x23);  /* ZRINIT: CANFDX CANOVIO CANFC32 */
+
+    while ((c = far_getc(far, 15000)) >= 0) {
+        if (c != 0x18)
+            continue;
+        c = far_getc(far, 2000);
+        if (c == 'B') {
+            type = (far_getc(far, 2000) - '0') * 16;
+            type += far_getc(far, 2000) - '0';
+        } else if (c == 'A' || c == 'C') {
+            type = far_getc(far, 2000);
+        } else {
+            continue;
+        }
+
+        if (type == 0 || type == 11)            /* ZRQINIT, ZEOF */
+            far_zhex(far, 1, 0x23);
+        else if (type == 4)                     /* ZFILE */
+            far_zhex(far, 9, 0);                /* ZRPOS 0 */
+        else if (type == 8) {                   /* ZFIN */
+            far_zhex(far, 8, 0);
+            return;
+        }
+    }
+}
+
+static void *far_thread(void *arg)
+{
+    bench_far_t *far = arg;
+
+    if (far->zmodem)
+        far_zmodem(far);
+    else
+        far_ymodem(far);
+    return NULL;
+}
+
+/*
+ * YMODEM-1K vs ZMODEM throughput over the emulated line at each rate
+ */
+static void bench_transfer(modem_emu_t *emu)
+{
+    static const int rates[] = { 2400, 9600, 33600 };
+    static char data[33600 / 10 * BENCH_TRANSFER_SECONDS];
+    char path[] = "/tmp/modem_bench.XXXXXX";
+    const char *paths[1] = { path };
+    int saved_speed = emu->connect_speed;
+    bench_far_t far;
+    pthread_t thread;
+    xfer_stats_t xs;
+    long long start, elapsed_ns;
+    int i, zmodem, len, file_fd, far_fd, rc;
+    double cps;
+
+    far_fd = modem_emu_remote(emu, BENCH_LINE_DELAY_MS);
+    file_fd = mkstemp(path);
+    if (far_fd < 0 || file_fd < 0) {
+        fprintf(stderr, "Transfer benchmark setup failed\n");
+        return;
+    }
+
+    for (i = 0; i < (int)sizeof(data); i++)
+        data[i] = (char)rand();
+
+    printf("\nFile transfer (%d s of line time, %d ms line delay each way)\n",
+           BENCH_TRANSFER_SECONDS, BENCH_LINE_DELAY_MS);
+    printf("  %-28s %9s %9s %9s %9s %10s\n",
+           "", "line bps", "bytes", "send ms", "cps", "efficiency");
+
+    for (i = 0; i < (int)(sizeof(rates) / sizeof(rates[0])) && !interrupted; i++) {
+        len = rates[i] / 10 * BENCH_TRANSFER_SECONDS;
+        if (ftruncate(file_fd, 0) != 0 || pwrite(file_fd, data, len, 0) != len)
+            break;
+
+        for (zmodem = 0; zmodem <= 1 && !interrupted; zmodem++) {
+            emu->connect_speed = rates[i];
+            if (bench_answer(emu) != SUCCESS) {
+                fprintf(stderr, "Transfer call at %d bps failed\n", rates[i]);
+                continue;
+            }
+
+            memset(&far, 0, sizeof(far));
+            far.fd = far_fd;
+            far.zmodem = zmodem;
+            while (far_getc(&far, 0) >= 0)
+                ;  /* Leftovers of the previous call */
+            far.next = far.len = 0;
+            pthread_create(&thread, NULL, far_thread, &far);
+
+            start = bench_now_ns();
+            rc = zmodem ? zmodem_send(serial_fd, paths, 1, &xs)
+                        : ymodem_send(serial_fd, paths, 1, &xs);
+            elapsed_ns = bench_now_ns() - start;
+
+            pthread_join(thread, NULL);
+            modem_hangup(serial_fd);
+
+            if (rc != SUCCESS || xs.files != 1) {
+                fprintf(stderr, "%s at %d bps failed (status: %d)\n",
+                        zmodem ? "ZMODEM" : "YMODEM", rates[i], rc);
+                continue;
+            }
+
+            cps = xs.bytes * 1e9 / elapsed_ns;
+            printf("  %-28s %9d %9lld %9.1f %9.1f %9.1f%%\n",
+                   zmodem ? "ZMODEM streaming" : "YMODEM-1K (ACK per block)",
+                   rates[i], xs.bytes, elapsed_ns / 1e6, cps, cps * 1000.0 / rates[i]);
+        }
+    }
+
+    close(file_fd);
+    unlink(path);
+    emu->connect_speed = saved_speed;
+}
+
+#define LOOPBACK_BYTES      20000
+#define LOOPBACK_DAMAGE_AT  6000    /* Sender byte damaged once: inside a data block */
+
+enum { LOOP_XMODEM, LOOP_YMODEM, LOOP_ZMODEM };
+
+/*
+ * Sender and receiver joined by two PTY pairs and a relay between the
+ * masters, which can damage one byte on its way to the receiver
+ */
+typedef struct {
+    int master[2];              /* Sender side, receiver side */
+    int slave[2];
+    long long damage_at;        /* -1 = pass everything intact */
+    volatile int stop;
+} bench_relay_t;
+
+typedef struct {
+    int fd;
+    int protocol;
+    const char *dir;
+    unsigned char data[LOOPBACK_BYTES + 1024];  /* XMODEM: blocks as received */
+    int len;
+    long long c_ns;             /* XMODEM: 'C' repeated after block 1 */
+    long long resend_ns;        /* XMODEM: block 1 back after that 'C' */
+    int duplicates;             /* XMODEM: blocks received twice after an ACK */
+    xfer_stats_t stats;
+    int rc;
+} bench_loop_rx_t;
+
+static void relay_copy(bench_relay_t *relay, int from, long long *offset)
+{
+    unsigned char buf[4096];
+    ssize_t n;
+
+    n = read(relay->master[from], buf, sizeof(buf));
+    if (n <= 0)
+        return;
+
+    if (from == 0 && relay->damage_at >= *offset && relay->damage_at < *offset + n) {
+        buf[relay->damage_at - *offset] ^= 0x55;
+        relay->damage_at = -1;
+    }
+    if (from == 0)
+        *offset += n;
+
+    if (write(relay->master[!from], buf, n) != n)
+        fprintf(stderr, "Loopback relay write failed\n");
+}
+
+static void *relay_thread(void *arg)
+{
+    bench_relay_t *relay = arg;
+    struct pollfd pfd[2];
+    long long offset = 0;
+    int i;
+
+    while (!relay->stop) {
+        for (i = 0; i < 2; i++) {
+            pfd[i].fd = relay->master[i];
+            pfd[i].events = POLLIN;
+            pfd[i].revents = 0;
+        }
+        if (poll(pfd, 2, 100) <= 0)
+            continue;
+        for (i = 0; i < 2; i++) {
+            if (pfd[i].revents & POLLIN)
+                relay_copy(relay, i, &offset);
+        }
+    }
+
+    return NULL;
+}
+
+/*
+ * XMODEM-CRC receiver: answers an intact block 1 with 'C' once more, as a
+ * receiver whose ACK got lost, follows the ACK of block 2 with a stale
+ * 'C' (which must not cost a resend) and NAKs damaged blocks
+ * Returns the bytes received (padding included) or an error code.
+ */
+static int loop_xmodem_receive(bench_loop_rx_t *rx)
+{
+    unsigned char block[2 + 1024 + 2];
+    bench_far_t far;
+    int c, i, size, expect = 1, asked = 0;
+
+    memset(&far, 0, sizeof(far));
+    far.fd = rx->fd;
+    far_put(&far, "C", 1);
+
+    while ((c = far_getc(&far, 15000)) >= 0) {
+        if (c == 0x04) {
+            far_put(&far, "\006", 1);
+            return rx->len;
+        }
+        if (c != 0x01 && c != 0x02)
+            continue;
+
+        size = c == 0x02 ? 1024 : 128;
+        for (i = 0; i < size + 4; i++) {
+            if ((c = far_getc(&far, 2000)) < 0)
+                return c;
+            block[i] = (unsigned char)c;
+        }
+
+        if (block[0] != (unsigned char)~block[1] ||
+            crc16_update(0, block + 2, size) != (block[size + 2] << 8 | block[size + 3])) {
+            rx->stats.retries++;
+            far_put(&far, "\025", 1);
+            continue;
+        }
+
+        if (block[0] == (unsigned char)expect) {
+            if (expect == 1 && !asked++) {
+                rx->c_ns = bench_now_ns();
+                far_put(&far, "C", 1);
+                continue;
+            }
+            if (expect == 1)
+                rx->resend_ns = bench_now_ns() - rx->c_ns;
+            if (rx->len + size > (int)sizeof(rx->data))
+                return ERROR_GENERAL;
+            memcpy(rx->data + rx->len, block + 2, size);
+            rx->len += size;
+            if (expect++ == 2) {
+                far_put(&far, "\006C", 2);
+                continue;
+            }
+        } else if (block[0] == (unsigned char)(expect - 1)) {
+            rx->duplicates++;
+        } else {
+            return ERROR_GENERAL;
+        }
+        far_put(&far, "\006", 1);
+    }
+
+    return c;
+}
+
+static void *loop_rx_thread(void *arg)
+{
+    bench_loop_rx_t *rx = arg;
+
+    if (rx->protocol == LOOP_XMODEM)
+        rx->rc = loop_xmodem_receive(rx);
+    else if (rx->protocol == LOOP_YMODEM)
+        rx->rc = ymodem_receive(rx->fd, rx->dir, &rx->stats);
+    else
+        rx->rc = zmodem_receive(rx->fd, rx->dir, &rx->stats);
+    return NULL;
+}
+
+/*
+ * Did the receiver end up with data[0..len)?  (XMODEM: followed by
+ * CP/M EOF padding; others: the file stored in dir)
+ */
+static int loop_verify(bench_loop_rx_t *rx, const char *path, const char *data, int len)
+{
+    static char got[LOOPBACK_BYTES + 1];
+    char stored[512];
+    int fd, n, i;
+
+    if (rx->protocol == LOOP_XMODEM) {
+        if (rx->len < len || memcmp(rx->data, data, len) != 0)
+            return 0;
+        for (i = len; i < rx->len; i++) {
+            if (rx->data[i] != 0x1A)
+                return 0;
+        }
+        return 1;
+    }
+
+    snprintf(stored, sizeof(stored), "%s/%s", rx->dir, strrchr(path, '/') + 1);
+    fd = open(stored, O_RDONLY);
+    if (fd < 0)
+        return 0;
+    n = read(fd, got, sizeof(got));
+    close(fd);
+    unlink(stored);
+
+    return n == len && memcmp(got, data, len) == 0;
+}
+
+/*
+ * Send a file with each protocol to its receiver over a PTY loopback,
+ * once intact and once with a damaged byte, and compare what arrived
+ */
+static void bench_loopback(void)
+{
+    static const char *names[] = {
+        "xmodem_send() 1K", "ymodem_send/receive", "zmodem_send/receive"
+    };
+    static char data[LOOPBACK_BYTES];
+    static bench_loop_rx_t rx;
+    char path[] = "/tmp/modem_bench.XXXXXX";
+    char dir[] = "/tmp/modem_loopback.XXXXXX";
+    const char *paths[1] = { path };
+    struct termios tios;
+    bench_relay_t relay;
+    pthread_t relay_tid, rx_tid;
+    xfer_stats_t xs;
+    long long start, elapsed_ns;
+    int protocol, damaged, file_fd, rc, i;
+
+    file_fd = mkstemp(path);
+    if (file_fd < 0 || !mkdtemp(dir)) {
+        fprintf(stderr, "Loopback setup failed\n");
+        return;
+    }
+
+    for (i = 0; i < (int)sizeof(data); i++)
+        data[i] = (char)rand();
+    if (write(file_fd, data, sizeof(data)) != (ssize_t)sizeof(data)) {
+        fprintf(stderr, "Loopback setup failed\n");
+        return;
+    }
+    close(file_fd);
+
+    memset(&relay, 0, sizeof(relay));
+    for (i = 0; i < 2; i++) {
+        if (openpty(&relay.master[i], &relay.slave[i], NULL, NULL, NULL) != 0) {
+            fprintf(stderr, "Loopback PTYs failed: %s\n", strerror(errno));
+            return;
+        }
+        tcgetattr(relay.slave[i], &tios);
+        cfmakeraw(&tios);
+        tios.c_cflag |= CLOCAL | CREAD;
+        tcsetattr(relay.slave[i], TCSANOW, &tios);
+        serial_set_nonblocking(relay.slave[i]);
+        serial_ring_get(relay.slave[i]);  /* Before two threads look up rings */
+    }
+
+    printf("\nTransfer loopback (PTY pairs, %d bytes, damaged byte at %d)\n",
+           LOOPBACK_BYTES, LOOPBACK_DAMAGE_AT);
+    printf("  %-24s %-8s %9s %9s %9s\n", "", "line", "result", "retries", "ms");
+
+    for (protocol = LOOP_XMODEM; protocol <= LOOP_ZMODEM && !interrupted; protocol++) {
+        for (damaged = 0; damaged <= 1 && !interrupted; damaged++) {
+            memset(&rx, 0, sizeof(rx));
+            rx.fd = relay.slave[1];
+            rx.protocol = protocol;
+            rx.dir = dir;
+            relay.damage_at = damaged ? LOOPBACK_DAMAGE_AT : -1;
+            relay.stop = 0;
+
+            pthread_create(&relay_tid, NULL, relay_thread, &relay);
+            pthread_create(&rx_tid, NULL, loop_rx_thread, &rx);
+
+            start = bench_now_ns();
+            if (protocol == LOOP_XMODEM)
+                rc = xmodem_send(relay.slave[0], path, 1, &xs);
+            else if (protocol == LOOP_YMODEM)
+                rc = ymodem_send(relay.slave[0], paths, 1, &xs);
+            else
+                rc = zmodem_send(relay.slave[0], paths, 1, &xs);
+            pthread_join(rx_tid, NULL);
+            elapsed_ns = bench_now_ns() - start;
+
+            relay.stop = 1;
+            pthread_join(relay_tid, NULL);
+
+            printf("  %-24s %-8s %9s %9d %9.1f\n", names[protocol],
+                   damaged ? "damaged" : "clean",
+                   rc != SUCCESS || rx.rc < 0 ? "FAILED" :
+                   loop_verify(&rx, path, data, sizeof(data)) ? "identical" : "DIFFERS",
+                   rx.stats.retries, elapsed_ns / 1e6);
+            if (protocol == LOOP_XMODEM && !damaged)
+                printf("  %-24s block 1 sent again %.1f ms after 'C', "
+                       "%d block(s) resent for a stale 'C'\n", "",
+                       rx.resend_ns / 1e6, rx.duplicates);
+
+            /* Nothing of this run may leak into the next */
+            for (i = 0; i < 2; i++) {
+                tcflush(relay.slave[i], TCIOFLUSH);
+                serial_ring_reset(relay.slave[i]);
+            }
+        }
+    }
+
+    for (i = 0; i < 2; i++) {
+        serial_ring_release(relay.slave[i]);
+        outq_release(relay.slave[i]);
+        close(relay.slave[i]);
+        close(relay.master[i]);
+    }
+    unlink(path);
+    rmdir(dir);
+}
+
+/* Modem output as captured on a V.34 line (X4, V1, call progress on) */
+static const char *recorded_output[] = {
+    "ATZ", "OK",
+    "AT&FQ0V1X4&C1&D2S7=60S10=120S30=5", "OK",
+    "ATE0S0=0", "OK",
+    "RING", "RING", "ATA",
+    "CARRIER 33600", "PROTOCOL: LAPM", "COMPRESSION: V.42BIS",
+    "CONNECT 33600/ARQ/V34/LAPM/V42BIS",
+    "NO CARRIER",
+    "ATS0?S7?S10?S30?", "000", "060", "120", "005", "OK",
+    "RING", "RING", "CONNECT 2400",
+    "NO CARRIER", "BUSY", "NO DIALTONE", "NO ANSWER", "ERROR",
+    "RING", "RING", "+MCR: V34", "+ER: LAPM", "CONNECT 115200",
+    "NO CARRIER", "ATH", "OK",
+};
+
+#define RECORDED_LINES  ((int)(sizeof(recorded_output) / sizeof(recorded_output[0])))
+#define CLASSIFY_PASSES 100000
+
+/*
+ * The strstr() chain classification used before result_code.c
+ */
+static modem_result_t classify_strstr(const char *text)
+{
+    if (strstr(text, "CONNECT") != NULL)
+        return RESULT_CONNECT;
+    if (strstr(text, "RING") != NULL)
+        return RESULT_RING;
+    if (strstr(text, "NO CARRIER") != NULL)
+        return RESULT_NO_CARRIER;
+    if (strstr(text, "BUSY") != NULL)
+        return RESULT_BUSY;
+    if (strstr(text, "NO DIALTONE") != NULL)
+        return RESULT_NO_DIALTONE;
+    if (strstr(text, "NO ANSWER") != NULL)
+        return RESULT_NO_ANSWER;
+    if (strstr(text, "OK") != NULL)
+        return RESULT_OK;
+    if (strstr(text, "ERROR") != NULL)
+        return RESULT_ERROR;
+    return RESULT_NONE;
+}
+
+/*
+ * Result code classification: strstr() chains vs. the shared automaton
+ */
+static void bench_classify(void)
+{
+    int lengths[RECORDED_LINES];
+    volatile int sink = 0;
+    long long start, chain_ns, automaton_ns;
+    double lines = (double)CLASSIFY_PASSES * RECORDED_LINES;
+    int mismatches = 0;
+    int i, j;
+
+    result_init();
+
+    for (j = 0; j < RECORDED_LINES; j++) {
+        lengths[j] = strlen(recorded_output[j]);
+        if (classify_strstr(recorded_output[j]) !=
+            classify_result(recorded_output[j], lengths[j], NULL))
+            mismatches++;
+    }
+
+    start = bench_now_ns();
+    for (i = 0; i < CLASSIFY_PASSES; i++) {
+        for (j = 0; j < RECORDED_LINES; j++)
+            sink += classify_strstr(recorded_output[j]);
+    }
+    chain_ns = bench_now_ns() - start;
+
+    start = bench_now_ns();
+    for (i = 0; i < CLASSIFY_PASSES; i++) {
+        for (j = 0; j < RECORDED_LINES; j++)
+            sink += classify_result(recorded_output[j], lengths[j], NULL);
+    }
+    automaton_ns = bench_now_ns() - start;
+
+    (void)sink;
+
+    printf("\nResult code classification (%d recorded lines x %d passes)\n",
+           RECORDED_LINES, CLASSIFY_PASSES);
+    printf("  %-44s %9.1f ns/line\n", "strstr() chains", chain_ns / lines);
+    printf("  %-44s %9.1f ns/line\n", "classify_result() automaton", automaton_ns / lines);
+    if (automaton_ns > 0)
+        printf("  speedup: %.2fx, %d classification mismatch(es)\n",
+               (double)chain_ns / automaton_ns, mismatches);
+}
+
+/* Command strings and the lines optimize_command_string() must produce */
+static const struct {
+    const char *in;
+    const char *out;
+} batch_cases[] = {
+    { "ATZ; AT&F Q0 V1 X4 &C1 &D2 S7=60", "ATZ; AT&FQ0V1X4&C1&D2S7=60" },
+    { "ATE1; ATE0 V1", "ATE0V1" },
+    { "ATE1 V0 &F", "AT&F" },
+    { "ATE1 &W; ATE0", "ATE1&WE0" },          /* &W stores E1 */
+    { "ATS0=1 &Y0; ATS0=0", "ATS0=1&Y0S0=0" },  /* &Y does not reset */
+    { "ATS7=50 S7? S7=60", "ATS7=50S7?S7=60" },
+    { "ATM1 DT555; ATM0", "ATM1DT555; ATM0" },
+};
+
+#define BATCH_CASES     (int)(sizeof(batch_cases) / sizeof(batch_cases[0]))
+#define BATCH_PASSES    100000
+
+/*
+ * AT command batching: check the merged lines, then time the optimizer
+ */
+static void bench_batching(void)
+{
+    char out[AT_MAX_LINE * 4];
+    long long start, elapsed_ns;
+    int mismatches = 0;
+    int i, j;
+
+    for (j = 0; j < BATCH_CASES; j++) {
+        if (optimize_command_string(batch_cases[j].in, out, sizeof(out)) < 0 ||
+            strcmp(out, batch_cases[j].out) != 0) {
+            printf("  batching mismatch: \"%s\" -> \"%s\", expected \"%s\"\n",
+                   batch_cases[j].in, out, batch_cases[j].out);
+            mismatches++;
+        }
+    }
+
+    start = bench_now_ns();
+    for (i = 0; i < BATCH_PASSES; i++) {
+        for (j = 0; j < BATCH_CASES; j++)
+            optimize_command_string(batch_cases[j].in, out, sizeof(out));
+    }
+    elapsed_ns = bench_now_ns() - start;
+
+    printf("\nAT command batching (%d command strings x %d passes)\n", BATCH_CASES, BATCH_PASSES);
+    printf("  %-44s %9.1f ns/string\n", "optimize_command_string()",
+           (double)elapsed_ns / ((double)BATCH_PASSES * BATCH_CASES));
+    printf("  %d batching mismatch(es)\n", mismatches);
+}
+
+#define LOG_ROUNDS          8
+#define LOG_ROUND_MESSAGES  2000    /* Below async_log_records: no drops */
+
+/*
+ * What print_message() does per call: format, then write()
+ */
+static void bench_sync_log(int fd, const char *format, ...)
+{
+    char line[BUFFER_SIZE];
+    va_list args;
+    int len;
+
+    va_start(args, format);
+    len = vsnprintf(line, sizeof(line) - 1, format, args);
+    va_end(args);
+    if (len > (int)sizeof(line) - 2)
+        len = sizeof(line) - 2;
+    line[len++] = '\n';
+    if (write(fd, line, len) < 0)
+        return;
+}
+
+/*
+ * Records logged before a synchronous line that are written out ahead of
+ * it (async_log_flush), of LOG_ORDER_RECORDS
+ */
+#define LOG_ORDER_RECORDS   100
+
+static int bench_log_order(void)
+{
+    static char out[LOG_ORDER_RECORDS * 32];
+    int fds[2], len = 0, n, i, before = 0;
+    char *p;
+
+    if (pipe(fds) != 0)
+        return -1;
+
+    if (async_log_start(LOG_ORDER_RECORDS * 2, fds[1], fds[1]) != SUCCESS) {
+        close(fds[0]);
+        close(fds[1]);
+        return -1;
+    }
+
+    for (i = 0; i < LOG_ORDER_RECORDS; i++)
+        log_message(serial_fd, LOG_LEVEL_INFO, "record %d", i);
+    async_log_flush();
+    if (write(fds[1], "sync\n", 5) != 5)
+        before = -1;
+    async_log_stop();
+    close(fds[1]);
+
+    while ((n = read(fds[0], out + len, sizeof(out) - 1 - len)) > 0)
+        len += n;
+    out[len] = '\0';
+    close(fds[0]);
+
+    for (p = out; before >= 0 && (p = strstr(p, "record ")) != NULL &&
+                  p < strstr(out, "sync\n"); p++)
+        before++;
+
+    return before;
+}
+
+/*
+ * Caller-side cost of a serial-path log line: synchronous vs. log thread
+ */
+static void bench_logging(void)
+{
+    static const unsigned char frame[] = "\x18\x42\x30\x31\x30\x30\x30\x30\x30\x30\x30\x30\x30\x30\x0d\x8a";
+    long long start, sync_ns = 0, async_ns = 0, data_ns = 0;
+    double lines = (double)LOG_ROUNDS * LOG_ROUND_MESSAGES;
+    int devnull, round, i, verbose = config.verbose_mode, ordered;
+
+    devnull = open("/dev/null", O_WRONLY);
+    if (devnull < 0)
+        return;
+
+    config.verbose_mode = 1;  /* Informational records are logged only then */
+
+    for (round = 0; round < LOG_ROUNDS; round++) {
+        start = bench_now_ns();
+        for (i = 0; i < LOG_ROUND_MESSAGES; i++)
+            bench_sync_log(devnull, "[%s] Received: %s", "/dev/ttyS0", "CONNECT 33600/ARQ/V34/LAPM/V42BIS");
+        sync_ns += bench_now_ns() - start;
+    }
+
+    if (async_log_start(LOG_ROUND_MESSAGES * 2, devnull, devnull) != SUCCESS) {
+        config.verbose_mode = verbose;
+        close(devnull);
+        return;
+    }
+
+    for (round = 0; round < LOG_ROUNDS; round++) {
+        start = bench_now_ns();
+        for (i = 0; i < LOG_ROUND_MESSAGES; i++)
+            log_message(serial_fd, LOG_LEVEL_INFO, "[%s] Received: %s", "/dev/ttyS0",
+                        "CONNECT 33600/ARQ/V34/LAPM/V42BIS");
+        async_ns += bench_now_ns() - start;
+        usleep(20000);  /* Let the log thread drain the ring */
+    }
+
+    for (round = 0; round < LOG_ROUNDS; round++) {
+        start = bench_now_ns();
+        for (i = 0; i < LOG_ROUND_MESSAGES; i++)
+            log_data(serial_fd, "TX", frame, sizeof(frame) - 1);
+        data_ns += bench_now_ns() - start;
+        usleep(20000);
+    }
+
+    async_log_stop();
+    close(devnull);
+
+    ordered = bench_log_order();
+    config.verbose_mode = verbose;
+
+    printf("\nSerial-path logging, caller side (%d lines to /dev/null)\n", (int)lines);
+    printf("  %-44s %9.1f ns/line\n", "format + write() per line", sync_ns / lines);
+    printf("  %-44s %9.1f ns/line\n", "log_message() record on the ring", async_ns / lines);
+    printf("  %-44s %9.1f ns/line\n", "log_data() 16-byte hex dump record", data_ns / lines);
+    printf("  %lu record(s) dropped\n", async_log_dropped());
+    printf("  %d of %d record(s) written before the next synchronous line\n",
+           ordered, LOG_ORDER_RECORDS);
+}
+
+#define METRICS_RECORDS     1000000
+
+/*
+ * Cost of recording metrics on the serial path
+ */
+static void bench_metrics(void)
+{
+    long long start, tx_ns, at_ns;
+    int i;
+
+    metrics_port_name(1000, "bench");
+
+    start = bench_now_ns();
+    for (i = 0; i < METRICS_RECORDS; i++)
+        metrics_tx(1000, 64);
+    tx_ns = bench_now_ns() - start;
+
+    start = bench_now_ns();
+    for (i = 0; i < METRICS_RECORDS; i++)
+        metrics_at_command(1000, "ATS0?", 10000 + (i & 1023));
+    at_ns = bench_now_ns() - start;
+
+    printf("\nMetrics recording (%d records)\n", METRICS_RECORDS);
+    printf("  %-44s %9.1f ns/record\n", "metrics_tx() counter pair", (double)tx_ns / METRICS_RECORDS);
+    printf("  %-44s %9.1f ns/record\n", "metrics_at_command() histogram", (double)at_ns / METRICS_RECORDS);
+}
+
+#define CRC_BLOCKS          20000
+
+/*
+ * CRC throughput over 1K blocks: byte-at-a-time vs slice-by-8
+ */
+static void bench_crc(void)
+{
+    static unsigned char block[1024];
+    long long start, byte_ns, slice_ns;
+    unsigned short a = 0, b = 0;
+    unsigned int a32 = 0, b32 = 0;
+    int i;
+
+    for (i = 0; i < (int)sizeof(block); i++)
+        block[i] = (unsigned char)rand();
+
+    start = bench_now_ns();
+    for (i = 0; i < CRC_BLOCKS; i++)
+        a ^= crc16_update_bytewise(0, block, sizeof(block));
+    byte_ns = bench_now_ns() - start;
+
+    start = bench_now_ns();
+    for (i = 0; i < CRC_BLOCKS; i++)
+        b ^= crc16_update(0, block, sizeof(block));
+    slice_ns = bench_now_ns() - start;
+
+    printf("\nCRC-16 (%d blocks of 1K)\n", CRC_BLOCKS);
+    printf("  %-44s %9.1f MB/s\n", "byte-at-a-time table",
+           (double)CRC_BLOCKS * sizeof(block) * 1000.0 / byte_ns);
+    printf("  %-44s %9.1f MB/s\n", "slice-by-8 crc16_update()",
+           (double)CRC_BLOCKS * sizeof(block) * 1000.0 / slice_ns);
+    if (a != b)
+        printf("  CRC mismatch: %04x vs %04x\n", a, b);
+
+    start = bench_now_ns();
+    for (i = 0; i < CRC_BLOCKS; i++)
+        a32 ^= crc32_update_bytewise(i, block, sizeof(block));
+    byte_ns = bench_now_ns() - start;
+
+    start = bench_now_ns();
+    for (i = 0; i < CRC_BLOCKS; i++)
+        b32 ^= crc32_update(i, block, sizeof(block));
+    slice_ns = bench_now_ns() - start;
+
+    printf("\nCRC-32 (%d blocks of 1K)\n", CRC_BLOCKS);
+    printf("  %-44s %9.1f MB/s\n", "byte-at-a-time table",
+           (double)CRC_BLOCKS * sizeof(block) * 1000.0 / byte_ns);
+    printf("  %-44s %9.1f MB/s\n", "slice-by-8 crc32_update()",
+           (double)CRC_BLOCKS * sizeof(block) * 1000.0 / slice_ns);
+    if (a32 != b32)
+        printf("  CRC mismatch: %08x vs %08x\n", a32, b32);
+}
+
+#define ANSI_SCREEN_MAX     65536
+
+typedef struct {
+    char data[ANSI_SCREEN_MAX];
+    int len;
+} bench_screen_t;
+
+static void screen_add(bench_screen_t *screen, const char *format, ...)
+{
+    va_list args;
+    int n;
+
+    va_start(args, format);
+    n = vsnprintf(screen->data + screen->len, sizeof(screen->data) - screen->len, format, args);
+    va_end(args);
+
+    if (n > 0)
+        screen->len += n;
+    if (screen->len >= (int)sizeof(screen->data))
+        screen->len = sizeof(screen->data) - 1;
+}
+
+/* The menu of bench_coalesce, written in one piece */
+static void screen_menu(bench_screen_t *screen, int minutes)
+{
+    int i;
+
+    screen->len = 0;
+    for (i = 0; i < MENU_WRITES; i++) {
+        if (strcmp(menu_output[i], "59") == 0)
+            screen_add(screen, "%d", minutes);
+        else
+            screen_add(screen, "%s", menu_output[i]);
+    }
+}
+
+/*
+ * A box as screen editors save it: every line positioned absolutely, a
+ * full SGR before each colour change, every blank written out
+ */
+static void screen_box(bench_screen_t *screen, const char *title)
+{
+    int row, i;
+
+    screen->len = 0;
+    screen_add(screen, "\x1b[0m\x1b[2J");
+
+    for (row = 3; row <= 20; row++) {
+        screen_add(screen, "\x1b[%d;5H\x1b[0;1;34;44m%c", row,
+                   row == 3 ? 0xC9 : row == 20 ? 0xC8 : 0xBA);
+        for (i = 0; i < 68; i++) {
+            if (row == 3 || row == 20)
+                screen_add(screen, "%c", 0xCD);
+            else
+                screen_add(screen, "\x1b[0;37;44m ");
+        }
+        screen_add(screen, "\x1b[0;1;34;44m%c\x1b[0m", row == 3 ? 0xBB : row == 20 ? 0xBC : 0xBA);
+    }
+
+    screen_add(screen, "\x1b[3;%dH\x1b[0;1;33;44m %s \x1b[0m",
+               39 - (int)strlen(title) / 2, title);
+    for (row = 5; row <= 17; row += 2)
+        screen_add(screen, "\x1b[%d;9H\x1b[0;1;37;44m%d\x1b[0;36;44m) Area %d\x1b[0m",
+                   row, (row - 3) / 2, row * 7);
+    screen_add(screen, "\x1b[22;1H\x1b[0;1;37mSelect: ");
+}
+
+/* A file listing longer than the screen (scrolls) */
+static void screen_listing(bench_screen_t *screen)
+{
+    int i;
+
+    screen->len = 0;
+    screen_add(screen, "\x1b[2J");
+    for (i = 1; i <= 60; i++)
+        screen_add(screen, "\x1b[1;36m%3d \x1b[0;37mFILE%04d.ZIP \x1b[1;33m%7d \x1b[0;32m"
+                   "Utility collection, volume %d\x1b[0m\r\n", i, i, i * 3217, i);
+    screen_add(screen, "\x1b[1;37mMore? ");
+}
+
+/*
+ * Bytes the optimizer sends for screen, after before was on the terminal
+ * (NULL = a new call), and its time in *elapsed_ns
+ */
+static int bench_ansi_send(const bench_screen_t *before, const bench_screen_t *screen,
+                           int use_rep, long long *elapsed_ns)
+{
+    ansi_opt_t *ao;
+    const char *out;
+    long long start;
+    int n = 0;
+
+    ao = ansi_opt_new(24, use_rep);
+    if (!ao)
+        return 0;
+
+    if (before) {
+        ansi_opt_feed(ao, before->data, before->len);
+        ansi_opt_output(ao, &out);
+    }
+
+    start = bench_now_ns();
+    if (ansi_opt_feed(ao, screen->data, screen->len) == SUCCESS)
+        n = ansi_opt_output(ao, &out);
+    *elapsed_ns = bench_now_ns() - start;
+
+    ansi_opt_free(ao);
+    return n;
+}
+
+static void bench_ansi_report(const char *name, const bench_screen_t *before,
+                              const bench_screen_t *screen)
+{
+    long long opt_ns, norep_ns;
+    double bytes_ms = 10000.0 / config.baudrate;
+    int opt, norep;
+
+    opt = bench_ansi_send(before, screen, 1, &opt_ns);
+    norep = bench_ansi_send(before, screen, 0, &norep_ns);
+
+    printf("  %-28s %6d %6d %6d %8.0f %8.0f %7.1f\n", name, screen->len, opt, norep,
+           screen->len * bytes_ms, opt * bytes_ms, opt_ns / 1000.0);
+}
+
+/*
+ * Bytes and time to a complete screen at config.baudrate, as written and
+ * through the ANSI optimizer (with and without REP); redraws assume the
+ * previous screen is still on the terminal
+ */
+static void bench_ansi(const char *screen_dir)
+{
+    static bench_screen_t first, second;
+    char path[512];
+    struct dirent *entry;
+    DIR *dir;
+    int fd;
+
+    printf("\nANSI optimizer (%d bps, 24 rows)\n", config.baudrate);
+    printf("  %-28s %6s %6s %6s %8s %8s %7s\n", "", "bytes", "opt", "no REP",
+           "ms", "opt ms", "cpu us");
+
+    screen_menu(&first, 59);
+    bench_ansi_report("menu", NULL, &first);
+    screen_menu(&second, 58);
+    bench_ansi_report("menu, time left changed", &first, &second);
+    bench_ansi_report("menu, same again", &first, &first);
+
+    screen_box(&first, "Message Areas");
+    bench_ansi_report("box", NULL, &first);
+    screen_box(&second, "File Areas");
+    bench_ansi_report("box, title changed", &first, &second);
+
+    screen_listing(&first);
+    bench_ansi_report("file listing (scrolls)", NULL, &first);
+
+    if (!screen_dir || !screen_dir[0])
+        return;
+
+    dir = opendir(screen_dir);
+    if (!dir) {
+        printf("  Cannot open %s: %s\n", screen_dir, strerror(errno));
+        return;
+    }
+
+    while ((entry = readdir(dir)) != NULL) {
+        if (entry->d_name[0] == '.')
+            continue;
+        snprintf(path, sizeof(path), "%s/%s", screen_dir, entry->d_name);
+        fd = open(path, O_RDONLY);
+        if (fd < 0)
+            continue;
+        first.len = read(fd, first.data, sizeof(first.data));
+        close(fd);
+        if (first.len <= 0)
+            continue;
+
+        bench_ansi_report(entry->d_name, NULL, &first);
+        snprintf(path, sizeof(path), "%.20s, again", entry->d_name);
+        bench_ansi_report(path, &first, &first);
+    }
+
+    closedir(dir);
+}
+
+#define CHARSET_ROUNDS      200
+
+/*
+ * Throughput of one charset_encode/charset_decode direction over data,
+ * through a buffer the size modem_line_write() uses
+ */
+static void bench_charset_run(const char *name, int id, int encode, const char *data, int len)
+{
+    char out[BUFFER_SIZE];
+    charset_t cs;
+    long long start, elapsed;
+    int i, done, used, bytes = 0;
+
+    charset_init(&cs, id);
+
+    start = bench_now_ns();
+    for (i = 0; i < CHARSET_ROUNDS; i++) {
+        for (done = 0; done < len; done += used)
+            bytes += encode ? charset_encode(&cs, data + done, len - done, out, sizeof(out), &used)
+                            : charset_decode(&cs, data + done, len - done, out, sizeof(out), &used);
+    }
+    elapsed = bench_now_ns() - start;
+
+    printf("  %-44s %9.1f MB/s %6.2f out/in\n", name,
+           (double)CHARSET_ROUNDS * len * 1000.0 / elapsed, (double)bytes / CHARSET_ROUNDS / len);
+}
+
+/*
+ * Terminal charset conversion of UTF-8 screens and of callers' input
+ */
+static void bench_charset(void)
+{
+    static bench_screen_t ascii, cp437, box, korean, euckr;
+    static const char *hangul = "\xea\xb2\x8c\xec\x8b\x9c\xed\x8c\x90 ";  /* UTF-8 */
+    static const char *hangul_euckr = "\xb0\xd4\xbd\xc3\xc6\xc7 ";
+    charset_t cs;
+    int i, used;
+
+    screen_listing(&ascii);
+
+    /* The box with its CP437 line drawing as UTF-8 */
+    charset_init(&cs, CHARSET_CP437);
+    screen_box(&cp437, "Message Areas");
+    box.len = charset_decode(&cs, cp437.data, cp437.len, box.data, sizeof(box.data), &used);
+
+    for (i = 0; i < 400; i++) {
+        screen_add(&korean, "\x1b[1;3%dm%d. %s%s\r\n", i % 8, i, hangul, hangul);
+        screen_add(&euckr, "%d. %s%s\r\n", i, hangul_euckr, hangul_euckr);
+    }
+
+    printf("\nTerminal charsets (%d rounds)\n", CHARSET_ROUNDS);
+    bench_charset_run("ASCII listing -> CP437", CHARSET_CP437, 1, ascii.data, ascii.len);
+    bench_charset_run("UTF-8 box -> CP437", CHARSET_CP437, 1, box.data, box.len);
+    bench_charset_run("UTF-8 Hangul -> EUC-KR", CHARSET_EUCKR, 1, korean.data, korean.len);
+    bench_charset_run("EUC-KR input -> UTF-8", CHARSET_EUCKR, 0, euckr.data, euckr.len);
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr, "Usage: %s [-n iterations] [-c calls] [-s connect_speed] "
+            "[-d response_delay_us] [-S screen_dir] [-N] [-v]\n", prog);
+}
+
+int main(int argc, char *argv[])
+{
+    static const char *commands[] = {
+        "AT",
+        "ATZ",
+        "AT&F Q0 V1 X4 &C1 &D2 S7=60 S10=120 S30=5",
+        "ATE0 S0=0",
+        "ATS0?",
+    };
+    static bench_series_t cmd_series[sizeof(commands) / sizeof(commands[0])];
+    static bench_series_t init_series = { "init_modem() response driven", {0}, 0 };
+    static bench_series_t init_fixed_series = { "init_modem() fixed 100/200ms pacing", {0}, 0 };
+    static bench_series_t autoanswer_series = { "set_modem_autoanswer()", {0}, 0 };
+    static bench_series_t full_reinit_series = { "init_modem() + set_modem_autoanswer()", {0}, 0 };
+    static bench_series_t cached_reinit_series = { "modem_reinit() state verified", {0}, 0 };
+    static bench_series_t reset_reinit_series = { "modem_reinit() after modem reset", {0}, 0 };
+    static bench_series_t ring_connect = { "RING -> CONNECT", {0}, 0 };
+    static bench_series_t ring_first_byte = { "RING -> first byte sent", {0}, 0 };
+    static bench_series_t hangup_series = { "modem_hangup()", {0}, 0 };
+    char response[BUFFER_SIZE];
+    modem_emu_t emu;
+    int iterations = 20;
+    int calls = 5;
+    int speed = 33600;
+    int response_delay_us = 10000;  /* Typical modem command processing time */
+    int numeric = 0;
+    const char *screen_dir = NULL;
+    long long start;
+    int i, j, opt, rc;
+
+    while ((opt = getopt(argc, argv, "n:c:s:d:S:Nv")) != -1) {
+        switch (opt) {
+            case 'n': iterations = atoi(optarg); break;
+            case 'c': calls = atoi(optarg); break;
+            case 's': speed = atoi(optarg); break;
+            case 'd': response_delay_us = atoi(optarg); break;
+            case 'S': screen_dir = optarg; break;
+            case 'N': numeric = 1; break;
+            case 'v': bench_verbose = 1; break;
+            default:
+                usage(argv[0]);
+                return 1;
+        }
+    }
+
+    if (iterations < 1 || iterations > BENCH_MAX_SAMPLES ||
+        calls < 0 || calls > BENCH_MAX_SAMPLES) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    /* Ctrl-C ends the run: signals go to the signalfd before any thread starts */
+    signal_event_init();
+
+    init_default_config();
+    config.verbose_mode = bench_verbose;
+    config.enable_transmission_log = 0;
+    config.enable_timing_log = 0;
+    config.async_log = 0;        /* Serial-path logging stays behind -v */
+    config.autoanswer_mode = 0;  /* SOFTWARE: exercise ATA path */
+    config.at_settle_delay_ms = 0;
+    config.at_command_guard_ms = 0;
+    config.numeric_results = numeric;  /* V0 result codes */
+
+    if (modem_emu_start(&emu, speed) != SUCCESS) {
+        fprintf(stderr, "Failed to start modem emulator\n");
+        return 1;
+    }
+
+    emu.response_delay_us = response_delay_us;
+    snprintf(config.serial_port, sizeof(config.serial_port), "%s", emu.device);
+
+    serial_fd = open_serial_port(config.serial_port, config.baudrate);
+    if (serial_fd < 0) {
+        fprintf(stderr, "Failed to open %s\n", config.serial_port);
+        modem_emu_stop(&emu);
+        return 1;
+    }
+
+    printf("Modem benchmark: emulator on %s, CONNECT %d, response delay %d us, "
+           "%d iterations, %d calls, %s results\n",
+           emu.device, speed, response_delay_us, iterations, calls,
+           numeric ? "numeric" : "verbose");
+
+    bench_classify();
+    bench_batching();
+    bench_logging();
+    bench_metrics();
+    bench_crc();
+    bench_ansi(screen_dir ? screen_dir : config.screen_dir);
+    bench_charset();
+
+    /* Per-command round trips */
+    for (j = 0; j < (int)(sizeof(commands) / sizeof(commands[0])); j++)
+        cmd_series[j].name = commands[j];
+
+    for (i = 0; i < iterations && !interrupted; i++) {
+        for (j = 0; j < (int)(sizeof(commands) / sizeof(commands[0])); j++) {
+            start = bench_now_ns();
+            rc = send_at_command(serial_fd, commands[j], response, sizeof(response),
+                                 config.at_command_timeout);
+            if (rc == SUCCESS)
+                bench_add(&cmd_series[j], bench_now_ns() - start);
+        }
+    }
+
+    bench_header("AT command round trip (send_at_command)");
+    for (j = 0; j < (int)(sizeof(commands) / sizeof(commands[0])); j++)
+        bench_report(&cmd_series[j]);
+
+    /* Whole initialization sequences */
+    for (i = 0; i < iterations && !interrupted; i++) {
+        start = bench_now_ns();
+        if (init_modem(serial_fd) == SUCCESS)
+            bench_add(&init_series, bench_now_ns() - start);
+
+        start = bench_now_ns();
+        if (set_modem_autoanswer(serial_fd) == SUCCESS)
+            bench_add(&autoanswer_series, bench_now_ns() - start);
+    }
+
+    bench_header("Initialization");
+    bench_report(&init_series);
+    bench_report(&autoanswer_series);
+
+    /* Same init with the former fixed pacing: 100ms after each write, 200ms between commands */
+    config.at_settle_delay_ms = 100;
+    config.at_command_guard_ms = 200;
+    for (i = 0; i < iterations && !interrupted; i++) {
+        start = bench_now_ns();
+        if (init_modem(serial_fd) == SUCCESS)
+            bench_add(&init_fixed_series, bench_now_ns() - start);
+    }
+    config.at_settle_delay_ms = 0;
+    config.at_command_guard_ms = 0;
+
+    bench_header("Init pacing");
+    bench_report(&init_fixed_series);
+    bench_report(&init_series);
+    if (init_fixed_series.count > 0 && init_series.count > 0) {
+        double fixed = bench_percentile(&init_fixed_series, 50);
+        double driven = bench_percentile(&init_series, 50);
+
+        printf("  init_modem() p50 saving: %.2f ms (%.1f%%)\n",
+               fixed - driven, fixed > 0 ? (fixed - driven) * 100.0 / fixed : 0.0);
+    }
+
+    /* Re-initialization between calls: full sequence vs. state cache check */
+    for (i = 0; i < iterations && !interrupted; i++) {
+        start = bench_now_ns();
+        if (init_modem(serial_fd) == SUCCESS && set_modem_autoanswer(serial_fd) == SUCCESS)
+            bench_add(&full_reinit_series, bench_now_ns() - start);
+
+        start = bench_now_ns();
+        if (modem_reinit(serial_fd) == SUCCESS)
+            bench_add(&cached_reinit_series, bench_now_ns() - start);
+
+        /* Modem reset behind our back: ATZ written without updating the cache */
+        serial_write(serial_fd, "ATZ\r", 4);
+        while (serial_read_line(serial_fd, response, sizeof(response), 1) >= 0 &&
+               strstr(response, "OK") == NULL)
+            ;
+        start = bench_now_ns();
+        if (modem_reinit(serial_fd) == SUCCESS)
+            bench_add(&reset_reinit_series, bench_now_ns() - start);
+    }
+
+    bench_header("Re-initialization");
+    bench_report(&full_reinit_series);
+    bench_report(&cached_reinit_series);
+    bench_report(&reset_reinit_series);
+
+    /* Incoming calls */
+    for (i = 0; i < calls && !interrupted; i++) {
+        rc = bench_call(&emu, &ring_connect, &ring_first_byte, &hangup_series);
+        if (rc != SUCCESS) {
+            fprintf(stderr, "Call %d failed (status: %d)\n", i + 1, rc);
+            break;
+        }
+    }
+
+    bench_header("Incoming call");
+    bench_report(&ring_connect);
+    bench_report(&ring_first_byte);
+    bench_report(&hangup_series);
+
+    if (calls > 0) {
+        bench_pacing(&emu);
+        bench_coalesce(&emu);
+        bench_transfer(&emu);
+    }
+
+    bench_loopback();
+
+    close_serial_port(serial_fd);
+    modem_emu_stop(&emu);
+
+    return 0;
+}
@@ -4,55 +4,173 @@
  *****************************************************************************/
 
 #include "modem_sample.h"
+#include <ctype.h>
+#include <poll.h>
 
 /*
- * Send AT command and wait for response
+ * Numeric (V0) result codes with X4 extended CONNECT speeds
+ * Codes 0-19 are the Hayes set; 59-91 are the common Rockwell V.32bis/V.34
+ * extensions.  Unlisted codes are left as RESULT_NONE.
+ */
+static const struct {
+    modem_result_t result;
+    int speed;
+} numeric_results[100] = {
+    [0]  = { RESULT_OK,          0      },
+    [1]  = { RESULT_CONNECT,     300    },
+    [2]  = { RESULT_RING,        0      },
+    [3]  = { RESULT_NO_CARRIER,  0      },
+    [4]  = { RESULT_ERROR,       0      },
+    [5]  = { RESULT_CONNECT,     1200   },
+    [6]  = { RESULT_NO_DIALTONE, 0      },
+    [7]  = { RESULT_BUSY,        0      },
+    [8]  = { RESULT_NO_ANSWER,   0      },
+    [9]  = { RESULT_CONNECT,     600    },
+    [10] = { RESULT_CONNECT,     2400   },
+    [11] = { RESULT_CONNECT,     4800   },
+    [12] = { RESULT_CONNECT,     9600   },
+    [13] = { RESULT_CONNECT,     7200   },
+    [14] = { RESULT_CONNECT,     12000  },
+    [15] = { RESULT_CONNECT,     14400  },
+    [16] = { RESULT_CONNECT,     19200  },
+    [17] = { RESULT_CONNECT,     38400  },
+    [18] = { RESULT_CONNECT,     57600  },
+    [19] = { RESULT_CONNECT,     115200 },
+    [59] = { RESULT_CONNECT,     16800  },
+    [61] = { RESULT_CONNECT,     21600  },
+    [62] = { RESULT_CONNECT,     24000  },
+    [63] = { RESULT_CONNECT,     26400  },
+    [64] = { RESULT_CONNECT,     28800  },
+    [84] = { RESULT_CONNECT,     33600  },
+    [91] = { RESULT_CONNECT,     31200  },
+};
+
+/*
+ * Parse a result line in either V0 (numeric) or V1 (verbose) form
+ * A numeric result is one or two digits and maps straight to the result
+ * and CONNECT speed; S-register values are always three digits and are
+ * never taken for a result.  Verbose lines go through classify_result().
+ * If speed is not NULL it receives the CONNECT speed (0 if unknown).
+ */
+modem_result_t parse_result_code(const char *text, int len, int *speed)
+{
+    const unsigned char *p = (const unsigned char *)text;
+    int code;
+
+    if (speed)
+        *speed = 0;
+
+    if (!text)
+        return RESULT_NONE;
+
+    if (len < 0)
+        len = strlen(text);
+
+    if ((len == 1 || len == 2) && p[0] >= '0' && p[0] <= '9' &&
+        (len == 1 || (p[1] >= '0' && p[1] <= '9'))) {
+        code = p[0] - '0';
+        if (len == 2)
+            code = code * 10 + (p[1] - '0');
+        if (speed)
+            *speed = numeric_results[code].speed;
+        return numeric_results[code].result;
+    }
+
+    code = classify_result(text, len, NULL);
+
+    if (code == RESULT_CONNECT && speed) {
+        connect_info_t info;
+
+        if (parse_connect_info(text, len, &info) == SUCCESS)
+            *speed = info.dce_speed;
+    }
+
+    return code;
+}
+
+/*
+ * Build the init command string for a configuration
+ * In numeric result mode ATV0 is appended; optimize_command_string()
+ * then merges it into the init line in place of V1.
+ */
+const char *modem_init_string(const modem_config_t *cfg, char *buf, int size)
+{
+    if (!cfg->numeric_results)
+        return cfg->modem_init_command;
+
+    snprintf(buf, size, "%s; ATV0", cfg->modem_init_command);
+    return buf;
+}
+
+/*
+ * Send AT command and wait for response (timeout in seconds)
  * Reference: mbcico/chat.c chat() and mbcico/dial.c initmodem()
  */
 int send_at_command(int fd, const char *command, char *response, int resp_size, int timeout)
+{
+    return send_at_command_ms(fd, command, response, resp_size, timeout * 1000);
+}
+
+/*
+ * Send AT command and wait for its final result code
+ * Returns as soon as OK/ERROR/CONNECT/NO CARRIER... arrives; the deadline
+ * is kept on CLOCK_MONOTONIC with millisecond resolution.
+ */
+int send_at_command_ms(int fd, const char *command, char *response, int resp_size, int timeout_ms)
 {
     char cmd_buf[256];
-    char line_buf[LINE_BUFFER_SIZE];
+    serial_line_t line;
+    modem_result_t result;
     int len, rc;
-    time_t start_time, current_time;
-    int remaining_timeout;
+    int resp_len = 0;
+    long long deadline, start_us;
+    int remaining_ms;
 
     if (fd < 0 || !command)
         return ERROR_GENERAL;
 
     /* Flush input buffer before sending command */
     serial_flush_input(fd);
+    serial_ring_reset(fd);
 
     /* Prepare command with CR terminator */
     snprintf(cmd_buf, sizeof(cmd_buf), "%s\r", command);
     len = strlen(cmd_buf);
 
-    print_message("Sending: %s", command);
+    log_message(fd, LOG_LEVEL_INFO, "Sending: %s", command);
 
     /* Send command */
+    start_us = monotonic_us();
     rc = serial_write(fd, cmd_buf, len);
+    if (rc >= 0)
+        rc = outq_flush(fd);  /* Out now, with any output queued before it */
     if (rc < 0) {
         print_error("Failed to send AT command");
         return ERROR_MODEM;
     }
 
-    /* Small delay after sending */
-    usleep(100000); /* 100ms */
+    /* Optional settle delay for modems that drop characters after a command */
+    if (config.at_settle_delay_ms > 0) {
+        rc = signal_event_sleep(config.at_settle_delay_ms);
+        if (rc != SUCCESS)
+            return rc;
+    }
 
-    /* Read response lines until OK or ERROR or timeout */
-    start_time = time(NULL);
-    response[0] = '\0';
+    /* Read response lines until a final result code or the deadline */
+    deadline = monotonic_ms() + timeout_ms;
+    if (response && resp_size > 0)
+        response[0] = '\0';
 
     while (1) {
-        current_time = time(NULL);
-        remaining_timeout = timeout - (current_time - start_time);
+        remaining_ms = (int)(deadline - monotonic_ms());
 
-        if (remaining_timeout <= 0) {
+        if (remaining_ms <= 0) {
             print_error("Timeout waiting for modem response");
             return ERROR_TIMEOUT;
         }
 
-        rc = serial_read_line(fd, line_buf, sizeof(line_buf), remaining_timeout);
+        /* Line is a view into the receive ring, valid until the next read */
+        rc = serial_ring_read_line(fd, &line, remaining_ms);
 
         if (rc < 0) {
             if (rc == ERROR_TIMEOUT) {
@@ -62,51 +180,49 @@ int send_at_command(int fd, const char *command, char *response, int resp_size,
         }
 
         if (rc > 0) {
+            const char *line_buf = line.data;
+
             /* Print received line */
-            print_message("Received: %s", line_buf);
+            log_message(fd, LOG_LEVEL_INFO, "Received: %s", line_buf);
 
             /* Store response if buffer provided */
             if (response && resp_size > 0) {
-                if (strlen(response) + rc + 2 < (size_t)resp_size) {
-                    if (response[0] != '\0')
-                        strcat(response, "\n");
-                    strcat(response, line_buf);
+                if (resp_len + rc + 2 < resp_size) {
+                    if (resp_len > 0)
+                        response[resp_len++] = '\n';
+                    memcpy(response + resp_len, line_buf, rc + 1);
+                    resp_len += rc;
                 }
             }
 
-            /* Check for CONNECT (successful connection) */
-            if (strstr(line_buf, "CONNECT") != NULL) {
-                print_message("Modem connected: %s", line_buf);
-                return SUCCESS;
-            }
+            result = parse_result_code(line_buf, rc, NULL);
+            if (result != RESULT_NONE && result != RESULT_RING)
+                metrics_at_command(fd, command, monotonic_us() - start_us);
 
-            /* Check for connection errors */
-            if (strstr(line_buf, "NO CARRIER") != NULL) {
-                print_error("Connection failed: NO CARRIER");
-                return ERROR_MODEM;
-            }
-            if (strstr(line_buf, "BUSY") != NULL) {
-                print_error("Connection failed: BUSY");
-                return ERROR_MODEM;
-            }
-            if (strstr(line_buf, "NO DIALTONE") != NULL) {
-                print_error("Connection failed: NO DIALTONE");
-                return ERROR_MODEM;
-            }
-            if (strstr(line_buf, "NO ANSWER") != NULL) {
-                print_error("Connection failed: NO ANSWER");
-                return ERROR_MODEM;
-            }
+            switch (result) {
+                case RESULT_CONNECT:
+                    print_message("Modem connected: %s", line_buf);
+                    return SUCCESS;
 
-            /* Check for OK */
-            if (strstr(line_buf, "OK") != NULL) {
-                return SUCCESS;
-            }
+                case RESULT_NO_CARRIER:
+                case RESULT_BUSY:
+                case RESULT_NO_DIALTONE:
+                case RESULT_NO_ANSWER:
+                    print_error("Connection failed: %s", line_buf);
+                    return ERROR_MODEM;
 
-            /* Check for ERROR */
-            if (strstr(line_buf, "ERROR") != NULL) {
-                print_error("Modem returned ERROR");
-                return ERROR_MODEM;
+                case RESULT_OK:
+                    modem_state_record(fd, command);
+                    return SUCCESS;
+
+                case RESULT_ERROR:
+                    print_error("Modem returned ERROR");
+                    /* Part of the command may have been applied */
+                    modem_state_invalidate(fd);
+                    return ERROR_MODEM;
+
+                default:
+                    break;  /* Echo or informational line */
             }
         }
     }
@@ -122,11 +238,20 @@ static int send_command_string(int fd, const char *cmd_string, int timeout)
 {
     char *commands, *cmd, *saveptr;
     char response[BUFFER_SIZE];
+    char batched[512];
+    int sent = 0;
     int rc;
 
     if (!cmd_string || strlen(cmd_string) == 0)
         return SUCCESS;
 
+    /* Merge compatible commands into as few AT lines as possible */
+    if (optimize_command_string(cmd_string, batched, sizeof(batched)) > 0) {
+        if (strcmp(batched, cmd_string) != 0)
+            print_message("Batched command string: %s", batched);
+        cmd_string = batched;
+    }
+
     /* Make a copy of the command string for parsing */
     commands = strdup(cmd_string);
     if (!commands)
@@ -141,14 +266,20 @@ static int send_command_string(int fd, const char *cmd_string, int timeout)
             cmd++;
 
         if (strlen(cmd) > 0) {
+            /* Optional guard time between commands (0 = back to back) */
+            if (sent++ > 0 && config.at_command_guard_ms > 0) {
+                rc = signal_event_sleep(config.at_command_guard_ms);
+                if (rc != SUCCESS) {
+                    free(commands);
+                    return rc;
+                }
+            }
+
             rc = send_at_command(fd, cmd, response, sizeof(response), timeout);
             if (rc != SUCCESS) {
                 free(commands);
                 return rc;
             }
-
-            /* Small delay between commands */
-            usleep(200000); /* 200ms */
         }
 
         cmd = strtok_r(NULL, ";", &saveptr);
@@ -164,15 +295,43 @@ static int send_command_string(int fd, const char *cmd_string, int timeout)
  */
 int init_modem(int fd)
 {
+    char init_buf[sizeof(config.modem_init_command) + 8];
     int rc;
 
+    /* SIGHUP and file changes reload inside the waits (serial_wait_io) */
+    config_watch_start();
+
+    /* Helper threads inherit the signal mask main() set (signal_event_init) */
+    if (config.async_log)
+        async_log_start(config.async_log_records, STDOUT_FILENO, STDERR_FILENO);
+
+    if (config.capture_file[0] && !capture_active() && capture_open(config.capture_file) == SUCCESS)
+        capture_port(fd, config.serial_port);
+
+    if (config.metrics_socket[0] || config.metrics_file[0])
+        metrics_start(config.metrics_socket, config.metrics_file, config.metrics_interval_ms);
+    metrics_port_name(fd, config.serial_port);
+
+    /* Between calls: pick up a reloaded configuration */
+    config_sync();
+
+    /* Writers wait in poll(POLLOUT) rather than blocking in write() */
+    if (serial_set_nonblocking(fd) != SUCCESS)
+        print_error("Cannot set O_NONBLOCK: %s", strerror(errno));
+
     print_message("Initializing modem...");
 
-    rc = send_command_string(fd, config.modem_init_command, config.at_command_timeout);
+    rc = send_command_string(fd, modem_init_string(&config, init_buf, sizeof(init_buf)),
+                             config.at_command_timeout);
 
     if (rc == SUCCESS) {
+        modem_state_t *state = modem_state_get(fd);
+
+        if (state)
+            state->initialized = 1;
         print_message("Modem initialized successfully");
     } else {
+        modem_state_invalidate(fd);
         print_error("Modem initialization failed");
     }
 
@@ -213,6 +372,51 @@ if (config.autoanswer_mode == 1) {
     return rc;
 }
 
+/*
+ * Re-initialize between calls using the modem state cache
+ * One batched S-register query verifies the settings we applied last;
+ * only settings that differ are sent again.  Without a cache (or when the
+ * modem does not answer the query) a full init + autoanswer is done.
+ */
+int modem_reinit(int fd)
+{
+    modem_state_t *state = modem_state_get(fd);
+    char query[64];
+    char response[BUFFER_SIZE];
+    char diff[512];
+    int rc, n;
+
+    if (fd < 0)
+        return ERROR_GENERAL;
+
+    if (state && state->initialized &&
+        modem_state_build_query(state, query, sizeof(query)) > 0) {
+        rc = send_at_command(fd, query, response, sizeof(response), config.at_command_timeout);
+        if (rc == SUCCESS) {
+            n = modem_state_diff(state, query, response, diff, sizeof(diff));
+            if (n == 0) {
+                print_message("Modem state verified, no re-initialization needed");
+                return SUCCESS;
+            }
+            if (n > 0) {
+                print_message("Modem state differs, restoring %d setting(s)", n);
+                rc = send_command_string(fd, diff, config.at_command_timeout);
+                if (rc == SUCCESS)
+                    return SUCCESS;
+            }
+        }
+        print_message("Modem state query failed, falling back to full init");
+    }
+
+    modem_state_invalidate(fd);
+
+    rc = init_modem(fd);
+    if (rc == SUCCESS)
+        rc = set_modem_autoanswer(fd);
+
+    return rc;
+}
+
 /*
  * Hangup modem connection
  * Reference: mbcico/dial.c hangup()
@@ -226,10 +430,15 @@ int modem_hangup(int fd)
 
     /* Flush buffers */
     serial_flush_input(fd);
+    outq_discard(fd);
+    carrier_watch_report(fd, config.serial_port);
+    carrier_watch_stop(fd);
+    signal_event_clear_hangup();
     serial_flush_output(fd);
+    serial_tx_release(fd);
 
-    /* Small delay before hangup command */
-    usleep(500000); /* 500ms */
+    /* Small delay before hangup command; a signal only cuts it short */
+    signal_event_sleep(500);
 
     /* Disable carrier detect before hangup to prevent I/O errors */
     print_message("Disabling carrier detect for hangup...");
@@ -271,133 +480,300 @@ int modem_hangup(int fd)
  */
 int detect_ring(const char *line)
 {
-    return (line && strstr(line, "RING") != NULL);
+    return parse_result_code(line, -1, NULL) == RESULT_RING;
+}
+
+/* CONNECT suffix tokens, compared after upper-casing and dropping '.' */
+#define CT_PROTOCOL     1
+#define CT_COMPRESSION  2
+#define CT_MODULATION   3
+
+static const struct {
+    const char *token;
+    int field;
+    int value;
+} connect_tokens[] = {
+    { "ARQ",    CT_PROTOCOL,    CONNECT_EC_ARQ      },
+    { "LAPM",   CT_PROTOCOL,    CONNECT_EC_LAPM     },
+    { "V42",    CT_PROTOCOL,    CONNECT_EC_LAPM     },
+    { "MNP",    CT_PROTOCOL,    CONNECT_EC_MNP      },
+    { "MNP2",   CT_PROTOCOL,    CONNECT_EC_MNP      },
+    { "MNP3",   CT_PROTOCOL,    CONNECT_EC_MNP      },
+    { "MNP4",   CT_PROTOCOL,    CONNECT_EC_MNP      },
+    { "MNP10",  CT_PROTOCOL,    CONNECT_EC_MNP      },
+    { "REL",    CT_PROTOCOL,    CONNECT_EC_MNP      },
+    { "ALT",    CT_PROTOCOL,    CONNECT_EC_MNP      },
+    { "V42BIS", CT_COMPRESSION, CONNECT_COMP_V42BIS },
+    { "V42B",   CT_COMPRESSION, CONNECT_COMP_V42BIS },
+    { "MNP5",   CT_COMPRESSION, CONNECT_COMP_MNP5   },
+    { "CLASS5", CT_COMPRESSION, CONNECT_COMP_MNP5   },
+    { "V44",    CT_COMPRESSION, CONNECT_COMP_V44    },
+    { "V21",    CT_MODULATION,  0 },
+    { "V22",    CT_MODULATION,  0 },
+    { "V22B",   CT_MODULATION,  0 },
+    { "V22BIS", CT_MODULATION,  0 },
+    { "V32",    CT_MODULATION,  0 },
+    { "V32B",   CT_MODULATION,  0 },
+    { "V32BIS", CT_MODULATION,  0 },
+    { "VFC",    CT_MODULATION,  0 },
+    { "V34",    CT_MODULATION,  0 },
+    { "V34+",   CT_MODULATION,  0 },
+    { "V90",    CT_MODULATION,  0 },
+    { "V92",    CT_MODULATION,  0 },
+    { "K56",    CT_MODULATION,  0 },
+    { "X2",     CT_MODULATION,  0 },
+    { "HST",    CT_MODULATION,  0 },
+    { "BELL103", CT_MODULATION, 0 },
+    { "BELL212", CT_MODULATION, 0 },
+};
+
+static const char *connect_protocol_names[] = { "NONE", "ARQ", "LAPM", "MNP" };
+static const char *connect_compression_names[] = { "NONE", "V42BIS", "MNP5", "V44" };
+
+/* Rates a UART can be set to (a modem without buffering follows the line) */
+static const int uart_rates[] = {
+    300, 600, 1200, 2400, 4800, 9600, 19200, 38400, 57600, 115200, 230400
+};
+
+/*
+ * Parse a CONNECT result into speeds, protocol and compression
+ * Handles "CONNECT", "CONNECT 2400", "CONNECT 33600/ARQ/V34/LAPM/V42BIS",
+ * ZyXEL style "CONNECT 38400/V32B 14400/V42b" (DTE rate first, then line
+ * rate) and V0 numeric codes.  Speeds are read as whole numbers, suffixes
+ * are looked up in connect_tokens[]; nothing is copied or allocated.
+ * Returns SUCCESS, or ERROR_GENERAL if text is not a CONNECT result.
+ */
+int parse_connect_info(const char *text, int len, connect_info_t *info)
+{
+    const char *p, *end, *tok;
+    char norm[16];
+    int speeds[2] = { 0, 0 };
+    int nspeeds = 0;
+    int speed, i, n;
+
+    if (!text || !info)
+        return ERROR_GENERAL;
+
+    memset(info, 0, sizeof(*info));
+
+    if (len < 0)
+        len = strlen(text);
+
+    /* Numeric result: the code gives the line rate only */
+    if (len <= 2) {
+        if (parse_result_code(text, len, &speed) != RESULT_CONNECT)
+            return ERROR_GENERAL;
+        info->dce_speed = speed;
+        return SUCCESS;
+    }
+
+    if (classify_result(text, len, &p) != RESULT_CONNECT)
+        return ERROR_GENERAL;
+    end = text + len;
+
+    while (p < end) {
+        while (p < end && (*p == ' ' || *p == '/' || *p == '\t' || *p == ',' ||
+                           *p == '(' || *p == ')' || *p == ':'))
+            p++;
+        tok = p;
+        while (p < end && *p != ' ' && *p != '/' && *p != '\t' && *p != ',' &&
+               *p != '(' && *p != ')' && *p != ':')
+            p++;
+        if (p == tok)
+            break;
+
+        /* Whole-number speed (never a substring of a longer number) */
+        if (*tok >= '0' && *tok <= '9') {
+            speed = 0;
+            for (i = 0; tok + i < p && tok[i] >= '0' && tok[i] <= '9' && i < 7; i++)
+                speed = speed * 10 + (tok[i] - '0');
+            if (tok + i == p && speed >= 75 && nspeeds < 2)
+                speeds[nspeeds++] = speed;
+            continue;
+        }
+
+        for (n = 0, i = 0; tok + i < p && n < (int)sizeof(norm) - 1; i++) {
+            if (tok[i] != '.')
+                norm[n++] = toupper((unsigned char)tok[i]);
+        }
+        norm[n] = '\0';
+
+        for (i = 0; i < (int)(sizeof(connect_tokens) / sizeof(connect_tokens[0])); i++) {
+            if (strcmp(norm, connect_tokens[i].token) != 0)
+                continue;
+            switch (connect_tokens[i].field) {
+                case CT_PROTOCOL:
+                    /* A named protocol is more specific than "ARQ" */
+                    if (info->protocol == CONNECT_EC_NONE || info->protocol == CONNECT_EC_ARQ)
+                        info->protocol = connect_tokens[i].value;
+                    break;
+                case CT_COMPRESSION:
+                    info->compression = connect_tokens[i].value;
+                    break;
+                case CT_MODULATION:
+                    snprintf(info->modulation, sizeof(info->modulation), "%s",
+                             connect_tokens[i].token);
+                    break;
+            }
+            break;
+        }
+    }
+
+    if (nspeeds == 2) {
+        info->dte_speed = speeds[0];
+        info->dce_speed = speeds[1];
+    } else if (nspeeds == 1) {
+        info->dce_speed = speeds[0];
+    } else {
+        info->dce_speed = 300;  /* Plain "CONNECT" (X0) */
+    }
+
+    /* Compression runs on top of error correction */
+    if (info->protocol == CONNECT_EC_NONE) {
+        if (info->compression == CONNECT_COMP_MNP5)
+            info->protocol = CONNECT_EC_MNP;
+        else if (info->compression != CONNECT_COMP_NONE)
+            info->protocol = CONNECT_EC_LAPM;
+    }
+
+    return SUCCESS;
 }
 
 /*
  * Parse CONNECT response to extract connection speed
  * Examples: "CONNECT 1200", "CONNECT 2400/ARQ", "CONNECT 9600/V42"
- * Enhanced version with better error handling and logging
+ * Returns the line rate, or -1 if the string is not a CONNECT result.
  */
 int parse_connect_speed(const char *connect_str)
 {
-    int speed = 0;
-    const char *ptr;
-    char temp_str[64];
+    connect_info_t info;
 
     if (!connect_str) {
         print_error("parse_connect_speed: connect_str is NULL");
         return -1;
     }
 
-    /* Log the raw CONNECT response for debugging */
-    print_message("Parsing CONNECT response: '%s'", connect_str);
-
-    /* Find "CONNECT" */
-    ptr = strstr(connect_str, "CONNECT");
-    if (!ptr) {
+    if (parse_connect_info(connect_str, -1, &info) != SUCCESS) {
         print_error("No 'CONNECT' found in response string");
         return -1;
     }
 
-    /* Skip "CONNECT" and any spaces */
-    ptr += 7; /* length of "CONNECT" */
-    while (*ptr == ' ' || *ptr == '\t')
-        ptr++;
+    if (info.dce_speed < 300 || info.dce_speed > 115200) {
+        print_message("Warning: Unusual speed %d bps - may be incorrect", info.dce_speed);
+    }
 
-    /* Copy the speed part for analysis */
-    strncpy(temp_str, ptr, sizeof(temp_str) - 1);
-    temp_str[sizeof(temp_str) - 1] = '\0';
+    return info.dce_speed;
+}
 
-    /* Remove any trailing protocol information */
-    char *slash_pos = strchr(temp_str, '/');
-    if (slash_pos) {
-        *slash_pos = '\0';
-        print_message("Protocol detected: '%s'", slash_pos + 1);
-    }
+const char *connect_protocol_name(connect_protocol_t protocol)
+{
+    if (protocol < 0 || protocol > CONNECT_EC_MNP)
+        return "UNKNOWN";
+    return connect_protocol_names[protocol];
+}
 
-    /* Remove any trailing spaces or newlines */
-    char *end = temp_str + strlen(temp_str) - 1;
-    while (end > temp_str && (*end == ' ' || *end == '\r' || *end == '\n')) {
-        *end = '\0';
-        end--;
-    }
+const char *connect_compression_name(connect_compression_t compression)
+{
+    if (compression < 0 || compression > CONNECT_COMP_V44)
+        return "UNKNOWN";
+    return connect_compression_names[compression];
+}
 
-    /* Extract the speed number */
-    if (sscanf(temp_str, "%d", &speed) == 1) {
-        print_message("Successfully parsed connection speed: %d bps", speed);
+/*
+ * Pick the port (DTE) rate for a connection
+ * A reported DTE rate wins.  An error-corrected connection is buffered
+ * by the modem, so the port stays at port_rate.  Otherwise the modem
+ * follows the line rate and the port has to as well, provided a UART can
+ * run at it (V.32bis/V.34 rates such as 14400 or 33600 imply buffering).
+ */
+int connect_dte_rate(const connect_info_t *info, int port_rate)
+{
+    int i;
 
-        /* Validate speed is reasonable */
-        if (speed < 300 || speed > 115200) {
-            print_message("Warning: Unusual speed %d bps - may be incorrect", speed);
-        }
+    if (!info)
+        return port_rate;
 
-        return speed;
-    }
+    if (info->dte_speed > 0)
+        return info->dte_speed;
+
+    if (info->protocol != CONNECT_EC_NONE || info->dce_speed <= 0)
+        return port_rate;
 
-    /* Check for common CONNECT variations */
-    if (strlen(temp_str) == 0) {
-        print_message("CONNECT without speed - assuming 300 bps (legacy modem)");
-        return 300;
+    for (i = 0; i < (int)(sizeof(uart_rates) / sizeof(uart_rates[0])); i++) {
+        if (uart_rates[i] == info->dce_speed)
+            return info->dce_speed;
     }
 
-    /* Try to extract from more complex formats */
-    if (strstr(temp_str, "1200")) speed = 1200;
-    else if (strstr(temp_str, "2400")) speed = 2400;
-    else if (strstr(temp_str, "4800")) speed = 4800;
-    else if (strstr(temp_str, "9600")) speed = 9600;
-    else if (strstr(temp_str, "19200")) speed = 19200;
-    else if (strstr(temp_str, "38400")) speed = 38400;
-    else if (strstr(temp_str, "57600")) speed = 57600;
-    else if (strstr(temp_str, "115200")) speed = 115200;
+    return port_rate;
+}
 
-    if (speed > 0) {
-        print_message("Extracted speed from complex format: %d bps", speed);
-        return speed;
-    }
+/*
+ * Pause needed after each chunk_size byte chunk so a port running at
+ * dte_rate does not outrun the line: the extra time the modem needs to
+ * send the chunk at the line rate (8N1, 10 bits per byte).  Compression
+ * is not counted in, since its gain depends on the data.
+ */
+int connect_tx_delay_us(const connect_info_t *info, int dte_rate, int chunk_size)
+{
+    long long line_us, port_us;
+
+    if (!info || info->dce_speed <= 0 || chunk_size <= 0)
+        return 0;
 
-    print_error("Failed to parse speed from CONNECT response: '%s'", temp_str);
-    return -1;
+    line_us = (long long)chunk_size * 10 * 1000000 / info->dce_speed;
+    port_us = dte_rate > 0 ? (long long)chunk_size * 10 * 1000000 / dte_rate : 0;
+
+    return line_us > port_us ? (int)(line_us - port_us) : 0;
 }
 
 /*
  * Answer incoming call with speed detection (SOFTWARE mode only)
  * Sends ATA command and parses CONNECT response to detect connection speed
  * Used when MODEM_AUTOANSWER_MODE = 0 (SOFTWARE mode)
+ * *connected_speed receives the DTE rate to run the port at (see
+ * connect_dte_rate); TX pacing of the port (serial_tx_pace, or the fixed
+ * delay of serial_tx_chunk_delay) is set for the line rate.
  */
 int modem_answer_with_speed_adjust(int fd, int *connected_speed)
 {
-    char line_buf[LINE_BUFFER_SIZE];
+    serial_line_t line;
+    connect_info_t info;
+    modem_result_t result;
     int rc;
     int speed = -1;
-    time_t start_time, current_time;
-    int remaining_timeout;
+    int delay_us;
+    long long deadline;
+    int remaining_ms;
 
     print_message("Answering incoming call (ATA) with speed detection...");
 
     /* Flush input buffer before sending command */
     serial_flush_input(fd);
+    serial_ring_reset(fd);
 
     /* Send ATA command */
     rc = serial_write(fd, "ATA\r", 4);
+    if (rc > 0)
+        rc = outq_flush(fd);
+    if (rc == SUCCESS)
+        metrics_answer(fd);
     if (rc < 0) {
         print_error("Failed to send ATA command");
         return ERROR_MODEM;
     }
 
     /* Wait for CONNECT response */
-    start_time = time(NULL);
+    deadline = monotonic_ms() + config.at_answer_timeout * 1000LL;
 
     while (1) {
-        current_time = time(NULL);
-        remaining_timeout = config.at_answer_timeout - (current_time - start_time);
+        remaining_ms = (int)(deadline - monotonic_ms());
 
-        if (remaining_timeout <= 0) {
+        if (remaining_ms <= 0) {
             print_error("Timeout waiting for modem response");
             return ERROR_TIMEOUT;
         }
 
-        rc = serial_read_line(fd, line_buf, sizeof(line_buf), remaining_timeout);
+        rc = serial_ring_read_line(fd, &line, remaining_ms);
 
         if (rc < 0) {
             if (rc == ERROR_TIMEOUT) {
@@ -407,14 +783,36 @@ int modem_answer_with_speed_adjust(int fd, int *connected_speed)
         }
 
         if (rc > 0) {
-            print_message("Received: %s", line_buf);
+            const char *line_buf = line.data;
+
+            log_message(fd, LOG_LEVEL_INFO, "Received: %s", line_buf);
+
+            result = parse_result_code(line_buf, rc, NULL);
+
+            if (result == RESULT_CONNECT) {
+                parse_connect_info(line_buf, rc, &info);
+                metrics_connect(fd, info.dce_speed);
+                print_message("Modem connected: %s (line %d bps, protocol %s, compression %s)",
+                              line_buf, info.dce_speed, connect_protocol_name(info.protocol),
+                              connect_compression_name(info.compression));
+
+                /* Port rate the caller should switch to, and TX pacing for it */
+                speed = connect_dte_rate(&info, config.baudrate);
+                delay_us = connect_tx_delay_us(&info, speed, config.tx_chunk_size);
+                serial_tx_chunk_delay(fd, delay_us);
+                if (config.tx_pacing) {
+                    serial_tx_pace(fd, info.dce_speed, speed, config.tx_queue_ms);
+                    print_message("DTE rate %d bps, TX paced at %d bps line rate",
+                                  speed, info.dce_speed);
+                } else {
+                    print_message("DTE rate %d bps, TX pacing %d us per %d bytes",
+                                  speed, delay_us, config.tx_chunk_size);
+                }
 
-            /* Check for CONNECT */
-            if (strstr(line_buf, "CONNECT") != NULL) {
-                print_message("Modem connected: %s", line_buf);
+                /* From here a dropped DCD ends any blocking read or write at once */
+                if (config.enable_carrier_detect)
+                    carrier_watch_start(fd);
 
-                /* Parse speed from CONNECT response */
-                speed = parse_connect_speed(line_buf);
                 if (speed > 0 && connected_speed) {
                     *connected_speed = speed;
                 }
@@ -422,17 +820,8 @@ int modem_answer_with_speed_adjust(int fd, int *connected_speed)
                 return SUCCESS;
             }
 
-            /* Check for errors */
-            if (strstr(line_buf, "NO CARRIER") != NULL) {
-                print_error("Connection failed: NO CARRIER");
-                return ERROR_MODEM;
-            }
-            if (strstr(line_buf, "BUSY") != NULL) {
-                print_error("Connection failed: BUSY");
-                return ERROR_MODEM;
-            }
-            if (strstr(line_buf, "NO ANSWER") != NULL) {
-                print_error("Connection failed: NO ANSWER");
+            if (result_is_failure(result)) {
+                print_error("Connection failed: %s", line_buf);
                 return ERROR_MODEM;
             }
         }
@@ -484,19 +873,187 @@ int verify_modem_readiness(int fd)
     return SUCCESS;
 }
 
+/*
+ * Look for a result code the modem sent during validation
+ * Returns SUCCESS, or ERROR_MODEM on NO CARRIER / ERROR / DISCONNECT.
+ */
+static int validation_check_input(int fd)
+{
+    char error_buf[64];
+    modem_result_t result;
+    int rc;
+
+    if (!serial_check_available(fd))
+        return SUCCESS;
+
+    rc = serial_read(fd, error_buf, sizeof(error_buf) - 1, 0);
+    if (rc <= 0)
+        return SUCCESS;
+
+    error_buf[rc] = '\0';
+    /* Verbose only: a lone digit here is more likely caller input than V0 */
+    result = classify_result(error_buf, rc, NULL);
+
+    if (result == RESULT_NO_CARRIER || result == RESULT_ERROR ||
+        result == RESULT_DISCONNECT) {
+        print_error("Connection error during validation: %s", error_buf);
+        return ERROR_MODEM;
+    }
+
+    return SUCCESS;
+}
+
+/*
+ * Receive errors since the start of validation (line_counters_t deltas)
+ */
+static void validation_counters(const line_counters_t *base, const line_counters_t *now,
+                                line_counters_t *delta)
+{
+    delta->rx = now->rx - base->rx;
+    delta->tx = now->tx - base->tx;
+    delta->frame = now->frame - base->frame;
+    delta->overrun = now->overrun - base->overrun;
+    delta->parity = now->parity - base->parity;
+    delta->brk = now->brk - base->brk;
+    delta->buf_overrun = now->buf_overrun - base->buf_overrun;
+    delta->dcd = now->dcd - base->dcd;
+    delta->dsr = now->dsr - base->dsr;
+    delta->cts = now->cts - base->cts;
+    delta->elapsed_ms = now->elapsed_ms - base->elapsed_ms;
+}
+
+/*
+ * Validation driven by status line events (carrier_watch.c)
+ * Passes once DCD and DSR have held for carrier_settle_ms and, where the
+ * UART keeps error counters, quality_window_ms of samples stayed below
+ * max_line_error_ppm.  Fails the moment DCD drops or the error budget is
+ * exceeded; duration_seconds only bounds a flapping line.
+ */
+static int validate_by_carrier_watch(int fd, int duration_seconds)
+{
+    struct pollfd pfd[3];
+    carrier_event_t ev;
+    line_counters_t base, sample, delta;
+    long long start, now, stable_since, deadline, window_end;
+    int lines, flaps = 0, counting, wait_ms, rc;
+    long ppm = 0;
+
+    lines = carrier_watch_lines(fd);
+    if (!(lines & TIOCM_CD)) {
+        print_error("No carrier at start of validation");
+        return ERROR_HANGUP;
+    }
+
+    start = stable_since = monotonic_ms();
+    deadline = start + duration_seconds * 1000LL;
+    counting = carrier_watch_counters(fd, &base) == SUCCESS;
+    window_end = counting ? start + config.quality_window_ms : start;
+    memset(&delta, 0, sizeof(delta));
+
+    pfd[0].fd = fd;
+    pfd[0].events = POLLIN;
+    pfd[1].fd = carrier_watch_fd(fd);
+    pfd[1].events = POLLIN;
+    pfd[2].fd = signal_event_fd();  /* Ignored by poll() while -1 */
+    pfd[2].events = POLLIN;
+
+    for (;;) {
+        now = monotonic_ms();
+
+        if (counting && carrier_watch_counters(fd, &sample) == SUCCESS) {
+            validation_counters(&base, &sample, &delta);
+            ppm = line_error_rate_ppm(&delta);
+            if (ppm > config.max_line_error_ppm) {
+                print_error("Line errors during validation: %ld ppm (frame %d parity %d "
+                            "overrun %d buffer %d in %lld chars)", ppm, delta.frame,
+                            delta.parity, delta.overrun, delta.buf_overrun, delta.rx);
+                return ERROR_MODEM;
+            }
+        }
+
+        if (now - stable_since >= config.carrier_settle_ms && now >= window_end) {
+            if (counting)
+                print_message("Connection validated in %lld ms (%d status line change(s), "
+                              "%ld ppm errors in %lld chars)", now - start, flaps, ppm, delta.rx);
+            else
+                print_message("Connection validated in %lld ms (%d status line change(s))",
+                              now - start, flaps);
+            return SUCCESS;
+        }
+        if (now >= deadline) {
+            print_message("Warning: Connection status lines unstable (%d changes in %d s)",
+                          flaps, duration_seconds);
+            return ERROR_MODEM; /* Not fatal, but indicates poor quality */
+        }
+
+        wait_ms = (int)(stable_since + config.carrier_settle_ms - now);
+        if (wait_ms < window_end - now)
+            wait_ms = (int)(window_end - now);
+        if (counting && wait_ms > config.quality_sample_ms)
+            wait_ms = config.quality_sample_ms;
+        if (wait_ms > deadline - now)
+            wait_ms = (int)(deadline - now);
+
+        pfd[0].revents = pfd[1].revents = pfd[2].revents = 0;
+        rc = poll(pfd, 3, wait_ms);
+        if (rc < 0) {
+            if (errno == EINTR && !interrupted)
+                continue;
+            return interrupted ? ERROR_GENERAL : ERROR_PORT;
+        }
+
+        if (pfd[2].revents & POLLIN) {
+            rc = signal_event_handle();
+            if (rc != SUCCESS)
+                return rc;
+        }
+
+        if (pfd[0].revents & POLLIN) {
+            rc = validation_check_input(fd);
+            if (rc != SUCCESS)
+                return rc;
+        }
+
+        while (carrier_watch_read(fd, &ev) == 1) {
+            if (!(ev.lines & TIOCM_CD)) {
+                print_error("Carrier lost during validation period");
+                metrics_carrier_drop(fd);
+                return ERROR_HANGUP;
+            }
+            /* CTS follows flow control; only DCD/DSR changes restart the settle time */
+            if (ev.changed & (TIOCM_CD | TIOCM_DSR)) {
+                flaps++;
+                stable_since = ev.time_ms;
+            }
+        }
+    }
+}
+
 /*
  * Validate connection quality after establishment
- * Monitors carrier signal and line quality
+ * Monitors carrier signal and line quality.  Ports with modem status
+ * lines are validated from carrier watch events and UART error counters;
+ * others fall back to checking the carrier once a second.
  */
 int validate_connection_quality(int fd, int duration_seconds)
 {
     time_t start_time;
     int carrier_checks = 0;
     int carrier_ok = 0;
+    int watched, rc;
 
     if (fd < 0)
         return ERROR_GENERAL;
 
+    /* Event driven when the port has status lines; keep a watch started elsewhere */
+    watched = carrier_watch_fd(fd) >= 0;
+    if (watched || carrier_watch_start(fd) == SUCCESS) {
+        rc = validate_by_carrier_watch(fd, duration_seconds);
+        if (!watched)
+            carrier_watch_stop(fd);
+        return rc;
+    }
+
     print_message("Validating connection quality for %d seconds...", duration_seconds);
 
     start_time = time(NULL);
@@ -513,25 +1070,19 @@ int validate_connection_quality(int fd, int duration_seconds)
             return ERROR_PORT;
         } else {
             print_error("Carrier lost during validation period");
+            metrics_carrier_drop(fd);
             return ERROR_HANGUP;
         }
 
         /* Check for any error indicators on the line */
-        if (serial_check_available(fd)) {
-            char error_buf[64];
-            int rc = serial_read(fd, error_buf, sizeof(error_buf) - 1, 0);
-            if (rc > 0) {
-                error_buf[rc] = '\0';
-                if (strstr(error_buf, "NO CARRIER") ||
-                    strstr(error_buf, "ERROR") ||
-                    strstr(error_buf, "DISCONNECT")) {
-                    print_error("Connection error during validation: %s", error_buf);
-                    return ERROR_MODEM;
-                }
-            }
-        }
+        rc = validation_check_input(fd);
+        if (rc != SUCCESS)
+            return rc;
 
-        sleep(1); /* Check every second */
+        /* Check every second, or as soon as the modem says something */
+        rc = serial_wait_io(fd, POLLIN, 1000);
+        if (rc == ERROR_GENERAL || rc == ERROR_HANGUP)
+            return rc;
     }
 
     /* Calculate carrier quality percentage */
@@ -566,9 +1117,20 @@ int recover_modem_error(int fd, int error_type)
     while (retry_count < config.max_recovery_attempts && !interrupted) {
         retry_count++;
         print_message("Recovery attempt %d/%d", retry_count, config.max_recovery_attempts);
+        metrics_recovery(fd);
 
         switch (error_type) {
             case ERROR_MODEM:
+                /* Verify cached settings first; a reset is only needed if that fails */
+                if (retry_count == 1 && modem_state_get(fd) && modem_state_get(fd)->initialized) {
+                    rc = modem_reinit(fd);
+                    if (rc == SUCCESS) {
+                        print_message("Modem recovery successful");
+                        return SUCCESS;
+                    }
+                    break;
+                }
+
                 /* Try to reset modem and reconfigure */
                 print_message("Resetting modem configuration...");
                 rc = send_at_command(fd, "ATZ", response, sizeof(response), 5);
@@ -595,7 +1157,9 @@ int recover_modem_error(int fd, int error_type)
                     return rc;
                 }
 
-                usleep(500000); /* Wait 500ms */
+                rc = signal_event_sleep(500);
+                if (rc != SUCCESS)
+                    return rc;
 
                 /* Check if modem responds */
                 rc = send_at_command(fd, "AT", response, sizeof(response), 3);
@@ -613,7 +1177,9 @@ int recover_modem_error(int fd, int error_type)
         /* Wait before retry */
         if (retry_count < 3) {
             print_message("Waiting 2 seconds before retry...");
-            sleep(2);
+            rc = signal_event_sleep(2000);
+            if (rc != SUCCESS)
+                return rc;
         }
     }
 
@@ -0,0 +1,767 @@
+/*****************************************************************************
+ * Modem Emulator Module
+ * PTY-backed Hayes modem used for benchmarking without real hardware
+ *
+ * The emulator owns the master side of a pseudo-terminal pair and runs in
+ * its own thread.  The program under test opens the slave side exactly as
+ * it would open /dev/ttyUSB0, so init_modem(), set_modem_autoanswer(),
+ * modem_answer_with_speed_adjust() and modem_hangup() run unchanged.
+ *
+ * With modem_emu_remote() the call has a far end: online data travels to a
+ * socket at the connect speed plus a fixed line delay, and what the far
+ * end writes comes back the same way.  While the line is backed up the
+ * emulator stops reading the PTY, as a modem does with CTS.
+ *
+ * A PTY has no modem status lines: TIOCMGET on the slave fails and
+ * check_carrier_status() assumes a carrier.  A remote hangup is therefore
+ * only visible in-band, as the NO CARRIER result; emu->dcd is what a real
+ * modem would show on DCD and is read by the bench via modem_emu_carrier().
+ *****************************************************************************/
+
+#include "modem_sample.h"
+#include <poll.h>
+#include <pty.h>
+#include <ctype.h>
+#include <sys/socket.h>
+
+#define EMU_LINE_SLICE          64      /* Bytes that arrive together at the far end */
+
+/* Hayes result codes (verbose / numeric) */
+#define EMU_RESULT_OK           0
+#define EMU_RESULT_CONNECT      1
+#define EMU_RESULT_RING         2
+#define EMU_RESULT_NO_CARRIER   3
+#define EMU_RESULT_ERROR        4
+
+static const char *emu_result_text[] = {
+    "OK", "CONNECT", "RING", "NO CARRIER", "ERROR"
+};
+
+/* X4 numeric CONNECT codes (Hayes 0-19, Rockwell V.34 extensions) */
+static const struct {
+    int speed;
+    int code;
+} emu_connect_codes[] = {
+    { 300, 1 }, { 600, 9 }, { 1200, 5 }, { 2400, 10 }, { 4800, 11 },
+    { 7200, 13 }, { 9600, 12 }, { 12000, 14 }, { 14400, 15 }, { 16800, 59 },
+    { 19200, 16 }, { 21600, 61 }, { 24000, 62 }, { 26400, 63 }, { 28800, 64 },
+    { 31200, 91 }, { 33600, 84 }, { 38400, 17 }, { 57600, 18 }, { 115200, 19 },
+};
+
+/*
+ * Monotonic clock in nanoseconds (shared time base with the benchmark)
+ */
+static long long emu_now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/*
+ * Write raw bytes to the DTE side
+ */
+static void emu_output(modem_emu_t *emu, const char *data, int len)
+{
+    int sent = 0;
+
+    while (sent < len) {
+        ssize_t n = write(emu->master_fd, data + sent, len - sent);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN) {
+                struct pollfd pfd = { emu->master_fd, POLLOUT, 0 };
+                poll(&pfd, 1, 10);
+                continue;
+            }
+            return;
+        }
+        sent += n;
+    }
+}
+
+/*
+ * Send a result code honouring Q/V settings
+ */
+static void emu_result(modem_emu_t *emu, int code, int speed)
+{
+    char buf[64];
+    int len;
+
+    if (emu->quiet)
+        return;
+
+    if (emu->verbose) {
+        if (code == EMU_RESULT_CONNECT && speed > 0)
+            len = snprintf(buf, sizeof(buf), "\r\nCONNECT %d\r\n", speed);
+        else
+            len = snprintf(buf, sizeof(buf), "\r\n%s\r\n", emu_result_text[code]);
+    } else {
+        if (code == EMU_RESULT_CONNECT) {
+            int i;
+
+            for (i = 0; i < (int)(sizeof(emu_connect_codes) / sizeof(emu_connect_codes[0])); i++) {
+                if (emu_connect_codes[i].speed == speed) {
+                    code = emu_connect_codes[i].code;
+                    break;
+                }
+            }
+        }
+        len = snprintf(buf, sizeof(buf), "%d\r", code);
+    }
+
+    emu_output(emu, buf, len);
+}
+
+/*
+ * Send an information line (S-register query responses)
+ */
+static void emu_info(modem_emu_t *emu, const char *text)
+{
+    char buf[64];
+    int len;
+
+    if (emu->verbose)
+        len = snprintf(buf, sizeof(buf), "\r\n%s\r\n", text);
+    else
+        len = snprintf(buf, sizeof(buf), "%s\r\n", text);
+
+    emu_output(emu, buf, len);
+}
+
+/*
+ * Restore power-on (ATZ / AT&F) settings
+ */
+static void emu_reset(modem_emu_t *emu)
+{
+    memset(emu->sregs, 0, sizeof(emu->sregs));
+    emu->sregs[2] = 43;   /* escape character '+' */
+    emu->sregs[3] = 13;   /* CR */
+    emu->sregs[4] = 10;   /* LF */
+    emu->sregs[5] = 8;    /* BS */
+    emu->sregs[7] = 50;   /* wait for carrier */
+    emu->sregs[10] = 14;  /* carrier loss delay */
+    emu->sregs[12] = 50;  /* escape guard time */
+
+    emu->echo = 1;
+    emu->verbose = 1;
+    emu->quiet = 0;
+}
+
+/*
+ * Go online (ATA, ATD or S0 auto-answer)
+ */
+static void emu_go_online(modem_emu_t *emu)
+{
+    if (emu->connect_delay_ms > 0)
+        usleep(emu->connect_delay_ms * 1000);
+
+    pthread_mutex_lock(&emu->lock);
+    emu->online = 1;
+    emu->dcd = 1;
+    emu->ring_pending = 0;
+    emu->ring_count = 0;
+    emu->stats.connect_ns = emu_now_ns();
+    emu->stats.first_data_ns = 0;
+    emu->stats.last_data_ns = 0;
+    emu->stats.overflow_bytes = 0;
+    emu->stats.data_reads = 0;
+    emu->stats.line_idle_ns = 0;
+    emu->tx_level = 0;
+    emu->stats.connects++;
+    pthread_mutex_unlock(&emu->lock);
+
+    emu_result(emu, EMU_RESULT_CONNECT, emu->connect_speed);
+}
+
+/*
+ * Drop the call and return to command mode
+ */
+static void emu_go_offline(modem_emu_t *emu, int report)
+{
+    int was_online;
+
+    pthread_mutex_lock(&emu->lock);
+    was_online = emu->online;
+    emu->online = 0;
+    emu->dcd = 0;
+    if (was_online)
+        emu->stats.hangups++;
+    pthread_mutex_unlock(&emu->lock);
+
+    if (was_online && report)
+        emu_result(emu, EMU_RESULT_NO_CARRIER, 0);
+}
+
+/*
+ * Parse a decimal number, advancing the cursor
+ */
+static int emu_number(const char **p, int def)
+{
+    int value = 0;
+
+    if (!isdigit((unsigned char)**p))
+        return def;
+
+    while (isdigit((unsigned char)**p)) {
+        value = value * 10 + (**p - '0');
+        (*p)++;
+    }
+
+    return value;
+}
+
+/*
+ * Execute one command line (text after "AT")
+ */
+static void emu_execute(modem_emu_t *emu, const char *p)
+{
+    int reg, value;
+    char info[16];
+
+    if (emu->response_delay_us > 0)
+        usleep(emu->response_delay_us);
+
+    while (*p) {
+        char c = toupper((unsigned char)*p++);
+
+        switch (c) {
+            case ' ':
+                break;
+
+            case 'Z':
+                emu_number(&p, 0);
+                emu_reset(emu);
+                break;
+
+            case 'E':
+                emu->echo = emu_number(&p, 0);
+                break;
+
+            case 'V':
+                emu->verbose = emu_number(&p, 0);
+                break;
+
+            case 'Q':
+                emu->quiet = emu_number(&p, 0);
+                break;
+
+            case 'H':
+                emu_number(&p, 0);
+                emu_go_offline(emu, 0);
+                break;
+
+            case 'X': case 'M': case 'L': case 'I': case 'B': case 'O':
+            case 'F': case 'N': case 'P': case 'T': case 'W': case 'Y':
+                emu_number(&p, 0);
+                break;
+
+            case '&':
+                c = toupper((unsigned char)*p);
+                if (!isalpha((unsigned char)c)) {
+                    emu_result(emu, EMU_RESULT_ERROR, 0);
+                    return;
+                }
+                p++;
+                emu_number(&p, 0);
+                if (c == 'F')
+                    emu_reset(emu);
+                break;
+
+            case '\\': case '%':
+                if (*p)
+                    p++;
+                emu_number(&p, 0);
+                break;
+
+            case 'S':
+                reg = emu_number(&p, -1);
+                if (reg < 0 || reg >= MODEM_EMU_SREGS) {
+                    emu_result(emu, EMU_RESULT_ERROR, 0);
+                    return;
+                }
+                if (*p == '=') {
+                    p++;
+                    value = emu_number(&p, 0);
+                    emu->sregs[reg] = value & 0xff;
+                } else if (*p == '?') {
+                    p++;
+                    snprintf(info, sizeof(info), "%03d", emu->sregs[reg]);
+                    emu_info(emu, info);
+                } else {
+                    emu_result(emu, EMU_RESULT_ERROR, 0);
+                    return;
+                }
+                break;
+
+            case 'A':
+            case 'D':
+                /* Answer / dial: rest of the line belongs to the command */
+                emu_go_online(emu);
+                return;
+
+            default:
+                emu_result(emu, EMU_RESULT_ERROR, 0);
+                return;
+        }
+    }
+
+    emu_result(emu, EMU_RESULT_OK, 0);
+}
+
+/*
+ * Handle a completed line received in command mode
+ */
+static void emu_command_line(modem_emu_t *emu, char *line)
+{
+    while (*line == ' ' || *line == '\n')
+        line++;
+
+    if (line[0] == '\0')
+        return;
+
+    if (toupper((unsigned char)line[0]) != 'A' ||
+        toupper((unsigned char)line[1]) != 'T') {
+        emu_result(emu, EMU_RESULT_ERROR, 0);
+        return;
+    }
+
+    pthread_mutex_lock(&emu->lock);
+    emu->stats.commands++;
+    pthread_mutex_unlock(&emu->lock);
+
+    emu_execute(emu, line + 2);
+}
+
+/*
+ * Pass online data through the modem buffer onto the line
+ * The buffer drains at the connect speed (10 bits per byte); what does
+ * not fit is lost, as on a modem without flow control.  Called with
+ * emu->lock held.
+ */
+static void emu_line_data(modem_emu_t *emu, int len, long long now)
+{
+    double drained, empty_ns;
+
+    if (emu->tx_buffer_size <= 0)
+        return;
+
+    if (emu->stats.last_data_ns != 0) {
+        drained = (double)(now - emu->tx_drain_ns) * emu->connect_speed / 10 / 1e9;
+        if (drained >= emu->tx_level) {
+            /* Buffer ran dry before this data arrived: the line sat idle */
+            empty_ns = emu->tx_level * 10 * 1e9 / emu->connect_speed;
+            emu->stats.line_idle_ns += (now - emu->tx_drain_ns) - (long long)empty_ns;
+            emu->tx_level = 0;
+        } else {
+            emu->tx_level -= drained;
+        }
+    }
+
+    emu->tx_drain_ns = now;
+    emu->tx_level += len;
+    if (emu->tx_level > emu->tx_buffer_size) {
+        emu->stats.overflow_bytes += (long long)(emu->tx_level - emu->tx_buffer_size);
+        emu->tx_level = emu->tx_buffer_size;
+    }
+}
+
+static void emu_line_reset(modem_emu_line_t *line)
+{
+    line->head = line->used = 0;
+    line->slice_head = line->slices = 0;
+    line->busy_ns = 0;
+}
+
+/*
+ * Bytes that can still be put on the line
+ */
+static int emu_line_room(const modem_emu_line_t *line)
+{
+    int room = MODEM_EMU_LINE_SIZE - line->used;
+    int slots = (MODEM_EMU_LINE_SLICES - line->slices) * EMU_LINE_SLICE;
+
+    return room < slots ? room : slots;
+}
+
+/*
+ * Put bytes on the line: each slice arrives once the line has carried it
+ * at the connect speed (10 bits per byte), plus the line delay
+ */
+static void emu_line_put(modem_emu_t *emu, modem_emu_line_t *line,
+                         const char *data, int len, long long now)
+{
+    int n, tail, first, slot;
+
+    while (len > 0 && line->slices < MODEM_EMU_LINE_SLICES) {
+        n = len < EMU_LINE_SLICE ? len : EMU_LINE_SLICE;
+        if (n > MODEM_EMU_LINE_SIZE - line->used)
+            break;
+
+        if (line->busy_ns < now)
+            line->busy_ns = now;
+        line->busy_ns += (long long)n * 10 * 1000000000LL / emu->connect_speed;
+
+        slot = (line->slice_head + line->slices) % MODEM_EMU_LINE_SLICES;
+        line->due_ns[slot] = line->busy_ns + (long long)emu->line_latency_ms * 1000000LL;
+        line->slice_len[slot] = n;
+        line->slices++;
+
+        tail = (line->head + line->used) % MODEM_EMU_LINE_SIZE;
+        first = MODEM_EMU_LINE_SIZE - tail < n ? MODEM_EMU_LINE_SIZE - tail : n;
+        memcpy(line->buf + tail, data, first);
+        memcpy(line->buf, data + first, n - first);
+        line->used += n;
+
+        data += n;
+        len -= n;
+    }
+}
+
+/*
+ * Hand the slices that have arrived to out_fd (non-blocking)
+ */
+static void emu_line_deliver(modem_emu_line_t *line, int out_fd, long long now)
+{
+    int n, chunk;
+    ssize_t w;
+
+    while (line->slices > 0 && line->due_ns[line->slice_head] <= now) {
+        n = line->slice_len[line->slice_head];
+        chunk = MODEM_EMU_LINE_SIZE - line->head < n ? MODEM_EMU_LINE_SIZE - line->head : n;
+
+        w = write(out_fd, line->buf + line->head, chunk);
+        if (w <= 0)
+            return;  /* Far end not reading: try again next round */
+
+        line->head = (line->head + w) % MODEM_EMU_LINE_SIZE;
+        line->used -= w;
+        line->slice_len[line->slice_head] -= w;
+        if (line->slice_len[line->slice_head] == 0) {
+            line->slice_head = (line->slice_head + 1) % MODEM_EMU_LINE_SLICES;
+            line->slices--;
+        }
+    }
+}
+
+/*
+ * Process bytes coming from the DTE
+ */
+static void emu_input(modem_emu_t *emu, const char *data, int len)
+{
+    long long now = emu_now_ns();
+    int i;
+
+    if (emu->online) {
+        /*
+         * Online data mode.  A chunk that starts with "AT" after the escape
+         * guard time of silence is taken as a command, as if the escape
+         * sequence had been sent: modem_hangup() writes ATH straight into
+         * the data stream after a 500ms pause.
+         */
+        if (len >= 3 && len < (int)sizeof(emu->cmd_buf) &&
+            toupper((unsigned char)data[0]) == 'A' &&
+            toupper((unsigned char)data[1]) == 'T' && data[len - 1] == '\r' &&
+            now - emu->last_input_ns >= (long long)emu->escape_guard_ms * 1000000LL) {
+            memcpy(emu->cmd_buf, data, len - 1);
+            emu->cmd_buf[len - 1] = '\0';
+            emu->cmd_len = 0;
+            emu->last_input_ns = now;
+            emu_command_line(emu, emu->cmd_buf);
+            return;
+        } else {
+            pthread_mutex_lock(&emu->lock);
+            if (emu->stats.first_data_ns == 0)
+                emu->stats.first_data_ns = now;
+            emu_line_data(emu, len, now);
+            emu->stats.last_data_ns = now;
+            emu->stats.data_bytes += len;
+            emu->stats.data_reads++;
+            pthread_mutex_unlock(&emu->lock);
+            if (emu->remote_fd >= 0)
+                emu_line_put(emu, &emu->to_remote, data, len, now);
+            emu->last_input_ns = now;
+            return;
+        }
+    }
+
+    emu->last_input_ns = now;
+
+    for (i = 0; i < len; i++) {
+        char c = data[i];
+
+        if (emu->echo)
+            emu_output(emu, &c, 1);
+
+        if (c == '\r') {
+            emu->cmd_buf[emu->cmd_len] = '\0';
+            emu->cmd_len = 0;
+            emu_command_line(emu, emu->cmd_buf);
+        } else if (c == '\b') {
+            if (emu->cmd_len > 0)
+                emu->cmd_len--;
+        } else if (emu->cmd_len < (int)sizeof(emu->cmd_buf) - 1) {
+            emu->cmd_buf[emu->cmd_len++] = c;
+        }
+    }
+}
+
+/*
+ * Detect DTR drop: the slave set its speed to B0 (see dtr_drop_hangup)
+ */
+static void emu_check_dtr(modem_emu_t *emu)
+{
+    struct termios tios;
+
+    if (tcgetattr(emu->master_fd, &tios) != 0)
+        return;
+
+    if (cfgetospeed(&tios) == B0) {
+        if (emu->online)
+            emu_go_offline(emu, 1);
+    }
+}
+
+/*
+ * Emit pending RINGs and handle S0 auto-answer
+ */
+static void emu_check_ring(modem_emu_t *emu)
+{
+    long long now = emu_now_ns();
+    int answer = 0;
+
+    pthread_mutex_lock(&emu->lock);
+    if (emu->ring_pending > 0 && !emu->online && now >= emu->next_ring_ns) {
+        emu->ring_pending--;
+        emu->ring_count++;
+        emu->next_ring_ns = now + (long long)emu->ring_interval_ms * 1000000LL;
+        emu->stats.ring_ns = now;
+        emu->stats.rings++;
+        if (emu->sregs[0] > 0 && emu->ring_count >= emu->sregs[0])
+            answer = 1;
+        pthread_mutex_unlock(&emu->lock);
+
+        emu_result(emu, EMU_RESULT_RING, 0);
+        if (answer)
+            emu_go_online(emu);
+        return;
+    }
+    pthread_mutex_unlock(&emu->lock);
+}
+
+/*
+ * Emulator thread main loop
+ */
+static void *emu_thread(void *arg)
+{
+    modem_emu_t *emu = arg;
+    char buf[BUFFER_SIZE];
+    struct pollfd pfd[2];
+    long long now;
+    ssize_t n;
+    int remote;
+
+    pfd[0].fd = emu->master_fd;
+
+    while (emu->running) {
+        remote = emu->remote_fd >= 0 && emu->online;
+
+        /* A backed-up line holds the DTE off */
+        pfd[0].events = !remote || emu_line_room(&emu->to_remote) >= (int)sizeof(buf) ? POLLIN : 0;
+        pfd[0].revents = 0;
+        pfd[1].fd = emu->remote_fd;
+        pfd[1].events = POLLIN;
+        pfd[1].revents = 0;
+
+        if (poll(pfd, emu->remote_fd >= 0 ? 2 : 1, 1) < 0 && errno != EINTR)
+            break;
+
+        if (pfd[0].revents & POLLIN) {
+            n = read(emu->master_fd, buf, sizeof(buf));
+            if (n > 0)
+                emu_input(emu, buf, n);
+        }
+
+        if (emu->remote_fd >= 0) {
+            now = emu_now_ns();
+            if (emu->online) {
+                if ((pfd[1].revents & POLLIN) && emu_line_room(&emu->to_dte) >= (int)sizeof(buf)) {
+                    n = read(emu->remote_fd, buf, sizeof(buf));
+                    if (n > 0)
+                        emu_line_put(emu, &emu->to_dte, buf, n, now);
+                }
+                emu_line_deliver(&emu->to_remote, emu->remote_fd, now);
+                emu_line_deliver(&emu->to_dte, emu->master_fd, now);
+            } else {
+                /* No call: whatever is in flight is lost */
+                if (pfd[1].revents & POLLIN)
+                    read(emu->remote_fd, buf, sizeof(buf));
+                emu_line_reset(&emu->to_remote);
+                emu_line_reset(&emu->to_dte);
+            }
+        }
+
+        emu_check_dtr(emu);
+        emu_check_ring(emu);
+    }
+
+    return NULL;
+}
+
+/*
+ * Start the emulator: open a PTY pair and spawn the modem thread
+ * The device to open is available in emu->device afterwards.
+ */
+int modem_emu_start(modem_emu_t *emu, int connect_speed)
+{
+    struct termios tios;
+    int slave_fd;
+
+    if (!emu)
+        return ERROR_GENERAL;
+
+    memset(emu, 0, sizeof(*emu));
+    emu->master_fd = -1;
+    emu->remote_fd = -1;
+    emu->connect_speed = connect_speed > 0 ? connect_speed : 33600;
+    emu->ring_interval_ms = 10;
+    emu->escape_guard_ms = 100;
+    emu_reset(emu);
+
+    if (openpty(&emu->master_fd, &slave_fd, emu->device, NULL, NULL) != 0) {
+        print_error("Failed to open emulator PTY: %s", strerror(errno));
+        return ERROR_PORT;
+    }
+
+    /* Raw slave so no line discipline processing distorts timings */
+    if (tcgetattr(slave_fd, &tios) == 0) {
+        cfmakeraw(&tios);
+        tcsetattr(slave_fd, TCSANOW, &tios);
+    }
+
+    /*
+     * Keep a slave descriptor open for the lifetime of the emulator so the
+     * master does not see EIO while the program reopens the port.
+     */
+    emu->slave_hold_fd = slave_fd;
+
+    fcntl(emu->master_fd, F_SETFL, fcntl(emu->master_fd, F_GETFL) | O_NONBLOCK);
+
+    if (pthread_mutex_init(&emu->lock, NULL) != 0) {
+        close(emu->master_fd);
+        close(slave_fd);
+        return ERROR_GENERAL;
+    }
+
+    emu->running = 1;
+    if (pthread_create(&emu->thread, NULL, emu_thread, emu) != 0) {
+        print_error("Failed to start emulator thread");
+        emu->running = 0;
+        pthread_mutex_destroy(&emu->lock);
+        close(emu->master_fd);
+        close(slave_fd);
+        return ERROR_GENERAL;
+    }
+
+    print_message("Modem emulator listening on %s (CONNECT %d)",
+                  emu->device, emu->connect_speed);
+    return SUCCESS;
+}
+
+/*
+ * Stop the emulator thread and release the PTY pair
+ */
+void modem_emu_stop(modem_emu_t *emu)
+{
+    if (!emu || !emu->running)
+        return;
+
+    emu->running = 0;
+    pthread_join(emu->thread, NULL);
+    pthread_mutex_destroy(&emu->lock);
+
+    close(emu->master_fd);
+    close(emu->slave_hold_fd);
+    emu->master_fd = -1;
+    emu->slave_hold_fd = -1;
+
+    if (emu->remote_fd >= 0) {
+        close(emu->remote_fd);
+        emu->remote_fd = -1;
+    }
+}
+
+/*
+ * Give the call a far end with latency_ms of one-way line delay
+ * Returns the far end's descriptor (a socket: read what the DTE sends
+ * online, write to answer), or ERROR_GENERAL.  Call before going online.
+ */
+int modem_emu_remote(modem_emu_t *emu, int latency_ms)
+{
+    int sv[2];
+
+    if (!emu || emu->remote_fd >= 0)
+        return ERROR_GENERAL;
+
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv) != 0) {
+        print_error("Failed to create emulator line: %s", strerror(errno));
+        return ERROR_GENERAL;
+    }
+
+    fcntl(sv[0], F_SETFL, fcntl(sv[0], F_GETFL) | O_NONBLOCK);
+    emu_line_reset(&emu->to_remote);
+    emu_line_reset(&emu->to_dte);
+    emu->line_latency_ms = latency_ms;
+    emu->remote_fd = sv[0];
+
+    return sv[1];
+}
+
+/*
+ * Schedule incoming RINGs, interval_ms apart
+ */
+void modem_emu_ring(modem_emu_t *emu, int count, int interval_ms)
+{
+    pthread_mutex_lock(&emu->lock);
+    emu->ring_pending = count;
+    emu->ring_count = 0;
+    emu->ring_interval_ms = interval_ms;
+    emu->next_ring_ns = emu_now_ns();
+    pthread_mutex_unlock(&emu->lock);
+}
+
+/*
+ * Remote side hangs up: report NO CARRIER (the program under test sees
+ * only that; the PTY has no DCD line to drop)
+ */
+void modem_emu_drop_carrier(modem_emu_t *emu)
+{
+    emu_go_offline(emu, 1);
+}
+
+/*
+ * DCD as the emulated modem would drive it (for the bench; not visible
+ * to TIOCMGET on the PTY)
+ */
+int modem_emu_carrier(modem_emu_t *emu)
+{
+    int dcd;
+
+    pthread_mutex_lock(&emu->lock);
+    dcd = emu->dcd;
+    pthread_mutex_unlock(&emu->lock);
+
+    return dcd;
+}
+
+/*
+ * Snapshot emulator counters and timestamps
+ */
+void modem_emu_get_stats(modem_emu_t *emu, modem_emu_stats_t *stats)
+{
+    pthread_mutex_lock(&emu->lock);
+    *stats = emu->stats;
+    pthread_mutex_unlock(&emu->lock);
+}
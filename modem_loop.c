@@ -0,0 +1,1437 @@
+/*****************************************************************************
+ * Modem Event Loop Module
+ * Drives many modem lines from one process with epoll
+ *
+ * Each line runs init, autoanswer, answer and hangup as a non-blocking
+ * state machine.  The blocking sequence in modem_control.c
+ * (init_modem -> set_modem_autoanswer -> modem_answer_with_speed_adjust ->
+ * modem_hangup) is reproduced step by step, driven by received lines and
+ * per-line deadlines instead of sleep()/select().
+ *****************************************************************************/
+
+#include "modem_sample.h"
+#include <sys/epoll.h>
+
+#define LOOP_MAX_EVENTS     32
+#define LOOP_HANGUP_GUARD_MS    500   /* modem_hangup(): delay before ATH */
+#define LOOP_HANGUP_TIMEOUT_MS  3000  /* modem_hangup(): ATH timeout */
+#define LOOP_DTR_DROP_MS        1000  /* dtr_drop_hangup(): DTR low time */
+#define LOOP_RETRY_DELAY_MS     2000  /* recover_modem_error(): retry wait */
+
+static const char *line_state_names[] = {
+    "CLOSED", "INIT", "AUTOANSWER", "IDLE", "ANSWERING",
+    "CONNECTED", "HANGUP_GUARD", "HANGUP", "DTR_DROP", "VERIFY", "RETRY", "FAILED"
+};
+
+/*
+ * Human readable state name (for logging)
+ */
+const char *modem_line_state_name(line_state_t state)
+{
+    if (state < 0 || state > LINE_FAILED)
+        return "UNKNOWN";
+    return line_state_names[state];
+}
+
+static void line_set_state(modem_line_t *line, line_state_t state, int timeout_ms)
+{
+    if (line->cfg->verbose_mode)
+        print_message("[%s] %s -> %s", line->device,
+                      modem_line_state_name(line->state), modem_line_state_name(state));
+
+    line->state = state;
+    line->deadline_ms = timeout_ms > 0 ? monotonic_ms() + timeout_ms : 0;
+}
+
+/*
+ * Is a file or cached screen being sent (output queued later waits)?
+ */
+static int line_tx_busy(const modem_line_t *line)
+{
+    return line->tx_file.file_fd >= 0 || line->tx_screen != NULL;
+}
+
+/*
+ * Drop a queued file or screen (hangup)
+ */
+static void line_tx_cancel(modem_line_t *line)
+{
+    file_send_close(&line->tx_file);
+    screen_cache_release(line->tx_screen);
+    line->tx_screen = NULL;
+}
+
+/*
+ * Update the epoll interest set (EPOLLOUT only while output is pending
+ * and neither coalescing nor the pacer is holding it back)
+ */
+static void line_update_events(modem_line_t *line)
+{
+    struct epoll_event ev;
+
+    ev.events = EPOLLIN | EPOLLRDHUP;
+    if ((outq_pending(line->fd) > 0 || line_tx_busy(line)) && line->tx_resume_ms == 0)
+        ev.events |= EPOLLOUT;
+    ev.data.ptr = line;
+
+    /* Coalesced writes come in bursts: only a change costs a system call */
+    if (ev.events == line->events)
+        return;
+    line->events = ev.events;
+
+    epoll_ctl(line->loop->epoll_fd, EPOLL_CTL_MOD, line->fd, &ev);
+}
+
+/*
+ * Bytes the pacer lets the line write now (see serial_tx_allowance)
+ * When it says wait, output resumes from the loop at tx_resume_ms.
+ */
+static int line_tx_allow(modem_line_t *line, int want)
+{
+    int wait_us, allowed;
+
+    allowed = serial_tx_allowance(line->fd, want, &wait_us);
+    line->tx_resume_ms = allowed > 0 ? 0 : monotonic_ms() + wait_us / 1000 + 1;
+
+    return allowed;
+}
+
+/*
+ * Send up to max bytes of a queued file, or of the current screen chunk
+ * Returns 1 on progress (or when done), 0 if the driver is full, or an
+ * error code.
+ */
+static int line_tx_body(modem_line_t *line, int max)
+{
+    const char *data;
+    int len, n;
+
+    if (line->tx_file.file_fd >= 0) {
+        n = file_send_step(line->fd, &line->tx_file, max);
+        if (n < 0)
+            return n;
+        serial_tx_account(line->fd, n);
+        if (line->tx_file.offset >= line->tx_file.size) {
+            file_send_close(&line->tx_file);
+            return 1;
+        }
+        return n > 0;
+    }
+
+    len = screen_chunk(line->tx_screen, screen_speed_class(line->connect.dce_speed),
+                       line->tx_chunk, &data);
+    if (len == 0) {
+        screen_cache_release(line->tx_screen);
+        line->tx_screen = NULL;
+        return 1;
+    }
+
+    if (len - line->tx_chunk_off < max)
+        max = len - line->tx_chunk_off;
+
+    n = write(line->fd, data + line->tx_chunk_off, max);
+    if (n > 0) {
+        capture_data(line->fd, CAPTURE_TX, data + line->tx_chunk_off, n);
+        metrics_tx(line->fd, n);
+    }
+    if (n < 0) {
+        if (errno == EINTR)
+            return 1;
+        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            metrics_write_retry(line->fd);
+            return 0;
+        }
+        if (errno == EPIPE || errno == ECONNRESET || errno == EIO)
+            return ERROR_HANGUP;
+        return ERROR_PORT;
+    }
+
+    serial_tx_account(line->fd, n);
+    line->tx_chunk_off += n;
+    if (line->tx_chunk_off == len) {
+        line->tx_chunk++;
+        line->tx_chunk_off = 0;
+    }
+
+    return n > 0;
+}
+
+/*
+ * Write as much pending output as the driver accepts
+ * Output queued before a file or screen (up to the output queue mark)
+ * goes first, then the file or screen, then output queued meanwhile.
+ * Queued output goes out once it is due (outq_push) or, with force set,
+ * at once.
+ */
+static int line_flush_tx(modem_line_t *line, int force)
+{
+    int allowed, n;
+
+    for (;;) {
+        n = outq_push(line->fd, force);
+        if (n < 0)
+            return n;
+
+        /* Held back by coalescing or the pacer, or waiting for room */
+        line->tx_resume_ms = n > 0 ? outq_deadline(line->fd) : 0;
+        if (n > 0 || !line_tx_busy(line))
+            break;
+
+        if (verify_carrier_before_send(line->fd) != SUCCESS)
+            return ERROR_HANGUP;
+
+        allowed = line_tx_allow(line, 0);
+        if (allowed == 0)
+            break;
+
+        n = line_tx_body(line, allowed);
+        if (n < 0) {
+            line_tx_cancel(line);
+            return n;
+        }
+        if (!line_tx_busy(line))
+            outq_unmark(line->fd);
+        if (n == 0)
+            break;
+    }
+
+    line_update_events(line);
+    return SUCCESS;
+}
+
+/*
+ * Queue output on the line's output queue and write what is due now
+ * Commands go out at once; session output is coalesced (outq_attach).
+ * Returns the bytes queued, fewer than len when the queue is full and
+ * the driver has not taken earlier output yet.
+ */
+static int line_queue(modem_line_t *line, const char *data, int len)
+{
+    int done = 0, n, rc;
+
+    for (;;) {
+        n = outq_write(line->fd, data + done, len - done);
+        if (n > 0)
+            done += n;
+
+        rc = line_flush_tx(line, line->state != LINE_CONNECTED);
+        if (rc == ERROR_HANGUP && line->state == LINE_CONNECTED)
+            modem_line_hangup(line);
+
+        /* Full: writing out may have made room for the rest */
+        if (n <= 0 || done == len || rc != SUCCESS)
+            return done;
+    }
+}
+
+/*
+ * Queue output that must go out whole (a short count could end inside a
+ * character); returns len, or 0 while the queue has no room for it
+ */
+static int line_queue_whole(modem_line_t *line, const char *data, int len)
+{
+    int rc;
+
+    if (outq_room(line->fd) < len) {
+        rc = line_flush_tx(line, 0);
+        if (rc == ERROR_HANGUP && line->state == LINE_CONNECTED)
+            modem_line_hangup(line);
+        if (rc != SUCCESS || outq_room(line->fd) < len)
+            return 0;
+    }
+
+    return line_queue(line, data, len);
+}
+
+/*
+ * Queue optimizer output that found no room earlier; returns the bytes
+ * still waiting (the loop queues them as the port drains)
+ */
+static int line_drain_ansi(modem_line_t *line)
+{
+    int n;
+
+    if (line->ansi_left > 0) {
+        n = line_queue(line, line->ansi_out, line->ansi_left);
+        if (line->ansi_left > 0) {  /* Not dropped by a hangup meanwhile */
+            line->ansi_out += n;
+            line->ansi_left -= n;
+        }
+    }
+
+    return line->ansi_left;
+}
+
+/*
+ * Queue session output, through the ANSI optimizer if the line has one
+ * whole is for charset output (line_queue_whole).  With the optimizer the
+ * data is taken in full, or not at all (0) while its earlier output is
+ * still waiting for room: the screen model has moved on once it is fed,
+ * so what does not fit waits on the line (line_drain_ansi).
+ */
+static int line_optimize(modem_line_t *line, const char *data, int len, int whole)
+{
+    const char *out;
+    int n;
+
+    if (!line->ansi)
+        return whole ? line_queue_whole(line, data, len) : line_queue(line, data, len);
+
+    if (line_drain_ansi(line) > 0)
+        return 0;
+
+    /* Only what changes on the caller's screen goes out */
+    if (ansi_opt_feed(line->ansi, data, len) != SUCCESS ||
+        (n = ansi_opt_output(line->ansi, &out)) < 0) {
+        /* Out of memory: the screen is unknown, the data goes out as it is */
+        ansi_opt_bypass(line->ansi);
+        return whole ? line_queue_whole(line, data, len) : line_queue(line, data, len);
+    }
+
+    line->ansi_out = out;
+    line->ansi_left = n;
+    line_drain_ansi(line);
+
+    return len;
+}
+
+/*
+ * Queue output for a line
+ * Online, output is converted to the caller's charset, and small writes
+ * are coalesced: they go out together once tx_coalesce_bytes are pending
+ * or tx_coalesce_ms after the first one (see output_queue.c), or at
+ * modem_line_flush().  Returns the bytes taken, fewer than len (possibly
+ * 0) when the output queue is full: write the rest once the port has
+ * drained.  Nothing taken is dropped.
+ */
+int modem_line_write(modem_line_t *line, const char *data, int len)
+{
+    char buf[BUFFER_SIZE];
+    charset_t saved;
+    int done = 0, n, used;
+
+    if (!line || line->fd < 0 || !data || len <= 0)
+        return 0;
+
+    if (line->state != LINE_CONNECTED)
+        return line_queue(line, data, len);
+
+    if (line->charset.id == CHARSET_UTF8)
+        return line_optimize(line, data, len, 0);
+
+    while (done < len && line->state == LINE_CONNECTED) {
+        saved = line->charset;
+        n = charset_encode(&line->charset, data + done, len - done, buf, sizeof(buf), &used);
+        if (n > 0 && line_optimize(line, buf, n, 1) < n) {
+            /* Not taken: the encoder forgets this chunk too */
+            line->charset = saved;
+            break;
+        }
+        done += used;
+    }
+
+    return done;
+}
+
+/*
+ * The port has room or the pacer lets output go on: write what is due,
+ * then queue optimizer output that was waiting for room
+ */
+static void line_tx_resume(modem_line_t *line)
+{
+    if (line_flush_tx(line, 0) == ERROR_HANGUP && line->state == LINE_CONNECTED)
+        modem_line_hangup(line);
+    else if (line->ansi_left > 0)
+        line_drain_ansi(line);
+}
+
+/*
+ * Write coalesced output now (end of a prompt that waits for input)
+ */
+int modem_line_flush(modem_line_t *line)
+{
+    int rc;
+
+    if (!line || line->fd < 0)
+        return ERROR_GENERAL;
+
+    line_drain_ansi(line);
+    rc = line_flush_tx(line, 1);
+    if (rc == ERROR_HANGUP && line->state == LINE_CONNECTED)
+        modem_line_hangup(line);
+
+    return rc;
+}
+
+/*
+ * Queue a file for a line, sent with sendfile() as the port drains
+ * Output written later is held until the file is out.  One file at a time;
+ * offset > 0 resumes a screen cut short by an earlier hangup.
+ */
+int modem_line_send_file(modem_line_t *line, const char *path, off_t offset)
+{
+    int rc;
+
+    if (!line || line->fd < 0 || line->state != LINE_CONNECTED)
+        return ERROR_GENERAL;
+
+    /* Busy, or optimizer output still waits for room (it goes first) */
+    if (line_tx_busy(line) || line_drain_ansi(line) > 0)
+        return ERROR_GENERAL;
+
+    rc = file_send_open(&line->tx_file, path, offset);
+    if (rc != SUCCESS)
+        return rc;
+
+    /* The file goes out as it is; the screen is unknown after it */
+    ansi_opt_bypass(line->ansi);
+
+    outq_mark(line->fd);
+
+    if (line_flush_tx(line, 0) == ERROR_HANGUP)
+        modem_line_hangup(line);
+
+    return SUCCESS;
+}
+
+/*
+ * Queue a cached screen for a line, sent in the chunks of its connect
+ * speed as the port drains (see modem_line_send_file for ordering)
+ */
+int modem_line_send_screen(modem_line_t *line, const char *name)
+{
+    screen_t *screen;
+
+    if (!line || line->fd < 0 || line->state != LINE_CONNECTED)
+        return ERROR_GENERAL;
+
+    /* Busy, or optimizer output still waits for room (it goes first) */
+    if (line_tx_busy(line) || line_drain_ansi(line) > 0)
+        return ERROR_GENERAL;
+
+    line->tx_screen = screen_cache_acquire(name);
+    if (!line->tx_screen) {
+        print_error("[%s] Screen %s not cached", line->device, name);
+        return ERROR_GENERAL;
+    }
+
+    /* A private copy in the caller's charset, then with only what changes */
+    if (line->charset.id != CHARSET_UTF8) {
+        screen = charset_screen(&line->charset, line->tx_screen);
+        screen_cache_release(line->tx_screen);
+        line->tx_screen = screen;
+        if (!screen)
+            return ERROR_GENERAL;
+    }
+
+    if (line->ansi) {
+        screen = ansi_opt_screen(line->ansi, line->tx_screen);
+        screen_cache_release(line->tx_screen);
+        line->tx_screen = screen;
+        if (!screen)
+            return ERROR_GENERAL;
+    }
+
+    line->tx_chunk = 0;
+    line->tx_chunk_off = 0;
+    outq_mark(line->fd);
+
+    if (line_flush_tx(line, 0) == ERROR_HANGUP)
+        modem_line_hangup(line);
+
+    return SUCCESS;
+}
+
+/*
+ * Switch a connected line to the charset its caller asked for (a session
+ * may ask after CONNECT); output already queued stays as it is
+ */
+int modem_line_set_charset(modem_line_t *line, const char *name)
+{
+    int charset = charset_lookup(name);
+
+    if (!line || line->fd < 0 || charset < 0)
+        return ERROR_GENERAL;
+
+    /* The optimizer goes, but not before its output is queued */
+    if (charset == CHARSET_EUCKR && line->ansi && line_drain_ansi(line) > 0)
+        return ERROR_GENERAL;
+
+    charset_init(&line->charset, charset);
+
+    if (charset == CHARSET_EUCKR && line->ansi) {
+        ansi_opt_free(line->ansi);
+        line->ansi = NULL;
+    }
+
+    return SUCCESS;
+}
+
+/*
+ * Send one AT command and arm the response deadline
+ */
+static void line_send_command(modem_line_t *line, const char *command, int timeout_ms)
+{
+    char cmd_buf[256];
+    int len;
+
+    if (line->cfg->verbose_mode)
+        log_message(line->fd, LOG_LEVEL_INFO, "[%s] Sending: %s", line->device, command);
+
+    snprintf(line->last_cmd, sizeof(line->last_cmd), "%s", command);
+    len = snprintf(cmd_buf, sizeof(cmd_buf), "%s\r", command);
+    line->cmd_start_us = monotonic_us();
+    modem_line_write(line, cmd_buf, len);
+    line->deadline_ms = monotonic_ms() + timeout_ms;
+}
+
+/*
+ * Load a ';' separated command string (see send_command_string)
+ */
+static void line_load_commands(modem_line_t *line, const char *cmd_string)
+{
+    if (!cmd_string ||
+        optimize_command_string(cmd_string, line->cmd_list, sizeof(line->cmd_list)) < 0)
+        snprintf(line->cmd_list, sizeof(line->cmd_list), "%s", cmd_string ? cmd_string : "");
+    line->cmd_next = line->cmd_list;
+}
+
+/*
+ * Send the next queued command; returns 0 when the queue is exhausted
+ */
+static int line_next_command(modem_line_t *line)
+{
+    char *cmd, *end;
+
+    while (line->cmd_next && *line->cmd_next) {
+        cmd = line->cmd_next;
+        end = strchr(cmd, ';');
+        if (end) {
+            *end = '\0';
+            line->cmd_next = end + 1;
+        } else {
+            line->cmd_next = NULL;
+        }
+
+        while (*cmd == ' ' || *cmd == '\t')
+            cmd++;
+
+        if (*cmd) {
+            line_send_command(line, cmd, line->cfg->at_command_timeout * 1000);
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+static void line_start_autoanswer(modem_line_t *line)
+{
+    const char *command = line->cfg->autoanswer_mode == 1 ?
+        line->cfg->modem_autoanswer_hardware_command :
+        line->cfg->modem_autoanswer_software_command;
+
+    line_set_state(line, LINE_AUTOANSWER, 0);
+    line_load_commands(line, command);
+    if (!line_next_command(line)) {
+        line->ring_count = 0;
+        line_set_state(line, LINE_IDLE, 0);
+    }
+}
+
+static void line_start_init(modem_line_t *line)
+{
+    char init_buf[sizeof(line->cfg->modem_init_command) + 8];
+
+    line->ring_count = 0;
+    line_set_state(line, LINE_INIT, 0);
+    line_load_commands(line, modem_init_string(line->cfg, init_buf, sizeof(init_buf)));
+    if (!line_next_command(line))
+        line_start_autoanswer(line);
+}
+
+/*
+ * Re-initialize after a hangup: verify the cached modem state with one
+ * query (see modem_reinit) and fall back to the full init sequence
+ */
+static void line_start_reinit(modem_line_t *line)
+{
+    modem_state_t *state = modem_state_get(line->fd);
+    char query[64];
+
+    if (!state || !state->initialized ||
+        modem_state_build_query(state, query, sizeof(query)) <= 0) {
+        line_start_init(line);
+        return;
+    }
+
+    line->ring_count = 0;
+    line->resp_len = 0;
+    line->resp_buf[0] = '\0';
+    line_set_state(line, LINE_VERIFY, 0);
+    line_send_command(line, query, line->cfg->at_command_timeout * 1000);
+}
+
+/*
+ * State query answered: go idle, restore what differs, or fully re-init
+ */
+static void line_finish_verify(modem_line_t *line)
+{
+    modem_state_t *state = modem_state_get(line->fd);
+    int rc;
+
+    rc = modem_state_diff(state, line->last_cmd, line->resp_buf,
+                          line->cmd_list, sizeof(line->cmd_list));
+    if (rc == 0) {
+        if (line->cfg->verbose_mode)
+            print_message("[%s] Modem state verified", line->device);
+        line_set_state(line, LINE_IDLE, 0);
+        return;
+    }
+
+    if (rc < 0) {
+        modem_state_invalidate(line->fd);
+        line_start_init(line);
+        return;
+    }
+
+    print_message("[%s] Modem state differs, restoring %d setting(s)", line->device, rc);
+    line_set_state(line, LINE_AUTOANSWER, 0);
+    line->cmd_next = line->cmd_list;
+    if (!line_next_command(line))
+        line_set_state(line, LINE_IDLE, 0);
+}
+
+/*
+ * Command failed or timed out: retry the init sequence after a pause
+ * (same policy as recover_modem_error)
+ */
+static void line_command_failed(modem_line_t *line, const char *reason)
+{
+    print_error("[%s] %s in state %s", line->device, reason,
+                modem_line_state_name(line->state));
+
+    /* The modem may have applied part of the failed command */
+    modem_state_invalidate(line->fd);
+
+    if (line->cfg->enable_error_recovery &&
+        line->recovery_attempts < line->cfg->max_recovery_attempts) {
+        line->recovery_attempts++;
+        metrics_recovery(line->fd);
+        line_set_state(line, LINE_RETRY, LOOP_RETRY_DELAY_MS);
+    } else {
+        line_set_state(line, LINE_FAILED, 0);
+    }
+}
+
+/*
+ * Watch DCD while online, so a lost carrier is noticed without waiting
+ * for NO CARRIER from the modem (ports without status lines are skipped)
+ */
+static void line_watch_carrier(modem_line_t *line)
+{
+    struct epoll_event ev;
+
+    if (!line->cfg->enable_carrier_detect || line->carrier_fd >= 0)
+        return;
+
+    if (carrier_watch_start(line->fd) != SUCCESS)
+        return;
+
+    line->carrier_fd = carrier_watch_fd(line->fd);
+
+    ev.events = EPOLLIN;
+    ev.data.ptr = &line->carrier_fd;
+    if (epoll_ctl(line->loop->epoll_fd, EPOLL_CTL_ADD, line->carrier_fd, &ev) != 0) {
+        print_error("[%s] epoll_ctl failed for carrier watch: %s",
+                    line->device, strerror(errno));
+        carrier_watch_stop(line->fd);
+        line->carrier_fd = -1;
+    }
+}
+
+static void line_unwatch_carrier(modem_line_t *line)
+{
+    if (line->carrier_fd < 0)
+        return;
+
+    epoll_ctl(line->loop->epoll_fd, EPOLL_CTL_DEL, line->carrier_fd, NULL);
+    carrier_watch_report(line->fd, line->device);
+    carrier_watch_stop(line->fd);
+    line->carrier_fd = -1;
+}
+
+/*
+ * An online line lost its carrier: the one place a loop drop is counted
+ */
+static void line_carrier_lost(modem_line_t *line, const char *how)
+{
+    if (line->state != LINE_CONNECTED)
+        return;
+
+    print_message("[%s] Carrier lost (%s)", line->device, how);
+    metrics_carrier_drop(line->fd);
+    modem_line_hangup(line);
+}
+
+/*
+ * Status lines changed: hang up as soon as DCD drops
+ */
+static void line_handle_carrier(modem_line_t *line)
+{
+    carrier_event_t ev;
+
+    while (carrier_watch_read(line->fd, &ev) == 1) {
+        if (line->cfg->verbose_mode)
+            print_message("[%s] Status lines: DCD %s DSR %s CTS %s",
+                          line->device, (ev.lines & TIOCM_CD) ? "ON" : "OFF",
+                          (ev.lines & TIOCM_DSR) ? "ON" : "OFF",
+                          (ev.lines & TIOCM_CTS) ? "ON" : "OFF");
+
+        if (line->state == LINE_CONNECTED && !(ev.lines & TIOCM_CD)) {
+            line_carrier_lost(line, "DCD dropped");
+            return;
+        }
+    }
+}
+
+/*
+ * Line whose carrier watch an epoll event belongs to, or NULL
+ */
+static modem_line_t *loop_carrier_line(modem_loop_t *loop, void *ptr)
+{
+    int i;
+
+    for (i = 0; i < loop->line_count; i++) {
+        if (ptr == &loop->lines[i].carrier_fd)
+            return &loop->lines[i];
+    }
+
+    return NULL;
+}
+
+/*
+ * Begin the modem_hangup() sequence: guard delay, ATH, DTR drop, re-init
+ */
+void modem_line_hangup(modem_line_t *line)
+{
+    struct termios tios;
+
+    if (!line || line->fd < 0)
+        return;
+
+    if (line->state == LINE_HANGUP_GUARD || line->state == LINE_HANGUP ||
+        line->state == LINE_DTR_DROP)
+        return;
+
+    if (line->state == LINE_CONNECTED && line->loop->on_hangup)
+        line->loop->on_hangup(line);
+
+    tcflush(line->fd, TCIOFLUSH);
+    outq_discard(line->fd);
+    line->tx_resume_ms = 0;
+    line_tx_cancel(line);
+    ansi_opt_free(line->ansi);
+    line->ansi = NULL;
+    line->ansi_left = 0;
+    line_unwatch_carrier(line);
+    serial_tx_release(line->fd);
+    serial_ring_reset(line->fd);
+    line_update_events(line);
+
+    /* Re-enable CLOCAL so the hangup itself does not raise I/O errors */
+    if (tcgetattr(line->fd, &tios) == 0) {
+        tios.c_cflag |= CLOCAL;
+        tcsetattr(line->fd, TCSANOW, &tios);
+    }
+
+    line_set_state(line, LINE_HANGUP_GUARD, LOOP_HANGUP_GUARD_MS);
+}
+
+/*
+ * Drop DTR by setting the line speed to B0 (see dtr_drop_hangup)
+ */
+static void line_start_dtr_drop(modem_line_t *line)
+{
+    struct termios tios;
+
+    if (tcgetattr(line->fd, &line->saved_tios) == 0) {
+        tios = line->saved_tios;
+        cfsetispeed(&tios, B0);
+        cfsetospeed(&tios, B0);
+        tcsetattr(line->fd, TCSANOW, &tios);
+    }
+
+    line_set_state(line, LINE_DTR_DROP, LOOP_DTR_DROP_MS);
+}
+
+static void line_connected(modem_line_t *line, const char *text, int len)
+{
+    int charset;
+
+    parse_connect_info(text, len, &line->connect);
+    line->connected_speed = line->connect.dce_speed;
+    metrics_connect(line->fd, line->connected_speed);
+    line->recovery_attempts = 0;
+    line->ring_count = 0;
+    line_set_state(line, LINE_CONNECTED, 0);
+
+    print_message("[%s] Modem connected: %s (line %d bps, protocol %s, compression %s)",
+                  line->device, text, line->connected_speed,
+                  connect_protocol_name(line->connect.protocol),
+                  connect_compression_name(line->connect.compression));
+
+    if (line->cfg->enable_carrier_detect)
+        enable_carrier_detect(line->fd);
+    line_watch_carrier(line);
+
+    if (line->cfg->tx_pacing)
+        serial_tx_pace(line->fd, line->connect.dce_speed,
+                       connect_dte_rate(&line->connect, line->cfg->baudrate),
+                       line->cfg->tx_queue_ms);
+
+    charset = charset_lookup(line->cfg->terminal_charset);
+    if (charset < 0) {
+        print_error("[%s] Unknown terminal_charset %s, sending UTF-8", line->device,
+                    line->cfg->terminal_charset);
+        charset = CHARSET_UTF8;
+    }
+    charset_init(&line->charset, charset);
+
+    /* The optimizer takes a byte for a screen cell, which EUC-KR's are not */
+    if (line->cfg->ansi_optimize && charset != CHARSET_EUCKR) {
+        line->ansi = ansi_opt_new(line->cfg->ansi_rows, line->cfg->ansi_rep);
+        if (!line->ansi)
+            print_error("[%s] ANSI optimizer unavailable, sending output as it is",
+                        line->device);
+    }
+
+    /* First bytes after CONNECT come straight from the screen cache */
+    if (line->cfg->connect_screen[0])
+        modem_line_send_screen(line, line->cfg->connect_screen);
+
+    if (line->loop->on_connect)
+        line->loop->on_connect(line, line->connected_speed);
+}
+
+/*
+ * Feed one received line into the state machine
+ */
+static void line_handle_response(modem_line_t *line, const char *text, int len)
+{
+    modem_result_t result = parse_result_code(text, len, NULL);
+
+    if (line->cfg->verbose_mode)
+        log_message(line->fd, LOG_LEVEL_INFO, "[%s] Received: %s", line->device, text);
+
+    if (line->cmd_start_us && result != RESULT_NONE && result != RESULT_RING) {
+        metrics_at_command(line->fd, line->last_cmd, monotonic_us() - line->cmd_start_us);
+        line->cmd_start_us = 0;
+    }
+
+    switch (line->state) {
+        case LINE_INIT:
+        case LINE_AUTOANSWER:
+            if (result == RESULT_OK) {
+                modem_state_record(line->fd, line->last_cmd);
+                if (line_next_command(line))
+                    break;
+                if (line->state == LINE_INIT) {
+                    modem_state_t *state = modem_state_get(line->fd);
+
+                    if (state)
+                        state->initialized = 1;
+                    line_start_autoanswer(line);
+                } else {
+                    line->ring_count = 0;
+                    line_set_state(line, LINE_IDLE, 0);
+                }
+            } else if (result == RESULT_ERROR || result_is_failure(result)) {
+                line_command_failed(line, "Modem returned an error");
+            }
+            break;
+
+        case LINE_IDLE:
+            if (result == RESULT_RING) {
+                line->ring_count++;
+                metrics_ring(line->fd);
+                line->deadline_ms = monotonic_ms() + line->cfg->ring_idle_timeout * 1000;
+                print_message("[%s] RING %d", line->device, line->ring_count);
+
+                if (line->cfg->autoanswer_mode == 0 && line->ring_count >= 2) {
+                    line_set_state(line, LINE_ANSWERING, 0);
+                    line_send_command(line, "ATA", line->cfg->at_answer_timeout * 1000);
+                    metrics_answer(line->fd);
+                }
+            } else if (result == RESULT_CONNECT) {
+                /* HARDWARE mode: the modem answered on its own (S0=2) */
+                line_connected(line, text, len);
+            }
+            break;
+
+        case LINE_ANSWERING:
+            if (result == RESULT_CONNECT) {
+                line_connected(line, text, len);
+            } else if (result_is_failure(result) || result == RESULT_ERROR) {
+                print_error("[%s] Connection failed: %s", line->device, text);
+                modem_line_hangup(line);
+            }
+            break;
+
+        case LINE_HANGUP:
+            if (result == RESULT_OK || result == RESULT_ERROR)
+                line_start_dtr_drop(line);
+            break;
+
+        case LINE_VERIFY:
+            if (result == RESULT_OK) {
+                line_finish_verify(line);
+            } else if (result == RESULT_ERROR) {
+                modem_state_invalidate(line->fd);
+                line_start_init(line);
+            } else {
+                /* Echo or register value: keep for modem_state_diff */
+                if (line->resp_len + len + 2 <= (int)sizeof(line->resp_buf)) {
+                    memcpy(line->resp_buf + line->resp_len, text, len);
+                    line->resp_len += len;
+                    line->resp_buf[line->resp_len++] = '\n';
+                    line->resp_buf[line->resp_len] = '\0';
+                }
+            }
+            break;
+
+        default:
+            break;
+    }
+}
+
+/*
+ * Hand session input to on_data, converted from the caller's charset
+ */
+static void line_deliver(modem_line_t *line, const char *data, int len)
+{
+    char buf[BUFFER_SIZE];
+    int n, used;
+
+    if (line->charset.id == CHARSET_UTF8) {
+        line->loop->on_data(line, data, len);
+        return;
+    }
+
+    while (len > 0 && line->state == LINE_CONNECTED) {
+        n = charset_decode(&line->charset, data, len, buf, sizeof(buf), &used);
+        if (n > 0)
+            line->loop->on_data(line, buf, n);
+        data += used;
+        len -= used;
+    }
+}
+
+/*
+ * Read available input into the line's receive ring; dispatch complete
+ * response lines, or raw data while a call is in progress
+ */
+static void line_handle_input(modem_line_t *line)
+{
+    serial_line_t text;
+    const char *data;
+    int rc, len;
+
+    for (;;) {
+        /* Not serial_ring_fill(): signals and carrier events are loop events */
+        rc = serial_ring_fill_ready(line->rx);
+        if (rc < 0) {
+            /* EOF/EIO on a tty: carrier lost with CLOCAL cleared */
+            line_carrier_lost(line, "end of input");
+            return;
+        }
+
+        while (line->state != LINE_CONNECTED && serial_ring_next_line(line->rx, &text))
+            line_handle_response(line, text.data, text.len);
+
+        /* Data following CONNECT belongs to the session */
+        if (line->state == LINE_CONNECTED) {
+            len = serial_ring_take(line->rx, &data);
+            if (len > 0 && line->loop->on_data)
+                line_deliver(line, data, len);
+        }
+
+        if (rc <= 0)
+            return;
+    }
+}
+
+/*
+ * Handle an expired per-line deadline
+ */
+static void line_handle_timeout(modem_line_t *line)
+{
+    switch (line->state) {
+        case LINE_INIT:
+        case LINE_AUTOANSWER:
+            line_command_failed(line, "Timeout waiting for modem response");
+            break;
+
+        case LINE_IDLE:
+            /* RING_IDLE_TIMEOUT elapsed between RINGs: start counting again */
+            line->ring_count = 0;
+            line->deadline_ms = 0;
+            break;
+
+        case LINE_ANSWERING:
+            print_error("[%s] Timeout waiting for CONNECT", line->device);
+            modem_line_hangup(line);
+            break;
+
+        case LINE_HANGUP_GUARD:
+            line_set_state(line, LINE_HANGUP, 0);
+            line_send_command(line, line->cfg->modem_hangup_command, LOOP_HANGUP_TIMEOUT_MS);
+            break;
+
+        case LINE_HANGUP:
+            print_message("[%s] ATH timeout (connection may already be dropped)", line->device);
+            line_start_dtr_drop(line);
+            break;
+
+        case LINE_DTR_DROP:
+            tcsetattr(line->fd, TCSANOW, &line->saved_tios);
+            tcflush(line->fd, TCIOFLUSH);
+            serial_ring_reset(line->fd);
+            print_message("[%s] Modem hangup completed", line->device);
+            line_start_reinit(line);
+            break;
+
+        case LINE_VERIFY:
+            modem_state_invalidate(line->fd);
+            line_start_init(line);
+            break;
+
+        case LINE_RETRY:
+            tcflush(line->fd, TCIOFLUSH);
+            serial_ring_reset(line->fd);
+            line_start_init(line);
+            break;
+
+        default:
+            line->deadline_ms = 0;
+            break;
+    }
+}
+
+/*
+ * Initialize an empty event loop for up to max_lines lines
+ */
+int modem_loop_init(modem_loop_t *loop, int max_lines)
+{
+    struct epoll_event ev;
+    int fd;
+
+    if (!loop || max_lines <= 0)
+        return ERROR_GENERAL;
+
+    memset(loop, 0, sizeof(*loop));
+
+    loop->config_fd = -1;
+    loop->screen_fd = -1;
+    loop->signal_fd = -1;
+
+    loop->lines = calloc(max_lines, sizeof(modem_line_t));
+    if (!loop->lines)
+        return ERROR_GENERAL;
+
+    loop->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (loop->epoll_fd < 0) {
+        print_error("epoll_create1 failed: %s", strerror(errno));
+        free(loop->lines);
+        loop->lines = NULL;
+        return ERROR_GENERAL;
+    }
+
+    loop->max_lines = max_lines;
+
+    /* Signals as loop events, once main() has routed them (signal_event_init) */
+    fd = signal_event_fd();
+    if (fd >= 0) {
+        ev.events = EPOLLIN;
+        ev.data.ptr = &loop->signal_fd;
+        if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, fd, &ev) == 0)
+            loop->signal_fd = fd;
+        else
+            print_error("epoll_ctl failed for signalfd: %s", strerror(errno));
+    }
+
+    if (config.async_log)
+        async_log_start(config.async_log_records, STDOUT_FILENO, STDERR_FILENO);
+
+    if (config.capture_file[0] && !capture_active())
+        capture_open(config.capture_file);
+
+    if (config.metrics_socket[0] || config.metrics_file[0])
+        metrics_start(config.metrics_socket, config.metrics_file, config.metrics_interval_ms);
+
+    return SUCCESS;
+}
+
+/*
+ * Signals: stop on SIGINT/SIGTERM, reload on SIGHUP (see signal_event.c)
+ * A tty SIGHUP does not say which line lost carrier, so every online
+ * line is checked.
+ */
+static void loop_handle_signals(modem_loop_t *loop)
+{
+    int i;
+
+    if (signal_event_handle() == ERROR_HANGUP) {
+        for (i = 0; i < loop->line_count; i++) {
+            modem_line_t *line = &loop->lines[i];
+
+            if (check_carrier_status(line->fd) == 0)
+                line_carrier_lost(line, "tty hangup");
+        }
+        signal_event_clear_hangup();
+    }
+
+    if (interrupted)
+        loop->running = 0;
+}
+
+/*
+ * Open a port described by cfg and start its init sequence
+ * cfg must stay valid until the line switches to a reloaded
+ * configuration (see loop_adopt_config), or for its lifetime.
+ */
+modem_line_t *modem_loop_add_line(modem_loop_t *loop, const modem_config_t *cfg)
+{
+    modem_line_t *line;
+    struct epoll_event ev;
+    int fd;
+
+    if (!loop || !cfg || loop->line_count >= loop->max_lines)
+        return NULL;
+
+    fd = open_serial_port(cfg->serial_port, cfg->baudrate);
+    if (fd < 0) {
+        print_error("Failed to open %s", cfg->serial_port);
+        return NULL;
+    }
+
+    serial_set_nonblocking(fd);
+
+    /* The loop writes the line's output queue itself (line_flush_tx) */
+    if (outq_attach(fd, cfg->tx_coalesce_bytes, cfg->tx_coalesce_ms) != SUCCESS) {
+        close_serial_port(fd);
+        return NULL;
+    }
+
+    line = &loop->lines[loop->line_count];
+    memset(line, 0, sizeof(*line));
+    line->index = loop->line_count;
+    line->fd = fd;
+    line->cfg = cfg;
+    line->config_gen = config_generation();
+    line->loop = loop;
+    line->rx = serial_ring_get(fd);
+    line->tx_file.file_fd = -1;
+    line->carrier_fd = -1;
+    modem_state_invalidate(fd);  /* Nothing known about a freshly opened modem */
+    line->state = LINE_CLOSED;
+    snprintf(line->device, sizeof(line->device), "%s", cfg->serial_port);
+    capture_port(fd, line->device);
+    metrics_port_name(fd, line->device);
+
+    ev.events = EPOLLIN | EPOLLRDHUP;
+    ev.data.ptr = line;
+    line->events = ev.events;
+    if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, fd, &ev) != 0) {
+        print_error("epoll_ctl failed for %s: %s", line->device, strerror(errno));
+        close_serial_port(fd);
+        return NULL;
+    }
+
+    loop->line_count++;
+
+    tcflush(fd, TCIOFLUSH);
+    line_start_init(line);
+
+    return line;
+}
+
+/*
+ * Reload the configuration on SIGHUP or when the file changes
+ * Returns SUCCESS even without inotify; SIGHUP still works then.
+ */
+int modem_loop_watch_config(modem_loop_t *loop)
+{
+    struct epoll_event ev;
+    int fd;
+
+    if (!loop || loop->epoll_fd < 0)
+        return ERROR_GENERAL;
+
+    fd = config_watch_start();
+    if (fd < 0 || loop->config_fd >= 0)
+        return SUCCESS;
+
+    ev.events = EPOLLIN;
+    ev.data.ptr = &loop->config_fd;
+    if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, fd, &ev) != 0) {
+        print_error("epoll_ctl failed for config watch: %s", strerror(errno));
+        return SUCCESS;
+    }
+
+    loop->config_fd = fd;
+    return SUCCESS;
+}
+
+/*
+ * Load the screen cache and refresh it from the loop as files change
+ */
+int modem_loop_load_screens(modem_loop_t *loop, const char *dir)
+{
+    struct epoll_event ev;
+    int rc, fd;
+
+    if (!loop || loop->epoll_fd < 0)
+        return ERROR_GENERAL;
+
+    rc = screen_cache_load(dir);
+    if (rc < 0)
+        return rc;
+
+    fd = screen_cache_watch_fd();
+    if (fd < 0 || loop->screen_fd >= 0)
+        return rc;
+
+    ev.events = EPOLLIN;
+    ev.data.ptr = &loop->screen_fd;
+    if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, fd, &ev) != 0) {
+        print_error("epoll_ctl failed for screen watch: %s", strerror(errno));
+        return rc;
+    }
+
+    loop->screen_fd = fd;
+    return rc;
+}
+
+/*
+ * Switch a line to the current configuration snapshot
+ */
+static void line_adopt_config(modem_line_t *line)
+{
+    config_snapshot_t *snap = config_acquire();
+    const modem_config_t *old = line->cfg;
+    int reinit;
+
+    if (!snap)
+        return;
+
+    /* Commands the modem was set up with changed: run the init again */
+    reinit = strcmp(old->modem_init_command, snap->cfg.modem_init_command) != 0 ||
+             strcmp(old->modem_autoanswer_software_command,
+                    snap->cfg.modem_autoanswer_software_command) != 0 ||
+             strcmp(old->modem_autoanswer_hardware_command,
+                    snap->cfg.modem_autoanswer_hardware_command) != 0 ||
+             old->autoanswer_mode != snap->cfg.autoanswer_mode ||
+             old->numeric_results != snap->cfg.numeric_results;
+
+    line->cfg = &snap->cfg;
+    line->config_gen = snap->generation;
+    config_release(line->snap);
+    line->snap = snap;
+    outq_attach(line->fd, line->cfg->tx_coalesce_bytes, line->cfg->tx_coalesce_ms);
+
+    print_message("[%s] Using configuration generation %lu", line->device, line->config_gen);
+
+    if (line->state == LINE_FAILED) {
+        line->recovery_attempts = 0;
+        line_start_init(line);
+    } else if (reinit && line->state == LINE_IDLE) {
+        line_start_init(line);
+    }
+}
+
+/*
+ * Move lines that are not in a call to a newer configuration
+ * Lines in a call keep their snapshot until they are idle again.
+ */
+static void loop_adopt_config(modem_loop_t *loop)
+{
+    unsigned long generation = config_generation();
+    int i;
+
+    for (i = 0; i < loop->line_count; i++) {
+        modem_line_t *line = &loop->lines[i];
+
+        if (line->fd < 0 || line->config_gen >= generation)
+            continue;
+
+        if (line->state == LINE_IDLE || line->state == LINE_RETRY ||
+            line->state == LINE_FAILED)
+            line_adopt_config(line);
+    }
+}
+
+/*
+ * Milliseconds until the nearest line deadline (-1 = none)
+ */
+static int loop_next_timeout(modem_loop_t *loop, long long now)
+{
+    long long nearest = -1;
+    int i;
+
+    for (i = 0; i < loop->line_count; i++) {
+        long long deadline = loop->lines[i].deadline_ms;
+
+        /* Paced output resuming sooner counts as a deadline too */
+        if (loop->lines[i].tx_resume_ms != 0 &&
+            (deadline == 0 || loop->lines[i].tx_resume_ms < deadline))
+            deadline = loop->lines[i].tx_resume_ms;
+
+        if (deadline == 0)
+            continue;
+        if (deadline <= now)
+            return 0;
+        if (nearest < 0 || deadline - now < nearest)
+            nearest = deadline - now;
+    }
+
+    /* Wake up at least once a second to notice 'interrupted' */
+    if (nearest < 0 || nearest > 1000)
+        nearest = 1000;
+
+    return (int)nearest;
+}
+
+/*
+ * Run the event loop until modem_loop_stop() or a signal
+ */
+int modem_loop_run(modem_loop_t *loop)
+{
+    struct epoll_event events[LOOP_MAX_EVENTS];
+    long long now;
+    int i, n;
+
+    if (!loop || loop->epoll_fd < 0)
+        return ERROR_GENERAL;
+
+    loop->running = 1;
+    print_message("Event loop serving %d line(s)", loop->line_count);
+
+    while (loop->running && !interrupted) {
+        n = epoll_wait(loop->epoll_fd, events, LOOP_MAX_EVENTS,
+                       loop_next_timeout(loop, monotonic_ms()));
+        if (n < 0) {
+            if (errno == EINTR) {
+                /* SIGHUP: reload now rather than after the next event */
+                config_check_reload();
+                loop_adopt_config(loop);
+                continue;
+            }
+            print_error("epoll_wait failed: %s", strerror(errno));
+            return ERROR_GENERAL;
+        }
+
+        for (i = 0; i < n; i++) {
+            modem_line_t *line = events[i].data.ptr;
+            modem_line_t *carrier_line;
+
+            if (events[i].data.ptr == &loop->config_fd) {
+                config_watch_handle();
+                continue;
+            }
+
+            if (events[i].data.ptr == &loop->screen_fd) {
+                screen_cache_watch_handle();
+                continue;
+            }
+
+            if (events[i].data.ptr == &loop->signal_fd) {
+                loop_handle_signals(loop);
+                continue;
+            }
+
+            carrier_line = loop_carrier_line(loop, events[i].data.ptr);
+            if (carrier_line) {
+                line_handle_carrier(carrier_line);
+                continue;
+            }
+
+            if (events[i].events & EPOLLOUT)
+                line_tx_resume(line);
+
+            if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLRDHUP | EPOLLERR))
+                line_handle_input(line);
+        }
+
+        now = monotonic_ms();
+        for (i = 0; i < loop->line_count; i++) {
+            modem_line_t *line = &loop->lines[i];
+
+            if (line->tx_resume_ms != 0 && line->tx_resume_ms <= now) {
+                line->tx_resume_ms = 0;
+                line_tx_resume(line);
+            }
+
+            if (line->deadline_ms != 0 && line->deadline_ms <= now)
+                line_handle_timeout(line);
+        }
+
+        config_check_reload();
+        loop_adopt_config(loop);
+    }
+
+    return SUCCESS;
+}
+
+/*
+ * Ask modem_loop_run() to return after the current iteration
+ */
+void modem_loop_stop(modem_loop_t *loop)
+{
+    if (loop)
+        loop->running = 0;
+}
+
+/*
+ * Close all lines and release loop resources
+ */
+void modem_loop_cleanup(modem_loop_t *loop)
+{
+    int i;
+
+    if (!loop)
+        return;
+
+    for (i = 0; i < loop->line_count; i++) {
+        if (loop->lines[i].fd >= 0) {
+            serial_ring_release(loop->lines[i].fd);
+            modem_state_invalidate(loop->lines[i].fd);
+            line_tx_cancel(&loop->lines[i]);
+            ansi_opt_free(loop->lines[i].ansi);
+            loop->lines[i].ansi = NULL;
+            line_unwatch_carrier(&loop->lines[i]);
+            close_serial_port(loop->lines[i].fd);
+            loop->lines[i].fd = -1;
+        }
+        config_release(loop->lines[i].snap);
+        loop->lines[i].snap = NULL;
+    }
+
+    if (loop->config_fd >= 0) {
+        config_watch_stop();
+        loop->config_fd = -1;
+    }
+
+    if (loop->screen_fd >= 0) {
+        screen_cache_unload();
+        loop->screen_fd = -1;
+    }
+
+    if (loop->epoll_fd >= 0)
+        close(loop->epoll_fd);
+
+    free(loop->lines);
+    loop->lines = NULL;
+    loop->line_count = 0;
+    loop->epoll_fd = -1;
+}
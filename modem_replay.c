@@ -0,0 +1,405 @@
+/*****************************************************************************
+ * Capture Replay
+ * Feeds a traffic capture (capture.c) back through the receive ring, the
+ * result code parser and the modem state cache, offline
+ *
+ * Received bytes are written into a pipe per captured port and read back
+ * with serial_ring_fill(), in the chunks the port returned them, so line
+ * splitting sees the same boundaries as the live session.  Response lines
+ * go through parse_result_code() and, in command mode, acknowledged AT
+ * commands update modem_state; after CONNECT the data goes to the session
+ * until DCD drops or the hangup sequence is sent.  By default records are replayed at full speed and the
+ * parse time is reported; -r replays with the recorded timing.
+ *
+ * Usage: modem_replay [-r] [-x speed] [-p port] [-v] capture_file
+ *****************************************************************************/
+
+#include "modem_sample.h"
+#include <stdarg.h>
+
+/* Globals normally provided by the main program */
+int serial_fd = -1;
+volatile sig_atomic_t interrupted = 0;
+
+#define REPLAY_MAX_PORTS    64
+#define REPLAY_SHOW_BYTES   48      /* Bytes of a record shown with -v */
+
+typedef struct {
+    int port;                   /* Descriptor of the port when captured */
+    int session;
+    char device[64];
+    int pipe_fd[2];
+    serial_ring_t *ring;
+    int connected;
+    char tx_line[AT_MAX_LINE + 64];
+    int tx_len;
+    char last_cmd[AT_MAX_LINE + 64];
+    long long rx_bytes, tx_bytes, data_bytes;
+    long lines;
+    long results[RESULT_COUNT];
+    long connects, hangups, line_changes;
+    long long parse_ns;
+} replay_port_t;
+
+static replay_port_t ports[REPLAY_MAX_PORTS];
+static int port_count = 0;
+static int replay_verbose = 0;
+
+void print_message(const char *format, ...)
+{
+    va_list args;
+
+    if (!replay_verbose)
+        return;
+
+    va_start(args, format);
+    vprintf(format, args);
+    va_end(args);
+    printf("\n");
+}
+
+void print_error(const char *format, ...)
+{
+    va_list args;
+
+    va_start(args, format);
+    fprintf(stderr, "ERROR: ");
+    vfprintf(stderr, format, args);
+    va_end(args);
+    fprintf(stderr, "\n");
+}
+
+static long long replay_now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/*
+ * Port of the current run, set up on first use
+ */
+static replay_port_t *replay_port(int port, int session)
+{
+    replay_port_t *p;
+    int i;
+
+    for (i = 0; i < port_count; i++) {
+        if (ports[i].port == port && ports[i].session == session)
+            return &ports[i];
+    }
+
+    if (port_count >= REPLAY_MAX_PORTS)
+        return NULL;
+
+    p = &ports[port_count];
+    memset(p, 0, sizeof(*p));
+    if (pipe(p->pipe_fd) != 0) {
+        print_error("pipe failed: %s", strerror(errno));
+        return NULL;
+    }
+    fcntl(p->pipe_fd[0], F_SETFL, O_NONBLOCK);
+    fcntl(p->pipe_fd[1], F_SETFL, O_NONBLOCK);
+
+    p->ring = serial_ring_get(p->pipe_fd[0]);
+    if (!p->ring) {
+        close(p->pipe_fd[0]);
+        close(p->pipe_fd[1]);
+        return NULL;
+    }
+    modem_state_invalidate(p->pipe_fd[0]);
+
+    p->port = port;
+    p->session = session;
+    snprintf(p->device, sizeof(p->device), "fd %d", port);
+    port_count++;
+
+    return p;
+}
+
+/*
+ * Feed one received response line to the parser and the state cache
+ */
+static void replay_response(replay_port_t *p, const char *text, int len, long long t_ns)
+{
+    modem_result_t result = parse_result_code(text, len, NULL);
+    connect_info_t info;
+
+    p->lines++;
+    p->results[result]++;
+
+    if (result == RESULT_OK && p->last_cmd[0]) {
+        modem_state_record(p->pipe_fd[0], p->last_cmd);
+        p->last_cmd[0] = '\0';
+    } else if (result == RESULT_CONNECT) {
+        parse_connect_info(text, len, &info);
+        p->connected = 1;
+        p->connects++;
+        if (replay_verbose)
+            printf("%12.3f %-12s CONNECT %d bps, protocol %s, compression %s\n",
+                   t_ns / 1e6, p->device, info.dce_speed,
+                   connect_protocol_name(info.protocol),
+                   connect_compression_name(info.compression));
+    }
+}
+
+/*
+ * Received bytes: through the pipe into the receive ring, as the port
+ * would deliver them
+ */
+static void replay_rx(replay_port_t *p, const unsigned char *data, int len, long long t_ns)
+{
+    serial_line_t line;
+    const char *view;
+    long long start;
+    ssize_t n;
+    int rc;
+
+    p->rx_bytes += len;
+
+    while (len > 0) {
+        n = write(p->pipe_fd[1], data, len);
+        if (n <= 0)
+            n = 0;
+        data += n;
+        len -= n;
+
+        start = replay_now_ns();
+        do {
+            rc = serial_ring_fill(p->ring, 0);
+
+            while (!p->connected && serial_ring_next_line(p->ring, &line))
+                replay_response(p, line.data, line.len, t_ns);
+
+            if (p->connected)
+                p->data_bytes += serial_ring_take(p->ring, &view);
+        } while (rc > 0);
+        p->parse_ns += replay_now_ns() - start;
+    }
+}
+
+/*
+ * End of a call: back to command mode
+ */
+static void replay_hangup(replay_port_t *p, const char *why, long long t_ns)
+{
+    p->connected = 0;
+    p->hangups++;
+    p->tx_len = 0;
+    serial_ring_reset(p->pipe_fd[0]);
+    if (replay_verbose)
+        printf("%12.3f %-12s hangup: %s\n", t_ns / 1e6, p->device, why);
+}
+
+/*
+ * Written bytes: in command mode, remember the AT command awaiting OK
+ * During a call, an escape or ATH from modem_hangup() ends it.
+ */
+static void replay_tx(replay_port_t *p, const unsigned char *data, int len, long long t_ns)
+{
+    int i;
+
+    p->tx_bytes += len;
+    if (p->connected) {
+        if ((len >= 3 && memcmp(data, "+++", 3) == 0) ||
+            (len >= 3 && strncasecmp((const char *)data, "ATH", 3) == 0))
+            replay_hangup(p, "modem_hangup() sequence", t_ns);
+        else
+            return;
+    }
+
+    for (i = 0; i < len; i++) {
+        if (data[i] == '\r') {
+            p->tx_line[p->tx_len] = '\0';
+            if (p->tx_len >= 2 && strncasecmp(p->tx_line, "AT", 2) == 0)
+                memcpy(p->last_cmd, p->tx_line, p->tx_len + 1);
+            p->tx_len = 0;
+        } else if (p->tx_len < (int)sizeof(p->tx_line) - 1) {
+            p->tx_line[p->tx_len++] = data[i];
+        }
+    }
+}
+
+static void replay_lines(replay_port_t *p, int lines, int changed, long long t_ns)
+{
+    p->line_changes++;
+
+    if ((changed & TIOCM_CD) && !(lines & TIOCM_CD) && p->connected)
+        replay_hangup(p, "DCD dropped", t_ns);
+}
+
+/*
+ * One line of the -v timeline
+ */
+static void replay_show(const replay_port_t *p, const capture_record_t *rec, long long t_ns)
+{
+    static const char *names[] = { "", "SESSION", "RX", "TX", "LINES", "PORT" };
+    int i, shown = rec->len < REPLAY_SHOW_BYTES ? rec->len : REPLAY_SHOW_BYTES;
+
+    printf("%12.3f %-12s %-5s", t_ns / 1e6, p ? p->device : "", names[rec->type]);
+
+    if (rec->type == CAPTURE_LINES) {
+        printf(" DCD=%d DSR=%d CTS=%d RI=%d (changed 0x%x)\n",
+               !!(rec->lines & TIOCM_CD), !!(rec->lines & TIOCM_DSR),
+               !!(rec->lines & TIOCM_CTS), !!(rec->lines & TIOCM_RI), rec->changed);
+        return;
+    }
+
+    printf(" %5d \"", rec->len);
+    for (i = 0; i < shown; i++) {
+        unsigned char c = rec->data[i];
+
+        if (c == '\r')
+            printf("\\r");
+        else if (c == '\n')
+            printf("\\n");
+        else if (c >= 0x20 && c < 0x7F && c != '"' && c != '\\')
+            putchar(c);
+        else
+            printf("\\x%02x", c);
+    }
+    printf("\"%s\n", shown < rec->len ? "..." : "");
+}
+
+/*
+ * Sleep until a record is due in real-time replay
+ */
+static void replay_wait(long long due_ns)
+{
+    struct timespec ts;
+    long long wait_ns = due_ns - replay_now_ns();
+
+    if (wait_ns <= 0)
+        return;
+
+    ts.tv_sec = wait_ns / 1000000000LL;
+    ts.tv_nsec = wait_ns % 1000000000LL;
+    while (nanosleep(&ts, &ts) != 0 && errno == EINTR && !interrupted)
+        ;
+}
+
+static void replay_report(long long elapsed_ns, long long captured_ns)
+{
+    long long rx = 0, parse_ns = 0;
+    int i, r;
+
+    printf("\n%-12s %10s %10s %10s %7s %8s %8s %7s\n", "port", "rx bytes", "tx bytes",
+           "data", "lines", "connects", "hangups", "status");
+    for (i = 0; i < port_count; i++) {
+        replay_port_t *p = &ports[i];
+
+        printf("%-12s %10lld %10lld %10lld %7ld %8ld %8ld %7ld\n", p->device, p->rx_bytes,
+               p->tx_bytes, p->data_bytes, p->lines, p->connects, p->hangups, p->line_changes);
+        for (r = RESULT_OK; r < RESULT_COUNT; r++) {
+            if (p->results[r] > 0)
+                printf("    %-12s %ld\n", modem_result_name(r), p->results[r]);
+        }
+        rx += p->rx_bytes;
+        parse_ns += p->parse_ns;
+    }
+
+    printf("\nCaptured span %.3f s, replayed in %.3f s\n", captured_ns / 1e9, elapsed_ns / 1e9);
+    if (rx > 0)
+        printf("Receive path: %lld bytes in %.3f ms, %.1f ns/byte\n",
+               rx, parse_ns / 1e6, (double)parse_ns / rx);
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr, "Usage: %s [-r] [-x speed] [-p port] [-v] capture_file\n"
+            "  -r        replay with the recorded timing (default: full speed)\n"
+            "  -x speed  time scale for -r (2 = twice as fast)\n"
+            "  -p port   only this captured port (descriptor number)\n"
+            "  -v        print every record\n", prog);
+}
+
+int main(int argc, char *argv[])
+{
+    capture_reader_t reader;
+    capture_record_t rec;
+    replay_port_t *p;
+    double speed = 1.0;
+    int realtime = 0, only_port = -1, opt, rc;
+    long long base_ns = 0, offset_ns = 0, last_ns = 0, start_ns, t_ns;
+
+    while ((opt = getopt(argc, argv, "rx:p:v")) != -1) {
+        switch (opt) {
+            case 'r': realtime = 1; break;
+            case 'x': speed = atof(optarg); break;
+            case 'p': only_port = atoi(optarg); break;
+            case 'v': replay_verbose = 1; break;
+            default:
+                usage(argv[0]);
+                return 1;
+        }
+    }
+
+    if (optind != argc - 1 || speed <= 0) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    init_default_config();
+    result_init();
+
+    if (capture_reader_open(&reader, argv[optind]) != SUCCESS)
+        return 1;
+
+    start_ns = replay_now_ns();
+
+    while (!interrupted && (rc = capture_reader_next(&reader, &rec)) == 1) {
+        if (rec.type == CAPTURE_SESSION) {
+            /* New run: its clock and descriptors start over */
+            base_ns = rec.time_ns;
+            offset_ns = last_ns;
+            if (replay_verbose) {
+                time_t sec = reader.realtime_ns / 1000000000LL;
+                printf("%12.3f session %d started %s", last_ns / 1e6, reader.sessions, ctime(&sec));
+            }
+            continue;
+        }
+        t_ns = offset_ns + rec.time_ns - base_ns;
+        last_ns = t_ns;
+
+        if (only_port >= 0 && rec.port != only_port)
+            continue;
+
+        if (realtime)
+            replay_wait(start_ns + (long long)(t_ns / speed));
+
+        p = replay_port(rec.port, reader.sessions);
+        if (!p) {
+            print_error("Too many ports in capture");
+            break;
+        }
+
+        if (replay_verbose)
+            replay_show(p, &rec, t_ns);
+
+        switch (rec.type) {
+            case CAPTURE_PORT:
+                snprintf(p->device, sizeof(p->device), "%s", (const char *)rec.data);
+                break;
+            case CAPTURE_RX:
+                replay_rx(p, rec.data, rec.len, t_ns);
+                break;
+            case CAPTURE_TX:
+                replay_tx(p, rec.data, rec.len, t_ns);
+                break;
+            case CAPTURE_LINES:
+                replay_lines(p, rec.lines, rec.changed, t_ns);
+                break;
+        }
+    }
+
+    if (rc < 0)
+        print_error("Malformed record after %ld records", reader.records);
+    if (reader.truncated)
+        printf("Last record cut off (capture not closed cleanly)\n");
+
+    replay_report(replay_now_ns() - start_ns, last_ns);
+
+    capture_reader_close(&reader);
+    return rc < 0 ? 1 : 0;
+}
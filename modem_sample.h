@@ -18,6 +18,7 @@
 #include <sys/ioctl.h>
 #include <signal.h>
 #include <time.h>
+#include <pthread.h>
 
 /* Configuration Constants */
 #define SERIAL_PORT     "/dev/ttyUSB0"
@@ -86,6 +87,9 @@ typedef struct {
     /* Autoanswer Mode Configuration */
     int autoanswer_mode;  /* 0=SOFTWARE, 1=HARDWARE */
 
+    /* Result Code Mode */
+    int numeric_results;  /* 0=verbose (V1), 1=numeric (V0) */
+
     /* Timeout Configuration (seconds) */
     int at_command_timeout;
     int at_answer_timeout;
@@ -102,20 +106,441 @@ typedef struct {
     int retry_delay_us;
     int tx_chunk_size;
     int tx_chunk_delay_us;
+    int tx_pacing;              /* 0=fixed chunk/delay, 1=adaptive (line rate + TIOCOUTQ) */
+    int tx_queue_ms;            /* Adaptive: output queue high-water mark, in line time */
+    int tx_coalesce_bytes;      /* Output queue: flush once this much is queued */
+    int tx_coalesce_ms;         /* Output queue: flush deadline, 0 = write through */
+    int tx_write_timeout_ms;    /* Give up when the port takes nothing this long */
+
+    /* AT Command Pacing (milliseconds, 0 = response driven) */
+    int at_settle_delay_ms;     /* Pause after writing a command */
+    int at_command_guard_ms;    /* Pause between commands of a command string */
+
+    /* Screen Cache (sent after CONNECT) */
+    char screen_dir[256];       /* Directory of welcome/menu screens, "" = none */
+    char connect_screen[64];    /* Screen sent on CONNECT, "" = none */
+    int ansi_optimize;          /* Send only what changes on the caller's screen */
+    int ansi_rep;               /* Callers' terminals understand REP (CSI n b) */
+    int ansi_rows;              /* Callers' screen height */
+    char terminal_charset[16];  /* Callers' charset: utf-8 (as is), cp437, euc-kr */
+
+    /* File Transfer (xmodem.c, zmodem.c) */
+    int zmodem_resume;          /* Ask receivers to resume partial files (ZCRESUM) */
+    int zmodem_window;          /* Bytes sent before waiting for a ZACK, 0 = stream */
 
     /* Logging Configuration */
     int verbose_mode;
     int enable_transmission_log;
     int enable_timing_log;
+    int async_log;              /* Format and write log records on a background thread */
+    int async_log_records;      /* Log ring size; a full ring drops records */
+    char capture_file[256];     /* Binary traffic capture (capture.c), "" = off */
+    char metrics_socket[108];   /* Prometheus text on this Unix socket, "" = off */
+    char metrics_file[256];     /* Prometheus text rewritten periodically, "" = off */
+    int metrics_interval_ms;    /* metrics_file update interval */
 
     /* Advanced Options */
     int enable_carrier_detect;
     int enable_connection_validation;
     int validation_duration;
+    int carrier_settle_ms;      /* Validation passes once DCD/DSR held this long */
+    int quality_window_ms;      /* Validation: error counter sampling window */
+    int quality_sample_ms;      /* Validation: counter sampling interval */
+    int max_line_error_ppm;     /* Validation fails above this receive error rate */
     int enable_error_recovery;
     int max_recovery_attempts;
 } modem_config_t;
 
+/* Configuration Snapshot (config.c), shared read-only and refcounted */
+typedef struct {
+    modem_config_t cfg;
+    unsigned long generation;
+    int refs;
+} config_snapshot_t;
+
+/* Modem State Cache (modem_state.c) */
+#define AT_MAX_LINE         40      /* Command characters after "AT" per line */
+#define MODEM_STATE_KEYS    538     /* S0-S255, basic A-Z (256+), &A-&Z (512+) */
+
+typedef struct {
+    int fd;
+    int initialized;                /* A full init_modem() has completed */
+    char known[MODEM_STATE_KEYS];   /* Setting acknowledged since last reset */
+    int value[MODEM_STATE_KEYS];
+} modem_state_t;
+
+/* Modem Emulator (modem_emu.c) */
+#define MODEM_EMU_SREGS     64
+
+typedef struct {
+    long long ring_ns;          /* Last RING sent (CLOCK_MONOTONIC ns) */
+    long long connect_ns;       /* Last CONNECT sent */
+    long long first_data_ns;    /* First data byte received after CONNECT */
+    long long last_data_ns;     /* Last data received in this call */
+    long long data_bytes;       /* Data bytes received while online */
+    long long overflow_bytes;   /* Data lost to a full modem buffer, this call */
+    int data_reads;             /* Online data reads (DTE writes seen), this call */
+    long long line_idle_ns;     /* Line idle between data, this call */
+    int commands;               /* AT command lines executed */
+    int rings;
+    int connects;
+    int hangups;
+} modem_emu_stats_t;
+
+#define MODEM_EMU_LINE_SIZE     65536
+#define MODEM_EMU_LINE_SLICES   1024
+
+/* One direction of the line to the remote end: bytes in flight */
+typedef struct {
+    char buf[MODEM_EMU_LINE_SIZE];
+    int head, used;
+    long long due_ns[MODEM_EMU_LINE_SLICES];   /* Arrival time of each slice */
+    int slice_len[MODEM_EMU_LINE_SLICES];
+    int slice_head, slices;
+    long long busy_ns;          /* Line busy with earlier bytes until then */
+} modem_emu_line_t;
+
+typedef struct {
+    char device[256];           /* Slave PTY path to open as serial port */
+    int master_fd;
+    int slave_hold_fd;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    volatile int running;
+
+    /* Emulation parameters */
+    int connect_speed;          /* Speed reported in CONNECT */
+    int connect_delay_ms;       /* Carrier training time after ATA */
+    int response_delay_us;      /* Command processing time */
+    int escape_guard_ms;        /* Idle time before an online "AT" line is a command */
+    int ring_interval_ms;
+    int tx_buffer_size;         /* Modem buffer in front of the line, 0 = not modelled */
+    int line_latency_ms;        /* One-way delay to the remote end (V.42 buffering) */
+
+    /* Modem state */
+    int sregs[MODEM_EMU_SREGS];
+    int echo;
+    int verbose;
+    int quiet;
+    int online;
+    int dcd;                    /* Emulated DCD, not visible on the PTY */
+    int ring_pending;
+    int ring_count;
+    long long next_ring_ns;
+    long long last_input_ns;
+    double tx_level;            /* Bytes in the modem buffer, draining at connect_speed */
+    long long tx_drain_ns;
+    char cmd_buf[LINE_BUFFER_SIZE];
+    int cmd_len;
+
+    /* Remote end of the call (modem_emu_remote), -1 = data is dropped */
+    int remote_fd;
+    modem_emu_line_t to_remote;
+    modem_emu_line_t to_dte;
+
+    modem_emu_stats_t stats;
+} modem_emu_t;
+
+/* Receive Ring (serial_ring.c), MBSE TT_BUFSIZ style buffer */
+#define RX_RING_SIZE    4096
+
+typedef struct {
+    const char *data;   /* Points into the ring, '\0' terminated */
+    int len;
+} serial_line_t;
+
+typedef struct {
+    int fd;
+    int next;           /* Offset of first unconsumed byte */
+    int left;           /* Unconsumed bytes */
+    int scan;           /* Bytes after 'next' already searched for CR/LF */
+    char buf[RX_RING_SIZE + 1];
+} serial_ring_t;
+
+/* File Send (file_send.c) */
+typedef struct {
+    int file_fd;        /* -1 = no file open */
+    off_t size;
+    off_t offset;       /* First unsent byte: the resume point */
+    int no_sendfile;    /* sendfile() refused: pread() and write() instead */
+} file_send_t;
+
+/* Screen Cache (screen_cache.c) */
+#define SCREEN_SPEED_CLASSES    11
+
+typedef struct {
+    char name[64];
+    const char *data;
+    int len;
+    const int *chunk_end;                   /* Chunk end offsets of all classes */
+    int first[SCREEN_SPEED_CLASSES + 1];    /* Class c: chunk_end[first[c]..first[c+1]) */
+    int refs;
+} screen_t;
+
+/* ANSI Optimizer (ansi_opt.c) */
+#define ANSI_COLS       80
+#define ANSI_ROWS_MAX   60
+
+typedef struct {
+    unsigned char ch;
+    unsigned short attr;        /* SGR attributes (ansi_opt.c) */
+} ansi_cell_t;
+
+typedef struct {
+    int rows;
+    int use_rep;                /* Terminal understands REP (CSI n b) */
+
+    /* Screen as the output so far would leave it */
+    ansi_cell_t want[ANSI_ROWS_MAX][ANSI_COLS];
+    unsigned char dirty[ANSI_ROWS_MAX];     /* Row changed since the last output */
+    int row, col;
+    int wrap;                   /* Last column written, wrap pending */
+    unsigned short pen;
+    int saved_row, saved_col;
+    unsigned char last_ch;      /* For REP in the output */
+
+    /* Screen as the terminal shows it */
+    ansi_cell_t have[ANSI_ROWS_MAX][ANSI_COLS];
+    int have_valid;             /* 0 = unknown: clear before the next output */
+    int raw;                    /* Passing output through until the next clear */
+    int term_row, term_col;     /* -1 = cursor position unknown */
+    int term_pen;               /* -1 = attributes unknown */
+
+    char esc[32];               /* Escape sequence being collected */
+    int esc_len;
+
+    char *out;                  /* Optimized output */
+    int used;
+    int size;
+    int taken;                  /* out handed to the caller, reset on the next call */
+    int error;
+
+    long long bytes_in;
+    long long bytes_out;
+} ansi_opt_t;
+
+/* Terminal Charsets (charset.c) */
+#define CHARSET_UTF8    0   /* As it is */
+#define CHARSET_CP437   1
+#define CHARSET_EUCKR   2
+#define KSX1001_CELLS   (94 * 94)
+
+typedef struct {
+    int id;                     /* CHARSET_* */
+    int utf_need;               /* Output: continuation bytes still to come */
+    unsigned int utf_ucs;       /* Code point so far */
+    unsigned int utf_min;       /* Smallest one of its length (overlong check) */
+    int lead;                   /* Input: EUC-KR lead byte waiting, 0 = none */
+    long long replaced;         /* Characters sent or received as '?' */
+} charset_t;
+
+/* Carrier Watch (carrier_watch.c) */
+typedef struct {
+    int lines;          /* TIOCM_* status lines after the change */
+    int changed;        /* TIOCM_* bits that changed */
+    long long time_ms;  /* CLOCK_MONOTONIC time of the change */
+} carrier_event_t;
+
+#define LINE_ERROR_MIN_CHARS    1000    /* Error rate floor: see line_error_rate_ppm */
+
+typedef struct {
+    long long rx;       /* Characters received */
+    long long tx;       /* Characters sent */
+    int frame;          /* Framing errors */
+    int overrun;        /* UART FIFO overruns */
+    int parity;         /* Parity errors */
+    int brk;            /* Breaks received */
+    int buf_overrun;    /* tty buffer overruns */
+    int dcd;            /* DCD transitions */
+    int dsr;
+    int cts;
+    long long elapsed_ms;   /* Since the counters were started */
+} line_counters_t;
+
+/* Asynchronous Log (async_log.c) */
+typedef enum {
+    LOG_LEVEL_INFO = 0,     /* print_message */
+    LOG_LEVEL_ERROR,        /* print_error */
+    LOG_LEVEL_DATA          /* log_transmission hex dump */
+} log_level_t;
+
+/* Traffic Capture (capture.c) */
+typedef enum {
+    CAPTURE_SESSION = 1,    /* Start of a capture run: realtime / monotonic ns */
+    CAPTURE_RX,             /* Bytes read from the port */
+    CAPTURE_TX,             /* Bytes written to the port */
+    CAPTURE_LINES,          /* Status line change: TIOCM lines / changed */
+    CAPTURE_PORT            /* Device name of a port */
+} capture_type_t;
+
+typedef struct {
+    int type;                   /* capture_type_t */
+    int port;                   /* Descriptor of the port when captured */
+    long long time_ns;          /* CLOCK_MONOTONIC of the capturing run */
+    const unsigned char *data;  /* Payload, '\0' terminated */
+    int len;
+    int lines, changed;         /* CAPTURE_LINES */
+} capture_record_t;
+
+typedef struct {
+    FILE *fp;
+    unsigned char *buf;
+    long long buf_size;
+    long long time_ns;
+    long long realtime_ns;      /* Wall clock at the last CAPTURE_SESSION */
+    long records;
+    int sessions;
+    int truncated;              /* Last record cut off (capture ended by a crash) */
+} capture_reader_t;
+
+/* Write-Behind File Output (write_behind.c) */
+#define WRITE_BEHIND_BUFFERS        8
+#define WRITE_BEHIND_BUFFER_SIZE    131072
+
+typedef struct {
+    int fd;
+    char *buf[WRITE_BEHIND_BUFFERS];    /* Page aligned */
+    int len[WRITE_BEHIND_BUFFERS];
+    int fill;                   /* Buffer the caller fills */
+    int used;                   /* Bytes committed in it */
+    int head;                   /* Oldest buffer queued for the writer */
+    int queued;
+    int closing;
+    int error;                  /* errno of the first failed write */
+    long long total;            /* File size once everything is written */
+    long stalls;                /* Times the caller had to wait for the disk */
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+} write_behind_t;
+
+/* File transfer statistics (xmodem.c, zmodem.c) */
+typedef struct {
+    long long bytes;            /* File data delivered (padding excluded) */
+    long long resumed;          /* Bytes the receiver already had (ZMODEM ZRPOS) */
+    int blocks;                 /* Blocks ACKed, headers included */
+    int retries;                /* Blocks resent after NAK/timeout, ZMODEM repositions */
+    int files;                  /* Files delivered completely */
+} xfer_stats_t;
+
+/* Modem Result Codes (result_code.c) */
+typedef enum {
+    RESULT_NONE = 0,    /* Not a result line (echo, register value...) */
+    RESULT_OK,
+    RESULT_CONNECT,
+    RESULT_RING,
+    RESULT_NO_CARRIER,
+    RESULT_ERROR,
+    RESULT_NO_DIALTONE,
+    RESULT_BUSY,
+    RESULT_NO_ANSWER,
+    RESULT_DISCONNECT,
+    RESULT_COUNT
+} modem_result_t;
+
+/* CONNECT Result Details (modem_control.c) */
+typedef enum {
+    CONNECT_EC_NONE = 0,    /* No error correction reported */
+    CONNECT_EC_ARQ,         /* Error corrected, protocol not named */
+    CONNECT_EC_LAPM,        /* V.42 LAPM */
+    CONNECT_EC_MNP          /* MNP 2-4/10 */
+} connect_protocol_t;
+
+typedef enum {
+    CONNECT_COMP_NONE = 0,
+    CONNECT_COMP_V42BIS,
+    CONNECT_COMP_MNP5,
+    CONNECT_COMP_V44
+} connect_compression_t;
+
+typedef struct {
+    int dce_speed;                      /* Line rate between the modems */
+    int dte_speed;                      /* Port rate, if CONNECT reports it (else 0) */
+    connect_protocol_t protocol;
+    connect_compression_t compression;
+    char modulation[8];                 /* "V34", "V32B"... empty if not reported */
+} connect_info_t;
+
+/* Event Loop (modem_loop.c) */
+typedef enum {
+    LINE_CLOSED = 0,
+    LINE_INIT,          /* Sending modem_init_command */
+    LINE_AUTOANSWER,    /* Sending autoanswer command */
+    LINE_IDLE,          /* Waiting for RING */
+    LINE_ANSWERING,     /* ATA sent, waiting for CONNECT */
+    LINE_CONNECTED,     /* Call in progress */
+    LINE_HANGUP_GUARD,  /* Pause before ATH */
+    LINE_HANGUP,        /* ATH sent */
+    LINE_DTR_DROP,      /* DTR held low */
+    LINE_VERIFY,        /* Checking cached modem state after hangup */
+    LINE_RETRY,         /* Waiting before re-init after an error */
+    LINE_FAILED         /* Recovery attempts exhausted */
+} line_state_t;
+
+typedef struct modem_loop modem_loop_t;
+typedef struct modem_line modem_line_t;
+
+struct modem_line {
+    int index;
+    int fd;
+    char device[256];
+    const modem_config_t *cfg;  /* Per-line configuration */
+    config_snapshot_t *snap;    /* Snapshot cfg points into (NULL = caller's cfg) */
+    unsigned long config_gen;   /* Configuration generation in use */
+    modem_loop_t *loop;
+    void *user;                 /* Session data owned by the caller */
+
+    line_state_t state;
+    long long deadline_ms;      /* CLOCK_MONOTONIC deadline, 0 = none */
+    int ring_count;
+    int connected_speed;
+    connect_info_t connect;     /* Details of the last CONNECT */
+    int recovery_attempts;
+    struct termios saved_tios;  /* Restored after DTR drop */
+
+    /* Pending command string (';' separated) */
+    char cmd_list[512];
+    char *cmd_next;
+    char last_cmd[LINE_BUFFER_SIZE];    /* Recorded in the state cache on OK */
+    long long cmd_start_us;     /* last_cmd written (latency metric), 0 = answered */
+
+    /* Collected state query response (LINE_VERIFY) */
+    char resp_buf[BUFFER_SIZE];
+    int resp_len;
+
+    serial_ring_t *rx;          /* Receive ring (serial_ring.c) */
+
+    /* Pending output: the port's output queue (outq_attach), then */
+    file_send_t tx_file;        /* File being sent, after the queue mark */
+    screen_t *tx_screen;        /* Or cached screen being sent, by chunk */
+    int tx_chunk;
+    int tx_chunk_off;
+    long long tx_resume_ms;     /* Output held back until then, 0 = not */
+    unsigned int events;        /* epoll interest set of the port */
+    ansi_opt_t *ansi;           /* Caller's screen while connected, NULL = off */
+    const char *ansi_out;       /* Optimizer output the queue had no room for */
+    int ansi_left;
+    charset_t charset;          /* Caller's terminal charset (charset.c) */
+
+    int carrier_fd;             /* Status line events (carrier_watch.c), -1 = none */
+};
+
+struct modem_loop {
+    int epoll_fd;
+    int config_fd;              /* inotify watch on the config file, -1 = none */
+    int screen_fd;              /* inotify watch on the screen directory, -1 = none */
+    int signal_fd;              /* signalfd (signal_event.c), -1 = none */
+    modem_line_t *lines;
+    int line_count;
+    int max_lines;
+    volatile int running;
+
+    /* Session callbacks */
+    void (*on_connect)(modem_line_t *line, int speed);
+    void (*on_data)(modem_line_t *line, const char *data, int len);
+    void (*on_hangup)(modem_line_t *line);
+};
+
 /* Global Variables */
 extern int serial_fd;
 extern volatile sig_atomic_t interrupted;
@@ -136,6 +561,19 @@ int lock_port(const char *device);
 void unlock_port(void);
 int adjust_serial_speed(int fd, int new_baudrate);
 
+/* Receive Ring Functions (serial_ring.c) */
+serial_ring_t *serial_ring_get(int fd);
+void serial_ring_release(int fd);
+void serial_ring_reset(int fd);
+int serial_ring_pending(int fd);
+int serial_ring_fill(serial_ring_t *ring, int timeout_ms);
+int serial_ring_fill_ready(serial_ring_t *ring);
+int serial_ring_next_line(serial_ring_t *ring, serial_line_t *line);
+int serial_ring_take(serial_ring_t *ring, const char **data);
+int serial_ring_getc(serial_ring_t *ring, int timeout_ms);
+int serial_ring_read(serial_ring_t *ring, void *buf, int len, int timeout_ms);
+int serial_ring_read_line(int fd, serial_line_t *line, int timeout_ms);
+
 /* Enhanced Transmission Functions (from MBSE patterns) */
 int check_carrier_status(int fd);
 int verify_carrier_before_send(int fd);
@@ -144,31 +582,237 @@ int buffered_serial_send(int fd, const char *data, int len);
 void log_transmission(const char *label, const char *data, int len);
 int wait_for_client_ready(int fd, const char *ready_string, int timeout);
 
+/* File Send Functions (file_send.c) */
+int file_send_open(file_send_t *fs, const char *path, off_t offset);
+void file_send_close(file_send_t *fs);
+int file_send_read(file_send_t *fs, off_t offset, void *buf, int len);
+int file_send_step(int fd, file_send_t *fs, size_t max);
+int file_send_run(int fd, file_send_t *fs);
+int serial_send_file(int fd, const char *path, off_t *offset);
+
+/* Transmit Pacing Functions (serial_tx.c) */
+void serial_tx_pace(int fd, int line_rate, int port_rate, int queue_ms);
+void serial_tx_release(int fd);
+void serial_tx_chunk_delay(int fd, int delay_us);
+int serial_tx_delay_us(int fd);
+int serial_tx_allowance(int fd, int want, int *wait_us);
+void serial_tx_account(int fd, int bytes);
+int serial_tx_wait(int fd, int want);
+int serial_set_nonblocking(int fd);
+int serial_wait_writable(int fd, int timeout_ms);
+int serial_write_wait(int fd, const char *data, int len, int timeout_ms, int *sent);
+int serial_paced_send(int fd, const char *data, int len);
+
+/* Output Queue Functions (output_queue.c) */
+int outq_write(int fd, const void *data, int len);
+int outq_write_ref(int fd, const void *data, int len);
+int outq_flush(int fd);
+int outq_pending(int fd);
+void outq_discard(int fd);
+int outq_attach(int fd, int hold_bytes, int hold_ms);
+int outq_push(int fd, int force);
+long long outq_deadline(int fd);
+int outq_room(int fd);
+void outq_mark(int fd);
+void outq_unmark(int fd);
+void outq_release(int fd);
+
+/* Carrier Watch Functions (carrier_watch.c) */
+int carrier_watch_start(int fd);
+void carrier_watch_stop(int fd);
+int carrier_watch_fd(int fd);
+int carrier_watch_read(int fd, carrier_event_t *ev);
+int carrier_watch_wait(int fd, carrier_event_t *ev, int timeout_ms);
+int carrier_watch_lines(int fd);
+int carrier_watch_counters(int fd, line_counters_t *counters);
+long line_error_rate_ppm(const line_counters_t *counters);
+void carrier_watch_report(int fd, const char *device);
+
+/* Asynchronous Log Functions (async_log.c) */
+int async_log_start(int records, int out, int err);
+void async_log_stop(void);
+void async_log_flush(void);
+unsigned long async_log_dropped(void);
+void log_message(int port, int level, const char *format, ...);
+void log_data(int port, const char *label, const void *data, int len);
+
+/* Traffic Capture Functions (capture.c) */
+int capture_open(const char *path);
+void capture_close(void);
+void capture_flush(void);
+int capture_active(void);
+void capture_data(int port, int type, const void *data, int len);
+void capture_lines(int port, int lines, int changed);
+void capture_port(int port, const char *device);
+int capture_reader_open(capture_reader_t *r, const char *path);
+int capture_reader_next(capture_reader_t *r, capture_record_t *rec);
+void capture_reader_close(capture_reader_t *r);
+
+/* Metrics Functions (metrics.c) */
+void metrics_port_name(int fd, const char *device);
+void metrics_at_command(int fd, const char *command, long long us);
+void metrics_ring(int fd);
+void metrics_answer(int fd);
+void metrics_connect(int fd, int speed);
+void metrics_tx(int fd, int len);
+void metrics_rx(int fd, int len);
+void metrics_write_retry(int fd);
+void metrics_recovery(int fd);
+void metrics_carrier_drop(int fd);
+int metrics_format(char *out, int size);
+int metrics_start(const char *sock, const char *file, int interval_ms);
+void metrics_stop(void);
+
+/* ANSI Optimizer Functions (ansi_opt.c) */
+ansi_opt_t *ansi_opt_new(int rows, int use_rep);
+void ansi_opt_free(ansi_opt_t *ao);
+void ansi_opt_reset(ansi_opt_t *ao);
+void ansi_opt_bypass(ansi_opt_t *ao);
+int ansi_opt_feed(ansi_opt_t *ao, const char *data, int len);
+int ansi_opt_output(ansi_opt_t *ao, const char **data);
+int ansi_opt_send(int fd, ansi_opt_t *ao, const char *data, int len);
+screen_t *ansi_opt_screen(ansi_opt_t *ao, const screen_t *screen);
+
+/* Charset Functions (charset.c, charset_ksx1001.c) */
+extern const unsigned short charset_ksx1001[KSX1001_CELLS];
+int charset_lookup(const char *name);
+const char *charset_name(int id);
+void charset_init(charset_t *cs, int id);
+int charset_encode(charset_t *cs, const char *data, int len, char *out, int size, int *used);
+int charset_decode(charset_t *cs, const char *data, int len, char *out, int size, int *used);
+screen_t *charset_screen(charset_t *cs, const screen_t *screen);
+
+/* CRC Functions (crc.c) */
+unsigned short crc16_update(unsigned short crc, const void *data, size_t len);
+unsigned short crc16_update_bytewise(unsigned short crc, const void *data, size_t len);
+unsigned int crc32_update(unsigned int crc, const void *data, size_t len);
+unsigned int crc32_update_bytewise(unsigned int crc, const void *data, size_t len);
+
+/* Write-Behind Functions (write_behind.c) */
+int write_behind_open(write_behind_t *wb, const char *path, off_t offset);
+unsigned char *write_behind_reserve(write_behind_t *wb, int len);
+void write_behind_commit(write_behind_t *wb, int len);
+int write_behind_write(write_behind_t *wb, const void *data, int len);
+int write_behind_close(write_behind_t *wb);
+
+/* XMODEM/YMODEM Functions (xmodem.c) */
+int xmodem_send(int fd, const char *path, int use_1k, xfer_stats_t *stats);
+int ymodem_send(int fd, const char *const *paths, int count, xfer_stats_t *stats);
+int ymodem_receive(int fd, const char *dir, xfer_stats_t *stats);
+int xfer_upload_path(const char *dir, const char *name, char *path, size_t size);
+int xfer_upload_unique(char *path, size_t size);
+
+/* ZMODEM Functions (zmodem.c) */
+int zmodem_send(int fd, const char *const *paths, int count, xfer_stats_t *stats);
+int zmodem_receive(int fd, const char *dir, xfer_stats_t *stats);
+
+/* Signal Event Functions (signal_event.c) */
+int signal_event_init(void);
+int signal_event_fd(void);
+int signal_event_handle(void);
+int signal_event_sleep(int timeout_ms);
+void signal_event_clear_hangup(void);
+int serial_wait_io(int fd, short events, int timeout_ms);
+
+/* Screen Cache Functions (screen_cache.c) */
+int screen_cache_load(const char *dir);
+void screen_cache_unload(void);
+int screen_cache_watch_fd(void);
+void screen_cache_watch_handle(void);
+screen_t *screen_cache_acquire(const char *name);
+screen_t *screen_cache_build(const char *name, const char *data, int len);
+void screen_cache_release(screen_t *screen);
+int screen_speed_class(int speed);
+int screen_chunk(const screen_t *screen, int speed_class, int index, const char **data);
+int screen_cache_send(int fd, const char *name, int speed);
+
 /* Modem Control Functions (modem_control.c) */
 int send_at_command(int fd, const char *command, char *response, int resp_size, int timeout);
+int send_at_command_ms(int fd, const char *command, char *response, int resp_size, int timeout_ms);
 int init_modem(int fd);
 int set_modem_autoanswer(int fd);
+int modem_reinit(int fd);
 int modem_answer_with_speed_adjust(int fd, int *connected_speed);
 int modem_hangup(int fd);
 int detect_ring(const char *line);
 int parse_connect_speed(const char *connect_str);
+int parse_connect_info(const char *text, int len, connect_info_t *info);
+const char *connect_protocol_name(connect_protocol_t protocol);
+const char *connect_compression_name(connect_compression_t compression);
+int connect_dte_rate(const connect_info_t *info, int port_rate);
+int connect_tx_delay_us(const connect_info_t *info, int dte_rate, int chunk_size);
+modem_result_t parse_result_code(const char *text, int len, int *speed);
+const char *modem_init_string(const modem_config_t *cfg, char *buf, int size);
 
 /* Enhanced Modem Functions */
 int verify_modem_readiness(int fd);
 int validate_connection_quality(int fd, int duration_seconds);
 int recover_modem_error(int fd, int error_type);
 
+/* Event Loop Functions (modem_loop.c) */
+int modem_loop_init(modem_loop_t *loop, int max_lines);
+modem_line_t *modem_loop_add_line(modem_loop_t *loop, const modem_config_t *cfg);
+int modem_loop_run(modem_loop_t *loop);
+void modem_loop_stop(modem_loop_t *loop);
+void modem_loop_cleanup(modem_loop_t *loop);
+int modem_loop_watch_config(modem_loop_t *loop);
+int modem_loop_load_screens(modem_loop_t *loop, const char *dir);
+int modem_line_write(modem_line_t *line, const char *data, int len);
+int modem_line_send_file(modem_line_t *line, const char *path, off_t offset);
+int modem_line_send_screen(modem_line_t *line, const char *name);
+int modem_line_set_charset(modem_line_t *line, const char *name);
+int modem_line_flush(modem_line_t *line);
+void modem_line_hangup(modem_line_t *line);
+const char *modem_line_state_name(line_state_t state);
+
+/* Modem Emulator Functions (modem_emu.c) */
+int modem_emu_start(modem_emu_t *emu, int connect_speed);
+void modem_emu_stop(modem_emu_t *emu);
+void modem_emu_ring(modem_emu_t *emu, int count, int interval_ms);
+void modem_emu_drop_carrier(modem_emu_t *emu);
+int modem_emu_carrier(modem_emu_t *emu);
+int modem_emu_remote(modem_emu_t *emu, int latency_ms);
+void modem_emu_get_stats(modem_emu_t *emu, modem_emu_stats_t *stats);
+
+/* Modem State Functions (modem_state.c) */
+int optimize_command_string(const char *cmd_string, char *out, int out_size);
+modem_state_t *modem_state_get(int fd);
+void modem_state_invalidate(int fd);
+void modem_state_record(int fd, const char *command);
+int modem_state_build_query(const modem_state_t *state, char *out, int out_size);
+int modem_state_diff(const modem_state_t *state, const char *query, const char *response,
+                     char *out, int out_size);
+
+/* Result Code Functions (result_code.c) */
+void result_init(void);
+modem_result_t classify_result(const char *text, int len, const char **payload);
+int result_is_failure(modem_result_t result);
+const char *modem_result_name(modem_result_t result);
+
 /* Configuration Functions (config.c) */
 int load_config(const char *config_file);
 void init_default_config(void);
 void print_config(void);
 int get_config_int(const char *key, int default_value);
 const char *get_config_string(const char *key, const char *default_value);
+config_snapshot_t *config_acquire(void);
+void config_release(config_snapshot_t *snap);
+unsigned long config_generation(void);
+int config_reload(void);
+int config_sync(void);
+void config_request_reload(void);
+int config_watch_start(void);
+int config_watch_fd(void);
+void config_watch_handle(void);
+void config_watch_stop(void);
+int config_check_reload(void);
 
 /* Utility Functions */
 void print_message(const char *format, ...);
 void print_error(const char *format, ...);
 void signal_handler(int sig);
 void setup_signal_handlers(void);
+long long monotonic_ms(void);
+long long monotonic_us(void);
 
 #endif /* MODEM_SAMPLE_H */
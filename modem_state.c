@@ -0,0 +1,461 @@
+/*****************************************************************************
+ * Modem State Module
+ * AT command batching and a cache of the modem settings we last applied
+ *
+ * optimize_command_string() turns a ';' separated command string such as
+ * "ATZ; AT&F Q0 V1 X4 &C1 &D2 S7=60" into the fewest AT lines that leave
+ * the modem in the same state.  The state cache remembers every setting
+ * acknowledged with OK since the last reset, so a re-init can verify the
+ * modem with one batched S-register query and send only what differs.
+ *****************************************************************************/
+
+#include "modem_sample.h"
+#include <ctype.h>
+
+#define MAX_STATE_PORTS     64
+#define AT_MAX_TOKENS       64
+#define AT_TOKEN_SIZE       48
+
+/* Token kinds */
+#define TOK_SETTING     0   /* E0, &C1, S7=60: overridable settings */
+#define TOK_RESET       1   /* Z, &F: replace the active profile */
+#define TOK_ACTION      2   /* H, I, S7?, &W, &Y, vendor commands: kept as is */
+#define TOK_TERMINAL    3   /* A, D, O, +...: must end the line */
+
+typedef struct {
+    char text[AT_TOKEN_SIZE];
+    int kind;
+    int key;            /* Identifies the setting (see token_key) */
+    int value;
+} at_token_t;
+
+static modem_state_t states[MAX_STATE_PORTS];
+static int state_count = 0;
+
+/* Basic letters whose numeric argument is a persistent setting */
+static const char basic_settings[] = "BEFLMQVX";
+
+/*
+ * Setting key: S-registers 0..255, basic letters 256+, &letters 512+
+ */
+static int token_key(char prefix, char letter, int reg)
+{
+    if (prefix == 'S')
+        return reg;
+    if (prefix == '&')
+        return 512 + (letter - 'A');
+    return 256 + (letter - 'A');
+}
+
+/*
+ * Split the body of one AT command (text after "AT") into tokens
+ * Returns the number of tokens added, or -1 if the array is full.
+ */
+static int tokenize_command(const char *p, at_token_t *tokens, int max_tokens)
+{
+    int count = 0;
+
+    while (*p) {
+        at_token_t *tok;
+        const char *start;
+        char c;
+        int len, reg = -1;
+
+        if (*p == ' ' || *p == '\t') {
+            p++;
+            continue;
+        }
+
+        if (count >= max_tokens)
+            return -1;
+
+        tok = &tokens[count];
+        start = p;
+        c = toupper((unsigned char)*p++);
+        tok->kind = TOK_ACTION;
+        tok->key = -1;
+        tok->value = 0;
+
+        if (c == 'D' || c == 'A' || c == 'O' || c == '+') {
+            /* Dial string / extended command: rest of the command */
+            p += strlen(p);
+            tok->kind = TOK_TERMINAL;
+        } else if (c == 'S') {
+            reg = 0;
+            while (isdigit((unsigned char)*p))
+                reg = reg * 10 + (*p++ - '0');
+            if (*p == '=') {
+                p++;
+                tok->value = atoi(p);
+                while (isdigit((unsigned char)*p))
+                    p++;
+                tok->kind = TOK_SETTING;
+                tok->key = token_key('S', 0, reg & 0xff);
+            } else if (*p == '?') {
+                p++;
+            }
+        } else if (c == '&' || c == '\\' || c == '%') {
+            char letter = toupper((unsigned char)*p);
+
+            if (*p)
+                p++;
+            tok->value = atoi(p);
+            while (isdigit((unsigned char)*p))
+                p++;
+            if (c == '&' && isalpha((unsigned char)letter)) {
+                if (letter == 'F')
+                    tok->kind = TOK_RESET;
+                else if (!strchr("WVZTY", letter))
+                    tok->kind = TOK_SETTING;
+                tok->key = token_key('&', letter, 0);
+            }
+        } else if (isalpha((unsigned char)c)) {
+            tok->value = atoi(p);
+            while (isdigit((unsigned char)*p))
+                p++;
+            if (c == 'Z') {
+                tok->kind = TOK_RESET;
+            } else if (strchr(basic_settings, c)) {
+                tok->kind = TOK_SETTING;
+                tok->key = token_key(0, c, 0);
+            }
+        }
+
+        len = p - start;
+        if (len >= AT_TOKEN_SIZE)
+            len = AT_TOKEN_SIZE - 1;
+        memcpy(tok->text, start, len);
+        tok->text[len] = '\0';
+        count++;
+    }
+
+    return count;
+}
+
+/*
+ * Tokenize a ';' separated command string
+ * Returns the token count, or -1 for anything that is not an AT command.
+ */
+static int tokenize_command_string(const char *cmd_string, at_token_t *tokens, int max_tokens)
+{
+    char buf[512];
+    char *cmd, *saveptr;
+    int count = 0, n;
+
+    snprintf(buf, sizeof(buf), "%s", cmd_string ? cmd_string : "");
+
+    for (cmd = strtok_r(buf, ";", &saveptr); cmd; cmd = strtok_r(NULL, ";", &saveptr)) {
+        while (*cmd == ' ' || *cmd == '\t')
+            cmd++;
+        if (*cmd == '\0')
+            continue;
+
+        if (toupper((unsigned char)cmd[0]) != 'A' || toupper((unsigned char)cmd[1]) != 'T')
+            return -1;
+
+        n = tokenize_command(cmd + 2, tokens + count, max_tokens - count);
+        if (n < 0)
+            return -1;
+        count += n;
+    }
+
+    return count;
+}
+
+/*
+ * Append tokens to ';' separated AT lines of at most AT_MAX_LINE characters
+ */
+static int emit_lines(const at_token_t *tokens, const int *live, int count,
+                      char *out, int out_size)
+{
+    char line[AT_MAX_LINE + 1];
+    int line_len = 0, out_len = 0, lines = 0;
+    int i, len;
+
+    out[0] = '\0';
+
+    for (i = 0; i <= count; i++) {
+        int flush = (i == count);
+
+        if (!flush && !live[i])
+            continue;
+
+        if (!flush) {
+            len = strlen(tokens[i].text);
+            if (line_len > 0 && line_len + len > AT_MAX_LINE)
+                flush = 1;
+        }
+
+        if (flush && line_len > 0) {
+            len = snprintf(out + out_len, out_size - out_len, "%sAT%s",
+                           lines > 0 ? "; " : "", line);
+            if (len >= out_size - out_len)
+                return -1;
+            out_len += len;
+            line_len = 0;
+            lines++;
+        }
+
+        if (i == count)
+            break;
+
+        len = strlen(tokens[i].text);
+        memcpy(line + line_len, tokens[i].text, len + 1);
+        line_len += len;
+
+        /* Nothing may follow Z, A, D, O or an extended command on a line */
+        if (tokens[i].kind == TOK_TERMINAL || toupper((unsigned char)tokens[i].text[0]) == 'Z') {
+            len = snprintf(out + out_len, out_size - out_len, "%sAT%s",
+                           lines > 0 ? "; " : "", line);
+            if (len >= out_size - out_len)
+                return -1;
+            out_len += len;
+            line_len = 0;
+            lines++;
+        }
+    }
+
+    return lines;
+}
+
+/*
+ * Merge a ';' separated command string into the fewest equivalent AT lines
+ *  - a setting overridden later in the string (E1 ... E0) is dropped
+ *  - a setting followed by a reset (Z, &F) is dropped
+ *  - nothing is dropped across an action (&W, &Y, S7?, H...) or a
+ *    terminal command: those may store, report or act on the setting
+ *  - Z, A, D, O and extended (+) commands end their line
+ * Returns the number of AT lines written to out, or -1 if the string
+ * cannot be optimized (caller should send it unchanged).
+ */
+int optimize_command_string(const char *cmd_string, char *out, int out_size)
+{
+    at_token_t tokens[AT_MAX_TOKENS];
+    int live[AT_MAX_TOKENS];
+    int count, i, j;
+
+    if (!out || out_size <= 0)
+        return -1;
+
+    count = tokenize_command_string(cmd_string, tokens, AT_MAX_TOKENS);
+    if (count < 0)
+        return -1;
+
+    for (i = 0; i < count; i++) {
+        live[i] = 1;
+
+        if (tokens[i].kind != TOK_SETTING)
+            continue;
+
+        for (j = i + 1; j < count; j++) {
+            if (tokens[j].kind == TOK_ACTION || tokens[j].kind == TOK_TERMINAL)
+                break;
+            if (tokens[j].kind == TOK_RESET) {
+                live[i] = 0;
+                break;
+            }
+            if (tokens[j].key == tokens[i].key) {
+                live[i] = 0;
+                break;
+            }
+        }
+    }
+
+    return emit_lines(tokens, live, count, out, out_size);
+}
+
+/*
+ * Get the state cache of a port, creating it on first use
+ */
+modem_state_t *modem_state_get(int fd)
+{
+    int i;
+
+    if (fd < 0)
+        return NULL;
+
+    for (i = 0; i < state_count; i++) {
+        if (states[i].fd == fd)
+            return &states[i];
+    }
+
+    for (i = 0; i < state_count; i++) {
+        if (states[i].fd < 0)
+            break;
+    }
+
+    if (i == state_count) {
+        if (state_count >= MAX_STATE_PORTS)
+            return NULL;
+        state_count++;
+    }
+
+    memset(&states[i], 0, sizeof(states[i]));
+    states[i].fd = fd;
+    return &states[i];
+}
+
+/*
+ * Forget everything known about a port's modem settings
+ */
+void modem_state_invalidate(int fd)
+{
+    modem_state_t *state = modem_state_get(fd);
+
+    if (state) {
+        memset(state, 0, sizeof(*state));
+        state->fd = fd;
+    }
+}
+
+/*
+ * Record a command the modem acknowledged with OK
+ */
+void modem_state_record(int fd, const char *command)
+{
+    modem_state_t *state = modem_state_get(fd);
+    at_token_t tokens[AT_MAX_TOKENS];
+    int count, i;
+
+    if (!state || !command)
+        return;
+
+    count = tokenize_command_string(command, tokens, AT_MAX_TOKENS);
+    if (count < 0)
+        return;
+
+    for (i = 0; i < count; i++) {
+        at_token_t *tok = &tokens[i];
+
+        if (tok->kind == TOK_RESET) {
+            /* Factory/stored profile: nothing we set earlier survives */
+            int initialized = state->initialized;
+
+            memset(state, 0, sizeof(*state));
+            state->fd = fd;
+            state->initialized = initialized;
+        } else if (tok->kind == TOK_SETTING && tok->key >= 0 && tok->key < MODEM_STATE_KEYS) {
+            state->known[tok->key] = 1;
+            state->value[tok->key] = tok->value;
+        }
+    }
+}
+
+/*
+ * Build one batched query for every cached S-register ("ATS0?S7?S10?...")
+ * Returns the number of registers queried.
+ */
+int modem_state_build_query(const modem_state_t *state, char *out, int out_size)
+{
+    int len, reg, count = 0;
+
+    if (!state || !out || out_size < 3)
+        return 0;
+
+    len = snprintf(out, out_size, "AT");
+
+    for (reg = 0; reg < 256; reg++) {
+        if (!state->known[reg])
+            continue;
+        if (len + 6 >= out_size || len - 2 + 6 > AT_MAX_LINE)
+            break;
+        len += snprintf(out + len, out_size - len, "S%d?", reg);
+        count++;
+    }
+
+    return count;
+}
+
+/*
+ * Compare a query response with the cache and build the commands needed
+ * to restore the cached state.  The response holds one line per register
+ * (as collected by send_at_command).  If anything differs, the modem may
+ * have been reset, so settings that cannot be queried (E, V, X, &C, &D...)
+ * are resent together with the mismatching registers.
+ * Returns the number of settings to send (0 = modem matches the cache),
+ * or -1 if the response could not be matched to the query.
+ */
+int modem_state_diff(const modem_state_t *state, const char *query, const char *response,
+                     char *out, int out_size)
+{
+    at_token_t tokens[AT_MAX_TOKENS];
+    int live[AT_MAX_TOKENS];
+    int mismatch[256];
+    const char *p = response;
+    int reg, key, count = 0, values = 0, differs = 0;
+    int queried = 0;
+    int echo_seen = 0;
+
+    if (!state || !query || !response || !out || out_size <= 0)
+        return -1;
+
+    for (p = query; *p; p++) {
+        if (*p == '?')
+            queried++;
+    }
+    p = response;
+
+    out[0] = '\0';
+    memset(mismatch, 0, sizeof(mismatch));
+
+    /* Walk response lines in the order the registers were queried */
+    reg = 0;
+    while (*p) {
+        const char *eol = strchr(p, '\n');
+        int len = eol ? (int)(eol - p) : (int)strlen(p);
+
+        if (len >= 2 && strncmp(p, query, len) == 0) {
+            echo_seen = 1;
+        } else if (len > 0 && isdigit((unsigned char)p[0]) && values < queried) {
+            while (reg < 256 && !state->known[reg])
+                reg++;
+            if (reg >= 256)
+                return -1;
+            if (atoi(p) != state->value[reg]) {
+                mismatch[reg] = 1;
+                differs = 1;
+            }
+            values++;
+            reg++;
+        }
+
+        p += len;
+        if (*p == '\n')
+            p++;
+    }
+
+    if (values != queried)
+        return -1;
+
+    /* Echo on while we set E0 (or off while we set E1) means a reset */
+    key = token_key(0, 'E', 0);
+    if (state->known[key] && state->value[key] != echo_seen)
+        differs = 1;
+
+    if (!differs)
+        return 0;
+
+    for (key = 0; key < MODEM_STATE_KEYS && count < AT_MAX_TOKENS; key++) {
+        if (!state->known[key])
+            continue;
+        if (key < 256 && !mismatch[key] && key < reg)
+            continue;  /* Register verified by the query */
+
+        if (key < 256)
+            snprintf(tokens[count].text, AT_TOKEN_SIZE, "S%d=%d", key, state->value[key]);
+        else if (key < 512)
+            snprintf(tokens[count].text, AT_TOKEN_SIZE, "%c%d", 'A' + key - 256, state->value[key]);
+        else
+            snprintf(tokens[count].text, AT_TOKEN_SIZE, "&%c%d", 'A' + key - 512, state->value[key]);
+
+        tokens[count].kind = TOK_SETTING;
+        tokens[count].key = key;
+        live[count] = 1;
+        count++;
+    }
+
+    if (emit_lines(tokens, live, count, out, out_size) < 0)
+        return -1;
+
+    return count;
+}
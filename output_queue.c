@@ -0,0 +1,667 @@
+/*****************************************************************************
+ * Output Queue Module
+ * Per-port coalescing of small writes, flushed with writev()
+ * Based on MBSE BBS mbsebbs/ttyio.c tty_write() / PUTSTR() output path
+ *
+ * Prompts and status lines are made of many short strings, and writing
+ * each one on its own costs a system call and sends the modem a nearly
+ * empty buffer.  Here small writes are gathered per port and go out in one
+ * writev() once tx_coalesce_bytes are queued, tx_coalesce_ms after the
+ * first one was queued (Nagle-like), before the port is read from, or when
+ * the caller asks with outq_flush().  serial_write() queues here, so AT
+ * commands and session output of the blocking path share the queue.
+ *
+ * Copied data is merged into the queue buffer; outq_write_ref() queues a
+ * caller buffer by reference (string literals, cached screens) without a
+ * copy.  Deadline flushes run on a flusher thread started on first use;
+ * an error it hits is reported by the next call on that port.
+ *
+ * The event loop (modem_loop.c) owns the queues of its lines instead
+ * (outq_attach): nothing blocks on them, the flusher leaves them alone,
+ * and the loop writes them out with outq_push() when they are due, at
+ * outq_deadline() or once the port is writable.  A mark (outq_mark) holds
+ * back output queued behind a file or screen until it has been sent.
+ *****************************************************************************/
+
+#include "modem_sample.h"
+#include <sys/uio.h>
+
+#define MAX_OUTPUT_QUEUES   64
+#define OUTQ_MAX_IOV        32
+#define OUTQ_BUF_SIZE       4096
+
+typedef struct {
+    int fd;                     /* -1 = free slot */
+    struct iovec iov[OUTQ_MAX_IOV];
+    int iov_count;
+    int iov_first;              /* First iovec not yet fully written */
+    char buf[OUTQ_BUF_SIZE];    /* Copies of queued data */
+    int buf_used;
+    int pending;                /* Bytes queued, not yet written */
+    long long deadline_ms;      /* Flush deadline, 0 = nothing queued */
+    int error;                  /* Flush error for the next caller */
+    int owned;                  /* Driven by an event loop (outq_attach) */
+    int hold_bytes;             /* Owned: due once this much is queued */
+    int hold_ms;                /* Owned: due this long after the first write */
+    int mark;                   /* Owned: bytes ahead of a file or screen, -1 = none */
+} output_queue_t;
+
+static output_queue_t queues[MAX_OUTPUT_QUEUES];
+static int queue_count = 0;
+
+static pthread_mutex_t outq_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t outq_cond;
+static pthread_once_t outq_once = PTHREAD_ONCE_INIT;
+static pthread_t outq_thread;
+
+static void *outq_flusher(void *arg);
+
+/*
+ * Start the deadline flusher (run once through pthread_once)
+ */
+static void outq_start(void)
+{
+    pthread_condattr_t attr;
+
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&outq_cond, &attr);
+    pthread_condattr_destroy(&attr);
+
+    if (pthread_create(&outq_thread, NULL, outq_flusher, NULL) == 0)
+        pthread_detach(outq_thread);
+    else
+        print_error("Failed to start output queue flusher");
+}
+
+/*
+ * Queue of a port, creating it if asked (call with outq_lock held)
+ */
+static output_queue_t *outq_get(int fd, int create)
+{
+    int i;
+
+    for (i = 0; i < queue_count; i++) {
+        if (queues[i].fd == fd)
+            return &queues[i];
+    }
+
+    if (!create || fd < 0)
+        return NULL;
+
+    for (i = 0; i < queue_count; i++) {
+        if (queues[i].fd < 0)
+            break;
+    }
+
+    if (i == queue_count) {
+        if (queue_count >= MAX_OUTPUT_QUEUES) {
+            print_error("outq_get: too many open ports");
+            return NULL;
+        }
+        queue_count++;
+    }
+
+    memset(&queues[i], 0, sizeof(queues[i]));
+    queues[i].fd = fd;
+    queues[i].mark = -1;
+    return &queues[i];
+}
+
+/*
+ * Forget everything queued (call with outq_lock held)
+ */
+static void outq_reset(output_queue_t *q)
+{
+    q->iov_count = q->iov_first = 0;
+    q->buf_used = 0;
+    q->pending = 0;
+    q->deadline_ms = 0;
+}
+
+/*
+ * Move what is still queued to the front of the buffer and the iovec
+ * array, making room behind it (call with outq_lock held)
+ */
+static void outq_compact(output_queue_t *q)
+{
+    char *from = q->buf + q->buf_used, *base;
+    int i, shift;
+
+    /* Copies go out in the order they were made: the unsent ones are contiguous */
+    for (i = q->iov_first; i < q->iov_count; i++) {
+        base = q->iov[i].iov_base;
+        if (base >= q->buf && base < from)
+            from = base;
+    }
+
+    shift = from - q->buf;
+    if (shift > 0) {
+        for (i = q->iov_first; i < q->iov_count; i++) {
+            base = q->iov[i].iov_base;
+            if (base >= q->buf && base < q->buf + OUTQ_BUF_SIZE)
+                q->iov[i].iov_base = base - shift;
+        }
+        memmove(q->buf, from, q->buf_used - shift);
+        q->buf_used -= shift;
+    }
+
+    if (q->iov_first > 0) {
+        memmove(q->iov, q->iov + q->iov_first, (q->iov_count - q->iov_first) * sizeof(q->iov[0]));
+        q->iov_count -= q->iov_first;
+        q->iov_first = 0;
+    }
+}
+
+/*
+ * Write queued data with writev() (call with outq_lock held)
+ * With wait set, blocks until everything is out; otherwise writes what
+ * the pacer and the driver take now and leaves the rest queued.  While
+ * blocked the lock is dropped.  Every error path empties the queue, so no
+ * reference to a caller buffer outlives the call.  A marked queue stops
+ * at the mark.
+ * Returns SUCCESS, ERROR_HANGUP, ERROR_TIMEOUT, ERROR_PORT or
+ * ERROR_GENERAL (interrupted).
+ */
+static int outq_write_out(output_queue_t *q, int wait)
+{
+    struct iovec iov[OUTQ_MAX_IOV];
+    int count, allowed, wait_us, want, n, i, rc, fd = q->fd;
+    ssize_t written;
+
+    while (q->pending > 0 && q->mark != 0) {
+        /* An owner follows the carrier with its own events */
+        if (!q->owned && verify_carrier_before_send(q->fd) != SUCCESS) {
+            outq_reset(q);
+            return ERROR_HANGUP;
+        }
+
+        want = q->mark > 0 ? q->mark : q->pending;
+        allowed = serial_tx_allowance(q->fd, want, &wait_us);
+        if (allowed > want)
+            allowed = want;
+        if (allowed == 0 && wait) {
+            /* Line busy: wait without holding up the flusher and other ports */
+            n = q->pending;
+            pthread_mutex_unlock(&outq_lock);
+            rc = serial_tx_wait(fd, n);
+            pthread_mutex_lock(&outq_lock);
+            if (q->fd != fd)
+                return ERROR_PORT;  /* Released meanwhile */
+            if (rc < 0) {
+                outq_reset(q);
+                return rc;
+            }
+            continue;
+        }
+        if (allowed == 0) {
+            q->deadline_ms = monotonic_ms() + wait_us / 1000 + 1;
+            return SUCCESS;
+        }
+
+        /* Gather at most 'allowed' bytes */
+        for (count = 0, n = 0, i = q->iov_first; i < q->iov_count && n < allowed; i++, count++) {
+            iov[count] = q->iov[i];
+            if ((int)iov[count].iov_len > allowed - n)
+                iov[count].iov_len = allowed - n;
+            n += iov[count].iov_len;
+        }
+
+        written = writev(q->fd, iov, count);
+        if (written < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                metrics_write_retry(q->fd);
+                if (!wait) {
+                    /* An owner waits for the port to become writable */
+                    q->deadline_ms = q->owned ? 0 : monotonic_ms() + 1;
+                    return SUCCESS;
+                }
+                /* Driver buffer full: wake as soon as it has room */
+                pthread_mutex_unlock(&outq_lock);
+                rc = serial_wait_writable(fd, -1);
+                pthread_mutex_lock(&outq_lock);
+                if (q->fd != fd)
+                    return ERROR_PORT;
+                if (rc != SUCCESS) {
+                    outq_reset(q);
+                    return rc;
+                }
+                continue;
+            }
+            outq_reset(q);
+            return (errno == EPIPE || errno == ECONNRESET || errno == EIO) ?
+                   ERROR_HANGUP : ERROR_PORT;
+        }
+
+        serial_tx_account(q->fd, written);
+        metrics_tx(q->fd, written);
+        q->pending -= written;
+        if (q->mark > 0)
+            q->mark -= written;
+
+        for (i = 0, n = written; n > 0 && capture_active(); n -= iov[i++].iov_len) {
+            if ((int)iov[i].iov_len > n)
+                iov[i].iov_len = n;
+            capture_data(q->fd, CAPTURE_TX, iov[i].iov_base, iov[i].iov_len);
+        }
+
+        /* Resume after a partial write: advance past what went out */
+        while (written > 0 && q->iov_first < q->iov_count) {
+            struct iovec *v = &q->iov[q->iov_first];
+
+            if ((size_t)written >= v->iov_len) {
+                written -= v->iov_len;
+                q->iov_first++;
+            } else {
+                v->iov_base = (char *)v->iov_base + written;
+                v->iov_len -= written;
+                written = 0;
+            }
+        }
+    }
+
+    if (q->pending == 0)
+        outq_reset(q);
+    return SUCCESS;
+}
+
+/*
+ * Flusher thread: writes out queues whose deadline has passed
+ */
+static void *outq_flusher(void *arg)
+{
+    struct timespec ts;
+    long long now, next;
+    int i, rc;
+
+    (void)arg;
+
+    pthread_mutex_lock(&outq_lock);
+
+    for (;;) {
+        now = monotonic_ms();
+        next = 0;
+
+        for (i = 0; i < queue_count; i++) {
+            output_queue_t *q = &queues[i];
+
+            if (q->fd < 0 || q->owned || q->deadline_ms == 0)
+                continue;
+
+            if (q->deadline_ms <= now) {
+                q->deadline_ms = 0;
+                rc = outq_write_out(q, 0);
+                if (rc != SUCCESS)
+                    q->error = rc;
+            }
+
+            if (q->deadline_ms != 0 && (next == 0 || q->deadline_ms < next))
+                next = q->deadline_ms;
+        }
+
+        if (next == 0) {
+            pthread_cond_wait(&outq_cond, &outq_lock);
+        } else {
+            ts.tv_sec = next / 1000;
+            ts.tv_nsec = (next % 1000) * 1000000;
+            pthread_cond_timedwait(&outq_cond, &outq_lock, &ts);
+        }
+    }
+
+    return NULL;
+}
+
+/*
+ * Add data to a queue that has room for it (call with outq_lock held)
+ */
+static void outq_append(output_queue_t *q, const void *data, int len, int ref)
+{
+    struct iovec *last;
+    int merge;
+
+    last = q->iov_count > q->iov_first ? &q->iov[q->iov_count - 1] : NULL;
+
+    if (ref) {
+        q->iov[q->iov_count].iov_base = (void *)data;
+        q->iov[q->iov_count].iov_len = len;
+        q->iov_count++;
+    } else {
+        /* Copies that follow each other in buf share one iovec */
+        merge = last && (char *)last->iov_base + last->iov_len == q->buf + q->buf_used &&
+                (char *)last->iov_base >= q->buf && (char *)last->iov_base < q->buf + OUTQ_BUF_SIZE;
+        memcpy(q->buf + q->buf_used, data, len);
+        if (merge) {
+            last->iov_len += len;
+        } else {
+            q->iov[q->iov_count].iov_base = q->buf + q->buf_used;
+            q->iov[q->iov_count].iov_len = len;
+            q->iov_count++;
+        }
+        q->buf_used += len;
+    }
+
+    q->pending += len;
+}
+
+/*
+ * Queue on a port an event loop owns (call with outq_lock held)
+ * Never writes and never blocks: takes what fits and returns that, 0 when
+ * the queue is full until outq_push() has made room.
+ */
+static int outq_queue_owned(output_queue_t *q, const void *data, int len, int ref)
+{
+    if (q->iov_count == OUTQ_MAX_IOV || (!ref && q->buf_used + len > OUTQ_BUF_SIZE))
+        outq_compact(q);
+
+    if (q->iov_count == OUTQ_MAX_IOV)
+        return 0;
+    if (!ref && len > OUTQ_BUF_SIZE - q->buf_used)
+        len = OUTQ_BUF_SIZE - q->buf_used;
+    if (len == 0)
+        return 0;
+
+    /* Nagle-like: due hold_ms after the first write (behind a mark: with it) */
+    if (q->pending == 0 && q->mark < 0)
+        q->deadline_ms = monotonic_ms() + q->hold_ms;
+
+    outq_append(q, data, len, ref);
+    return len;
+}
+
+/*
+ * Queue len bytes for a port
+ * ref set: data is queued by reference and must stay valid until the
+ * queue is flushed (string literals, cached screens).
+ * Returns len or an error code; on a queue an event loop owns, the bytes
+ * that fit (see outq_queue_owned).
+ */
+static int outq_queue(int fd, const void *data, int len, int ref)
+{
+    output_queue_t *q;
+    int rc = len;
+
+    if (fd < 0 || !data || len < 0)
+        return ERROR_GENERAL;
+    if (len == 0)
+        return 0;
+
+    pthread_mutex_lock(&outq_lock);
+    q = outq_get(fd, 0);
+    if (q && q->owned) {
+        rc = outq_queue_owned(q, data, len, ref);
+        pthread_mutex_unlock(&outq_lock);
+        return rc;
+    }
+    pthread_mutex_unlock(&outq_lock);
+
+    /* Coalescing off: write through */
+    if (config.tx_coalesce_ms <= 0)
+        return serial_paced_send(fd, data, len);
+
+    pthread_once(&outq_once, outq_start);
+    pthread_mutex_lock(&outq_lock);
+
+    q = outq_get(fd, 1);
+    if (!q) {
+        pthread_mutex_unlock(&outq_lock);
+        return serial_paced_send(fd, data, len);
+    }
+
+    if (q->error) {
+        rc = q->error;
+        q->error = 0;
+        pthread_mutex_unlock(&outq_lock);
+        return rc;
+    }
+
+    /* Make room: the buffer or the iovec array is full */
+    if (q->iov_count == OUTQ_MAX_IOV || (!ref && q->buf_used + len > OUTQ_BUF_SIZE)) {
+        rc = outq_write_out(q, 1);
+        if (rc != SUCCESS) {
+            pthread_mutex_unlock(&outq_lock);
+            return rc;
+        }
+        rc = len;
+    }
+
+    if (!ref && len > OUTQ_BUF_SIZE) {
+        /* Too big to copy: the queue is empty now, write it through */
+        pthread_mutex_unlock(&outq_lock);
+        return serial_paced_send(fd, data, len);
+    }
+
+    outq_append(q, data, len, ref);
+
+    if (q->pending >= config.tx_coalesce_bytes || len > OUTQ_BUF_SIZE) {
+        q->deadline_ms = 0;
+        rc = outq_write_out(q, 1);
+        if (rc == SUCCESS)
+            rc = len;
+    } else if (q->deadline_ms == 0) {
+        q->deadline_ms = monotonic_ms() + config.tx_coalesce_ms;
+        pthread_cond_signal(&outq_cond);
+    }
+
+    pthread_mutex_unlock(&outq_lock);
+    return rc;
+}
+
+/*
+ * Queue a copy of data; returns len or an error code
+ */
+int outq_write(int fd, const void *data, int len)
+{
+    return outq_queue(fd, data, len, 0);
+}
+
+/*
+ * Queue data by reference; it must stay valid until outq_flush(fd)
+ */
+int outq_write_ref(int fd, const void *data, int len)
+{
+    return outq_queue(fd, data, len, 1);
+}
+
+/*
+ * Write out everything queued for a port now (blocking)
+ * Returns SUCCESS, ERROR_HANGUP or ERROR_PORT.
+ */
+int outq_flush(int fd)
+{
+    output_queue_t *q;
+    int rc = SUCCESS;
+
+    pthread_mutex_lock(&outq_lock);
+
+    q = outq_get(fd, 0);
+    if (q) {
+        if (q->error) {
+            rc = q->error;
+            q->error = 0;
+        } else {
+            q->deadline_ms = 0;
+            rc = outq_write_out(q, 1);
+        }
+    }
+
+    pthread_mutex_unlock(&outq_lock);
+    return rc;
+}
+
+/*
+ * Bytes queued for a port
+ */
+int outq_pending(int fd)
+{
+    output_queue_t *q;
+    int pending;
+
+    pthread_mutex_lock(&outq_lock);
+    q = outq_get(fd, 0);
+    pending = q ? q->pending : 0;
+    pthread_mutex_unlock(&outq_lock);
+
+    return pending;
+}
+
+/*
+ * Drop queued output (hangup: it can no longer be delivered)
+ */
+void outq_discard(int fd)
+{
+    output_queue_t *q;
+
+    pthread_mutex_lock(&outq_lock);
+    q = outq_get(fd, 0);
+    if (q) {
+        outq_reset(q);
+        q->error = 0;
+        q->mark = -1;
+    }
+    pthread_mutex_unlock(&outq_lock);
+}
+
+/*
+ * Hand the queue of a port to an event loop, which writes it out with
+ * outq_push(); hold_bytes and hold_ms are its coalescing thresholds
+ * (hold_ms <= 0: due at once).  Called again, only updates them.
+ * Returns SUCCESS or ERROR_GENERAL.
+ */
+int outq_attach(int fd, int hold_bytes, int hold_ms)
+{
+    output_queue_t *q;
+
+    pthread_mutex_lock(&outq_lock);
+    q = outq_get(fd, 1);
+    if (q) {
+        q->owned = 1;
+        q->hold_bytes = hold_bytes;
+        q->hold_ms = hold_ms > 0 ? hold_ms : 0;
+    }
+    pthread_mutex_unlock(&outq_lock);
+
+    return q ? SUCCESS : ERROR_GENERAL;
+}
+
+/*
+ * Write out what is due on an owned queue, without blocking
+ * Output is due once hold_bytes are queued, hold_ms after the first
+ * write, ahead of a mark, or when force is set.  What the pacer or the
+ * driver do not take stays queued: call again at outq_deadline(), or
+ * once the port is writable when that is 0.
+ * Returns the bytes still waiting to go out (up to the mark, if set),
+ * ERROR_HANGUP or ERROR_PORT.
+ */
+int outq_push(int fd, int force)
+{
+    output_queue_t *q;
+    int rc = SUCCESS;
+
+    pthread_mutex_lock(&outq_lock);
+
+    q = outq_get(fd, 0);
+    if (!q || !q->owned) {
+        pthread_mutex_unlock(&outq_lock);
+        return ERROR_GENERAL;
+    }
+
+    if (q->pending > 0 && q->mark != 0 &&
+        (force || q->mark > 0 || q->pending >= q->hold_bytes || q->deadline_ms <= monotonic_ms())) {
+        q->deadline_ms = 0;
+        rc = outq_write_out(q, 0);
+    }
+
+    if (rc == SUCCESS)
+        rc = q->mark >= 0 ? q->mark : q->pending;
+
+    pthread_mutex_unlock(&outq_lock);
+    return rc;
+}
+
+/*
+ * When an owned queue wants outq_push() again: its coalescing or pacing
+ * deadline, 0 = when the port is writable (or nothing is queued)
+ */
+long long outq_deadline(int fd)
+{
+    output_queue_t *q;
+    long long deadline;
+
+    pthread_mutex_lock(&outq_lock);
+    q = outq_get(fd, 0);
+    deadline = q && q->pending > 0 ? q->deadline_ms : 0;
+    pthread_mutex_unlock(&outq_lock);
+
+    return deadline;
+}
+
+/*
+ * Bytes an owned queue takes now in one piece (0 when it is full until
+ * outq_push() has made room)
+ */
+int outq_room(int fd)
+{
+    output_queue_t *q;
+    int room = 0;
+
+    pthread_mutex_lock(&outq_lock);
+    q = outq_get(fd, 0);
+    if (q && q->owned) {
+        if (q->iov_count == OUTQ_MAX_IOV || q->buf_used > OUTQ_BUF_SIZE / 2)
+            outq_compact(q);
+        if (q->iov_count < OUTQ_MAX_IOV)
+            room = OUTQ_BUF_SIZE - q->buf_used;
+    }
+    pthread_mutex_unlock(&outq_lock);
+
+    return room;
+}
+
+/*
+ * Hold back output queued from now on: a file or screen goes out after
+ * what is queued already (owned queues; see outq_push)
+ */
+void outq_mark(int fd)
+{
+    output_queue_t *q;
+
+    pthread_mutex_lock(&outq_lock);
+    q = outq_get(fd, 0);
+    if (q && q->owned)
+        q->mark = q->pending;
+    pthread_mutex_unlock(&outq_lock);
+}
+
+/*
+ * The file or screen is out: what was queued behind it is due now
+ */
+void outq_unmark(int fd)
+{
+    output_queue_t *q;
+
+    pthread_mutex_lock(&outq_lock);
+    q = outq_get(fd, 0);
+    if (q && q->mark >= 0) {
+        q->mark = -1;
+        q->deadline_ms = 0;
+    }
+    pthread_mutex_unlock(&outq_lock);
+}
+
+/*
+ * Release the queue of a port that is being closed
+ */
+void outq_release(int fd)
+{
+    output_queue_t *q;
+
+    pthread_mutex_lock(&outq_lock);
+    q = outq_get(fd, 0);
+    if (q) {
+        outq_reset(q);
+        q->fd = -1;
+    }
+    pthread_mutex_unlock(&outq_lock);
+}
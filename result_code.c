@@ -0,0 +1,180 @@
+/*****************************************************************************
+ * Result Code Module
+ * Single-pass classification of modem result lines
+ * Based on MBSE BBS mbcico/dial.c response matching (modem.error/connect)
+ *
+ * All result keywords are compiled once into an Aho-Corasick automaton
+ * (goto and failure functions folded into one transition table over a
+ * 28-symbol alphabet).  A line is classified in one scan, with the same
+ * outcome as the former strstr() chains: when several keywords occur, the
+ * one earliest in result_keywords[] wins.
+ *****************************************************************************/
+
+#include "modem_sample.h"
+
+#define RESULT_ALPHABET     28  /* other, 'A'..'Z', ' ' */
+#define RESULT_MAX_STATES   64
+#define RESULT_NO_MATCH     0xff
+
+/* Keywords in priority order (DISCONNECT before the CONNECT it contains) */
+static const struct {
+    const char *text;
+    modem_result_t result;
+} result_keywords[] = {
+    { "DISCONNECT",  RESULT_DISCONNECT  },
+    { "CONNECT",     RESULT_CONNECT     },
+    { "RING",        RESULT_RING        },
+    { "NO CARRIER",  RESULT_NO_CARRIER  },
+    { "BUSY",        RESULT_BUSY        },
+    { "NO DIALTONE", RESULT_NO_DIALTONE },
+    { "NO ANSWER",   RESULT_NO_ANSWER   },
+    { "OK",          RESULT_OK          },
+    { "ERROR",       RESULT_ERROR       },
+};
+
+#define RESULT_KEYWORDS     ((int)(sizeof(result_keywords) / sizeof(result_keywords[0])))
+
+static const char *result_names[RESULT_COUNT] = {
+    "NONE", "OK", "CONNECT", "RING", "NO CARRIER", "ERROR",
+    "NO DIALTONE", "BUSY", "NO ANSWER", "DISCONNECT"
+};
+
+static unsigned char symbol_class[256];
+static unsigned char transition[RESULT_MAX_STATES][RESULT_ALPHABET];
+static unsigned char output[RESULT_MAX_STATES];     /* Keyword index or RESULT_NO_MATCH */
+static pthread_once_t result_once = PTHREAD_ONCE_INIT;
+
+/*
+ * Build the automaton (run once through pthread_once)
+ */
+static void result_build(void)
+{
+    unsigned char fail[RESULT_MAX_STATES];
+    unsigned char queue[RESULT_MAX_STATES];
+    int states = 1;
+    int head = 0, tail = 0;
+    int i, c, s, next;
+    const char *p;
+
+    memset(symbol_class, 0, sizeof(symbol_class));
+    for (c = 'A'; c <= 'Z'; c++)
+        symbol_class[c] = c - 'A' + 1;
+    symbol_class[' '] = 27;
+
+    memset(transition, 0, sizeof(transition));
+    memset(output, RESULT_NO_MATCH, sizeof(output));
+    memset(fail, 0, sizeof(fail));
+
+    /* Goto function: a trie of all keywords (state 0 is the root) */
+    for (i = 0; i < RESULT_KEYWORDS; i++) {
+        s = 0;
+        for (p = result_keywords[i].text; *p; p++) {
+            c = symbol_class[(unsigned char)*p];
+            if (transition[s][c] == 0)
+                transition[s][c] = states++;
+            s = transition[s][c];
+        }
+        if (output[s] == RESULT_NO_MATCH)
+            output[s] = i;
+    }
+
+    /* Breadth first: fold failure links into the transition table */
+    for (c = 0; c < RESULT_ALPHABET; c++) {
+        if (transition[0][c] != 0)
+            queue[tail++] = transition[0][c];
+    }
+
+    while (head < tail) {
+        s = queue[head++];
+
+        /* A keyword ending inside a longer one matches here too */
+        if (output[fail[s]] < output[s])
+            output[s] = output[fail[s]];
+
+        for (c = 0; c < RESULT_ALPHABET; c++) {
+            next = transition[s][c];
+            if (next != 0) {
+                fail[next] = transition[fail[s]][c];
+                queue[tail++] = next;
+            } else {
+                transition[s][c] = transition[fail[s]][c];
+            }
+        }
+    }
+}
+
+/*
+ * Build the shared automaton (optional; classify_result does it on first use)
+ */
+void result_init(void)
+{
+    pthread_once(&result_once, result_build);
+}
+
+/*
+ * Classify a modem line in one pass
+ * len < 0 means text is NUL terminated.  If payload is not NULL it is set
+ * to the text following the keyword (leading spaces skipped), e.g.
+ * "33600/ARQ" for "CONNECT 33600/ARQ".
+ * Returns RESULT_NONE if the line holds no result code.
+ */
+modem_result_t classify_result(const char *text, int len, const char **payload)
+{
+    const unsigned char *p, *end, *match_end = NULL;
+    int best = RESULT_NO_MATCH;
+    int s = 0;
+
+    if (payload)
+        *payload = NULL;
+
+    if (!text)
+        return RESULT_NONE;
+
+    result_init();
+
+    if (len < 0)
+        len = strlen(text);
+
+    p = (const unsigned char *)text;
+    end = p + len;
+
+    for (; p < end; p++) {
+        s = transition[s][symbol_class[*p]];
+        if (output[s] < best) {
+            best = output[s];
+            match_end = p + 1;
+            if (best == 0)
+                break;  /* Nothing outranks the first keyword */
+        }
+    }
+
+    if (best == RESULT_NO_MATCH)
+        return RESULT_NONE;
+
+    if (payload) {
+        while (match_end < end && *match_end == ' ')
+            match_end++;
+        *payload = (const char *)match_end;
+    }
+
+    return result_keywords[best].result;
+}
+
+/*
+ * Call failure results (NO CARRIER, BUSY, NO DIALTONE, NO ANSWER)
+ */
+int result_is_failure(modem_result_t result)
+{
+    return result == RESULT_NO_CARRIER || result == RESULT_BUSY ||
+           result == RESULT_NO_DIALTONE || result == RESULT_NO_ANSWER;
+}
+
+/*
+ * Result code name (for logging)
+ */
+const char *modem_result_name(modem_result_t result)
+{
+    if (result < 0 || result >= RESULT_COUNT)
+        return "UNKNOWN";
+    return result_names[result];
+}
@@ -0,0 +1,482 @@
+/*****************************************************************************
+ * Screen Cache Module
+ * Welcome and menu screens held in memory, pre-chunked per connect speed
+ * Based on MBSE BBS mbsebbs/misc.c DisplayLogo() and mbsebbs/user.c
+ * DisplayFile() (mainlogo, welcome, welcome1..9)
+ *
+ * Every file of the screen directory is read once at startup.  For each
+ * speed class the chunk boundaries are computed up front: a chunk carries
+ * about SCREEN_CHUNK_MS of line time and never ends inside an ANSI escape
+ * sequence, so carrier is re-checked at a steady rate and a screen cut off
+ * between chunks leaves the terminal in a sane state.  Sending after
+ * CONNECT is then a series of write()s straight from memory.
+ *
+ * An inotify watch on the directory refreshes a screen in place when its
+ * file is rewritten.  Screens are refcounted: a send in progress keeps the
+ * old contents until it finishes.
+ *****************************************************************************/
+
+#include "modem_sample.h"
+#include <dirent.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+
+#define SCREEN_MAX          64
+#define SCREEN_MAX_SIZE     (256 * 1024)
+#define SCREEN_CHUNK_MS     50      /* Line time carried by one chunk */
+#define SCREEN_CHUNK_MIN    16
+#define SCREEN_CHUNK_MAX    4096
+#define SCREEN_ESC_MAX      32      /* Longest escape sequence kept whole */
+#define SCREEN_STALL_MS     10000   /* Give up if the port accepts nothing */
+
+/* Lowest connect speed of each class (parse_connect_speed results) */
+static const int screen_speeds[SCREEN_SPEED_CLASSES] = {
+    300, 1200, 2400, 4800, 9600, 14400, 19200, 28800, 33600, 57600, 115200
+};
+
+static pthread_mutex_t screen_lock = PTHREAD_MUTEX_INITIALIZER;
+static screen_t *screens[SCREEN_MAX];
+static int screen_count = 0;
+static char screen_path[256];
+static int screen_watch_fd = -1;
+
+/*
+ * Speed class of a connect speed (0 for unknown / 300 bps)
+ */
+int screen_speed_class(int speed)
+{
+    int c;
+
+    for (c = SCREEN_SPEED_CLASSES - 1; c > 0; c--) {
+        if (speed >= screen_speeds[c])
+            break;
+    }
+
+    return c;
+}
+
+/*
+ * Target chunk size for a speed class: SCREEN_CHUNK_MS at 10 bits per byte
+ */
+static int screen_chunk_size(int speed_class)
+{
+    int size = screen_speeds[speed_class] / 10 * SCREEN_CHUNK_MS / 1000;
+
+    if (size < SCREEN_CHUNK_MIN)
+        size = SCREEN_CHUNK_MIN;
+    if (size > SCREEN_CHUNK_MAX)
+        size = SCREEN_CHUNK_MAX;
+
+    return size;
+}
+
+/*
+ * Is the escape sequence at p still open after avail bytes?
+ * (ESC [ parameters/intermediates final, or a two-byte ESC x)
+ */
+static int screen_esc_open(const char *p, int avail)
+{
+    int i;
+
+    if (avail < 2)
+        return 1;
+    if (p[1] != '[')
+        return 0;
+
+    for (i = 2; i < avail; i++) {
+        if (p[i] >= 0x40 && p[i] <= 0x7e)
+            return 0;
+    }
+
+    return 1;
+}
+
+/*
+ * Split data into chunks of about size bytes
+ * A chunk that would end inside an escape sequence ends before its ESC
+ * instead.  Stores the end offsets in ends (if not NULL) and returns the
+ * number of chunks.
+ */
+static int screen_split(const char *data, int len, int size, int *ends)
+{
+    int start = 0, end, i, count = 0;
+
+    while (start < len) {
+        end = start + size;
+        if (end >= len) {
+            end = len;
+        } else {
+            for (i = end - 1; i > start && i >= end - SCREEN_ESC_MAX; i--) {
+                if (data[i] == '\033')
+                    break;
+            }
+            if (i > start && data[i] == '\033' && screen_esc_open(data + i, end - i))
+                end = i;
+        }
+
+        if (ends)
+            ends[count] = end;
+        count++;
+        start = end;
+    }
+
+    return count;
+}
+
+/*
+ * Build a screen from file contents (one allocation: header, chunk
+ * offsets for every speed class, then the data)
+ * Also used for screens outside the cache (ansi_opt.c); the reference
+ * returned is dropped with screen_cache_release().
+ */
+screen_t *screen_cache_build(const char *name, const char *data, int len)
+{
+    screen_t *screen;
+    int counts[SCREEN_SPEED_CLASSES];
+    int total = 0, c;
+    int *ends;
+    char *copy;
+
+    for (c = 0; c < SCREEN_SPEED_CLASSES; c++) {
+        counts[c] = screen_split(data, len, screen_chunk_size(c), NULL);
+        total += counts[c];
+    }
+
+    screen = malloc(sizeof(*screen) + total * sizeof(int) + len + 1);
+    if (!screen)
+        return NULL;
+
+    ends = (int *)(screen + 1);
+    copy = (char *)(ends + total);
+    memcpy(copy, data, len);
+    copy[len] = '\0';
+
+    snprintf(screen->name, sizeof(screen->name), "%s", name);
+    screen->data = copy;
+    screen->len = len;
+    screen->chunk_end = ends;
+    screen->refs = 1;  /* Reference held by the cache */
+
+    screen->first[0] = 0;
+    for (c = 0; c < SCREEN_SPEED_CLASSES; c++) {
+        screen_split(copy, len, screen_chunk_size(c), ends + screen->first[c]);
+        screen->first[c + 1] = screen->first[c] + counts[c];
+    }
+
+    return screen;
+}
+
+/*
+ * Names the cache ignores (hidden files, editor backups)
+ */
+static int screen_skip_name(const char *name)
+{
+    size_t len = strlen(name);
+
+    return name[0] == '.' || len == 0 || name[len - 1] == '~' ||
+           len >= sizeof(((screen_t *)0)->name);
+}
+
+/*
+ * Read one screen file from the screen directory
+ */
+static screen_t *screen_read(const char *name)
+{
+    char path[sizeof(screen_path) + 64];
+    struct stat st;
+    screen_t *screen = NULL;
+    char *data;
+    ssize_t n;
+    int fd, len = 0;
+
+    snprintf(path, sizeof(path), "%s/%s", screen_path, name);
+
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return NULL;
+
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+        close(fd);
+        return NULL;
+    }
+
+    if (st.st_size > SCREEN_MAX_SIZE) {
+        print_error("Screen %s too large (%lld bytes)", name, (long long)st.st_size);
+        close(fd);
+        return NULL;
+    }
+
+    data = malloc(st.st_size + 1);
+    if (data) {
+        while (len < st.st_size) {
+            n = read(fd, data + len, st.st_size - len);
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n <= 0)
+                break;
+            len += n;
+        }
+        screen = screen_cache_build(name, data, len);
+        free(data);
+    }
+
+    close(fd);
+    return screen;
+}
+
+/*
+ * Put a screen into the cache, replacing one of the same name
+ * screen == NULL removes name.
+ */
+static void screen_store(const char *name, screen_t *screen)
+{
+    screen_t *old = NULL;
+    int i;
+
+    pthread_mutex_lock(&screen_lock);
+
+    for (i = 0; i < screen_count; i++) {
+        if (strcmp(screens[i]->name, name) == 0)
+            break;
+    }
+
+    if (i < screen_count) {
+        old = screens[i];
+        if (screen)
+            screens[i] = screen;
+        else
+            screens[i] = screens[--screen_count];
+    } else if (screen) {
+        if (screen_count < SCREEN_MAX) {
+            screens[screen_count++] = screen;
+        } else {
+            print_error("Screen cache full, %s not loaded", name);
+            old = screen;
+        }
+    }
+
+    pthread_mutex_unlock(&screen_lock);
+
+    if (old)
+        screen_cache_release(old);
+}
+
+/*
+ * Load every screen in dir and watch it for changes
+ * Returns the number of screens loaded, or ERROR_GENERAL.
+ */
+int screen_cache_load(const char *dir)
+{
+    struct dirent *entry;
+    screen_t *screen;
+    DIR *d;
+    int loaded = 0;
+
+    if (!dir || dir[0] == '\0')
+        return ERROR_GENERAL;
+
+    snprintf(screen_path, sizeof(screen_path), "%s", dir);
+
+    d = opendir(screen_path);
+    if (!d) {
+        print_error("Cannot open screen directory %s: %s", screen_path, strerror(errno));
+        return ERROR_GENERAL;
+    }
+
+    while ((entry = readdir(d)) != NULL) {
+        if (screen_skip_name(entry->d_name))
+            continue;
+
+        screen = screen_read(entry->d_name);
+        if (screen) {
+            screen_store(entry->d_name, screen);
+            loaded++;
+        }
+    }
+
+    closedir(d);
+
+    if (screen_watch_fd < 0) {
+        screen_watch_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+        if (screen_watch_fd >= 0 &&
+            inotify_add_watch(screen_watch_fd, screen_path,
+                              IN_CLOSE_WRITE | IN_MOVED_TO | IN_DELETE | IN_MOVED_FROM) < 0) {
+            print_error("Cannot watch %s: %s", screen_path, strerror(errno));
+            close(screen_watch_fd);
+            screen_watch_fd = -1;
+        }
+    }
+
+    print_message("Screen cache: %d screen(s) loaded from %s", loaded, screen_path);
+    return loaded;
+}
+
+/*
+ * inotify descriptor for the event loop (-1 if not watching)
+ */
+int screen_cache_watch_fd(void)
+{
+    return screen_watch_fd;
+}
+
+/*
+ * Drain inotify events, refreshing or dropping the screens that changed
+ */
+void screen_cache_watch_handle(void)
+{
+    char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    const struct inotify_event *event;
+    ssize_t n;
+    char *p;
+
+    if (screen_watch_fd < 0)
+        return;
+
+    while ((n = read(screen_watch_fd, buf, sizeof(buf))) > 0) {
+        for (p = buf; p < buf + n; p += sizeof(struct inotify_event) + event->len) {
+            event = (const struct inotify_event *)p;
+            if (event->len == 0 || screen_skip_name(event->name))
+                continue;
+
+            if (event->mask & (IN_DELETE | IN_MOVED_FROM)) {
+                screen_store(event->name, NULL);
+            } else {
+                screen_store(event->name, screen_read(event->name));
+                if (config.verbose_mode)
+                    print_message("Screen %s refreshed", event->name);
+            }
+        }
+    }
+}
+
+/*
+ * Take a reference to a cached screen (NULL if not cached)
+ */
+screen_t *screen_cache_acquire(const char *name)
+{
+    screen_t *screen = NULL;
+    int i;
+
+    if (!name)
+        return NULL;
+
+    pthread_mutex_lock(&screen_lock);
+    for (i = 0; i < screen_count; i++) {
+        if (strcmp(screens[i]->name, name) == 0) {
+            screen = screens[i];
+            screen->refs++;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&screen_lock);
+
+    return screen;
+}
+
+/*
+ * Drop a screen reference; the last one frees it
+ */
+void screen_cache_release(screen_t *screen)
+{
+    int refs;
+
+    if (!screen)
+        return;
+
+    pthread_mutex_lock(&screen_lock);
+    refs = --screen->refs;
+    pthread_mutex_unlock(&screen_lock);
+
+    if (refs == 0)
+        free(screen);
+}
+
+/*
+ * Chunk 'index' of a screen for a speed class
+ * Returns the chunk length (0 past the last chunk) and sets *data.
+ */
+int screen_chunk(const screen_t *screen, int speed_class, int index, const char **data)
+{
+    int first, start;
+
+    if (!screen || speed_class < 0 || speed_class >= SCREEN_SPEED_CLASSES)
+        return 0;
+
+    first = screen->first[speed_class];
+    if (index < 0 || first + index >= screen->first[speed_class + 1])
+        return 0;
+
+    start = index > 0 ? screen->chunk_end[first + index - 1] : 0;
+    *data = screen->data + start;
+    return screen->chunk_end[first + index] - start;
+}
+
+/*
+ * Send a cached screen to the port in the chunks of the connect speed
+ * Carrier is verified before every chunk; writes follow the line pace
+ * (serial_tx.c) and go through serial_write_wait(), so captures, metrics,
+ * signals and carrier loss see them like any other output.  Returns
+ * SUCCESS, ERROR_HANGUP, ERROR_TIMEOUT, ERROR_PORT, or ERROR_GENERAL if
+ * the screen is not cached or the wait was interrupted.
+ */
+int screen_cache_send(int fd, const char *name, int speed)
+{
+    screen_t *screen;
+    const char *data;
+    int speed_class, index, len, n, allowed, rc = SUCCESS;
+
+    screen = screen_cache_acquire(name);
+    if (!screen)
+        return ERROR_GENERAL;
+
+    speed_class = screen_speed_class(speed);
+
+    for (index = 0; rc == SUCCESS && (len = screen_chunk(screen, speed_class, index, &data)) > 0; index++) {
+        if (verify_carrier_before_send(fd) != SUCCESS) {
+            rc = ERROR_HANGUP;
+            break;
+        }
+
+        while (len > 0) {
+            allowed = serial_tx_wait(fd, len);
+            if (allowed < 0) {
+                rc = allowed;
+                break;
+            }
+
+            rc = serial_write_wait(fd, data, allowed < len ? allowed : len, SCREEN_STALL_MS, &n);
+            serial_tx_account(fd, n);
+            data += n;
+            len -= n;
+            if (rc < 0)
+                break;
+            rc = SUCCESS;
+        }
+    }
+
+    screen_cache_release(screen);
+    return rc;
+}
+
+/*
+ * Drop all screens and stop watching the directory
+ */
+void screen_cache_unload(void)
+{
+    screen_t *old[SCREEN_MAX];
+    int i, count;
+
+    pthread_mutex_lock(&screen_lock);
+    count = screen_count;
+    memcpy(old, screens, count * sizeof(screens[0]));
+    screen_count = 0;
+    pthread_mutex_unlock(&screen_lock);
+
+    for (i = 0; i < count; i++)
+        screen_cache_release(old[i]);
+
+    if (screen_watch_fd >= 0) {
+        close(screen_watch_fd);
+        screen_watch_fd = -1;
+    }
+}
@@ -1,193 +1,393 @@
+/*****************************************************************************
+ * Serial Port Module
+ * Opening, locking, configuring and closing the modem port
+ * Based on MBSE BBS mbcico/openport.c and lib/ttyio.c
+ *
+ * The port is opened O_NONBLOCK with CLOCAL set, so AT commands work
+ * before there is a carrier; enable_carrier_detect() clears CLOCAL once a
+ * call is up and a dropped DCD then ends reads with EOF/EIO.  Ports are
+ * locked UUCP style (/var/lock/LCK..ttyXX) so two programs never share a
+ * modem.  Reads go through the receive ring (serial_ring.c) and writes
+ * through the output queue (output_queue.c), so captures and metrics see
+ * every byte.
+ *****************************************************************************/
+
+#include "modem_sample.h"
+#include <limits.h>
+
+#define MAX_PORT_LOCKS  16
+#define LOCK_DIR        "/var/lock"
+
+typedef struct {
+    int fd;                     /* Port holding the lock, -1 = being opened */
+    char path[PATH_MAX];
+} port_lock_t;
+
+static port_lock_t port_locks[MAX_PORT_LOCKS];
+static int lock_count = 0;
+static pthread_mutex_t lock_mutex = PTHREAD_MUTEX_INITIALIZER;
+
 /*
- * serial_port.c
- * Serial port communication functions for modem connection
+ * termios speed for a baud rate (B0 if the rate is not supported)
  */
+static speed_t baud_to_speed(int baudrate)
+{
+    switch (baudrate) {
+        case 300:    return B300;
+        case 1200:   return B1200;
+        case 2400:   return B2400;
+        case 4800:   return B4800;
+        case 9600:   return B9600;
+        case 19200:  return B19200;
+        case 38400:  return B38400;
+        case 57600:  return B57600;
+        case 115200: return B115200;
+        case 230400: return B230400;
+        default:     return B0;
+    }
+}
+
+/*
+ * Create the UUCP lock file of a device
+ * A lock left by a process that no longer runs is removed.  Returns
+ * SUCCESS (also when the lock directory is not writable: the port is then
+ * used unlocked), or ERROR_PORT if another process holds the port.
+ */
+int lock_port(const char *device)
+{
+    char path[PATH_MAX], pidbuf[16];
+    const char *devname;
+    port_lock_t *lock;
+    ssize_t n;
+    int fd, pid, len;
+
+    if (!device)
+        return ERROR_GENERAL;
+
+    devname = strrchr(device, '/');
+    devname = devname ? devname + 1 : device;
+    snprintf(path, sizeof(path), "%s/LCK..%s", LOCK_DIR, devname);
+
+    fd = open(path, O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW | O_CLOEXEC, 0644);
+    if (fd < 0 && errno == EEXIST) {
+        pid = 0;
+        fd = open(path, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+        if (fd >= 0) {
+            n = read(fd, pidbuf, sizeof(pidbuf) - 1);
+            close(fd);
+            if (n > 0) {
+                pidbuf[n] = '\0';
+                pid = atoi(pidbuf);
+            }
+        }
+
+        if (pid > 0 && (kill(pid, 0) == 0 || errno == EPERM)) {
+            print_error("Port %s locked by process %d", device, pid);
+            return ERROR_PORT;
+        }
+
+        print_message("Removing stale lock file %s", path);
+        unlink(path);
+        fd = open(path, O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW | O_CLOEXEC, 0644);
+    }
 
-#include <stdio.h>
-#include <stdlib.h>
-#include <string.h>
-#include <unistd.h>
-#include <fcntl.h>
-#include <errno.h>
-#include <termios.h>
-#include <sys/select.h>
-#include <time.h>
-
-// Function to configure serial port
-int configure_serial_port(const char* device_path, int baud_rate) {
-    int fd;
-    struct termios tty;
-    
-    // Open serial port
-    fd = open(device_path, O_RDWR | O_NOCTTY);
     if (fd < 0) {
-        perror("Error opening serial port");
-        return -1;
+        print_error("Cannot create lock file %s: %s (port not locked)", path, strerror(errno));
+        return SUCCESS;
     }
-    
-    // Get current terminal attributes
-    if (tcgetattr(fd, &tty) != 0) {
-        perror("Error getting terminal attributes");
-        close(fd);
-        return -1;
+
+    len = snprintf(pidbuf, sizeof(pidbuf), "%10d\n", (int)getpid());
+    if (write(fd, pidbuf, len) != len)
+        print_error("Cannot write lock file %s: %s", path, strerror(errno));
+    close(fd);
+
+    pthread_mutex_lock(&lock_mutex);
+    if (lock_count < MAX_PORT_LOCKS) {
+        lock = &port_locks[lock_count++];
+        lock->fd = -1;
+        snprintf(lock->path, sizeof(lock->path), "%s", path);
     }
-    
-    // Change baud rate
-    cfsetospeed(&tty, baud_rate);
-    cfsetispeed(&tty, baud_rate);
-    
-    // Configure for raw communication
-    tty.c_cflag |= (CLOCAL | CREAD);
-    tty.c_cflag &= ~PARENB;
-    tty.c_cflag &= ~CSTOPB;
-    tty.c_cflag &= ~CSIZE;
-    tty.c_cflag |= CS8;
-    tty.c_cflag &= ~CRTSCTS;
-    
-    tty.c_lflag &= ~ICANON;
-    tty.c_lflag &= ~ECHO;
-    tty.c_lflag &= ~ECHOE;
-    tty.c_lflag &= ~ISIG;
-    
-    tty.c_iflag &= ~IXON;
-    tty.c_iflag &= ~IXOFF;
-    tty.c_iflag &= ~IGNBRK;
-    tty.c_iflag &= ~ISTRIP;
-    
-    tty.c_oflag &= ~OPOST;
-    
-    // Set timeout for read
-    tty.c_cc[VMIN] = 0;
-    tty.c_cc[VTIME] = 10; // 1 second timeout
-    
-    // Apply settings
-    if (tcsetattr(fd, TCSANOW, &tty) != 0) {
-        perror("Error setting terminal attributes");
-        close(fd);
-        return -1;
+    pthread_mutex_unlock(&lock_mutex);
+
+    return SUCCESS;
+}
+
+/*
+ * Remove the lock of one port (fd >= 0), or all locks this process holds
+ */
+static void unlock_fd(int fd)
+{
+    int i;
+
+    pthread_mutex_lock(&lock_mutex);
+    for (i = 0; i < lock_count; ) {
+        if (fd >= 0 && port_locks[i].fd != fd) {
+            i++;
+            continue;
+        }
+        unlink(port_locks[i].path);
+        port_locks[i] = port_locks[--lock_count];
     }
-    
-    return fd;
+    pthread_mutex_unlock(&lock_mutex);
 }
 
-// Function to send data to serial port
-int serial_send(int fd, const char* data, size_t length) {
-    ssize_t n;
-    
-    n = write(fd, data, length);
-    if (n < 0) {
-        perror("Error writing to serial port");
-        return -1;
+void unlock_port(void)
+{
+    unlock_fd(-1);
+}
+
+/*
+ * Hand the lock just taken by lock_port() to the opened port, or drop it
+ * (fd < 0) when the open failed
+ */
+static void claim_lock(int fd)
+{
+    int i;
+
+    pthread_mutex_lock(&lock_mutex);
+    for (i = lock_count - 1; i >= 0; i--) {
+        if (port_locks[i].fd != -1)
+            continue;
+        if (fd >= 0) {
+            port_locks[i].fd = fd;
+        } else {
+            unlink(port_locks[i].path);
+            port_locks[i] = port_locks[--lock_count];
+        }
+        break;
     }
-    
-    return n;
+    pthread_mutex_unlock(&lock_mutex);
 }
 
-// Function to receive data from serial port
-int serial_receive(int fd, char* buffer, size_t buffer_size, int timeout_seconds) {
-    fd_set readfds;
-    struct timeval timeout;
-    ssize_t n;
-    int result;
-    
-    // Set up the timeout
-    timeout.tv_sec = timeout_seconds;
-    timeout.tv_usec = 0;
-    
-    // Set up file descriptor set
-    FD_ZERO(&readfds);
-    FD_SET(fd, &readfds);
-    
-    // Wait for data to be available
-    result = select(fd + 1, &readfds, NULL, NULL, &timeout);
-    
-    if (result < 0) {
-        perror("Error in select");
-        return -1;
-    } else if (result == 0) {
-        // Timeout
-        return 0;
+/*
+ * Open and lock a modem port: raw 8N1 (or as configured) at baudrate,
+ * CLOCAL set, non-blocking
+ * Returns the file descriptor or ERROR_PORT.
+ */
+int open_serial_port(const char *device, int baudrate)
+{
+    struct termios tios;
+    speed_t speed;
+    int fd;
+
+    if (!device)
+        return ERROR_PORT;
+
+    speed = baud_to_speed(baudrate);
+    if (speed == B0) {
+        print_error("Unsupported baud rate %d", baudrate);
+        return ERROR_PORT;
     }
-    
-    if (FD_ISSET(fd, &readfds)) {
-        n = read(fd, buffer, buffer_size - 1);
-        if (n < 0) {
-            perror("Error reading from serial port");
-            return -1;
-        }
-        
-        buffer[n] = '\0';
-        return n;
+
+    if (lock_port(device) != SUCCESS)
+        return ERROR_PORT;
+
+    fd = open(device, O_RDWR | O_NOCTTY | O_NONBLOCK | O_CLOEXEC);
+    if (fd < 0) {
+        print_error("Cannot open %s: %s", device, strerror(errno));
+        claim_lock(-1);
+        return ERROR_PORT;
     }
-    
-    return -1;
-}
-
-// Function to send AT command and receive response
-int send_at_command(int fd, const char* command, char* response, size_t response_size, int timeout) {
-    char terminator[2] = "\r";
-    char full_command[256];
-    int result;
-    
-    // Format command with CR terminator
-    snprintf(full_command, sizeof(full_command), "%s%s", command, terminator);
-    
-    // Send command
-    result = serial_send(fd, full_command, strlen(full_command));
-    if (result < 0) {
-        return -1;
+
+    claim_lock(fd);
+
+    if (tcgetattr(fd, &tios) != 0) {
+        print_error("tcgetattr %s: %s", device, strerror(errno));
+        close_serial_port(fd);
+        return ERROR_PORT;
     }
-    
-    // Read response
-    result = serial_receive(fd, response, response_size, timeout);
-    if (result < 0) {
-        return -1;
+
+    cfmakeraw(&tios);
+    tios.c_cflag |= CLOCAL | CREAD | HUPCL;
+
+    tios.c_cflag &= ~CSIZE;
+    switch (config.data_bits) {
+        case 5:  tios.c_cflag |= CS5; break;
+        case 6:  tios.c_cflag |= CS6; break;
+        case 7:  tios.c_cflag |= CS7; break;
+        default: tios.c_cflag |= CS8; break;
     }
-    
-    return result;
-}
-
-// Function to check if modem is responding
-int modem_test_connection(int fd) {
-    char response[256];
-    
-    // Send basic AT command
-    if (send_at_command(fd, "AT", response, sizeof(response), 3) > 0) {
-        // Check if we got a proper response
-        if (strstr(response, "OK") != NULL || strstr(response, "ERROR") != NULL) {
-            return 1; // Modem is responding
-        }
+
+    tios.c_cflag &= ~(PARENB | PARODD);
+    if (strcasecmp(config.parity, "EVEN") == 0)
+        tios.c_cflag |= PARENB;
+    else if (strcasecmp(config.parity, "ODD") == 0)
+        tios.c_cflag |= PARENB | PARODD;
+
+    if (config.stop_bits == 2)
+        tios.c_cflag |= CSTOPB;
+    else
+        tios.c_cflag &= ~CSTOPB;
+
+    tios.c_cflag &= ~CRTSCTS;
+    tios.c_iflag &= ~(IXON | IXOFF);
+    if (strcasecmp(config.flow_control, "RTSCTS") == 0 ||
+        strcasecmp(config.flow_control, "HARDWARE") == 0)
+        tios.c_cflag |= CRTSCTS;
+    else if (strcasecmp(config.flow_control, "XONXOFF") == 0 ||
+             strcasecmp(config.flow_control, "SOFTWARE") == 0)
+        tios.c_iflag |= IXON | IXOFF;
+
+    tios.c_cc[VMIN] = 1;
+    tios.c_cc[VTIME] = 0;
+    cfsetispeed(&tios, speed);
+    cfsetospeed(&tios, speed);
+
+    if (tcsetattr(fd, TCSANOW, &tios) != 0) {
+        print_error("tcsetattr %s: %s", device, strerror(errno));
+        close_serial_port(fd);
+        return ERROR_PORT;
     }
-    
-    return 0; // Modem not responding
-}
-
-// Function to wait for specific response from modem
-int wait_for_response(int fd, const char* expected_response, char* response, size_t response_size, int timeout_seconds) {
-    char buffer[256];
-    int total_read = 0;
-    int remaining_timeout = timeout_seconds;
-    int result;
-    
-    while (remaining_timeout > 0) {
-        // Read data
-        result = serial_receive(fd, buffer, sizeof(buffer) - 1, 1);
-        
-        if (result > 0) {
-            buffer[result] = '\0';
-            strcat(response, buffer);
-            total_read += result;
-            
-            // Check if we found the expected response
-            if (strstr(response, expected_response) != NULL) {
-                return 0; // Success
-            }
-        } else if (result < 0) {
-            return -1; // Error
-        }
-        
-        remaining_timeout--;
+
+    tcflush(fd, TCIOFLUSH);
+    return fd;
+}
+
+/*
+ * Close a port and remove its lock
+ */
+void close_serial_port(int fd)
+{
+    if (fd < 0)
+        return;
+
+    outq_release(fd);  /* The number is reused by the next open */
+    close(fd);
+    unlock_fd(fd);
+}
+
+/*
+ * Write a whole buffer through the port's output queue
+ * Small writes are coalesced; reading the port (serial_ring_fill) or
+ * outq_flush() sends them.  enable_transmission_log dumps them to the
+ * log.  Returns len or an error code.
+ */
+int serial_write(int fd, const char *data, int len)
+{
+    if (config.enable_transmission_log && data && len > 0)
+        log_data(fd, "TX", data, len);
+
+    return outq_write(fd, data, len);
+}
+
+void serial_flush_input(int fd)
+{
+    tcflush(fd, TCIFLUSH);
+    serial_ring_reset(fd);
+}
+
+void serial_flush_output(int fd)
+{
+    tcflush(fd, TCOFLUSH);
+}
+
+/*
+ * Bytes that can be read without waiting (receive ring and driver)
+ */
+int serial_check_available(int fd)
+{
+    int n = 0;
+
+    if (ioctl(fd, FIONREAD, &n) < 0)
+        n = 0;
+
+    return n + serial_ring_pending(fd);
+}
+
+/*
+ * Let the port see DCD: clear CLOCAL once a call is connected
+ */
+int enable_carrier_detect(int fd)
+{
+    struct termios tios;
+
+    if (tcgetattr(fd, &tios) != 0)
+        return ERROR_PORT;
+
+    tios.c_cflag &= ~CLOCAL;
+    if (tcsetattr(fd, TCSANOW, &tios) != 0)
+        return ERROR_PORT;
+
+    return SUCCESS;
+}
+
+/*
+ * Hang up in hardware: drop DTR (speed B0) for a second, then restore
+ */
+int dtr_drop_hangup(int fd)
+{
+    struct termios tios, saved;
+
+    if (fd < 0)
+        return ERROR_GENERAL;
+
+    if (tcgetattr(fd, &saved) != 0) {
+        print_error("tcgetattr failed: %s", strerror(errno));
+        return ERROR_PORT;
     }
-    
-    return -1; // Timeout
-}
\ No newline at end of file
+
+    tios = saved;
+    tios.c_cflag |= CLOCAL;  /* The hangup itself must not raise I/O errors */
+    cfsetispeed(&tios, B0);
+    cfsetospeed(&tios, B0);
+    if (tcsetattr(fd, TCSANOW, &tios) != 0) {
+        print_error("tcsetattr failed: %s", strerror(errno));
+        return ERROR_PORT;
+    }
+
+    sleep(1);
+
+    saved.c_cflag |= CLOCAL;
+    if (tcsetattr(fd, TCSANOW, &saved) != 0) {
+        print_error("tcsetattr failed: %s", strerror(errno));
+        return ERROR_PORT;
+    }
+
+    return SUCCESS;
+}
+
+/*
+ * Change the port speed (DTE rate) of an open port
+ */
+int adjust_serial_speed(int fd, int new_baudrate)
+{
+    struct termios tios;
+    speed_t speed = baud_to_speed(new_baudrate);
+
+    if (speed == B0 || tcgetattr(fd, &tios) != 0)
+        return ERROR_PORT;
+
+    cfsetispeed(&tios, speed);
+    cfsetospeed(&tios, speed);
+
+    return tcsetattr(fd, TCSANOW, &tios) == 0 ? SUCCESS : ERROR_PORT;
+}
+
+/*
+ * DCD state: 1 = carrier, 0 = no carrier, -1 = error
+ * Devices without modem status lines (a PTY) report a carrier.
+ */
+int check_carrier_status(int fd)
+{
+    int status;
+
+    if (ioctl(fd, TIOCMGET, &status) < 0)
+        return (errno == ENOTTY || errno == EINVAL) ? 1 : -1;
+
+    return (status & TIOCM_CAR) ? 1 : 0;
+}
+
+/*
+ * Before sending: is the call still up?  With CLOCAL set (no call yet,
+ * or carrier detect off) the carrier is not checked.
+ * Returns SUCCESS or ERROR_HANGUP.
+ */
+int verify_carrier_before_send(int fd)
+{
+    struct termios tios;
+
+    if (tcgetattr(fd, &tios) == 0 && (tios.c_cflag & CLOCAL))
+        return SUCCESS;
+
+    return check_carrier_status(fd) == 0 ? ERROR_HANGUP : SUCCESS;
+}
@@ -0,0 +1,422 @@
+/*****************************************************************************
+ * Serial Receive Ring Module
+ * Per-port receive buffer with zero-copy line extraction
+ * Based on MBSE BBS mbcico/ttyio.c TT_BUFSIZ buffer with left/next pointers
+ *
+ * Input is pulled in with one large read() per wakeup.  Complete lines are
+ * handed out as pointer+length views into the buffer: the CR/LF terminator
+ * is overwritten with '\0' in place, so a view is also a C string and
+ * nothing is copied.  A scan offset remembers how far the buffer has been
+ * searched for a terminator, so every received byte is examined once.
+ *****************************************************************************/
+
+#include "modem_sample.h"
+#include <poll.h>
+
+#define MAX_SERIAL_RINGS    64
+
+static serial_ring_t rings[MAX_SERIAL_RINGS];
+static int ring_count = 0;
+
+/*
+ * Monotonic clock in milliseconds, for deadlines immune to clock changes
+ */
+long long monotonic_ms(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+/*
+ * Monotonic clock in microseconds (token refill, latency metrics)
+ */
+long long monotonic_us(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+/*
+ * Get the receive ring of a port, creating it on first use
+ */
+serial_ring_t *serial_ring_get(int fd)
+{
+    int i;
+
+    if (fd < 0)
+        return NULL;
+
+    for (i = 0; i < ring_count; i++) {
+        if (rings[i].fd == fd)
+            return &rings[i];
+    }
+
+    /* Reuse a released slot */
+    for (i = 0; i < ring_count; i++) {
+        if (rings[i].fd < 0)
+            break;
+    }
+
+    if (i == ring_count) {
+        if (ring_count >= MAX_SERIAL_RINGS) {
+            print_error("serial_ring_get: too many open ports");
+            return NULL;
+        }
+        ring_count++;
+    }
+
+    rings[i].fd = fd;
+    rings[i].next = 0;
+    rings[i].left = 0;
+    rings[i].scan = 0;
+
+    return &rings[i];
+}
+
+/*
+ * Release the ring of a port that is being closed
+ */
+void serial_ring_release(int fd)
+{
+    serial_ring_t *ring;
+    int i;
+
+    for (i = 0; i < ring_count; i++) {
+        ring = &rings[i];
+        if (ring->fd == fd) {
+            ring->fd = -1;
+            ring->next = ring->left = ring->scan = 0;
+            return;
+        }
+    }
+}
+
+/*
+ * Discard buffered input (pair with serial_flush_input)
+ */
+void serial_ring_reset(int fd)
+{
+    serial_ring_t *ring = serial_ring_get(fd);
+
+    if (ring)
+        ring->next = ring->left = ring->scan = 0;
+}
+
+/*
+ * Number of buffered, unconsumed bytes
+ */
+int serial_ring_pending(int fd)
+{
+    serial_ring_t *ring = serial_ring_get(fd);
+
+    return ring ? ring->left : 0;
+}
+
+/*
+ * Make room at the tail by moving unconsumed bytes to the front
+ * Returns 0 if the ring is full (the caller must consume first), else 1.
+ */
+static int serial_ring_compact(serial_ring_t *ring)
+{
+    if (ring->next > 0) {
+        if (ring->left > 0)
+            memmove(ring->buf, ring->buf + ring->next, ring->left);
+        ring->next = 0;
+    }
+
+    return ring->left < RX_RING_SIZE;
+}
+
+/*
+ * One read() of whatever the driver holds into the ring tail
+ * Returns bytes read (0 if nothing was pending), ERROR_HANGUP or ERROR_PORT.
+ */
+static int serial_ring_read_port(serial_ring_t *ring)
+{
+    ssize_t n;
+
+    n = read(ring->fd, ring->buf + ring->left, RX_RING_SIZE - ring->left);
+    if (n < 0) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+            return 0;
+        if (errno == EPIPE || errno == ECONNRESET || errno == EIO)
+            return ERROR_HANGUP;
+        return ERROR_PORT;
+    }
+    if (n == 0)
+        return ERROR_HANGUP;  /* Readable with no data: the other end hung up */
+
+    capture_data(ring->fd, CAPTURE_RX, ring->buf + ring->left, n);
+    metrics_rx(ring->fd, n);
+    if (config.enable_transmission_log)
+        log_data(ring->fd, "RX", ring->buf + ring->left, n);
+    ring->left += n;
+    return n;
+}
+
+/*
+ * Read as much as fits into the ring, waiting up to timeout_ms for data
+ * Returns bytes read, ERROR_TIMEOUT, ERROR_HANGUP or ERROR_PORT.
+ * Invalidates previously returned line views.
+ */
+int serial_ring_fill(serial_ring_t *ring, int timeout_ms)
+{
+    int rc;
+
+    if (!ring || ring->fd < 0)
+        return ERROR_GENERAL;
+
+    if (!serial_ring_compact(ring))
+        return 0;  /* Full: caller must consume first */
+
+    /* A prompt still in the output queue must go out before we wait for the answer */
+    rc = outq_flush(ring->fd);
+    if (rc == ERROR_HANGUP)
+        return rc;
+
+    /* Also ends on a signal or a dropped carrier (signal_event.c) */
+    rc = serial_wait_io(ring->fd, POLLIN, timeout_ms);
+    if (rc != SUCCESS)
+        return rc;
+
+    return serial_ring_read_port(ring);
+}
+
+/*
+ * Read what the driver already holds, without waiting
+ * For an event loop that was told the port is readable: signals, carrier
+ * events and config reloads are its own events, so nothing here takes
+ * them (unlike serial_wait_io).
+ * Returns bytes read (0 if nothing was pending or the ring is full),
+ * ERROR_HANGUP or ERROR_PORT.  Invalidates previously returned line views.
+ */
+int serial_ring_fill_ready(serial_ring_t *ring)
+{
+    if (!ring || ring->fd < 0)
+        return ERROR_GENERAL;
+
+    if (!serial_ring_compact(ring))
+        return 0;
+
+    return serial_ring_read_port(ring);
+}
+
+/*
+ * Extract the next complete line from buffered data
+ * Empty lines (the CR/LF pairs around modem responses) are skipped.
+ * Returns 1 and fills *line if a line is available, 0 otherwise.
+ */
+int serial_ring_next_line(serial_ring_t *ring, serial_line_t *line)
+{
+    char *start, *p, *end;
+
+    if (!ring || !line)
+        return 0;
+
+    for (;;) {
+        start = ring->buf + ring->next;
+        end = start + ring->left;
+        p = start + ring->scan;
+
+        /* Only bytes not seen by a previous call are scanned */
+        while (p < end && *p != '\r' && *p != '\n')
+            p++;
+
+        if (p == end) {
+            if (ring->left < RX_RING_SIZE) {
+                ring->scan = ring->left;
+                return 0;
+            }
+            /* Buffer full without terminator: hand out what we have */
+        }
+
+        *p = '\0';  /* Terminator (or spare byte past a full buffer) */
+        line->data = start;
+        line->len = p - start;
+
+        if (p < end)
+            p++;
+        ring->left -= p - start;
+        ring->next += p - start;
+        ring->scan = 0;
+
+        if (line->len > 0)
+            return 1;
+    }
+}
+
+/*
+ * Consume all buffered bytes as one view (raw data after CONNECT)
+ * Returns the number of bytes in the view.
+ */
+int serial_ring_take(serial_ring_t *ring, const char **data)
+{
+    int len;
+
+    if (!ring || ring->left == 0)
+        return 0;
+
+    *data = ring->buf + ring->next;
+    len = ring->left;
+
+    ring->next += len;
+    ring->left = 0;
+    ring->scan = 0;
+
+    return len;
+}
+
+/*
+ * Take one byte, waiting up to timeout_ms for input (protocol replies)
+ * Returns the byte (0-255), ERROR_TIMEOUT or another error code.
+ */
+int serial_ring_getc(serial_ring_t *ring, int timeout_ms)
+{
+    long long deadline;
+    int remaining, rc;
+
+    if (!ring)
+        return ERROR_GENERAL;
+
+    if (ring->left == 0) {
+        deadline = monotonic_ms() + timeout_ms;
+        do {
+            remaining = (int)(deadline - monotonic_ms());
+            if (remaining < 0)
+                return ERROR_TIMEOUT;
+            rc = serial_ring_fill(ring, remaining);
+            if (rc < 0)
+                return rc;
+        } while (ring->left == 0);
+    }
+
+    ring->left--;
+    if (ring->scan > 0)
+        ring->scan--;
+    return (unsigned char)ring->buf[ring->next++];
+}
+
+/*
+ * Take exactly len bytes (protocol blocks), waiting up to timeout_ms for
+ * all of them
+ * Returns len, ERROR_TIMEOUT or another error code.
+ */
+int serial_ring_read(serial_ring_t *ring, void *buf, int len, int timeout_ms)
+{
+    char *p = buf;
+    long long deadline;
+    int got = 0, n, remaining, rc;
+
+    if (!ring || !buf || len < 0)
+        return ERROR_GENERAL;
+
+    deadline = monotonic_ms() + timeout_ms;
+
+    while (got < len) {
+        if (ring->left == 0) {
+            remaining = (int)(deadline - monotonic_ms());
+            if (remaining < 0)
+                return ERROR_TIMEOUT;
+            rc = serial_ring_fill(ring, remaining);
+            if (rc < 0)
+                return rc;
+            continue;
+        }
+
+        n = ring->left < len - got ? ring->left : len - got;
+        memcpy(p + got, ring->buf + ring->next, n);
+        ring->next += n;
+        ring->left -= n;
+        got += n;
+    }
+
+    ring->scan = 0;
+    return len;
+}
+
+/*
+ * Wait up to timeout_ms for a complete line on a port
+ * Returns the line length, ERROR_TIMEOUT or another error code.
+ */
+int serial_ring_read_line(int fd, serial_line_t *line, int timeout_ms)
+{
+    serial_ring_t *ring = serial_ring_get(fd);
+    long long deadline;
+    int remaining, rc;
+
+    if (!ring || !line)
+        return ERROR_GENERAL;
+
+    deadline = monotonic_ms() + timeout_ms;
+
+    while (!serial_ring_next_line(ring, line)) {
+        remaining = (int)(deadline - monotonic_ms());
+        if (remaining <= 0)
+            return ERROR_TIMEOUT;
+
+        rc = serial_ring_fill(ring, remaining);
+        if (rc < 0)
+            return rc;
+    }
+
+    return line->len;
+}
+
+/*
+ * Read whatever is buffered, waiting up to timeout seconds for input
+ * Returns the number of bytes (at most size), ERROR_TIMEOUT or another
+ * error code.
+ */
+int serial_read(int fd, char *buffer, int size, int timeout)
+{
+    serial_ring_t *ring = serial_ring_get(fd);
+    int rc, n;
+
+    if (!ring || !buffer || size <= 0)
+        return ERROR_GENERAL;
+
+    if (ring->left == 0) {
+        rc = serial_ring_fill(ring, timeout * 1000);
+        if (rc < 0)
+            return rc;
+        if (ring->left == 0)
+            return ERROR_TIMEOUT;
+    }
+
+    n = ring->left < size ? ring->left : size;
+    memcpy(buffer, ring->buf + ring->next, n);
+    ring->next += n;
+    ring->left -= n;
+    ring->scan = ring->scan > n ? ring->scan - n : 0;
+
+    return n;
+}
+
+/*
+ * Read one line into a caller buffer (timeout in seconds)
+ * Thin copying wrapper over the receive ring for existing callers.
+ */
+int serial_read_line(int fd, char *buffer, int size, int timeout)
+{
+    serial_line_t line;
+    int rc, len;
+
+    if (!buffer || size <= 0)
+        return ERROR_GENERAL;
+
+    rc = serial_ring_read_line(fd, &line, timeout * 1000);
+    if (rc < 0) {
+        buffer[0] = '\0';
+        return rc;
+    }
+
+    len = line.len < size - 1 ? line.len : size - 1;
+    memcpy(buffer, line.data, len);
+    buffer[len] = '\0';
+
+    return len;
+}
@@ -0,0 +1,374 @@
+/*****************************************************************************
+ * Serial Transmit Pacing Module
+ * Adaptive output pacing from the CONNECT speed and the driver queue
+ * Based on MBSE BBS mbcico/ttyio.c tty_write() and the TT_BUFSIZ chunking
+ * of buffered_serial_send()
+ *
+ * Fixed pacing (tx_chunk_size bytes, then tx_chunk_delay_us) is either too
+ * fast for a 2400 bps line or leaves a 33600 bps line idle; where it is
+ * still used, the delay derived from a CONNECT is kept per port
+ * (serial_tx_chunk_delay), not in the shared configuration.  Adaptive
+ * pacing sends at the negotiated line rate instead: a token bucket refills
+ * at line_rate / 10 bytes per second, and TIOCOUTQ keeps the kernel output
+ * queue below a high-water mark of tx_queue_ms of line time.  Output is
+ * topped up whenever half of that has drained, so the line never runs dry
+ * and the modem buffer never overflows.
+ *
+ * Ports are driven O_NONBLOCK.  A writer that finds the driver buffer full
+ * sleeps in poll(POLLOUT) and wakes the moment there is room, instead of
+ * retrying after a fixed delay; it gives up only when the port has taken
+ * nothing for tx_write_timeout_ms.
+ *****************************************************************************/
+
+#include "modem_sample.h"
+#include <limits.h>
+#include <poll.h>
+
+#define MAX_TX_PACERS       64
+#define TX_QUEUE_MIN        16      /* Smallest high-water mark (bytes) */
+#define TX_QUEUE_MAX        4000    /* Below the 4 KiB tty output buffer */
+
+typedef struct {
+    int fd;
+    int line_rate;          /* Negotiated line rate (bps), 0 = not paced */
+    int port_rate;          /* DTE rate the driver queue drains at */
+    int high_water;         /* Max bytes in the output queue */
+    double tokens;          /* Bytes the line has room for */
+    long long stamp_us;     /* Last token refill */
+} tx_pacer_t;
+
+static tx_pacer_t pacers[MAX_TX_PACERS];
+static int pacer_count = 0;
+
+/* Fixed pacing delay per port, set from the CONNECT speed */
+typedef struct {
+    int fd;                 /* -1 = free slot */
+    int delay_us;
+} tx_delay_t;
+
+static tx_delay_t delays[MAX_TX_PACERS];
+static int delay_count = 0;
+
+/*
+ * Pacer of a port (NULL if the port is not paced)
+ */
+static tx_pacer_t *pacer_find(int fd)
+{
+    int i;
+
+    for (i = 0; i < pacer_count; i++) {
+        if (pacers[i].fd == fd && pacers[i].line_rate > 0)
+            return &pacers[i];
+    }
+
+    return NULL;
+}
+
+/*
+ * Pace a port at line_rate after CONNECT
+ * port_rate is the DTE rate (connect_dte_rate).  queue_ms <= 0 or an
+ * unknown line rate turns pacing off for the port.
+ */
+void serial_tx_pace(int fd, int line_rate, int port_rate, int queue_ms)
+{
+    tx_pacer_t *pacer = NULL;
+    int i;
+
+    for (i = 0; i < pacer_count; i++) {
+        if (pacers[i].fd == fd) {
+            pacer = &pacers[i];
+            break;
+        }
+    }
+
+    if (line_rate <= 0 || queue_ms <= 0) {
+        if (pacer)
+            pacer->line_rate = 0;
+        return;
+    }
+
+    if (!pacer) {
+        for (i = 0; i < pacer_count; i++) {
+            if (pacers[i].line_rate == 0)
+                break;
+        }
+        if (i == pacer_count) {
+            if (pacer_count >= MAX_TX_PACERS)
+                return;  /* Unpaced rather than failing the call */
+            pacer_count++;
+        }
+        pacer = &pacers[i];
+    }
+
+    pacer->fd = fd;
+    pacer->line_rate = line_rate;
+    pacer->port_rate = port_rate > line_rate ? port_rate : line_rate;
+    pacer->high_water = (int)((long long)line_rate / 10 * queue_ms / 1000);
+    if (pacer->high_water < TX_QUEUE_MIN)
+        pacer->high_water = TX_QUEUE_MIN;
+    if (pacer->high_water > TX_QUEUE_MAX)
+        pacer->high_water = TX_QUEUE_MAX;
+    pacer->tokens = pacer->high_water;
+    pacer->stamp_us = monotonic_us();
+}
+
+/*
+ * Set the fixed pacing delay of an unpaced port (connect_tx_delay_us);
+ * delay_us < 0 goes back to config.tx_chunk_delay_us
+ */
+void serial_tx_chunk_delay(int fd, int delay_us)
+{
+    int i, slot = -1;
+
+    for (i = 0; i < delay_count; i++) {
+        if (delays[i].fd == fd) {
+            slot = i;
+            break;
+        }
+        if (delays[i].fd < 0 && slot < 0)
+            slot = i;
+    }
+
+    if (delay_us < 0) {
+        if (slot >= 0 && delays[slot].fd == fd)
+            delays[slot].fd = -1;
+        return;
+    }
+
+    if (slot < 0) {
+        if (delay_count >= MAX_TX_PACERS)
+            return;  /* Configured delay rather than failing the call */
+        slot = delay_count++;
+    }
+
+    delays[slot].fd = fd;
+    delays[slot].delay_us = delay_us;
+}
+
+/*
+ * Fixed pacing delay of a port: set from its CONNECT, else the configured one
+ */
+int serial_tx_delay_us(int fd)
+{
+    int i;
+
+    for (i = 0; i < delay_count; i++) {
+        if (delays[i].fd == fd)
+            return delays[i].delay_us;
+    }
+
+    return config.tx_chunk_delay_us;
+}
+
+/*
+ * Stop pacing a port (hangup or close)
+ */
+void serial_tx_release(int fd)
+{
+    serial_tx_pace(fd, 0, 0, 0);
+    serial_tx_chunk_delay(fd, -1);
+}
+
+/*
+ * Bytes that may be written now without outrunning the line
+ * Returns at least min(want, high_water / 2) bytes, or 0 with *wait_us
+ * set to the time until that much is allowed.  Unpaced ports get INT_MAX.
+ */
+int serial_tx_allowance(int fd, int want, int *wait_us)
+{
+    tx_pacer_t *pacer = pacer_find(fd);
+    long long now, token_us, queue_us;
+    int queued = 0, room, threshold;
+
+    if (wait_us)
+        *wait_us = 0;
+
+    if (!pacer)
+        return INT_MAX;
+
+    now = monotonic_us();
+    pacer->tokens += (double)(now - pacer->stamp_us) * pacer->line_rate / 10 / 1000000;
+    if (pacer->tokens > pacer->high_water)
+        pacer->tokens = pacer->high_water;
+    pacer->stamp_us = now;
+
+    if (ioctl(fd, TIOCOUTQ, &queued) != 0 || queued < 0)
+        queued = 0;  /* No queue information: the token bucket alone paces */
+
+    room = pacer->high_water - queued;
+    if (room > (int)pacer->tokens)
+        room = (int)pacer->tokens;
+
+    threshold = pacer->high_water / 2;
+    if (want > 0 && want < threshold)
+        threshold = want;
+
+    if (room >= threshold && room > 0)
+        return room;
+
+    /* Time until the line has taken enough, and the queue drained enough */
+    token_us = (long long)(threshold - pacer->tokens) * 10 * 1000000 / pacer->line_rate;
+    queue_us = (long long)(queued + threshold - pacer->high_water) * 10 * 1000000 / pacer->port_rate;
+
+    if (wait_us)
+        *wait_us = (int)(token_us > queue_us ? token_us : queue_us) + 1;
+    return 0;
+}
+
+/*
+ * Charge bytes written to a paced port against its token bucket
+ */
+void serial_tx_account(int fd, int bytes)
+{
+    tx_pacer_t *pacer = pacer_find(fd);
+
+    if (pacer && bytes > 0)
+        pacer->tokens -= bytes;
+}
+
+/*
+ * Block until at least min(want, high_water / 2) bytes may be written
+ * The wait ends early on a signal (signal_event_sleep).  Returns the
+ * allowance, ERROR_GENERAL if interrupted or ERROR_HANGUP on a tty hangup.
+ */
+int serial_tx_wait(int fd, int want)
+{
+    int allowed, wait_us, rc;
+
+    for (;;) {
+        allowed = serial_tx_allowance(fd, want, &wait_us);
+        if (allowed > 0)
+            return allowed;
+
+        rc = signal_event_sleep((wait_us + 999) / 1000);
+        if (rc != SUCCESS)
+            return rc;
+    }
+}
+
+/*
+ * Put a port in non-blocking mode (writes return EAGAIN when the driver
+ * buffer is full; see serial_wait_writable)
+ */
+int serial_set_nonblocking(int fd)
+{
+    int flags;
+
+    flags = fcntl(fd, F_GETFL);
+    if (flags < 0)
+        return ERROR_PORT;
+    if (!(flags & O_NONBLOCK) && fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0)
+        return ERROR_PORT;
+
+    return SUCCESS;
+}
+
+/*
+ * Wait until the driver has room for output
+ * timeout_ms < 0 uses tx_write_timeout_ms.  Returns SUCCESS, ERROR_TIMEOUT,
+ * ERROR_HANGUP (also on carrier loss), ERROR_PORT, or ERROR_GENERAL if
+ * interrupted.
+ */
+int serial_wait_writable(int fd, int timeout_ms)
+{
+    if (timeout_ms < 0)
+        timeout_ms = config.tx_write_timeout_ms;
+
+    /* Also ends on a signal or a dropped carrier (signal_event.c) */
+    return serial_wait_io(fd, POLLOUT, timeout_ms);
+}
+
+/*
+ * Write a whole buffer to a non-blocking port
+ * A partial write resumes at the first unwritten byte once poll() reports
+ * room.  timeout_ms bounds the time without progress (< 0: the
+ * tx_write_timeout_ms default).  If sent is not NULL it is set to the bytes
+ * written, also on error.  Returns len, ERROR_HANGUP (EPIPE, ECONNRESET,
+ * EIO or POLLHUP), ERROR_TIMEOUT, ERROR_PORT or ERROR_GENERAL.
+ */
+int serial_write_wait(int fd, const char *data, int len, int timeout_ms, int *sent)
+{
+    ssize_t n;
+    int done = 0, rc = SUCCESS;
+
+    if (fd < 0 || !data || len < 0)
+        return ERROR_GENERAL;
+
+    while (done < len) {
+        n = write(fd, data + done, len - done);
+        if (n > 0) {
+            capture_data(fd, CAPTURE_TX, data + done, n);
+            metrics_tx(fd, n);
+            done += n;
+            continue;
+        }
+
+        if (n < 0 && errno == EINTR && !interrupted)
+            continue;
+        if (n < 0 && (errno == EPIPE || errno == ECONNRESET || errno == EIO)) {
+            rc = ERROR_HANGUP;
+            break;
+        }
+        if (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
+            rc = interrupted ? ERROR_GENERAL : ERROR_PORT;
+            break;
+        }
+
+        /* Driver buffer full: sleep until it drains */
+        metrics_write_retry(fd);
+        rc = serial_wait_writable(fd, timeout_ms);
+        if (rc != SUCCESS)
+            break;
+    }
+
+    if (sent)
+        *sent = done;
+    return rc == SUCCESS ? len : rc;
+}
+
+/*
+ * Send a buffer at the pace of the line (blocking)
+ * Paced ports follow the line rate (serial_tx_pace); others fall back to
+ * fixed pacing: tx_chunk_size bytes, then serial_tx_delay_us().  Carrier is verified
+ * before every chunk; pacing waits end on a signal.  Returns len,
+ * ERROR_HANGUP, ERROR_TIMEOUT, ERROR_PORT or ERROR_GENERAL (interrupted).
+ */
+int serial_paced_send(int fd, const char *data, int len)
+{
+    int sent = 0, chunk, paced, delay_us, n, rc;
+
+    if (fd < 0 || !data || len < 0)
+        return ERROR_GENERAL;
+
+    paced = pacer_find(fd) != NULL;
+    delay_us = serial_tx_delay_us(fd);
+
+    while (sent < len) {
+        if (paced) {
+            chunk = serial_tx_wait(fd, len - sent);
+            if (chunk < 0)
+                return chunk;
+        } else {
+            chunk = config.tx_chunk_size > 0 ? config.tx_chunk_size : len;
+        }
+        if (chunk > len - sent)
+            chunk = len - sent;
+
+        if (verify_carrier_before_send(fd) != SUCCESS)
+            return ERROR_HANGUP;
+
+        rc = serial_write_wait(fd, data + sent, chunk, -1, &n);
+        sent += n;
+        serial_tx_account(fd, n);
+        if (rc < 0)
+            return rc;
+
+        if (!paced && delay_us > 0 && sent < len) {
+            rc = signal_event_sleep((delay_us + 999) / 1000);
+            if (rc != SUCCESS)
+                return rc;
+        }
+    }
+
+    return sent;
+}
@@ -0,0 +1,250 @@
+/*****************************************************************************
+ * Signal Event Module
+ * Signals delivered through signalfd into the serial I/O wait
+ * Based on MBSE BBS lib/signame.c and the die() / hangup handling of
+ * mbcico/mbcico.c
+ *
+ * With a plain handler, SIGINT or SIGTERM only sets 'interrupted'.  A
+ * caller blocked in poll() for an AT response would notice it only after
+ * at_answer_timeout.  Here SIGINT, SIGTERM, SIGQUIT and SIGHUP are
+ * blocked and read from a signalfd.  Every blocking serial wait polls
+ * that descriptor next to the port, along with the port's carrier watch
+ * (carrier_watch.c) and the configuration watch (config.c).  A signal or
+ * a dropped DCD therefore ends the wait immediately:
+ * - SIGINT, SIGTERM and SIGQUIT end it with ERROR_GENERAL.
+ * - Carrier loss ends it with ERROR_HANGUP, so the caller starts the
+ *   modem_hangup() sequence.
+ *
+ * SIGHUP is told apart by its sender.  kill(1) means reload the
+ * configuration (config_request_reload).  The kernel sends SIGHUP on
+ * carrier loss on a controlling tty, and that counts as a hangup.
+ * Reload requests are served inside the wait, so a blocking caller picks
+ * up the new snapshot with config_sync() between calls.
+ *****************************************************************************/
+
+#include "modem_sample.h"
+#include <poll.h>
+#include <sys/signalfd.h>
+
+static int signal_fd = -1;
+static volatile sig_atomic_t hangup_pending = 0;
+static pthread_once_t signal_once = PTHREAD_ONCE_INIT;
+
+static void signal_event_open(void)
+{
+    sigset_t mask;
+
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGINT);
+    sigaddset(&mask, SIGTERM);
+    sigaddset(&mask, SIGQUIT);
+    sigaddset(&mask, SIGHUP);
+
+    /* Threads started from now on inherit the mask */
+    if (pthread_sigmask(SIG_BLOCK, &mask, NULL) != 0) {
+        print_error("Cannot block signals for signalfd");
+        return;
+    }
+
+    signal_fd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+    if (signal_fd < 0) {
+        print_error("signalfd failed: %s", strerror(errno));
+        pthread_sigmask(SIG_UNBLOCK, &mask, NULL);  /* Back to the handlers */
+    }
+}
+
+/*
+ * Route the termination and hangup signals through a signalfd
+ * Call early in main(), before other threads start: threads started
+ * earlier could still take the signal themselves.  Returns the
+ * descriptor to poll, or ERROR_GENERAL (signal handlers stay in charge).
+ */
+int signal_event_init(void)
+{
+    pthread_once(&signal_once, signal_event_open);
+    return signal_fd >= 0 ? signal_fd : ERROR_GENERAL;
+}
+
+/*
+ * The signalfd, or -1 before signal_event_init()
+ */
+int signal_event_fd(void)
+{
+    return signal_fd;
+}
+
+/*
+ * Read and act on pending signals
+ * Returns ERROR_GENERAL if a termination signal was taken (interrupted is
+ * set), ERROR_HANGUP on a kernel SIGHUP (carrier loss), else SUCCESS.
+ */
+int signal_event_handle(void)
+{
+    struct signalfd_siginfo info;
+    int rc = SUCCESS;
+    ssize_t n;
+
+    if (signal_fd < 0)
+        return interrupted ? ERROR_GENERAL : SUCCESS;
+
+    for (;;) {
+        n = read(signal_fd, &info, sizeof(info));
+        if (n != (ssize_t)sizeof(info))
+            break;
+
+        switch (info.ssi_signo) {
+        case SIGHUP:
+            if (info.ssi_code == SI_KERNEL) {
+                print_message("Carrier lost (SIGHUP from the tty)");
+                hangup_pending = 1;
+            } else {
+                config_request_reload();
+            }
+            break;
+        default:
+            print_message("Received signal %d, shutting down", (int)info.ssi_signo);
+            interrupted = 1;
+            break;
+        }
+    }
+
+    if (interrupted)
+        rc = ERROR_GENERAL;
+    else if (hangup_pending)
+        rc = ERROR_HANGUP;
+
+    return rc;
+}
+
+/*
+ * Sleep for timeout_ms, ending early on a termination signal or a tty
+ * hangup (for pacing and retry delays, where no port is waited on)
+ * Returns SUCCESS once the time is up, else as signal_event_handle().
+ */
+int signal_event_sleep(int timeout_ms)
+{
+    struct pollfd pfd;
+    long long deadline = monotonic_ms() + timeout_ms;
+    int wait_ms, rc;
+
+    for (;;) {
+        rc = signal_event_handle();
+        if (rc != SUCCESS)
+            return rc;
+
+        wait_ms = (int)(deadline - monotonic_ms());
+        if (wait_ms <= 0)
+            return SUCCESS;
+
+        if (signal_fd < 0) {
+            usleep(wait_ms * 1000);  /* Handlers set interrupted; EINTR ends the sleep */
+            continue;
+        }
+
+        pfd.fd = signal_fd;
+        pfd.events = POLLIN;
+        pfd.revents = 0;
+        poll(&pfd, 1, wait_ms);
+    }
+}
+
+/*
+ * Forget a tty hangup once modem_hangup() has dealt with it
+ */
+void signal_event_clear_hangup(void)
+{
+    hangup_pending = 0;
+}
+
+/*
+ * Wait for a serial port to become ready for events (POLLIN / POLLOUT)
+ * Also wakes for signals and for a DCD drop on a watched port, so no
+ * blocking read or write outlives a shutdown or a lost carrier, and
+ * reloads the configuration when asked to.
+ * Returns SUCCESS, ERROR_TIMEOUT, ERROR_HANGUP (carrier lost or POLLHUP),
+ * ERROR_PORT, or ERROR_GENERAL when interrupted.
+ */
+int serial_wait_io(int fd, short events, int timeout_ms)
+{
+    struct pollfd pfd[4];
+    carrier_event_t ev;
+    long long deadline = 0;
+    int nfds = 1, carrier_slot = -1, config_slot = -1, wait_ms = timeout_ms, rc;
+
+    if (timeout_ms >= 0)
+        deadline = monotonic_ms() + timeout_ms;
+
+    pfd[0].fd = fd;
+    pfd[0].events = events;
+
+    if (signal_fd >= 0) {
+        pfd[nfds].fd = signal_fd;
+        pfd[nfds].events = POLLIN;
+        nfds++;
+    }
+
+    pfd[nfds].fd = carrier_watch_fd(fd);
+    if (pfd[nfds].fd >= 0) {
+        pfd[nfds].events = POLLIN;
+        carrier_slot = nfds++;
+    }
+
+    pfd[nfds].fd = config_watch_fd();
+    if (pfd[nfds].fd >= 0) {
+        pfd[nfds].events = POLLIN;
+        config_slot = nfds++;
+    }
+
+    for (;;) {
+        if (interrupted)
+            return ERROR_GENERAL;
+        if (hangup_pending)
+            return ERROR_HANGUP;
+
+        for (rc = 0; rc < nfds; rc++)
+            pfd[rc].revents = 0;
+
+        rc = poll(pfd, nfds, wait_ms);
+        if (rc < 0) {
+            if (errno != EINTR)
+                return ERROR_PORT;
+        } else if (rc == 0) {
+            return ERROR_TIMEOUT;
+        } else {
+            if (nfds > 1 && pfd[1].fd == signal_fd && (pfd[1].revents & POLLIN)) {
+                rc = signal_event_handle();
+                if (rc != SUCCESS)
+                    return rc;
+            }
+
+            if (config_slot > 0 && (pfd[config_slot].revents & POLLIN))
+                config_watch_handle();
+            config_check_reload();
+
+            if (carrier_slot > 0 && (pfd[carrier_slot].revents & POLLIN)) {
+                /* A blocking caller owns the watch: take its events here */
+                while (carrier_watch_read(fd, &ev) == 1) {
+                    if (!(ev.lines & TIOCM_CD)) {
+                        print_error("Carrier lost during serial I/O");
+                        metrics_carrier_drop(fd);
+                        return ERROR_HANGUP;
+                    }
+                }
+            }
+
+            if (pfd[0].revents & POLLNVAL)
+                return ERROR_PORT;
+            if (pfd[0].revents & (events | POLLHUP | POLLERR)) {
+                if ((pfd[0].revents & (POLLHUP | POLLERR)) && !(pfd[0].revents & events))
+                    return ERROR_HANGUP;
+                return SUCCESS;
+            }
+        }
+
+        if (timeout_ms >= 0) {
+            wait_ms = (int)(deadline - monotonic_ms());
+            if (wait_ms < 0)
+                wait_ms = 0;
+        }
+    }
+}
@@ -0,0 +1,250 @@
+/*****************************************************************************
+ * Write-Behind Module
+ * Large, aligned file output on a writer thread for uploads
+ * Based on MBSE BBS mbcico/zmrecv.c (file buffering of received data)
+ *
+ * A receiver that write()s every subpacket stops reading the port each
+ * time the disk is slow, and at 33600 bps the UART overruns within a few
+ * hundred ms.  Received data goes into page-aligned buffers of
+ * WRITE_BEHIND_BUFFER_SIZE bytes instead; a full buffer is handed to the
+ * file's writer thread and the receiver carries on in the next one.  With
+ * WRITE_BEHIND_BUFFERS buffers (1 MB) the disk may stall for five minutes at
+ * 33600 bps before the receiver has to wait for it.  Callers decode
+ * straight into the buffer (write_behind_reserve) and commit only data
+ * whose CRC checked out, so a damaged block costs no copy.
+ *****************************************************************************/
+
+#include "modem_sample.h"
+#include <sys/stat.h>
+
+#define WRITE_BEHIND_ALIGN  4096
+
+/*
+ * Writer thread: write out queued buffers, oldest first
+ */
+static void *write_behind_thread(void *arg)
+{
+    write_behind_t *wb = arg;
+    const char *p;
+    ssize_t n;
+    int len, err;
+
+    pthread_mutex_lock(&wb->lock);
+
+    for (;;) {
+        while (wb->queued == 0 && !wb->closing)
+            pthread_cond_wait(&wb->cond, &wb->lock);
+        if (wb->queued == 0)
+            break;
+
+        p = wb->buf[wb->head];
+        len = wb->len[wb->head];
+        pthread_mutex_unlock(&wb->lock);
+
+        err = 0;
+        while (len > 0) {
+            n = write(wb->fd, p, len);
+            if (n < 0) {
+                if (errno == EINTR)
+                    continue;
+                err = errno;
+                break;
+            }
+            p += n;
+            len -= n;
+        }
+
+        pthread_mutex_lock(&wb->lock);
+        if (err && !wb->error)
+            wb->error = err;
+        wb->head = (wb->head + 1) % WRITE_BEHIND_BUFFERS;
+        wb->queued--;
+        pthread_cond_broadcast(&wb->cond);
+    }
+
+    pthread_mutex_unlock(&wb->lock);
+    return NULL;
+}
+
+/*
+ * Open path for writing from offset on and start its writer thread
+ * Offset 0 creates a new file and fails if path exists.  A resume (offset
+ * > 0) reopens the existing regular file, keeps its first offset bytes and
+ * truncates the rest.  Symlinks are never followed.
+ */
+int write_behind_open(write_behind_t *wb, const char *path, off_t offset)
+{
+    struct stat st;
+    int i;
+
+    if (!wb || !path || offset < 0)
+        return ERROR_GENERAL;
+
+    memset(wb, 0, sizeof(*wb));
+
+    if (offset > 0)
+        wb->fd = open(path, O_WRONLY | O_NOFOLLOW | O_CLOEXEC);
+    else
+        wb->fd = open(path, O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW | O_CLOEXEC, 0644);
+    if (wb->fd < 0) {
+        print_error("Cannot %s %s: %s", offset > 0 ? "reopen" : "create", path, strerror(errno));
+        return ERROR_GENERAL;
+    }
+
+    if (fstat(wb->fd, &st) != 0 || !S_ISREG(st.st_mode) || st.st_size < offset) {
+        print_error("Cannot resume %s: not a regular file of at least %lld bytes",
+                    path, (long long)offset);
+        close(wb->fd);
+        return ERROR_GENERAL;
+    }
+
+    if (ftruncate(wb->fd, offset) != 0 || lseek(wb->fd, offset, SEEK_SET) != offset) {
+        print_error("Cannot position %s: %s", path, strerror(errno));
+        close(wb->fd);
+        return ERROR_GENERAL;
+    }
+
+    for (i = 0; i < WRITE_BEHIND_BUFFERS; i++) {
+        if (posix_memalign((void **)&wb->buf[i], WRITE_BEHIND_ALIGN, WRITE_BEHIND_BUFFER_SIZE) != 0) {
+            while (--i >= 0)
+                free(wb->buf[i]);
+            close(wb->fd);
+            return ERROR_GENERAL;
+        }
+    }
+
+    pthread_mutex_init(&wb->lock, NULL);
+    pthread_cond_init(&wb->cond, NULL);
+
+    if (pthread_create(&wb->thread, NULL, write_behind_thread, wb) != 0) {
+        print_error("write_behind_open: cannot start writer thread");
+        for (i = 0; i < WRITE_BEHIND_BUFFERS; i++)
+            free(wb->buf[i]);
+        pthread_cond_destroy(&wb->cond);
+        pthread_mutex_destroy(&wb->lock);
+        close(wb->fd);
+        return ERROR_GENERAL;
+    }
+
+    wb->total = offset;
+    return SUCCESS;
+}
+
+/*
+ * Queue the buffer being filled for the writer and move to the next one,
+ * waiting only if every buffer is still queued (disk far behind)
+ */
+static int write_behind_handoff(write_behind_t *wb)
+{
+    int rc;
+
+    pthread_mutex_lock(&wb->lock);
+
+    wb->len[wb->fill] = wb->used;
+    wb->queued++;
+    wb->fill = (wb->fill + 1) % WRITE_BEHIND_BUFFERS;
+    pthread_cond_broadcast(&wb->cond);
+
+    if (wb->queued == WRITE_BEHIND_BUFFERS) {
+        wb->stalls++;
+        while (wb->queued == WRITE_BEHIND_BUFFERS)
+            pthread_cond_wait(&wb->cond, &wb->lock);
+    }
+    rc = wb->error ? ERROR_GENERAL : SUCCESS;
+
+    pthread_mutex_unlock(&wb->lock);
+
+    wb->used = 0;
+    return rc;
+}
+
+/*
+ * Room for len bytes (at most WRITE_BEHIND_BUFFER_SIZE) in the buffer
+ * being filled; the data counts once write_behind_commit() is called
+ */
+unsigned char *write_behind_reserve(write_behind_t *wb, int len)
+{
+    if (len > WRITE_BEHIND_BUFFER_SIZE)
+        return NULL;
+
+    if (wb->used + len > WRITE_BEHIND_BUFFER_SIZE && write_behind_handoff(wb) != SUCCESS)
+        return NULL;
+
+    /* fill is only moved by the caller's thread; the writer never touches it */
+    return (unsigned char *)wb->buf[wb->fill] + wb->used;
+}
+
+/*
+ * Accept len bytes written at the last write_behind_reserve() pointer
+ */
+void write_behind_commit(write_behind_t *wb, int len)
+{
+    wb->used += len;
+    wb->total += len;
+}
+
+/*
+ * Copy data into the buffers
+ */
+int write_behind_write(write_behind_t *wb, const void *data, int len)
+{
+    const char *p = data;
+    unsigned char *dst;
+    int n;
+
+    while (len > 0) {
+        n = WRITE_BEHIND_BUFFER_SIZE - wb->used;
+        if (n == 0)
+            n = WRITE_BEHIND_BUFFER_SIZE;
+        if (n > len)
+            n = len;
+
+        dst = write_behind_reserve(wb, n);
+        if (!dst)
+            return ERROR_GENERAL;
+        memcpy(dst, p, n);
+        write_behind_commit(wb, n);
+        p += n;
+        len -= n;
+    }
+
+    return SUCCESS;
+}
+
+/*
+ * Write out what is buffered, stop the writer and close the file
+ * Returns SUCCESS, or ERROR_GENERAL if any write failed.
+ */
+int write_behind_close(write_behind_t *wb)
+{
+    int i, rc = SUCCESS;
+
+    if (!wb || wb->fd < 0)
+        return ERROR_GENERAL;
+
+    if (wb->used > 0)
+        write_behind_handoff(wb);
+
+    pthread_mutex_lock(&wb->lock);
+    wb->closing = 1;
+    pthread_cond_broadcast(&wb->cond);
+    pthread_mutex_unlock(&wb->lock);
+    pthread_join(wb->thread, NULL);
+
+    if (wb->error) {
+        print_error("Upload write failed: %s", strerror(wb->error));
+        rc = ERROR_GENERAL;
+    }
+    if (close(wb->fd) != 0)
+        rc = ERROR_GENERAL;
+    wb->fd = -1;
+
+    for (i = 0; i < WRITE_BEHIND_BUFFERS; i++) {
+        free(wb->buf[i]);
+        wb->buf[i] = NULL;
+    }
+    pthread_cond_destroy(&wb->cond);
+    pthread_mutex_destroy(&wb->lock);
+
+    return rc;
+}
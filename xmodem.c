@@ -0,0 +1,643 @@
+/*****************************************************************************
+ * XMODEM/YMODEM Module
+ * XMODEM-CRC and YMODEM-1K batch file sender, YMODEM batch receiver
+ * Based on MBSE BBS mbcico/xmsend.c and the XMODEM/YMODEM Protocol
+ * Reference (Forsberg, 1988)
+ *
+ * Blocks are built in place in one frame buffer per transfer: the file is
+ * read straight behind the 3-byte header and the CRC (crc.c, slice-by-8)
+ * is appended, so nothing is allocated or copied per block.  YMODEM sends
+ * 1K blocks (STX), which cuts the per-block overhead and the ACK round
+ * trips to 1/8 of 128-byte XMODEM; 128-byte blocks are used for short
+ * tails to limit padding.  Frames go out through serial_paced_send() at
+ * the pace of the line.  The receiver's ACK/NAK/CAN is read from the
+ * receive ring with serial_ring_getc(), whose wait ends at once on a
+ * signal or a dropped carrier (signal_event.c).
+ *
+ * The receiver copies each block from the receive ring straight into the
+ * write-behind buffer of the file (write_behind.c), checks the CRC over
+ * the whole block there and commits it only if it matches.
+ *****************************************************************************/
+
+#include "modem_sample.h"
+#include <sys/stat.h>
+
+#define SOH             0x01
+#define STX             0x02
+#define EOT             0x04
+#define ACK             0x06
+#define NAK             0x15
+#define CAN             0x18
+#define CPMEOF          0x1A
+
+#define XM_START_MS     60000   /* Receiver has this long to send 'C' or NAK */
+#define XM_ACK_MS       10000   /* Per-block ACK timeout */
+#define XM_RETRIES      10      /* Per block, NAKs and timeouts together */
+#define XM_FRAME_MAX    (3 + 1024 + 2)
+
+typedef struct {
+    int fd;
+    serial_ring_t *ring;
+    int crc;                            /* CRC-16, else 8-bit checksum */
+    int use_1k;                         /* STX blocks allowed */
+    unsigned char block;                /* Next block number */
+    int first;                          /* Next block is the first after 'C'/NAK */
+    unsigned char frame[XM_FRAME_MAX];  /* Header, data and check of one block (sender) */
+    xfer_stats_t *stats;
+} xm_session_t;
+
+/*
+ * Abort the transfer on the receiver side (CANs, then BS to wipe them
+ * from a terminal)
+ */
+static void xm_cancel(xm_session_t *xm)
+{
+    static const char abort_seq[] = "\030\030\030\030\030\030\030\030\b\b\b\b\b\b\b\b";
+
+    serial_paced_send(xm->fd, abort_seq, sizeof(abort_seq) - 1);
+}
+
+/*
+ * Turn path into the name of a file that does not exist yet: an upload
+ * never replaces a file, a second one is stored as name.1, name.2, ...
+ * Returns SUCCESS, or ERROR_GENERAL if no free name was found.
+ */
+int xfer_upload_unique(char *path, size_t size)
+{
+    char base[512];
+    struct stat st;
+    int n;
+
+    if (lstat(path, &st) != 0 && errno == ENOENT)
+        return SUCCESS;
+
+    snprintf(base, sizeof(base), "%s", path);
+    for (n = 1; n < 100; n++) {
+        if (snprintf(path, size, "%s.%d", base, n) >= (int)size)
+            break;
+        if (lstat(path, &st) != 0 && errno == ENOENT)
+            return SUCCESS;
+    }
+
+    snprintf(path, size, "%s", base);
+    return ERROR_GENERAL;
+}
+
+/*
+ * Discard input until the line has been quiet for quiet_ms (a second
+ * after a damaged block, so the NAK is not answered by the rest of it;
+ * 0 drops only what has already arrived)
+ */
+static void xm_purge(xm_session_t *xm, int quiet_ms)
+{
+    while (serial_ring_getc(xm->ring, quiet_ms) >= 0)
+        ;
+}
+
+/*
+ * Read the receiver's next control byte
+ * Returns ACK, NAK, 'C', CAN (after two in a row), ERROR_TIMEOUT or
+ * another error code; anything else is line noise and skipped.
+ */
+static int xm_reply(xm_session_t *xm, int timeout_ms)
+{
+    long long deadline = monotonic_ms() + timeout_ms;
+    int c, cans = 0, remaining;
+
+    for (;;) {
+        remaining = (int)(deadline - monotonic_ms());
+        if (remaining < 0)
+            return ERROR_TIMEOUT;
+
+        c = serial_ring_getc(xm->ring, remaining);
+        if (c < 0)
+            return c;
+
+        if (c == CAN) {
+            if (++cans >= 2)
+                return CAN;
+            continue;
+        }
+        cans = 0;
+
+        if (c == ACK || c == NAK || c == 'C')
+            return c;
+    }
+}
+
+/*
+ * Wait for the receiver to ask for the first block: 'C' selects CRC-16,
+ * NAK the checksum (XMODEM only)
+ */
+static int xm_wait_start(xm_session_t *xm, int allow_checksum)
+{
+    long long deadline = monotonic_ms() + XM_START_MS;
+    int c, remaining;
+
+    for (;;) {
+        remaining = (int)(deadline - monotonic_ms());
+        if (remaining < 0)
+            return ERROR_TIMEOUT;
+
+        c = xm_reply(xm, remaining);
+        if (c < 0)
+            return c;
+        if (c == CAN)
+            return ERROR_GENERAL;
+
+        if (c == 'C' || (c == NAK && allow_checksum)) {
+            xm->crc = c == 'C';
+            if (!xm->crc)
+                xm->use_1k = 0;     /* Checksum receivers predate 1K blocks */
+            xm->first = 1;
+            /* Receivers repeat 'C' while they wait: drop the queued ones */
+            xm_purge(xm, 0);
+            return SUCCESS;
+        }
+    }
+}
+
+/*
+ * Send the block in xm->frame (data already in place) until it is ACKed
+ */
+static int xm_send_block(xm_session_t *xm, int size)
+{
+    unsigned char *f = xm->frame;
+    unsigned short crc;
+    long long deadline;
+    int len, tries, rc, i, remaining;
+    unsigned char sum = 0;
+
+    f[0] = size == 1024 ? STX : SOH;
+    f[1] = xm->block;
+    f[2] = (unsigned char)~xm->block;
+
+    if (xm->crc) {
+        crc = crc16_update(0, f + 3, size);
+        f[3 + size] = (unsigned char)(crc >> 8);
+        f[4 + size] = (unsigned char)crc;
+        len = size + 5;
+    } else {
+        for (i = 0; i < size; i++)
+            sum += f[3 + i];
+        f[3 + size] = sum;
+        len = size + 4;
+    }
+
+    for (tries = 0; tries < XM_RETRIES; tries++) {
+        if (tries > 0 && xm->stats)
+            xm->stats->retries++;
+
+        rc = serial_paced_send(xm->fd, (const char *)f, len);
+        if (rc < 0)
+            return rc;
+
+        /* 'C' asks for the first block again (its ACK was lost); later it is stale */
+        deadline = monotonic_ms() + XM_ACK_MS;
+        do {
+            remaining = (int)(deadline - monotonic_ms());
+            rc = remaining < 0 ? ERROR_TIMEOUT : xm_reply(xm, remaining);
+        } while (rc == 'C' && !xm->first);
+
+        if (rc == ACK) {
+            xm->block++;
+            xm->first = 0;
+            if (xm->stats)
+                xm->stats->blocks++;
+            return SUCCESS;
+        }
+        if (rc == CAN)
+            return ERROR_GENERAL;
+        if (rc < 0 && rc != ERROR_TIMEOUT)
+            return rc;
+        /* NAK, 'C' for the first block, or timeout: send again */
+    }
+
+    xm_cancel(xm);
+    return ERROR_TIMEOUT;
+}
+
+/*
+ * Send EOT until the receiver ACKs it (many NAK the first one)
+ */
+static int xm_send_eot(xm_session_t *xm)
+{
+    const char eot = EOT;
+    int tries, rc;
+
+    for (tries = 0; tries < XM_RETRIES; tries++) {
+        rc = serial_paced_send(xm->fd, &eot, 1);
+        if (rc < 0)
+            return rc;
+
+        rc = xm_reply(xm, XM_ACK_MS);
+        if (rc == ACK)
+            return SUCCESS;
+        if (rc == CAN)
+            return ERROR_GENERAL;
+        if (rc < 0 && rc != ERROR_TIMEOUT)
+            return rc;
+    }
+
+    return ERROR_TIMEOUT;
+}
+
+/*
+ * Send the contents of an open file as data blocks, then EOT
+ */
+static int xm_send_data(xm_session_t *xm, int file_fd, off_t size)
+{
+    off_t left = size;
+    int block, n, got, rc;
+
+    while (left > 0) {
+        rc = signal_event_handle();
+        if (rc != SUCCESS) {
+            xm_cancel(xm);
+            return rc;
+        }
+
+        /* 1K blocks while the tail is long enough to fill most of one */
+        block = xm->use_1k && left > 896 ? 1024 : 128;
+
+        for (got = 0; got < block && got < left; got += n) {
+            n = read(file_fd, xm->frame + 3 + got, (left < block ? left : block) - got);
+            if (n <= 0) {
+                if (n < 0 && errno == EINTR) {
+                    n = 0;
+                    continue;
+                }
+                print_error("File read failed: %s", n < 0 ? strerror(errno) : "file shrank");
+                xm_cancel(xm);
+                return ERROR_GENERAL;
+            }
+        }
+        if (got < block)
+            memset(xm->frame + 3 + got, CPMEOF, block - got);
+
+        rc = xm_send_block(xm, block);
+        if (rc != SUCCESS)
+            return rc;
+
+        left -= got;
+        if (xm->stats)
+            xm->stats->bytes += got;
+    }
+
+    return xm_send_eot(xm);
+}
+
+static int xm_open(const char *path, struct stat *st)
+{
+    int file_fd;
+
+    file_fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (file_fd < 0) {
+        print_error("Cannot open %s: %s", path, strerror(errno));
+        return ERROR_GENERAL;
+    }
+
+    if (fstat(file_fd, st) != 0 || !S_ISREG(st->st_mode)) {
+        print_error("Not a regular file: %s", path);
+        close(file_fd);
+        return ERROR_GENERAL;
+    }
+
+    posix_fadvise(file_fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    return file_fd;
+}
+
+static int xm_init(xm_session_t *xm, int fd, xfer_stats_t *stats)
+{
+    memset(xm, 0, sizeof(*xm));
+    xm->fd = fd;
+    xm->ring = serial_ring_get(fd);
+    xm->stats = stats;
+    if (stats)
+        memset(stats, 0, sizeof(*stats));
+
+    if (!xm->ring)
+        return ERROR_GENERAL;
+
+    /* Output still queued would land in the middle of the protocol */
+    return outq_flush(fd);
+}
+
+/*
+ * Send one file with XMODEM-CRC (falls back to checksum if the receiver
+ * asks with NAK); use_1k allows 1K blocks for XMODEM-1K receivers
+ * Returns SUCCESS, ERROR_TIMEOUT, ERROR_HANGUP, or ERROR_GENERAL if either
+ * side cancelled.
+ */
+int xmodem_send(int fd, const char *path, int use_1k, xfer_stats_t *stats)
+{
+    xm_session_t xm;
+    struct stat st;
+    int file_fd, rc;
+
+    rc = xm_init(&xm, fd, stats);
+    if (rc != SUCCESS)
+        return rc;
+
+    file_fd = xm_open(path, &st);
+    if (file_fd < 0)
+        return file_fd;
+
+    xm.use_1k = use_1k;
+    xm.block = 1;
+
+    rc = xm_wait_start(&xm, 1);
+    if (rc == SUCCESS)
+        rc = xm_send_data(&xm, file_fd, st.st_size);
+
+    close(file_fd);
+
+    if (rc == SUCCESS && stats)
+        stats->files = 1;
+    return rc;
+}
+
+/*
+ * Block 0 of a YMODEM file: name, size, mtime (octal) and mode (octal);
+ * an empty name ends the batch
+ */
+static int ym_send_header(xm_session_t *xm, const char *path, const struct stat *st)
+{
+    const char *name;
+    int len, size;
+
+    memset(xm->frame + 3, 0, 1024);
+    xm->block = 0;
+
+    if (path) {
+        name = strrchr(path, '/');
+        name = name ? name + 1 : path;
+        len = snprintf((char *)xm->frame + 3, 1024, "%s", name) + 1;
+        if (len > 1024)
+            len = 1024;
+        snprintf((char *)xm->frame + 3 + len, 1024 - len, "%lld %llo %o",
+                 (long long)st->st_size, (unsigned long long)st->st_mtime,
+                 (unsigned int)(st->st_mode & 07777));
+        size = strlen((char *)xm->frame + 3 + len) + len < 128 ? 128 : 1024;
+    } else {
+        size = 128;
+    }
+
+    return xm_send_block(xm, size);
+}
+
+/*
+ * Send files as one YMODEM batch with 1K blocks
+ * Returns SUCCESS once the receiver has ACKed the end of the batch;
+ * stats->files counts the files delivered completely.
+ */
+int ymodem_send(int fd, const char *const *paths, int count, xfer_stats_t *stats)
+{
+    xm_session_t xm;
+    struct stat st;
+    int file_fd, rc, i;
+
+    rc = xm_init(&xm, fd, stats);
+    if (rc != SUCCESS)
+        return rc;
+
+    for (i = 0; i < count; i++) {
+        file_fd = xm_open(paths[i], &st);
+        if (file_fd < 0)
+            continue;  /* Skip it, the batch goes on */
+
+        if (config.verbose_mode)
+            print_message("YMODEM: sending %s (%lld bytes)", paths[i], (long long)st.st_size);
+
+        /* 'C' for the header, ACK, then 'C' again for the data */
+        xm.use_1k = 1;
+        rc = xm_wait_start(&xm, 0);
+        if (rc == SUCCESS)
+            rc = ym_send_header(&xm, paths[i], &st);
+        if (rc == SUCCESS)
+            rc = xm_wait_start(&xm, 0);
+        if (rc == SUCCESS)
+            rc = xm_send_data(&xm, file_fd, st.st_size);
+
+        close(file_fd);
+        if (rc != SUCCESS)
+            return rc;
+
+        if (stats)
+            stats->files++;
+    }
+
+    /* End of batch: an empty header block */
+    rc = xm_wait_start(&xm, 0);
+    if (rc == SUCCESS)
+        rc = ym_send_header(&xm, NULL, NULL);
+
+    return rc;
+}
+
+/*
+ * Where to store an upload named name (as sent by the other side) in dir:
+ * only the last path component, and nothing hidden or unprintable
+ * Returns SUCCESS, or ERROR_GENERAL for a name that is refused.
+ */
+int xfer_upload_path(const char *dir, const char *name, char *path, size_t size)
+{
+    const char *base, *p;
+
+    base = strrchr(name, '/');
+    base = base ? base + 1 : name;
+
+    if (base[0] == '\0' || base[0] == '.')
+        return ERROR_GENERAL;
+    for (p = base; *p; p++) {
+        if ((unsigned char)*p < 0x20 || *p == 0x7F || *p == '\\')
+            return ERROR_GENERAL;
+    }
+
+    if (snprintf(path, size, "%s/%s", dir && dir[0] ? dir : ".", base) >= (int)size)
+        return ERROR_GENERAL;
+
+    return SUCCESS;
+}
+
+static void xm_putc(xm_session_t *xm, int c)
+{
+    char b = (char)c;
+
+    serial_paced_send(xm->fd, &b, 1);
+}
+
+/*
+ * Receive one block into data (1024 bytes of room)
+ * Returns the block size with *block set, EOT, CAN, ERROR_GENERAL for a
+ * damaged block, ERROR_TIMEOUT or another error code.
+ */
+static int ym_recv_block(xm_session_t *xm, unsigned char *data, int *block, int timeout_ms)
+{
+    unsigned char num[2], check[2];
+    long long deadline = monotonic_ms() + timeout_ms;
+    int c, size, rc, remaining;
+
+    do {
+        remaining = (int)(deadline - monotonic_ms());
+        if (remaining < 0)
+            return ERROR_TIMEOUT;
+        c = serial_ring_getc(xm->ring, remaining);
+        if (c < 0)
+            return c;
+        if (c == CAN && serial_ring_getc(xm->ring, 1000) == CAN)
+            return CAN;
+    } while (c != SOH && c != STX && c != EOT);
+
+    if (c == EOT)
+        return EOT;
+
+    size = c == STX ? 1024 : 128;
+    if ((rc = serial_ring_read(xm->ring, num, 2, XM_ACK_MS)) < 0 ||
+        (rc = serial_ring_read(xm->ring, data, size, XM_ACK_MS)) < 0 ||
+        (rc = serial_ring_read(xm->ring, check, 2, XM_ACK_MS)) < 0)
+        return rc == ERROR_TIMEOUT ? ERROR_GENERAL : rc;
+
+    /* One pass over the whole block, slice-by-8 */
+    if (num[0] != (unsigned char)~num[1] ||
+        crc16_update(0, data, size) != (check[0] << 8 | check[1]))
+        return ERROR_GENERAL;
+
+    *block = num[0];
+    return size;
+}
+
+/*
+ * Receive the data blocks of one file into wb, up to EOT
+ */
+static int ym_recv_data(xm_session_t *xm, write_behind_t *wb, long long size)
+{
+    unsigned char *dst;
+    unsigned char expect = 1;
+    long long left = size;
+    int rc, block, n, errors = 0;
+
+    for (;;) {
+        dst = write_behind_reserve(wb, 1024);
+        if (!dst) {
+            xm_cancel(xm);
+            return ERROR_GENERAL;
+        }
+
+        rc = ym_recv_block(xm, dst, &block, XM_ACK_MS);
+        if (rc == EOT) {
+            xm_putc(xm, ACK);
+            return SUCCESS;
+        }
+        if (rc == CAN)
+            return ERROR_GENERAL;
+
+        if (rc > 0 && block == expect) {
+            n = rc;
+            if (size >= 0 && n > left)
+                n = (int)left;  /* Padding of the last block */
+            write_behind_commit(wb, n);
+            left -= n;
+            expect++;
+            errors = 0;
+            if (xm->stats)
+                xm->stats->blocks++;
+            xm_putc(xm, ACK);
+        } else if (rc > 0 && block == (unsigned char)(expect - 1)) {
+            xm_putc(xm, ACK);  /* Our ACK was lost: the block again */
+        } else if (rc > 0) {
+            print_error("YMODEM: block %d out of sequence (expected %d)", block, expect);
+            xm_cancel(xm);
+            return ERROR_GENERAL;
+        } else if (rc == ERROR_GENERAL || rc == ERROR_TIMEOUT) {
+            if (++errors >= XM_RETRIES) {
+                xm_cancel(xm);
+                return ERROR_TIMEOUT;
+            }
+            if (xm->stats)
+                xm->stats->retries++;
+            xm_purge(xm, 1000);
+            xm_putc(xm, NAK);
+        } else {
+            return rc;
+        }
+    }
+}
+
+/*
+ * Receive a YMODEM batch into dir
+ * Returns SUCCESS once the sender has ended the batch; stats->files
+ * counts the files received completely.
+ */
+int ymodem_receive(int fd, const char *dir, xfer_stats_t *stats)
+{
+    xm_session_t xm;
+    write_behind_t wb;
+    char path[512];
+    const char *name;
+    long long size;
+    int rc, block, tries, closed;
+
+    rc = xm_init(&xm, fd, stats);
+    if (rc != SUCCESS)
+        return rc;
+
+    for (;;) {
+        /* 'C' until block 0 (file name, size) arrives */
+        for (tries = 0; tries < XM_START_MS / XM_ACK_MS; tries++) {
+            xm_putc(&xm, 'C');
+            rc = ym_recv_block(&xm, xm.frame, &block, XM_ACK_MS);
+            if (rc > 0 && block == 0)
+                break;
+            if (rc == CAN)
+                return ERROR_GENERAL;
+            if (rc == EOT)
+                xm_putc(&xm, ACK);  /* Repeated EOT of the last file */
+            else if (rc == ERROR_GENERAL)
+                xm_purge(&xm, 1000);
+            else if (rc < 0 && rc != ERROR_TIMEOUT)
+                return rc;
+        }
+        if (rc <= 0 || block != 0) {
+            xm_cancel(&xm);
+            return ERROR_TIMEOUT;
+        }
+
+        xm_putc(&xm, ACK);
+
+        name = (const char *)xm.frame;
+        if (name[0] == '\0')
+            return SUCCESS;  /* Empty header: end of batch */
+
+        xm.frame[rc - 1] = '\0';
+        size = -1;
+        sscanf(name + strlen(name) + 1, "%lld", &size);
+
+        if (xfer_upload_path(dir, name, path, sizeof(path)) != SUCCESS ||
+            xfer_upload_unique(path, sizeof(path)) != SUCCESS ||
+            write_behind_open(&wb, path, 0) != SUCCESS) {
+            print_error("YMODEM: refusing upload %s", name);
+            xm_cancel(&xm);
+            return ERROR_GENERAL;
+        }
+
+        if (config.verbose_mode)
+            print_message("YMODEM: receiving %s (%lld bytes)", path, size);
+
+        xm_putc(&xm, 'C');
+        rc = ym_recv_data(&xm, &wb, size);
+        closed = write_behind_close(&wb);
+
+        if (rc != SUCCESS)
+            return rc;
+        if (closed != SUCCESS) {
+            xm_cancel(&xm);
+            return ERROR_GENERAL;
+        }
+
+        if (stats) {
+            stats->files++;
+            stats->bytes += wb.total;
+        }
+    }
+}
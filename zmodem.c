@@ -0,0 +1,1181 @@
+/*****************************************************************************
+ * ZMODEM Module
+ * Streaming ZMODEM batch file sender and receiver with CRC-32 and crash
+ * recovery
+ * Based on MBSE BBS mbcico/zmsend.c, mbcico/zmmisc.c and the ZMODEM
+ * Protocol Reference (Forsberg, 1988); receiver after mbcico/zmrecv.c
+ *
+ * YMODEM waits for an ACK after every block, so on a V.42 call with a few
+ * hundred ms of round trip most of the line sits idle.  ZMODEM streams
+ * ZCRCG subpackets and never stops for the receiver: it only speaks up
+ * with ZRPOS when a subpacket is damaged, and the sender goes back to
+ * that offset.  A receiver holding part of the file from a dropped call
+ * answers ZFILE with ZRPOS at its length, so the transfer resumes there.
+ *
+ * File data is read one subpacket at a time with pread() (file_send.c,
+ * no mapping, so a file truncated under us is an error rather than
+ * SIGBUS), escaped through a 256-entry ZDLE table straight into one
+ * output buffer per session and sent at the pace of the line with
+ * serial_paced_send().
+ * Subpackets carry a slice-by-8 CRC-32 (crc.c) whenever the receiver
+ * offers CANFC32.  Between subpackets the receive ring is checked without
+ * waiting, so a ZRPOS is acted on within one subpacket.
+ *
+ * The receiver decodes subpackets straight out of the receive ring: runs
+ * of bytes that need no unescaping are copied with memcpy() into the
+ * write-behind buffer of the file (write_behind.c), and only ZDLE and
+ * flow control bytes go through the byte-at-a-time decoder.  The CRC is
+ * checked once over the whole subpacket and a damaged one is simply not
+ * committed, so nothing is ever copied twice.
+ *****************************************************************************/
+
+#include "modem_sample.h"
+#include <sys/stat.h>
+
+#define ZPAD            '*'
+#define ZDLE            0x18
+#define ZBIN            'A'
+#define ZHEX            'B'
+#define ZBIN32          'C'
+#define XON             0x11
+
+/* Frame types */
+#define ZRQINIT         0
+#define ZRINIT          1
+#define ZSINIT          2
+#define ZACK            3
+#define ZFILE           4
+#define ZSKIP           5
+#define ZNAK            6
+#define ZABORT          7
+#define ZFIN            8
+#define ZRPOS           9
+#define ZDATA           10
+#define ZEOF            11
+#define ZFERR           12
+#define ZCRC            13
+#define ZCHALLENGE      14
+#define ZCOMPL          15
+#define ZCAN            16
+#define ZFREECNT        17
+#define ZCOMMAND        18
+
+/* Subpacket ends: ZDLE followed by one of these */
+#define ZCRCE           'h'     /* End of frame, no reply */
+#define ZCRCG           'i'     /* Frame continues, no reply */
+#define ZCRCQ           'j'     /* Frame continues, ZACK expected */
+#define ZCRCW           'k'     /* End of frame, ZACK expected */
+#define ZRUB0           'l'     /* Escaped 0x7F */
+#define ZRUB1           'm'     /* Escaped 0xFF */
+
+/* ZRINIT capabilities (ZF0) */
+#define CANFDX          0x01
+#define CANOVIO         0x02
+#define CANFC32         0x20
+#define ESCCTL          0x40
+
+/* ZFILE conversion option (ZF0) */
+#define ZCBIN           1
+#define ZCRESUM         3
+
+/* Header bytes: positions little endian, flags from the top */
+#define ZP0             0
+#define ZP1             1
+#define ZF1             2
+#define ZF0             3
+
+#define ZM_SUBPACKET    1024
+#define ZM_OUT_FLUSH    8192    /* Hand the buffer to the line at this fill */
+#define ZM_OUT_SIZE     (ZM_OUT_FLUSH + 2 * ZM_SUBPACKET + 64)
+#define ZM_REPLY_MS     10000   /* Receiver's answer to a header */
+#define ZM_FRAME_MS     2000    /* Between bytes of one header */
+#define ZM_RETRIES      10
+#define ZM_RX_MAX       8192    /* Longest subpacket accepted */
+#define ZM_CANCELLED    0x200   /* zm_getc_zdl(): run of CANs (not a data byte) */
+
+/* ZDLE table entries */
+#define ZM_ESC_ALWAYS   1
+#define ZM_ESC_AFTER_AT 2       /* CR after '@' (Telenet command escape) */
+
+typedef struct {
+    int fd;
+    serial_ring_t *ring;
+    int crc32;                  /* Receiver takes CRC-32 subpackets */
+    int rxcrc32;                /* Last header received was ZBIN32: so are its subpackets */
+    int escctl;                 /* Receiver wants all control characters escaped */
+    int window;                 /* Bytes between ZACKs, 0 = stream */
+    unsigned char last;         /* Last byte sent, for ZM_ESC_AFTER_AT */
+    unsigned char rxhdr[4];     /* Header data of the last frame received */
+    unsigned char out[ZM_OUT_SIZE];
+    int used;
+    xfer_stats_t *stats;
+} zm_session_t;
+
+static unsigned char zm_esc[2][256];    /* [escctl][byte] */
+static unsigned char zm_rx_special[256];  /* Received bytes the plain copy must stop at */
+static pthread_once_t zm_esc_once = PTHREAD_ONCE_INIT;
+
+static void zm_esc_build(void)
+{
+    static const unsigned char always[] = { ZDLE, 0x10, 0x11, 0x13 };
+    int c, i;
+
+    for (i = 0; i < (int)sizeof(always); i++)
+        zm_esc[0][always[i]] = zm_esc[0][always[i] | 0x80] = ZM_ESC_ALWAYS;
+    zm_esc[0]['\r'] = zm_esc[0]['\r' | 0x80] = ZM_ESC_AFTER_AT;
+
+    for (c = 0; c < 256; c++)
+        zm_esc[1][c] = (c & 0x60) == 0 ? ZM_ESC_ALWAYS : zm_esc[0][c];
+
+    zm_rx_special[ZDLE] = 1;
+    zm_rx_special[0x11] = zm_rx_special[0x13] = 1;
+    zm_rx_special[0x91] = zm_rx_special[0x93] = 1;
+}
+
+/*
+ * Append data to the output buffer, ZDLE-escaped (room must be there)
+ */
+static void zm_put(zm_session_t *zm, const unsigned char *p, int len)
+{
+    const unsigned char *esc = zm_esc[zm->escctl];
+    unsigned char *o = zm->out + zm->used;
+    unsigned char c, last = zm->last;
+
+    while (len-- > 0) {
+        c = *p++;
+        if (esc[c] && (esc[c] == ZM_ESC_ALWAYS || (last & 0x7F) == '@')) {
+            *o++ = ZDLE;
+            c ^= 0x40;
+        }
+        *o++ = last = c;
+    }
+
+    zm->last = last;
+    zm->used = o - zm->out;
+}
+
+/*
+ * Append bytes unescaped (frame structure)
+ */
+static void zm_put_raw(zm_session_t *zm, const void *data, int len)
+{
+    memcpy(zm->out + zm->used, data, len);
+    zm->used += len;
+    zm->last = ((const unsigned char *)data)[len - 1];
+}
+
+/*
+ * Send the output buffer
+ */
+static int zm_flush(zm_session_t *zm)
+{
+    int rc = SUCCESS;
+
+    if (zm->used > 0)
+        rc = serial_paced_send(zm->fd, (const char *)zm->out, zm->used);
+    zm->used = 0;
+
+    return rc < 0 ? rc : SUCCESS;
+}
+
+static void zm_set_pos(unsigned char *hdr, long long pos)
+{
+    hdr[0] = (unsigned char)pos;
+    hdr[1] = (unsigned char)(pos >> 8);
+    hdr[2] = (unsigned char)(pos >> 16);
+    hdr[3] = (unsigned char)(pos >> 24);
+}
+
+static long long zm_get_pos(const unsigned char *hdr)
+{
+    return (long long)hdr[0] | (long long)hdr[1] << 8 |
+           (long long)hdr[2] << 16 | (long long)hdr[3] << 24;
+}
+
+/*
+ * Send a hex header (all printable, for frames outside the data stream)
+ */
+static int zm_send_hex_header(zm_session_t *zm, int type, const unsigned char *hdr)
+{
+    static const char hex[] = "0123456789abcdef";
+    unsigned char frame[5];
+    char text[32];
+    unsigned short crc;
+    int i, len = 0;
+
+    frame[0] = (unsigned char)type;
+    memcpy(frame + 1, hdr, 4);
+    crc = crc16_update(0, frame, 5);
+
+    text[len++] = ZPAD;
+    text[len++] = ZPAD;
+    text[len++] = ZDLE;
+    text[len++] = ZHEX;
+    for (i = 0; i < 5; i++) {
+        text[len++] = hex[frame[i] >> 4];
+        text[len++] = hex[frame[i] & 0x0F];
+    }
+    text[len++] = hex[(crc >> 12) & 0x0F];
+    text[len++] = hex[(crc >> 8) & 0x0F];
+    text[len++] = hex[(crc >> 4) & 0x0F];
+    text[len++] = hex[crc & 0x0F];
+    text[len++] = '\r';
+    text[len++] = (char)0x8A;
+    if (type != ZFIN && type != ZACK)
+        text[len++] = XON;
+
+    zm_put_raw(zm, text, len);
+    return zm_flush(zm);
+}
+
+/*
+ * Append a binary header, with CRC-32 if the receiver takes it
+ */
+static void zm_put_bin_header(zm_session_t *zm, int type, const unsigned char *hdr)
+{
+    unsigned char frame[5], check[4];
+    unsigned short crc16;
+    unsigned int crc32;
+    const char start[3] = { ZPAD, ZDLE, zm->crc32 ? ZBIN32 : ZBIN };
+
+    frame[0] = (unsigned char)type;
+    memcpy(frame + 1, hdr, 4);
+
+    zm_put_raw(zm, start, 3);
+    zm_put(zm, frame, 5);
+
+    if (zm->crc32) {
+        crc32 = crc32_update(0, frame, 5);
+        zm_set_pos(check, crc32);
+        zm_put(zm, check, 4);
+    } else {
+        crc16 = crc16_update(0, frame, 5);
+        check[0] = (unsigned char)(crc16 >> 8);
+        check[1] = (unsigned char)crc16;
+        zm_put(zm, check, 2);
+    }
+}
+
+/*
+ * Append a data subpacket (len <= ZM_SUBPACKET) ending in frameend
+ */
+static void zm_put_subpacket(zm_session_t *zm, const unsigned char *data, int len, int frameend)
+{
+    unsigned char end = (unsigned char)frameend, check[4];
+    const char trailer[2] = { ZDLE, (char)frameend };
+    unsigned short crc16;
+    unsigned int crc32;
+
+    zm_put(zm, data, len);
+    zm_put_raw(zm, trailer, 2);
+
+    if (zm->crc32) {
+        crc32 = crc32_update(crc32_update(0, data, len), &end, 1);
+        zm_set_pos(check, crc32);
+        zm_put(zm, check, 4);
+    } else {
+        crc16 = crc16_update(crc16_update(0, data, len), &end, 1);
+        check[0] = (unsigned char)(crc16 >> 8);
+        check[1] = (unsigned char)crc16;
+        zm_put(zm, check, 2);
+    }
+
+    if (frameend == ZCRCW)
+        zm_put_raw(zm, "\021", 1);
+}
+
+/*
+ * Read a byte, ignoring XON/XOFF
+ */
+static int zm_getc(zm_session_t *zm, int timeout_ms)
+{
+    int c;
+
+    do {
+        c = serial_ring_getc(zm->ring, timeout_ms);
+    } while (c == 0x11 || c == 0x13 || c == 0x91 || c == 0x93);
+
+    return c;
+}
+
+/*
+ * Read a ZDLE-decoded byte
+ * Returns the byte, 0x100 | frameend after ZDLE ZCRCx, ZM_CANCELLED after
+ * a run of CANs, or an error code.
+ */
+static int zm_getc_zdl(zm_session_t *zm, int timeout_ms)
+{
+    int c, cans;
+
+    c = zm_getc(zm, timeout_ms);
+    if (c != ZDLE)
+        return c;
+
+    for (cans = 1; ; cans++) {
+        c = zm_getc(zm, timeout_ms);
+        if (c < 0)
+            return c;
+        if (c != ZDLE)
+            break;
+        if (cans >= 4)
+            return ZM_CANCELLED;  /* Five CANs: the other side gave up */
+    }
+
+    switch (c) {
+        case ZCRCE: case ZCRCG: case ZCRCQ: case ZCRCW:
+            return 0x100 | c;
+        case ZRUB0:
+            return 0x7F;
+        case ZRUB1:
+            return 0xFF;
+        default:
+            if ((c & 0x60) == 0x40)
+                return c ^ 0x40;
+            return ERROR_GENERAL;  /* Bad escape */
+    }
+}
+
+static int zm_hex_digit(int c)
+{
+    if (c >= '0' && c <= '9')
+        return c - '0';
+    if (c >= 'a' && c <= 'f')
+        return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F')
+        return c - 'A' + 10;
+    return -1;
+}
+
+/*
+ * Read the rest of a header after ZPAD ZDLE <format>
+ * Returns the frame type, ERROR_GENERAL for a damaged header, ZCAN, or
+ * another error code.
+ */
+static int zm_read_header(zm_session_t *zm, int format)
+{
+    unsigned char frame[9];
+    int count, i, c, hi, lo;
+
+    count = format == ZBIN32 ? 9 : 7;
+
+    for (i = 0; i < count; i++) {
+        if (format == ZHEX) {
+            hi = zm_getc(zm, ZM_FRAME_MS);
+            lo = hi < 0 ? hi : zm_getc(zm, ZM_FRAME_MS);
+            if (lo < 0)
+                return lo;
+            hi = zm_hex_digit(hi);
+            lo = zm_hex_digit(lo);
+            if (hi < 0 || lo < 0)
+                return ERROR_GENERAL;
+            c = hi << 4 | lo;
+        } else {
+            c = zm_getc_zdl(zm, ZM_FRAME_MS);
+            if (c < 0)
+                return c;
+            if (c == ZM_CANCELLED)
+                return ZCAN;
+            if (c > 0xFF)
+                return ERROR_GENERAL;
+        }
+        frame[i] = (unsigned char)c;
+    }
+
+    if (format == ZBIN32) {
+        if (crc32_update(0, frame, 5) != (unsigned int)zm_get_pos(frame + 5))
+            return ERROR_GENERAL;
+    } else {
+        if (crc16_update(0, frame, 5) != (frame[5] << 8 | frame[6]))
+            return ERROR_GENERAL;
+    }
+
+    memcpy(zm->rxhdr, frame + 1, 4);
+    zm->rxcrc32 = format == ZBIN32;
+    return frame[0];
+}
+
+/*
+ * Wait up to timeout_ms for a header from the other side
+ * Line noise and damaged headers are skipped.  Returns the frame type
+ * (ZCAN after a run of CANs), ERROR_TIMEOUT or another error code.
+ */
+static int zm_get_header(zm_session_t *zm, int timeout_ms)
+{
+    long long deadline = monotonic_ms() + timeout_ms;
+    int c, cans = 0, remaining, type;
+
+    for (;;) {
+        remaining = (int)(deadline - monotonic_ms());
+        if (remaining < 0)
+            return ERROR_TIMEOUT;
+
+        c = zm_getc(zm, remaining);
+        if (c < 0)
+            return c;
+
+        if (c == ZDLE) {
+            if (++cans >= 5)
+                return ZCAN;
+            continue;
+        }
+        cans = 0;
+
+        if ((c & 0x7F) != ZPAD)
+            continue;
+
+        do {
+            c = zm_getc(zm, ZM_FRAME_MS);
+        } while ((c & 0x7F) == ZPAD);
+        if (c < 0)
+            return c;
+        if (c != ZDLE)
+            continue;
+
+        c = zm_getc(zm, ZM_FRAME_MS);
+        if (c < 0)
+            return c;
+        if (c != ZHEX && c != ZBIN && c != ZBIN32)
+            continue;
+
+        type = zm_read_header(zm, c);
+        if (type >= 0 || type == ERROR_HANGUP || type == ERROR_PORT)
+            return type;
+        /* Damaged or cut off: look for the next one */
+    }
+}
+
+/*
+ * Check for a header from the receiver while streaming, without waiting
+ * Returns the frame type, or ERROR_TIMEOUT if nothing has arrived.
+ */
+static int zm_poll_header(zm_session_t *zm)
+{
+    int rc;
+
+    if (zm->ring->left == 0) {
+        rc = serial_ring_fill(zm->ring, 0);
+        if (rc < 0)
+            return rc;
+    }
+
+    /* Noise alone must not stall the stream */
+    while (zm->ring->left > 0) {
+        unsigned char c = (unsigned char)zm->ring->buf[zm->ring->next];
+
+        if ((c & 0x7F) == ZPAD || c == ZDLE)
+            return zm_get_header(zm, ZM_FRAME_MS);
+        zm_getc(zm, 0);
+    }
+
+    return ERROR_TIMEOUT;
+}
+
+/*
+ * Read one data subpacket into dst (max bytes of room)
+ * Plain runs are copied straight out of the receive ring; the CRC is
+ * checked over the whole subpacket at the end.  Returns the frameend
+ * (ZCRCx) with the length in *len, ERROR_GENERAL for a damaged or
+ * overlong subpacket, ZCAN, or another error code.
+ */
+static int zm_read_subpacket(zm_session_t *zm, unsigned char *dst, int max, int *len)
+{
+    serial_ring_t *ring = zm->ring;
+    const unsigned char *src;
+    unsigned char check[4], end;
+    int n = 0, run, c, i, count;
+
+    for (;;) {
+        if (ring->left == 0) {
+            c = serial_ring_fill(ring, ZM_FRAME_MS);
+            if (c < 0)
+                return c;
+            continue;
+        }
+
+        src = (const unsigned char *)ring->buf + ring->next;
+        for (run = 0; run < ring->left && !zm_rx_special[src[run]]; run++)
+            ;
+
+        if (run > 0) {
+            if (n + run > max)
+                return ERROR_GENERAL;  /* Frame end lost in noise */
+            memcpy(dst + n, src, run);
+            ring->next += run;
+            ring->left -= run;
+            ring->scan = 0;
+            n += run;
+            continue;
+        }
+
+        c = zm_getc_zdl(zm, ZM_FRAME_MS);
+        if (c < 0)
+            return c;
+        if (c == ZM_CANCELLED)
+            return ZCAN;
+        if (c > 0xFF)
+            break;
+        if (n >= max)
+            return ERROR_GENERAL;
+        dst[n++] = (unsigned char)c;
+    }
+
+    end = (unsigned char)c;
+    count = zm->rxcrc32 ? 4 : 2;
+    for (i = 0; i < count; i++) {
+        c = zm_getc_zdl(zm, ZM_FRAME_MS);
+        if (c < 0)
+            return c;
+        if (c > 0xFF)
+            return ERROR_GENERAL;
+        check[i] = (unsigned char)c;
+    }
+
+    if (zm->rxcrc32) {
+        if (crc32_update(crc32_update(0, dst, n), &end, 1) != (unsigned int)zm_get_pos(check))
+            return ERROR_GENERAL;
+    } else {
+        if (crc16_update(crc16_update(0, dst, n), &end, 1) != (check[0] << 8 | check[1]))
+            return ERROR_GENERAL;
+    }
+
+    *len = n;
+    return end;
+}
+
+/*
+ * Set up a session on fd (~10K output buffer: kept off the caller's stack)
+ */
+static zm_session_t *zm_session_new(int fd, xfer_stats_t *stats)
+{
+    zm_session_t *zm;
+
+    if (stats)
+        memset(stats, 0, sizeof(*stats));
+
+    pthread_once(&zm_esc_once, zm_esc_build);
+
+    zm = calloc(1, sizeof(*zm));
+    if (!zm)
+        return NULL;
+
+    zm->fd = fd;
+    zm->ring = serial_ring_get(fd);
+    zm->stats = stats;
+    if (!zm->ring) {
+        free(zm);
+        return NULL;
+    }
+
+    return zm;
+}
+
+/*
+ * Abort the session on the receiver side
+ */
+static void zm_cancel(zm_session_t *zm)
+{
+    static const char abort_seq[] = "\030\030\030\030\030\030\030\030\b\b\b\b\b\b\b\b";
+
+    zm->used = 0;
+    serial_paced_send(zm->fd, abort_seq, sizeof(abort_seq) - 1);
+}
+
+/*
+ * ZRQINIT until the receiver answers ZRINIT; take its capabilities
+ */
+static int zm_get_rinit(zm_session_t *zm)
+{
+    static const unsigned char zero[4] = { 0, 0, 0, 0 };
+    int tries, rc, rxbuflen;
+
+    for (tries = 0; tries < ZM_RETRIES; tries++) {
+        if (tries == 0)
+            zm_put_raw(zm, "rz\r", 3);  /* Starts the download in many terminals */
+        rc = zm_send_hex_header(zm, ZRQINIT, zero);
+        if (rc != SUCCESS)
+            return rc;
+
+        rc = zm_get_header(zm, ZM_REPLY_MS);
+        switch (rc) {
+            case ZRINIT:
+                zm->crc32 = (zm->rxhdr[ZF0] & CANFC32) != 0;
+                zm->escctl = (zm->rxhdr[ZF0] & ESCCTL) != 0;
+                rxbuflen = zm->rxhdr[ZP0] | zm->rxhdr[ZP1] << 8;
+                zm->window = config.zmodem_window;
+                if (rxbuflen > 0 && (zm->window <= 0 || zm->window > rxbuflen))
+                    zm->window = rxbuflen;
+                if (!(zm->rxhdr[ZF0] & CANOVIO) && zm->window <= 0)
+                    zm->window = ZM_SUBPACKET;
+                return SUCCESS;
+            case ZCHALLENGE:
+                rc = zm_send_hex_header(zm, ZACK, zm->rxhdr);
+                if (rc != SUCCESS)
+                    return rc;
+                break;
+            case ZCAN:
+            case ZABORT:
+                return ERROR_GENERAL;
+            case ERROR_HANGUP:
+            case ERROR_PORT:
+                return rc;
+            default:
+                break;  /* Timeout, our own ZRQINIT echoed, noise: ask again */
+        }
+    }
+
+    return ERROR_TIMEOUT;
+}
+
+/*
+ * Reply to ZCRC: CRC-32 of the first n bytes of the file
+ */
+static int zm_send_file_crc(zm_session_t *zm, file_send_t *fs)
+{
+    unsigned char hdr[4], buf[4096];
+    long long n = zm_get_pos(zm->rxhdr), done;
+    unsigned int crc = 0;
+    int len;
+
+    if (n <= 0 || n > fs->size)
+        n = fs->size;
+
+    for (done = 0; done < n; done += len) {
+        len = n - done > (long long)sizeof(buf) ? (int)sizeof(buf) : (int)(n - done);
+        if (file_send_read(fs, done, buf, len) != len)
+            return ERROR_GENERAL;
+        crc = crc32_update(crc, buf, len);
+    }
+
+    zm_set_pos(hdr, crc);
+    return zm_send_hex_header(zm, ZCRC, hdr);
+}
+
+/*
+ * ZFILE with the file information until the receiver asks for data
+ * Returns SUCCESS with the start offset (ZRPOS) in *pos, ZSKIP, or an
+ * error code.
+ */
+static int zm_send_zfile(zm_session_t *zm, file_send_t *fs, const char *path,
+                         int files_left, long long bytes_left, long long *pos)
+{
+    unsigned char hdr[4] = { 0, 0, 0, 0 };
+    unsigned char info[ZM_SUBPACKET];
+    const char *name;
+    struct stat st;
+    int len, tries, rc;
+
+    name = strrchr(path, '/');
+    name = name ? name + 1 : path;
+
+    if (fstat(fs->file_fd, &st) != 0) {
+        st.st_mtime = 0;
+        st.st_mode = 0644;
+    }
+
+    len = snprintf((char *)info, sizeof(info), "%s", name) + 1;
+    if (len >= (int)sizeof(info))
+        len = sizeof(info) - 1;
+    len += snprintf((char *)info + len, sizeof(info) - len, "%lld %llo %o 0 %d %lld",
+                    (long long)fs->size, (unsigned long long)st.st_mtime,
+                    (unsigned int)(st.st_mode & 07777), files_left, bytes_left) + 1;
+    if (len > (int)sizeof(info))
+        len = sizeof(info);
+
+    hdr[ZF0] = config.zmodem_resume ? ZCRESUM : ZCBIN;
+
+    for (tries = 0; tries < ZM_RETRIES; tries++) {
+        zm_put_bin_header(zm, ZFILE, hdr);
+        zm_put_subpacket(zm, info, len, ZCRCW);
+        rc = zm_flush(zm);
+        if (rc != SUCCESS)
+            return rc;
+
+        for (;;) {
+            rc = zm_get_header(zm, ZM_REPLY_MS);
+            if (rc == ZRINIT)
+                continue;  /* Repeated answer to ZRQINIT, the reply to ZFILE follows */
+            if (rc != ZCRC)
+                break;
+            /* Receiver compares its partial copy before resuming */
+            rc = zm_send_file_crc(zm, fs);
+            if (rc != SUCCESS)
+                return rc;
+        }
+
+        switch (rc) {
+            case ZRPOS:
+                *pos = zm_get_pos(zm->rxhdr);
+                if (*pos > fs->size)
+                    *pos = fs->size;
+                return SUCCESS;
+            case ZSKIP:
+                return ZSKIP;
+            case ZCAN:
+            case ZABORT:
+            case ZFERR:
+                return ERROR_GENERAL;
+            case ERROR_HANGUP:
+            case ERROR_PORT:
+                return rc;
+            default:
+                break;  /* ZNAK or timeout: send it again */
+        }
+    }
+
+    return ERROR_TIMEOUT;
+}
+
+/*
+ * Stream one data frame from *pos to the end of the file
+ * Returns SUCCESS with everything sent, or the frame type or error code
+ * that cut it short; *acked is the last position the receiver confirmed
+ * (ZCRCW windows).
+ */
+static int zm_stream(zm_session_t *zm, file_send_t *fs, long long *pos, long long *acked)
+{
+    unsigned char data[ZM_SUBPACKET];
+    unsigned char hdr[4];
+    int n, end, rc;
+
+    *acked = *pos;
+    if (*pos >= fs->size)
+        return SUCCESS;
+
+    zm_set_pos(hdr, *pos);
+    zm_put_bin_header(zm, ZDATA, hdr);
+
+    for (;;) {
+        if (interrupted)
+            return ZABORT;
+
+        n = fs->size - *pos > ZM_SUBPACKET ? ZM_SUBPACKET : (int)(fs->size - *pos);
+
+        if (*pos + n >= fs->size)
+            end = ZCRCE;
+        else if (zm->window > 0 && *pos + n - *acked >= zm->window)
+            end = ZCRCW;
+        else
+            end = ZCRCG;
+
+        if (file_send_read(fs, *pos, data, n) != n)
+            return ZFERR;  /* The file shrank: cannot send what ZFILE announced */
+
+        zm_put_subpacket(zm, data, n, end);
+        *pos += n;
+        if (zm->stats)
+            zm->stats->blocks++;
+
+        if (zm->used >= ZM_OUT_FLUSH || end != ZCRCG) {
+            rc = zm_flush(zm);
+            if (rc != SUCCESS)
+                return rc;
+        }
+
+        if (end == ZCRCE)
+            return SUCCESS;
+
+        if (end == ZCRCW) {
+            rc = zm_get_header(zm, ZM_REPLY_MS);
+            if (rc != ZACK)
+                return rc;
+            *acked = *pos;
+            zm_set_pos(hdr, *pos);
+            zm_put_bin_header(zm, ZDATA, hdr);
+        } else {
+            rc = zm_poll_header(zm);
+            if (rc != ERROR_TIMEOUT && rc != ZACK)
+                return rc;
+        }
+    }
+}
+
+/*
+ * Send the file from pos, then ZEOF, until the receiver has all of it
+ * Returns SUCCESS, ZSKIP, or an error code.
+ */
+static int zm_send_data(zm_session_t *zm, file_send_t *fs, long long pos)
+{
+    unsigned char hdr[4];
+    long long acked, last_rpos = -1;
+    int rc, tries = 0;
+
+    for (;;) {
+        rc = zm_stream(zm, fs, &pos, &acked);
+
+        if (rc == SUCCESS) {
+            /* All data out: ZEOF, answered by ZRINIT */
+            zm_set_pos(hdr, fs->size);
+            zm_put_bin_header(zm, ZEOF, hdr);
+            rc = zm_flush(zm);
+            if (rc != SUCCESS)
+                return rc;
+
+            do {
+                rc = zm_get_header(zm, ZM_REPLY_MS);
+            } while (rc == ZACK);
+
+            if (rc == ZRINIT)
+                return SUCCESS;
+        }
+
+        switch (rc) {
+            case ZRPOS:
+                /* Damaged subpacket: drop what is still queued and go back */
+                pos = zm_get_pos(zm->rxhdr);
+                if (pos > fs->size)
+                    pos = fs->size;
+                if (pos > last_rpos)
+                    tries = 0;  /* Progress since the last one */
+                else if (++tries >= ZM_RETRIES)
+                    return ERROR_TIMEOUT;
+                last_rpos = pos;
+
+                zm->used = 0;
+                tcflush(zm->fd, TCOFLUSH);
+                if (zm->stats)
+                    zm->stats->retries++;
+                if (config.verbose_mode)
+                    print_message("ZMODEM: resending from %lld", pos);
+                break;
+            case ZSKIP:
+                return ZSKIP;
+            case ZCAN:
+            case ZABORT:
+            case ZFERR:
+                return ERROR_GENERAL;
+            case ERROR_TIMEOUT:
+                /* No ZACK for a ZCRCW, or no answer to ZEOF: from the last sure point */
+                if (++tries >= ZM_RETRIES)
+                    return ERROR_TIMEOUT;
+                if (pos < fs->size)
+                    pos = acked;
+                break;
+            default:
+                if (rc < 0)
+                    return rc;
+                break;  /* ZNAK or another frame: start a new data frame */
+        }
+    }
+}
+
+/*
+ * Send files as one ZMODEM batch
+ * Returns SUCCESS once the receiver has acknowledged the end of the
+ * session; stats->files counts the files it accepted completely.
+ */
+int zmodem_send(int fd, const char *const *paths, int count, xfer_stats_t *stats)
+{
+    static const unsigned char zero[4] = { 0, 0, 0, 0 };
+    zm_session_t *zm;
+    file_send_t fs;
+    struct stat st;
+    long long bytes_left = 0, pos;
+    int rc, i, tries;
+
+    zm = zm_session_new(fd, stats);
+    if (!zm)
+        return ERROR_GENERAL;
+
+    for (i = 0; i < count; i++) {
+        if (stat(paths[i], &st) == 0)
+            bytes_left += st.st_size;
+    }
+
+    /* Output still queued would land in the middle of the protocol */
+    rc = outq_flush(fd);
+    if (rc == SUCCESS)
+        rc = zm_get_rinit(zm);
+
+    for (i = 0; i < count && rc == SUCCESS; i++) {
+        if (file_send_open(&fs, paths[i], 0) != SUCCESS)
+            continue;  /* Skip it, the batch goes on */
+
+        if (config.verbose_mode)
+            print_message("ZMODEM: sending %s (%lld bytes)", paths[i], (long long)fs.size);
+
+        rc = zm_send_zfile(zm, &fs, paths[i], count - i, bytes_left, &pos);
+        if (rc == SUCCESS) {
+            if (pos > 0 && config.verbose_mode)
+                print_message("ZMODEM: receiver has %lld bytes, resuming", pos);
+
+            rc = zm_send_data(zm, &fs, pos);
+            if (rc == SUCCESS && stats) {
+                stats->files++;
+                stats->bytes += fs.size - pos;
+                stats->resumed += pos;
+            }
+        }
+        if (rc == ZSKIP)
+            rc = SUCCESS;  /* Receiver already has it or does not want it */
+
+        bytes_left -= fs.size;
+        file_send_close(&fs);
+    }
+
+    if (rc == SUCCESS) {
+        /* ZFIN both ways, then "over and out" */
+        for (tries = 0; tries < ZM_RETRIES / 2; tries++) {
+            rc = zm_send_hex_header(zm, ZFIN, zero);
+            if (rc != SUCCESS)
+                break;
+            rc = zm_get_header(zm, ZM_REPLY_MS);
+            if (rc == ZFIN) {
+                zm_put_raw(zm, "OO", 2);
+                rc = zm_flush(zm);
+                break;
+            }
+            if (rc == ERROR_HANGUP || rc == ERROR_PORT)
+                break;
+        }
+        if (rc > 0)
+            rc = ERROR_GENERAL;
+    } else if (rc != ERROR_HANGUP) {
+        zm_cancel(zm);
+    }
+
+    free(zm);
+    return rc;
+}
+
+/*
+ * Tell the sender what we take: full duplex, overlapped I/O, CRC-32
+ */
+static int zm_send_rinit(zm_session_t *zm)
+{
+    unsigned char hdr[4] = { 0, 0, 0, CANFDX | CANOVIO | CANFC32 };
+
+    return zm_send_hex_header(zm, ZRINIT, hdr);
+}
+
+/*
+ * Answer ZSINIT; its attention string is not kept, we never interrupt
+ * the sender
+ */
+static int zm_recv_sinit(zm_session_t *zm)
+{
+    unsigned char attn[ZM_SUBPACKET], hdr[4] = { 1, 0, 0, 0 };
+    int rc, len;
+
+    rc = zm_read_subpacket(zm, attn, sizeof(attn), &len);
+    if (rc == ERROR_GENERAL || rc == ERROR_TIMEOUT)
+        return zm_send_hex_header(zm, ZNAK, hdr);
+    if (rc < 0)
+        return rc;
+    if (rc == ZCAN)
+        return ERROR_GENERAL;
+
+    return zm_send_hex_header(zm, ZACK, hdr);
+}
+
+/*
+ * Answer ZFILE: ZSKIP, or open the file and ZRPOS where the data should
+ * start (the length of a partial copy when resuming)
+ */
+static int zm_recv_zfile(zm_session_t *zm, const char *dir, write_behind_t *wb,
+                         int *opened, long long *pos)
+{
+    unsigned char info[ZM_SUBPACKET + 1], hdr[4] = { 0, 0, 0, 0 };
+    char path[512];
+    const char *name;
+    struct stat st;
+    long long size = -1, have = 0;
+    int rc, len, resume;
+
+    resume = zm->rxhdr[ZF0] == ZCRESUM || config.zmodem_resume;
+
+    rc = zm_read_subpacket(zm, info, ZM_SUBPACKET, &len);
+    if (rc == ERROR_GENERAL || rc == ERROR_TIMEOUT)
+        return zm_send_hex_header(zm, ZNAK, hdr);
+    if (rc < 0)
+        return rc;
+    if (rc == ZCAN)
+        return ERROR_GENERAL;
+
+    if (*opened) {
+        /* Our ZRPOS got lost and the sender asks again */
+        zm_set_pos(hdr, *pos);
+        return zm_send_hex_header(zm, ZRPOS, hdr);
+    }
+
+    info[len] = '\0';
+    name = (const char *)info;
+    if ((int)strlen(name) + 1 < len)
+        sscanf(name + strlen(name) + 1, "%lld", &size);
+
+    if (xfer_upload_path(dir, name, path, sizeof(path)) != SUCCESS) {
+        print_error("ZMODEM: refusing upload %s", name);
+        return zm_send_hex_header(zm, ZSKIP, hdr);
+    }
+
+    if (resume && lstat(path, &st) == 0 && S_ISREG(st.st_mode))
+        have = st.st_size;
+    if (have > 0 && size >= 0 && have >= size) {
+        if (config.verbose_mode)
+            print_message("ZMODEM: already have %s, skipping", path);
+        return zm_send_hex_header(zm, ZSKIP, hdr);
+    }
+    if (have == 0 && xfer_upload_unique(path, sizeof(path)) != SUCCESS) {
+        print_error("ZMODEM: no free name for %s", path);
+        return zm_send_hex_header(zm, ZSKIP, hdr);
+    }
+
+    if (write_behind_open(wb, path, have) != SUCCESS)
+        return zm_send_hex_header(zm, ZSKIP, hdr);
+
+    if (config.verbose_mode)
+        print_message("ZMODEM: receiving %s (%lld bytes, from %lld)", path, size, have);
+
+    *opened = 1;
+    *pos = have;
+    if (zm->stats)
+        zm->stats->resumed += have;
+
+    zm_set_pos(hdr, have);
+    return zm_send_hex_header(zm, ZRPOS, hdr);
+}
+
+/*
+ * Receive the subpackets of one data frame into wb
+ * Returns SUCCESS at the end of the frame, or after a damaged subpacket
+ * once ZRPOS has been sent; otherwise ZCAN or an error code.
+ */
+static int zm_recv_data(zm_session_t *zm, write_behind_t *wb, long long *pos)
+{
+    unsigned char hdr[4], *dst;
+    int end, len, rc;
+
+    for (;;) {
+        dst = write_behind_reserve(wb, ZM_RX_MAX);
+        if (!dst)
+            return ERROR_GENERAL;
+
+        end = zm_read_subpacket(zm, dst, ZM_RX_MAX, &len);
+        if (end == ERROR_GENERAL || end == ERROR_TIMEOUT) {
+            /* Damaged or cut off: nothing committed, resend from here */
+            if (zm->stats)
+                zm->stats->retries++;
+            zm_set_pos(hdr, *pos);
+            return zm_send_hex_header(zm, ZRPOS, hdr);
+        }
+        if (end < 0 || end == ZCAN)
+            return end;
+
+        write_behind_commit(wb, len);
+        *pos += len;
+        if (zm->stats)
+            zm->stats->blocks++;
+
+        if (end == ZCRCQ || end == ZCRCW) {
+            zm_set_pos(hdr, *pos);
+            rc = zm_send_hex_header(zm, ZACK, hdr);
+            if (rc != SUCCESS)
+                return rc;
+        }
+        if (end == ZCRCE || end == ZCRCW)
+            return SUCCESS;
+    }
+}
+
+/*
+ * Receive a ZMODEM batch into dir
+ * Returns SUCCESS once the sender has ended the session; stats->files
+ * counts the files received completely.  A file cut off by an error is
+ * kept, so the next session can resume it.
+ */
+int zmodem_receive(int fd, const char *dir, xfer_stats_t *stats)
+{
+    zm_session_t *zm;
+    write_behind_t wb;
+    unsigned char hdr[4];
+    long long pos = 0, start = -1;
+    int rc, type, opened = 0, finished = 0, tries = 0;
+
+    zm = zm_session_new(fd, stats);
+    if (!zm)
+        return ERROR_GENERAL;
+
+    rc = outq_flush(fd);
+    if (rc == SUCCESS)
+        rc = zm_send_rinit(zm);
+
+    while (rc == SUCCESS && !finished) {
+        type = zm_get_header(zm, ZM_REPLY_MS);
+        if (type >= 0)
+            tries = 0;
+
+        switch (type) {
+            case ZRQINIT:
+                rc = zm_send_rinit(zm);
+                break;
+            case ZSINIT:
+                rc = zm_recv_sinit(zm);
+                break;
+            case ZFILE:
+                rc = zm_recv_zfile(zm, dir, &wb, &opened, &pos);
+                if (opened && start < 0)
+                    start = pos;
+                break;
+            case ZDATA:
+                if (!opened) {
+                    zm_set_pos(hdr, 0);
+                    rc = zm_send_hex_header(zm, ZNAK, hdr);
+                } else if (zm_get_pos(zm->rxhdr) != pos) {
+                    /* Rest of a frame we already asked to have resent */
+                    zm_set_pos(hdr, pos);
+                    rc = zm_send_hex_header(zm, ZRPOS, hdr);
+                } else {
+                    rc = zm_recv_data(zm, &wb, &pos);
+                }
+                break;
+            case ZEOF:
+                if (!opened || zm_get_pos(zm->rxhdr) != pos)
+                    break;  /* Stale: data still missing, the sender follows our ZRPOS */
+                opened = 0;
+                rc = write_behind_close(&wb);
+                if (rc == SUCCESS && stats) {
+                    stats->files++;
+                    stats->bytes += pos - start;
+                }
+                start = -1;
+                if (rc == SUCCESS)
+                    rc = zm_send_rinit(zm);
+                break;
+            case ZFIN:
+                zm_set_pos(hdr, 0);
+                rc = zm_send_hex_header(zm, ZFIN, hdr);
+                /* "OO", if it comes at all */
+                if (rc == SUCCESS && zm_getc(zm, ZM_FRAME_MS) == 'O')
+                    zm_getc(zm, ZM_FRAME_MS);
+                finished = 1;
+                break;
+            case ZCAN:
+            case ZABORT:
+            case ZFERR:
+                rc = ERROR_GENERAL;
+                break;
+            case ERROR_TIMEOUT:
+                /* Lost header: repeat what we said last */
+                if (++tries >= ZM_RETRIES) {
+                    rc = ERROR_TIMEOUT;
+                } else if (opened) {
+                    zm_set_pos(hdr, pos);
+                    rc = zm_send_hex_header(zm, ZRPOS, hdr);
+                } else {
+                    rc = zm_send_rinit(zm);
+                }
+                break;
+            default:
+                if (type < 0)
+                    rc = type;
+                break;  /* ZNAK, ZACK and other frames we do not expect */
+        }
+    }
+
+    if (opened)
+        write_behind_close(&wb);
+    if (rc != SUCCESS && rc != ERROR_HANGUP)
+        zm_cancel(zm);
+
+    free(zm);
+    return rc;
+}